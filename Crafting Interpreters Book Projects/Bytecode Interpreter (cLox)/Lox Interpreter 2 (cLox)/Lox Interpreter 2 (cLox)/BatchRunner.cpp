@@ -0,0 +1,351 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <deque>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// cLox includes.
+#include "BatchRunner.h"
+#include "SourceFile.h"
+#include "VM.h"
+
+
+
+
+/// <summary>
+/// Holds one script in a batch, along with its results once it has run.
+/// </summary>
+struct BatchJob
+{
+	const char* Path; // The file path of the Lox script.
+	int ExitCode; // The exit code the script would have produced if it was run on its own.
+	double Milliseconds; // How long it took to load, compile, and run the script.
+	std::string Out; // Everything the script's VM wrote to its output.
+	std::string Err; // Everything the script's VM wrote to its error output.
+	bool Done; // Whether the script has finished running.
+};
+
+
+/// <summary>
+/// Writes out the jobs' output in the order the scripts were given. Each job's output is written as
+/// soon as it and every job before it have finished, so the output of different scripts never gets
+/// mixed together, and nothing has to wait for the whole batch.
+/// </summary>
+struct BatchOutput
+{
+	std::mutex Lock;
+	BatchJob* Jobs;
+	int JobCount;
+	int NextJob; // The first job whose output hasn't been written yet.
+};
+
+
+/// <summary>
+/// A double-ended queue of job indices owned by a worker thread. The owner takes jobs off
+/// the front, and idle workers steal them off the back.
+/// </summary>
+struct WorkQueue
+{
+	std::mutex Lock;
+	std::deque<int> Jobs;
+};
+
+
+
+
+/// <summary>
+/// Takes the next job for the specified worker. It first checks the worker's own queue, and if
+/// that is empty it tries to steal work from the other workers' queues.
+/// </summary>
+/// <returns>The index of the job to run, or -1 if there is no work left anywhere.</returns>
+static int TakeJob(std::vector<WorkQueue>& queues, int worker)
+{
+	{
+		WorkQueue& own = queues[worker];
+		std::lock_guard<std::mutex> guard(own.Lock);
+		if (!own.Jobs.empty())
+		{
+			int job = own.Jobs.front();
+			own.Jobs.pop_front();
+			return job;
+		}
+	}
+
+
+	// Our own queue is empty, so steal from the back of someone else's.
+	// No new jobs are ever added once the batch starts, so if every queue is empty we're done.
+	int workerCount = (int)queues.size();
+	for (int i = 1; i < workerCount; i++)
+	{
+		WorkQueue& victim = queues[(worker + i) % workerCount];
+		std::lock_guard<std::mutex> guard(victim.Lock);
+		if (!victim.Jobs.empty())
+		{
+			int job = victim.Jobs.back();
+			victim.Jobs.pop_back();
+			return job;
+		}
+	}
+
+	return -1;
+}
+
+
+/// <summary>
+/// Reads everything written to a capture file into the specified string and closes the file.
+/// </summary>
+static void ReadCapture(FILE* capture, std::string* text)
+{
+	rewind(capture);
+
+	char buffer[4096];
+	size_t count;
+	while ((count = fread(buffer, 1, sizeof(buffer), capture)) > 0)
+	{
+		text->append(buffer, count);
+	}
+
+	fclose(capture);
+}
+
+
+/// <summary>
+/// Runs a single script in a brand new VM, capturing its output.
+/// </summary>
+static void RunJob(BatchJob* job)
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	// The VM writes to FILE streams, so its output goes to temporary files. They are read back and closed as soon as
+	// the script finishes, so a big batch never has more than two of them open per worker thread.
+	FILE* out = tmpfile();
+	FILE* err = tmpfile();
+	if (out == NULL || err == NULL)
+	{
+		if (out != NULL)
+			fclose(out);
+		if (err != NULL)
+			fclose(err);
+
+		job->Err = "Could not create temporary files to capture the script's output.\n";
+		job->ExitCode = 74;
+	}
+	else
+	{
+		// The error message goes to the job's captured stderr, so it comes out in order with the output of the other jobs.
+		SourceFile source;
+		if (!LoadSourceFile(job->Path, &source, err))
+		{
+			job->ExitCode = 74;
+		}
+		else
+		{
+			VM* machine = NewVM();
+			machine->Out = out;
+			machine->Err = err;
+
+			InterpretResult result = Interpret(source.Text, source.Length);
+			FreeVM(machine);
+			UnloadSourceFile(&source);
+
+			// These match the exit codes RunFile() in Main.cpp uses.
+			if (result == INTERPRET_COMPILE_ERROR)
+				job->ExitCode = 65;
+			else if (result == INTERPRET_RUNTIME_ERROR)
+				job->ExitCode = 70;
+			else
+				job->ExitCode = 0;
+		}
+
+		ReadCapture(out, &job->Out);
+		ReadCapture(err, &job->Err);
+	}
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	job->Milliseconds = elapsed.count();
+}
+
+
+/// <summary>
+/// Marks a job as finished, then writes out the output of it and any jobs after it that are now next in line.
+/// </summary>
+static void FinishJob(BatchOutput* output, int index)
+{
+	std::lock_guard<std::mutex> guard(output->Lock);
+
+	output->Jobs[index].Done = true;
+
+	while (output->NextJob < output->JobCount && output->Jobs[output->NextJob].Done)
+	{
+		BatchJob* job = &output->Jobs[output->NextJob++];
+
+		printf("== %s ==\n", job->Path);
+		fwrite(job->Out.data(), 1, job->Out.size(), stdout);
+		fflush(stdout);
+		fwrite(job->Err.data(), 1, job->Err.size(), stderr);
+		fflush(stderr);
+
+		// The output has been written, so don't hang on to it until the end of the batch.
+		std::string().swap(job->Out);
+		std::string().swap(job->Err);
+	}
+}
+
+
+/// <summary>
+/// The main loop of a worker thread. It keeps taking jobs until there are none left.
+/// </summary>
+static void WorkerLoop(std::vector<WorkQueue>* queues, BatchOutput* output, int worker)
+{
+	int job;
+	while ((job = TakeJob(*queues, worker)) != -1)
+	{
+		RunJob(&output->Jobs[job]);
+		FinishJob(output, job);
+	}
+}
+
+
+int RunBatch(const char** paths, int pathCount, int jobCount)
+{
+	if (jobCount < 1)
+	{
+		jobCount = (int)std::thread::hardware_concurrency();
+		if (jobCount < 1)
+			jobCount = 1;
+	}
+
+	if (jobCount > pathCount)
+		jobCount = pathCount;
+
+
+	std::vector<BatchJob> jobs(pathCount);
+	for (int i = 0; i < pathCount; i++)
+	{
+		jobs[i].Path = paths[i];
+		jobs[i].ExitCode = 0;
+		jobs[i].Milliseconds = 0;
+		jobs[i].Done = false;
+	}
+
+	BatchOutput output;
+	output.Jobs = jobs.data();
+	output.JobCount = pathCount;
+	output.NextJob = 0;
+
+
+	// Deal the jobs out round-robin. Workers that finish early steal from the others.
+	std::vector<WorkQueue> queues(jobCount);
+	for (int i = 0; i < pathCount; i++)
+	{
+		queues[i % jobCount].Jobs.push_back(i);
+	}
+
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	std::vector<std::thread> workers;
+	for (int i = 0; i < jobCount; i++)
+	{
+		workers.emplace_back(WorkerLoop, &queues, &output, i);
+	}
+
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i].join();
+	}
+
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+
+
+	int exitCode = 0;
+	for (int i = 0; i < pathCount; i++)
+	{
+		if (exitCode == 0 && jobs[i].ExitCode != 0)
+			exitCode = jobs[i].ExitCode;
+	}
+
+
+	fprintf(stderr, "\n== Batch Summary (%d scripts, %d worker threads) ==\n", pathCount, jobCount);
+	for (int i = 0; i < pathCount; i++)
+	{
+		fprintf(stderr, "%4d  %10.3f ms  %s\n", jobs[i].ExitCode, jobs[i].Milliseconds, jobs[i].Path);
+	}
+	fprintf(stderr, "Total wall time: %.3f ms\n", elapsed.count());
+
+	return exitCode;
+}
+
+
+const char** ReadManifest(const char* path, int* pathCount)
+{
+	*pathCount = 0;
+
+	SourceFile manifest;
+	if (!LoadSourceFile(path, &manifest, stderr))
+		return NULL;
+
+
+	int capacity = 8;
+	const char** paths = (const char**)malloc(sizeof(const char*) * capacity);
+	if (paths == NULL)
+		exit(1);
+
+
+	// Split the manifest into lines, trimming off any surrounding whitespace.
+	const char* line = manifest.Text;
+	const char* textEnd = manifest.Text + manifest.Length;
+	while (line < textEnd)
+	{
+		const char* end = line;
+		while (end < textEnd && *end != '\n')
+			end++;
+
+		const char* next = end == textEnd ? end : end + 1;
+
+		while (line < end && (*line == ' ' || *line == '\t'))
+			line++;
+		while (end > line && (end[-1] == ' ' || end[-1] == '\t' || end[-1] == '\r'))
+			end--;
+
+		if (end > line)
+		{
+			if (*pathCount == capacity)
+			{
+				capacity *= 2;
+				paths = (const char**)realloc(paths, sizeof(const char*) * capacity);
+				if (paths == NULL)
+					exit(1);
+			}
+
+			int length = (int)(end - line);
+			char* entry = (char*)malloc(length + 1);
+			if (entry == NULL)
+				exit(1);
+
+			memcpy(entry, line, length);
+			entry[length] = '\0';
+			paths[(*pathCount)++] = entry;
+		}
+
+		line = next;
+	} // End while
+
+	UnloadSourceFile(&manifest);
+	return paths;
+}
+
+
+void FreeManifest(const char** paths, int pathCount)
+{
+	for (int i = 0; i < pathCount; i++)
+	{
+		free((void*)paths[i]);
+	}
+
+	free(paths);
+}
@@ -0,0 +1,37 @@
+// This file contains code for running many Lox scripts at once on a pool of worker threads.
+//
+
+#pragma once
+
+// #ifndef cLox_BatchRunner_h
+//	#define cLox_BatchRunner_h
+
+// cLox includes.
+#include "Common.h"
+
+
+
+
+/// <summary>
+/// Runs a batch of Lox script files on a fixed-size pool of worker threads. Each script runs in
+/// its own isolated VM. The output of each script is captured separately and written out in the
+/// order the scripts were given, as soon as that script and every one before it have finished.
+/// Once they have all finished, a summary with each script's exit code and run time is written to stderr.
+/// </summary>
+/// <param name="paths">The file paths of the Lox scripts to run.</param>
+/// <param name="pathCount">The number of scripts.</param>
+/// <param name="jobCount">The number of worker threads to use. If this is less than 1, one thread per CPU core is used.</param>
+/// <returns>0 if every script succeeded. Otherwise the exit code of the first script (in the order given) that failed.</returns>
+int RunBatch(const char** paths, int pathCount, int jobCount);
+
+
+/// <summary>
+/// Reads a manifest file listing Lox scripts to run, one file path per line. Blank lines are ignored.
+/// </summary>
+/// <param name="path">The file path of the manifest.</param>
+/// <param name="pathCount">Used to return the number of script paths read.</param>
+/// <returns>An array of script paths, or NULL if the manifest could not be read. Free it with FreeManifest().</returns>
+const char** ReadManifest(const char* path, int* pathCount);
+void FreeManifest(const char** paths, int pathCount);
+
+// #endif
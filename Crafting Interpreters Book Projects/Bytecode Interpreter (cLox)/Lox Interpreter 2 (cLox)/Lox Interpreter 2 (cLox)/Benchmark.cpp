@@ -0,0 +1,836 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <chrono>
+#include <string>
+#include <thread>
+#include <vector>
+
+// cLox includes.
+#include "Benchmark.h"
+#include "Hash.h"
+#include "Memory.h"
+#include "NumberParser.h"
+#include "Scanner.h"
+#include "Table.h"
+#include "TokenBuffer.h"
+#include "VM.h"
+
+
+
+
+typedef int (*BenchmarkFunction)();
+
+
+struct Benchmark
+{
+	const char* Name; // The name used to run the benchmark from the command line.
+	const char* Description; // What the benchmark measures.
+	BenchmarkFunction Function;
+};
+
+
+
+
+static double MillisecondsSince(std::chrono::steady_clock::time_point start)
+{
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	return elapsed.count();
+}
+
+
+/// <summary>
+/// Generates a pseudo random number literal. The mix is meant to look like the numeric tables people embed
+/// in Lox scripts: mostly small integers and short decimals, plus some long ones with lots of digits.
+/// </summary>
+static std::string MakeNumberLiteral(uint32_t* seed)
+{
+	// A simple xorshift random number generator, so the benchmark is the same on every run and platform.
+	uint32_t x = *seed;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	*seed = x;
+
+	char buffer[64];
+	switch (x % 4)
+	{
+		case 0: // A small integer.
+			snprintf(buffer, sizeof(buffer), "%u", (x >> 8) % 100000);
+			break;
+		case 1: // A short decimal, like a price or a measurement.
+			snprintf(buffer, sizeof(buffer), "%u.%02u", (x >> 8) % 10000, (x >> 4) % 100);
+			break;
+		case 2: // A value between 0 and 1 with lots of digits.
+			snprintf(buffer, sizeof(buffer), "0.%09u%09u", x >> 3, (x * 2654435761u) >> 3);
+			break;
+		default: // A long number with more digits than a double can hold.
+			snprintf(buffer, sizeof(buffer), "%u%09u.%09u", x, x >> 7, (x * 2654435761u) >> 5);
+			break;
+	}
+
+	return std::string(buffer);
+}
+
+
+/// <summary>
+/// Times ParseNumberLiteral() against the strtod() call the compiler used to make, on the same literals. Then it
+/// times compiling a Lox script that is almost entirely number literals.
+/// </summary>
+static int BenchmarkNumbers()
+{
+	const int literalCount = 1000000;
+	const int repeatCount = 10;
+
+	uint32_t seed = 2463534242u;
+	std::vector<std::string> literals;
+	literals.reserve(literalCount);
+	for (int i = 0; i < literalCount; i++)
+	{
+		literals.push_back(MakeNumberLiteral(&seed));
+	}
+
+
+	// Both loops add up the results, so the compiler can't optimize the calls away.
+	double fastSum = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeatCount; r++)
+	{
+		for (int i = 0; i < literalCount; i++)
+		{
+			fastSum += ParseNumberLiteral(literals[i].data(), (int)literals[i].size());
+		}
+	}
+	double fastTime = MillisecondsSince(start);
+
+
+	double strtodSum = 0;
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeatCount; r++)
+	{
+		for (int i = 0; i < literalCount; i++)
+		{
+			strtodSum += strtod(literals[i].c_str(), NULL);
+		}
+	}
+	double strtodTime = MillisecondsSince(start);
+
+
+	int mismatches = 0;
+	for (int i = 0; i < literalCount; i++)
+	{
+		if (ParseNumberLiteral(literals[i].data(), (int)literals[i].size()) != strtod(literals[i].c_str(), NULL))
+			mismatches++;
+	}
+
+
+	double parseCount = (double)literalCount * repeatCount;
+	printf("Number literal parsing (%d literals x %d runs):\n", literalCount, repeatCount);
+	printf("  ParseNumberLiteral(): %10.3f ms  (%.2f ns per literal)\n", fastTime, fastTime * 1e6 / parseCount);
+	printf("  strtod():             %10.3f ms  (%.2f ns per literal)\n", strtodTime, strtodTime * 1e6 / parseCount);
+	printf("  Speedup: %.2fx   Results that differ from strtod(): %d\n", strtodTime / fastTime, mismatches);
+
+	if (fastSum != strtodSum)
+		printf("  WARNING: The sums of the results differ.\n");
+
+
+	// Now build a script full of number literals. Each function only gets 250 of them, since that is about
+	// how many constants one chunk can hold.
+	std::string source;
+	int literal = 0;
+	for (int f = 0; f < 100; f++)
+	{
+		source += "fun table" + std::to_string(f) + "() {\n  return ";
+		for (int i = 0; i < 250; i++)
+		{
+			if (i > 0)
+				source += (i % 10 == 0) ? " +\n    " : " + ";
+			source += literals[literal++];
+		}
+		source += ";\n}\n";
+	}
+
+
+	VM* machine = NewVM();
+	const int compileCount = 20;
+	InterpretResult result = INTERPRET_OK;
+
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < compileCount && result == INTERPRET_OK; r++)
+	{
+		result = Interpret(source.data(), source.size());
+	}
+	double compileTime = MillisecondsSince(start);
+
+	FreeVM(machine);
+
+
+	printf("\nCompiling a literal heavy script (%d literals, %.1f KB) %d times:\n", literal, source.size() / 1024.0, compileCount);
+	if (result != INTERPRET_OK)
+	{
+		printf("  The script failed to compile.\n");
+		return 70;
+	}
+
+	printf("  %10.3f ms  (%.2f MB/s)\n", compileTime, (source.size() * (double)compileCount) / (compileTime * 1000.0));
+	return 0;
+}
+
+
+
+/// <summary>
+/// Generates a big Lox script with a realistic mix of tokens: declarations, expressions, strings, comments, and blank lines.
+/// </summary>
+static std::string MakeLexingSource(int functionCount)
+{
+	std::string source;
+	for (int f = 0; f < functionCount; f++)
+	{
+		std::string n = std::to_string(f);
+		source += "// Function number " + n + " does some made up work.\n";
+		source += "fun function" + n + "(first, second) {\n";
+		source += "    var total = first * 3.25 + second / 17 - " + n + ";\n";
+		source += "    var label = \"a string literal for function " + n + "\";\n";
+		source += "    for (var i = 0; i < 100; i = i + 1) {\n";
+		source += "        if (i >= total and label != nil) total = total + i; // A trailing comment.\n";
+		source += "    }\n\n";
+		source += "    return total;\n";
+		source += "}\n\n";
+	}
+
+	return source;
+}
+
+
+/// <summary>
+/// Times lexing a big script up front into a TokenBuffer, against pulling the same tokens out of the scanner
+/// one at a time the way the compiler does when PRETOKENIZE_SOURCE is off.
+/// </summary>
+static int BenchmarkLexing()
+{
+	std::string source = MakeLexingSource(50000);
+	const int repeatCount = 5;
+
+
+	int scannedCount = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeatCount; r++)
+	{
+		Scanner scanner;
+		InitScanner(&scanner, source.data(), source.size());
+
+		scannedCount = 0;
+		while (ScanToken(&scanner).Type != TOKEN_EOF)
+		{
+			scannedCount++;
+		}
+	}
+	double scanTime = MillisecondsSince(start);
+
+
+	int bufferedCount = 0;
+	double tokenizeTime = 0;
+	double readTime = 0;
+	for (int r = 0; r < repeatCount; r++)
+	{
+		TokenBuffer buffer;
+		InitTokenBuffer(&buffer);
+
+		start = std::chrono::steady_clock::now();
+		TokenizeSource(&buffer, source.data(), source.size());
+		tokenizeTime += MillisecondsSince(start);
+
+		start = std::chrono::steady_clock::now();
+		TokenCursor cursor;
+		InitTokenCursor(&cursor, &buffer);
+
+		bufferedCount = 0;
+		while (NextToken(&cursor).Type != TOKEN_EOF)
+		{
+			bufferedCount++;
+		}
+		readTime += MillisecondsSince(start);
+
+		FreeTokenBuffer(&buffer);
+	}
+
+
+	double megabytes = (source.size() * (double)repeatCount) / (1024.0 * 1024.0);
+	printf("Lexing a %.1f MB script (%d tokens) %d times:\n", source.size() / (1024.0 * 1024.0), scannedCount, repeatCount);
+	printf("  ScanToken() one at a time:  %10.3f ms  (%.1f MB/s)\n", scanTime, megabytes / (scanTime / 1000.0));
+	printf("  TokenizeSource():           %10.3f ms  (%.1f MB/s)\n", tokenizeTime, megabytes / (tokenizeTime / 1000.0));
+	printf("  Reading the token buffer:   %10.3f ms\n", readTime);
+
+	if (scannedCount != bufferedCount)
+	{
+		printf("  The token buffer has %d tokens, but the scanner found %d.\n", bufferedCount, scannedCount);
+		return 70;
+	}
+
+	return 0;
+}
+
+
+/// <summary>
+/// Generates a script that is hard to lex in chunks. Most of its lines are inside multi-line string literals, and the text
+/// in those strings looks like code and comments, so a chunk that starts in the middle of one gets lexed completely wrong
+/// the first time. There are also comments with quotation marks in them, and sometimes an unterminated string at the end.
+/// </summary>
+static std::string MakeTrickyLexingSource(uint32_t seed, int lineCount)
+{
+	std::string source;
+	int line = 0;
+	while (line < lineCount)
+	{
+		// The same xorshift generator as MakeNumberLiteral(), so the check is the same on every run.
+		seed ^= seed << 13;
+		seed ^= seed >> 17;
+		seed ^= seed << 5;
+
+		switch (seed % 5)
+		{
+			case 0:
+			case 1: // A multi-line string whose lines look like code, comments and string literals.
+			{
+				int stringLines = 1 + (seed >> 8) % 30;
+				source += "var s" + std::to_string(line) + " = \"start of a string\n";
+				for (int i = 0; i < stringLines; i++)
+				{
+					source += (i % 3 == 0) ? "  print x; // not a comment\n" : (i % 3 == 1) ? "  fun f() { return 1.5; }\n" : "  // still in the string\n";
+				}
+				source += "end of the string\";\n";
+				line += stringLines + 2;
+				break;
+			}
+
+			case 2: // A comment with a quotation mark in it, which must not start a string.
+				source += "// a comment that says \"hi\" and then has a lone \" in it\n";
+				line++;
+				break;
+
+			case 3: // Ordinary code, with a one line string and a character the scanner doesn't know.
+				source += "if (a >= 2 and b != nil) print \"one line\" + c; @\n";
+				line++;
+				break;
+
+			default: // Blank lines, and a trailing comment.
+				source += "\n\n{ var y = 3; } // done\n";
+				line += 3;
+				break;
+		}
+	} // end while
+
+	if (seed % 2 == 0)
+		source += "var unterminated = \"this string never ends\n// and this isn't a comment\n";
+
+	return source;
+}
+
+
+/// <summary>
+/// Checks that two token buffers hold exactly the same tokens.
+/// </summary>
+static bool TokenBuffersMatch(TokenBuffer* a, TokenBuffer* b)
+{
+	if (a->Count != b->Count)
+		return false;
+
+	for (int i = 0; i < a->Count; i++)
+	{
+		if (a->Types[i] != b->Types[i] || a->Lengths[i] != b->Lengths[i] || a->LineDeltas[i] != b->LineDeltas[i])
+			return false;
+
+		if (a->Types[i] == TOKEN_ERROR)
+		{
+			if (strcmp(a->ErrorMessages[a->Offsets[i]], b->ErrorMessages[b->Offsets[i]]) != 0)
+				return false;
+		}
+		else if (a->Offsets[i] != b->Offsets[i])
+		{
+			return false;
+		}
+	}
+
+	return true;
+}
+
+
+/// <summary>
+/// Checks that TokenizeInParallel() gives exactly the same tokens as TokenizeOnOneThread() on scripts where the chunk
+/// boundaries land inside multi-line strings, for lots of different chunk counts. Then it times the two on a big script.
+/// </summary>
+static int BenchmarkParallelLexing()
+{
+	int checkCount = 0;
+	int fixUpCount = 0;
+	for (uint32_t seed = 1; seed <= 20; seed++)
+	{
+		std::string source = MakeTrickyLexingSource(seed * 2654435761u, 400);
+
+		TokenBuffer serial;
+		InitTokenBuffer(&serial);
+		TokenizeOnOneThread(&serial, source.data(), source.size());
+
+		for (int workerCount = 2; workerCount <= 32; workerCount++)
+		{
+			TokenBuffer parallel;
+			InitTokenBuffer(&parallel);
+			fixUpCount += TokenizeInParallel(&parallel, source.data(), source.size(), workerCount);
+
+			bool matches = TokenBuffersMatch(&serial, &parallel);
+			FreeTokenBuffer(&parallel);
+			checkCount++;
+
+			if (!matches)
+			{
+				printf("Parallel lexing with %d chunks gave different tokens than lexing on one thread (script %u).\n", workerCount, seed);
+				FreeTokenBuffer(&serial);
+				return 70;
+			}
+		}
+
+		FreeTokenBuffer(&serial);
+	}
+
+	printf("Parallel and single threaded lexing matched on %d tricky scripts and chunk counts (%d string literals crossed a chunk boundary).\n", checkCount, fixUpCount);
+	if (fixUpCount == 0)
+	{
+		printf("  None of the checks exercised the fix-up pass.\n");
+		return 70;
+	}
+
+
+	std::string source = MakeLexingSource(50000);
+	const int repeatCount = 5;
+
+	int workerCount = (int)std::thread::hardware_concurrency();
+	if (workerCount < 2)
+		workerCount = 2;
+
+	double serialTime = 0;
+	double parallelTime = 0;
+	for (int r = 0; r < repeatCount; r++)
+	{
+		TokenBuffer buffer;
+		InitTokenBuffer(&buffer);
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+		TokenizeOnOneThread(&buffer, source.data(), source.size());
+		serialTime += MillisecondsSince(start);
+		FreeTokenBuffer(&buffer);
+
+		InitTokenBuffer(&buffer);
+		start = std::chrono::steady_clock::now();
+		TokenizeInParallel(&buffer, source.data(), source.size(), workerCount);
+		parallelTime += MillisecondsSince(start);
+		FreeTokenBuffer(&buffer);
+	}
+
+	double megabytes = (source.size() * (double)repeatCount) / (1024.0 * 1024.0);
+	printf("Lexing a %.1f MB script into a token buffer %d times:\n", source.size() / (1024.0 * 1024.0), repeatCount);
+	printf("  TokenizeOnOneThread():          %10.3f ms  (%.1f MB/s)\n", serialTime, megabytes / (serialTime / 1000.0));
+	printf("  TokenizeInParallel(), %2d chunks: %10.3f ms  (%.1f MB/s)\n", workerCount, parallelTime, megabytes / (parallelTime / 1000.0));
+	printf("  This machine has %u hardware threads.\n", std::thread::hardware_concurrency());
+
+	return 0;
+}
+
+
+
+// An allocation heavy script for the garbage collector benchmark. It keeps a big tree of objects alive the whole time, so
+// marking has plenty to do, while it churns through short lived objects and regularly throws away parts of the tree.
+static const char* GCWorkloadSource =
+	"class Node { init(left, right) { this.left = left; this.right = right; } }\n"
+	"fun tree(depth) {\n"
+	"  if (depth < 1) return nil;\n"
+	"  return Node(tree(depth - 1), tree(depth - 1));\n"
+	"}\n"
+	"var live = tree(17);\n"
+	"var count = 0;\n"
+	"for (var i = 0; i < 1000000; i = i + 1) {\n"
+	"  var temp = Node(i, \"short\" + \"lived\");\n"
+	"  count = count + 1;\n"
+	"  if (count > 5000) {\n"
+	"    count = 0;\n"
+	"    live.left.right = tree(11);\n"
+	"  }\n"
+	"}\n";
+
+
+/// <summary>
+/// Runs the garbage collector workload on a new VM, and prints out how much the garbage collector paused it.
+/// </summary>
+/// <param name="pauseBudget">The pause budget for the incremental collector, in milliseconds. Ignored if INCREMENTAL_GC is off.</param>
+/// <param name="concurrent">Whether the marking can be done on a background thread. Ignored if CONCURRENT_GC is off.</param>
+/// <param name="parallel">Whether the marking that pauses the program is split across threads, no matter how small the heap is. Ignored if PARALLEL_GC is off.</param>
+static bool RunGCWorkload(const char* label, double pauseBudget, bool concurrent, bool parallel)
+{
+	VM* machine = NewVM();
+#ifdef INCREMENTAL_GC
+	machine->PauseBudget = pauseBudget;
+#endif
+#ifdef CONCURRENT_GC
+	machine->ConcurrentMarking = concurrent;
+#else
+	(void)concurrent;
+#endif
+#ifdef PARALLEL_GC
+	machine->ParallelMarkThreshold = parallel ? 0 : SIZE_MAX;
+#else
+	(void)parallel;
+#endif
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	InterpretResult result = Interpret(GCWorkloadSource, strlen(GCWorkloadSource));
+	double runTime = MillisecondsSince(start);
+
+	GCStats stats = machine->Stats;
+	FreeVM(machine);
+
+	if (result != INTERPRET_OK)
+	{
+		printf("  The script failed to run.\n");
+		return false;
+	}
+
+	printf("  %s\n", label);
+	printf("    Run time: %10.3f ms   Full collections: %d   Minor collections: %d\n", runTime, stats.Collections, stats.MinorCollections);
+	printf("    Pauses:   %10d      Total: %.3f ms   Average: %.4f ms   Max: %.3f ms\n",
+		stats.Pauses, stats.TotalPause, stats.Pauses > 0 ? stats.TotalPause / stats.Pauses : 0.0, stats.MaxPause);
+	printf("    Longest full collection pause: %.3f ms   Longest minor collection: %.3f ms\n", stats.MaxCollectionPause, stats.MaxMinorPause);
+	return true;
+}
+
+
+/// <summary>
+/// Measures how long the garbage collector pauses an allocation heavy script for. With INCREMENTAL_GC on, the script
+/// runs once with all of the marking for a collection done in one go, and once with the default pause budget. With
+/// CONCURRENT_GC on, it also runs once with the marking done on a background thread. With PARALLEL_GC on, it also runs
+/// once with the marking done in one go, but split across all of the CPU cores.
+/// </summary>
+static int BenchmarkGarbageCollector()
+{
+	printf("Garbage collector pauses:\n");
+
+#ifdef INCREMENTAL_GC
+	if (!RunGCWorkload("Marking in one go (no pause budget):", 0, false, false))
+		return 70;
+
+	#ifdef PARALLEL_GC
+	if (!RunGCWorkload("Parallel marking in one go (no pause budget):", 0, false, true))
+		return 70;
+	#endif
+
+	char label[64];
+	snprintf(label, sizeof(label), "Incremental marking (%.2f ms pause budget):", (double)GC_PAUSE_BUDGET);
+	if (!RunGCWorkload(label, GC_PAUSE_BUDGET, false, false))
+		return 70;
+
+	#ifdef CONCURRENT_GC
+	if (!RunGCWorkload("Concurrent marking on a background thread:", GC_PAUSE_BUDGET, true, false))
+		return 70;
+	#endif
+#else
+	if (!RunGCWorkload("Stop the world collector:", 0, false, false))
+		return 70;
+#endif
+
+	return 0;
+}
+
+
+
+/// <summary>
+/// The FNV-1a hash function cLox used for strings before HashString() replaced it. It is only kept around to compare against.
+/// See http://www.isthe.com/chongo/tech/comp/fnv/
+/// </summary>
+static uint32_t HashStringFNV1a(const char* key, int length)
+{
+	uint32_t hash = 2166136261u;
+	for (int i = 0; i < length; i++)
+	{
+		hash ^= (uint8_t)key[i];
+		hash *= 16777619;
+	}
+
+	return hash;
+}
+
+
+/// <summary>
+/// Hashes every key a number of times with HashString() and then with FNV-1a, and prints how long each took.
+/// </summary>
+static void TimeHashFunctions(const char* label, const std::vector<std::string>& keys, int repeatCount)
+{
+	size_t totalBytes = 0;
+	for (size_t i = 0; i < keys.size(); i++)
+	{
+		totalBytes += keys[i].size();
+	}
+
+
+	// Both loops add up the hash codes, so the compiler can't optimize the calls away.
+	uint32_t sum = 0;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeatCount; r++)
+	{
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			sum += HashString(keys[i].data(), (int)keys[i].size(), 0x1234567890abcdefULL + r);
+		}
+	}
+	double newTime = MillisecondsSince(start);
+
+
+	start = std::chrono::steady_clock::now();
+	for (int r = 0; r < repeatCount; r++)
+	{
+		for (size_t i = 0; i < keys.size(); i++)
+		{
+			sum += HashStringFNV1a(keys[i].data(), (int)keys[i].size());
+		}
+	}
+	double fnvTime = MillisecondsSince(start);
+
+
+	double hashCount = (double)keys.size() * repeatCount;
+	double megabytes = (totalBytes * (double)repeatCount) / (1024.0 * 1024.0);
+	printf("%s (%zu keys averaging %.1f bytes, x %d runs):\n", label, keys.size(), totalBytes / (double)keys.size(), repeatCount);
+	printf("  HashString(): %10.3f ms  (%.2f ns per key, %.0f MB/s)\n", newTime, newTime * 1e6 / hashCount, megabytes / (newTime / 1000.0));
+	printf("  FNV-1a:       %10.3f ms  (%.2f ns per key, %.0f MB/s)\n", fnvTime, fnvTime * 1e6 / hashCount, megabytes / (fnvTime / 1000.0));
+	printf("  Speedup: %.2fx   (checksum %08x)\n", fnvTime / newTime, sum);
+}
+
+
+/// <summary>
+/// Counts how many of the hash codes land in a bucket that an earlier one already landed in, when they are masked down to
+/// the number of buckets. The bucket count has to be a power of two.
+/// </summary>
+static int CountBucketCollisions(const std::vector<uint32_t>& hashes, int bucketCount)
+{
+	std::vector<bool> used(bucketCount, false);
+	int collisions = 0;
+	for (size_t i = 0; i < hashes.size(); i++)
+	{
+		uint32_t index = hashes[i] & (bucketCount - 1);
+		if (used[index])
+			collisions++;
+		used[index] = true;
+	}
+
+	return collisions;
+}
+
+
+/// <summary>
+/// Times HashString() against the FNV-1a hash function it replaced, on short keys that look like identifiers and on long
+/// ones that look like URLs. Then it checks how evenly both spread a set of very similar keys over a hash table's buckets.
+/// </summary>
+static int BenchmarkHashing()
+{
+	const int shortKeyCount = 1000000;
+	const int longKeyCount = 100000;
+
+	std::vector<std::string> shortKeys;
+	shortKeys.reserve(shortKeyCount);
+	for (int i = 0; i < shortKeyCount; i++)
+	{
+		shortKeys.push_back("field" + std::to_string(i));
+	}
+
+	std::vector<std::string> longKeys;
+	longKeys.reserve(longKeyCount);
+	for (int i = 0; i < longKeyCount; i++)
+	{
+		std::string n = std::to_string(i);
+		longKeys.push_back("https://api.example.com/v2/accounts/" + n + "/reports/monthly?format=json&fields=name,total,items&page=" +
+			std::to_string(i % 97) + "&session=" + std::to_string(i * 2654435761u));
+	}
+
+	TimeHashFunctions("Short identifier keys", shortKeys, 20);
+	printf("\n");
+	TimeHashFunctions("Long URL keys", longKeys, 20);
+
+
+	// The table is sized the way TableSet() sizes it, so it's at most 87.5% full.
+	int bucketCount = 1;
+	while (bucketCount * 7 < shortKeyCount * 8)
+	{
+		bucketCount *= 2;
+	}
+
+	std::vector<uint32_t> newHashes(shortKeyCount);
+	std::vector<uint32_t> fnvHashes(shortKeyCount);
+	for (int i = 0; i < shortKeyCount; i++)
+	{
+		newHashes[i] = HashString(shortKeys[i].data(), (int)shortKeys[i].size(), 0x1234567890abcdefULL);
+		fnvHashes[i] = HashStringFNV1a(shortKeys[i].data(), (int)shortKeys[i].size());
+	}
+
+	// How many collisions there would be on average if the hash codes were truly random.
+	double expected = shortKeyCount - bucketCount * (1.0 - pow(1.0 - 1.0 / bucketCount, shortKeyCount));
+
+	printf("\nBucket collisions for the short keys in a table with %d buckets:\n", bucketCount);
+	printf("  HashString(): %d\n", CountBucketCollisions(newHashes, bucketCount));
+	printf("  FNV-1a:       %d\n", CountBucketCollisions(fnvHashes, bucketCount));
+	printf("  Random:       %.0f (expected)\n", expected);
+
+	return 0;
+}
+
+
+/// <summary>
+/// Makes the strings the table benchmark uses as keys. They are all added to the VM's globals as well, so the garbage
+/// collector never frees them while the benchmark is using them.
+/// </summary>
+static std::vector<ObjString*> MakeTableKeys(VM* machine, const char* prefix, int count)
+{
+	std::vector<ObjString*> keys;
+	keys.reserve(count);
+	for (int i = 0; i < count; i++)
+	{
+		std::string name = prefix + std::to_string(i);
+
+		// The string stays on the stack until it's in the globals, since adding it may allocate.
+		Push(OBJ_VAL(CopyString(name.data(), (int)name.size())));
+		TableSet(&machine->Globals, AS_STRING(machine->StackTop[-1]), NIL_VAL);
+		keys.push_back(AS_STRING(Pop()));
+	}
+
+	return keys;
+}
+
+
+/// <summary>
+/// Times the basic hash table operations on a table of the specified size, and prints how long each one took per key.
+/// </summary>
+static void TimeTableOperations(const std::vector<ObjString*>& keys, const std::vector<ObjString*>& missingKeys, int size)
+{
+	// Small tables get built over and over again, so every size does about the same amount of work.
+	int repeatCount = (int)(keys.size() / size);
+	double insertTime = 0;
+	double hitTime = 0;
+	double missTime = 0;
+	double churnTime = 0;
+	double findTime = 0;
+	int found = 0;
+
+	for (int r = 0; r < repeatCount; r++)
+	{
+		Table table;
+		InitTable(&table);
+
+		auto start = std::chrono::steady_clock::now();
+		for (int i = 0; i < size; i++)
+		{
+			TableSet(&table, keys[i], NUMBER_VAL(i));
+		}
+		insertTime += MillisecondsSince(start);
+
+		Value value;
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < size; i++)
+		{
+			found += TableGet(&table, keys[i], &value);
+		}
+		hitTime += MillisecondsSince(start);
+
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < size; i++)
+		{
+			found += TableGet(&table, missingKeys[i], &value);
+		}
+		missTime += MillisecondsSince(start);
+
+		// Looks the keys up by their characters, the way a new string gets checked against the interned ones.
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < size; i++)
+		{
+			found += TableFindString(&table, keys[i]->Chars, keys[i]->Length, keys[i]->Hash) == keys[i];
+		}
+		findTime += MillisecondsSince(start);
+
+		// Deletes every key and puts it straight back, like an object whose fields keep getting removed and added.
+		start = std::chrono::steady_clock::now();
+		for (int i = 0; i < size; i++)
+		{
+			TableDelete(&table, keys[i]);
+			TableSet(&table, keys[i], NUMBER_VAL(i));
+		}
+		churnTime += MillisecondsSince(start);
+
+		FreeTable(&table);
+	}
+
+	double operations = (double)repeatCount * size / 1000000.0; // Turns milliseconds into nanoseconds per key.
+	printf("  %8d keys: insert %6.1f ns, hit %6.1f ns, miss %6.1f ns, find string %6.1f ns, delete and insert %6.1f ns%s\n", size,
+		insertTime / operations, hitTime / operations, missTime / operations, findTime / operations, churnTime / operations,
+		found == 2 * repeatCount * size ? "" : " (WRONG RESULTS)");
+}
+
+
+/// <summary>
+/// Times inserts, lookups that hit and miss, and deletes on hash tables from the size of a small instance's fields up to the
+/// size of a big string table.
+/// </summary>
+static int BenchmarkTables()
+{
+	const int keyCount = 1000000;
+
+	VM* machine = NewVM();
+	std::vector<ObjString*> keys = MakeTableKeys(machine, "key", keyCount);
+	std::vector<ObjString*> missingKeys = MakeTableKeys(machine, "missing", keyCount);
+
+	// Gets the garbage collector's work on all of those strings out of the way, so it doesn't end up in the first timing.
+	CollectGarbage();
+
+	printf("Hash table operations, per key:\n");
+	const int sizes[] = { 4, 16, 100, 10000, keyCount };
+	for (int size : sizes)
+	{
+		TimeTableOperations(keys, missingKeys, size);
+	}
+
+	FreeVM(machine);
+	return 0;
+}
+
+
+
+
+static const Benchmark Benchmarks[] =
+{
+	{ "numbers", "Number literal parsing and compiling literal heavy scripts.", BenchmarkNumbers },
+	{ "lexing", "Lexing a big script into a token buffer, compared to scanning it a token at a time.", BenchmarkLexing },
+	{ "parallel-lexing", "Checks parallel lexing gives the same tokens as lexing on one thread, then compares their speed.", BenchmarkParallelLexing },
+	{ "gc", "How long the garbage collector pauses an allocation heavy script for.", BenchmarkGarbageCollector },
+	{ "hashing", "String hashing speed on short and long keys, and how evenly the hash codes spread out.", BenchmarkHashing },
+	{ "tables", "Hash table inserts, lookups and deletes on small and big tables.", BenchmarkTables },
+};
+
+
+int RunBenchmark(const char* name)
+{
+	int benchmarkCount = (int)(sizeof(Benchmarks) / sizeof(Benchmarks[0]));
+
+	if (name != NULL)
+	{
+		for (int i = 0; i < benchmarkCount; i++)
+		{
+			if (strcmp(Benchmarks[i].Name, name) == 0)
+				return Benchmarks[i].Function();
+		}
+
+		fprintf(stderr, "There is no benchmark named \"%s\".\n", name);
+	}
+
+
+	fprintf(stderr, "Usage: cLox --benchmark <name>\n");
+	fprintf(stderr, "Available benchmarks:\n");
+	for (int i = 0; i < benchmarkCount; i++)
+	{
+		fprintf(stderr, "  %-16s %s\n", Benchmarks[i].Name, Benchmarks[i].Description);
+	}
+
+	return 64;
+}
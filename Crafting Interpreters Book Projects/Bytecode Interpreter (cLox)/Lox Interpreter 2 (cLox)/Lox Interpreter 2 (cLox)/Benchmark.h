@@ -0,0 +1,26 @@
+// This file contains built-in micro benchmarks for parts of the interpreter that are hard to time from a Lox script.
+//
+
+#pragma once
+
+// #ifndef cLox_Benchmark_h
+//	#define cLox_Benchmark_h
+
+// cLox includes.
+#include "Common.h"
+
+
+
+
+/// <summary>
+/// Runs one of the built-in benchmarks and prints the results to stdout.
+/// </summary>
+/// <param name="name">The name of the benchmark to run. Passing NULL lists the available benchmarks.</param>
+/// <returns>0 if the benchmark ran, or 64 if there is no benchmark with that name.</returns>
+/// <remarks>
+/// The timings are only meaningful in a release build with DEBUG_PRINT_CODE and DEBUG_TRACE_EXECUTION
+/// turned off in Common.h, since otherwise most of the time is spent writing out debug output.
+/// </remarks>
+int RunBenchmark(const char* name);
+
+// #endif
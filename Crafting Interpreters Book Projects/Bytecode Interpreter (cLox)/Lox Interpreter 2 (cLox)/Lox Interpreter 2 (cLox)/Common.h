@@ -18,6 +18,69 @@
 // CPU cache misses, and thus also increase performance.
 #define NAN_BOXING
 
+// When enabled, the scanner uses SIMD instructions (SSE2, or AVX2 if the compiler is targeting it) to skip over
+// whitespace, comments, and string bodies a whole block of characters at a time. If the CPU being compiled for
+// doesn't support SSE2, the scanner falls back to the plain one character at a time loops automatically.
+#define SCANNER_SIMD
+
+// When enabled, hash table lookups use SIMD instructions (SSE2) to check the control bytes of a whole group of 16 slots at
+// once. If the CPU being compiled for doesn't support SSE2, it falls back to checking them one at a time automatically.
+// See Table.cpp.
+#define TABLE_SIMD
+
+// When enabled, the compiler lexes the whole script into a compact token buffer before it starts parsing, instead of
+// asking the scanner for one token at a time as it goes. See TokenBuffer.h. It is off by default because it doesn't pay
+// for itself yet: in "--benchmark lexing", filling the buffer takes about 420 ms and reading it back another 55 ms,
+// against about 270 ms for just calling ScanToken(). The buffer also costs 13 bytes of memory per token, which the
+// scanner doesn't need at all.
+// #define PRETOKENIZE_SOURCE
+
+// When enabled, scripts of a megabyte or more are split into chunks that get lexed into the token buffer on several threads
+// at once. It builds on PRETOKENIZE_SOURCE, so that has to be enabled too. Run "--benchmark parallel-lexing" to see whether
+// it is faster than lexing on one thread on this machine. See TokenBuffer.cpp.
+// #define PARALLEL_LEX
+
+// When enabled, the bodies of functions and methods are not compiled when they are declared. The compiler just skips
+// over them, and each one gets compiled the first time it is called instead. This makes starting up a big script that
+// only calls a few of its functions a lot faster. Each skipped body is still preparsed to check its syntax, so compile
+// errors are reported up front. Only a few limits (like the number of constants in a function) aren't checked until
+// the function is first called.
+// #define LAZY_COMPILE_FUNCTIONS
+
+// When enabled, the garbage collector splits the heap into two generations. New objects are bump allocated in a small
+// nursery, and cheap minor collections copy the ones that survive into the old generation. Most objects die young,
+// so most garbage gets thrown away without the full mark and sweep ever having to look at it. See Memory.cpp.
+#define GENERATIONAL_GC
+
+// When enabled, the small objects in the old generation are allocated from pages that are split up into slots of a few fixed
+// sizes, instead of each one getting its own malloc. This packs them closer together, and sweeping walks the pages instead of
+// chasing a linked list. See SlabAllocator.h.
+#define SLAB_ALLOCATOR
+
+// When enabled, the slab pages aren't all swept at the end of a collection. They get swept one at a time afterwards, as the
+// program allocates, so the pause at the end of a collection doesn't grow with the size of the heap. It builds on
+// SLAB_ALLOCATOR, so that has to be enabled too. See Memory.cpp.
+#define LAZY_SWEEP
+
+// When enabled, full collections are followed by a compaction, which packs the objects left in the old generation into as
+// few slab pages as they fit in, and gives the emptied pages back to the system. This keeps long running programs from
+// holding on to memory they freed a long time ago. It needs GENERATIONAL_GC and SLAB_ALLOCATOR. See Memory.cpp.
+// #define COMPACTING_GC
+
+// When enabled, the garbage collector marks the heap a little at a time, interleaved with running the program, instead of
+// pausing the program for the whole collection. Each step is paid for by allocation, and is kept within a pause budget.
+// The first and last steps of a collection also do work that grows with the roots, the string table and the number of big
+// objects, and minor collections aren't covered by the budget. See Memory.cpp.
+#define INCREMENTAL_GC
+
+// When enabled, most of the garbage collector's marking is done by a background thread while the program keeps running,
+// which makes use of a spare CPU core. It builds on INCREMENTAL_GC, so that has to be enabled too. See Memory.cpp.
+// #define CONCURRENT_GC
+
+// When enabled, the parts of a collection that pause the program mark the heap using several threads at once, as long as the
+// heap is big enough to be worth it. See VM::ParallelMarkThreshold and Memory.cpp.
+// #define PARALLEL_GC
+
 #define DEBUG_PRINT_KEY // I added this. When this symbol is defined, a description of the columns in the debug output will be displayed.
 #define DEBUG_PRINT_STACK // I added this. When enabled, the debug output prints out the cLox stack after every opcode runs, just like it does normally in the book.
 
@@ -29,5 +92,22 @@
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+
+#if defined(CONCURRENT_GC) && !defined(INCREMENTAL_GC)
+	#error CONCURRENT_GC needs INCREMENTAL_GC to be enabled as well.
+#endif
+
+#if defined(PARALLEL_LEX) && !defined(PRETOKENIZE_SOURCE)
+	#error PARALLEL_LEX needs PRETOKENIZE_SOURCE to be enabled as well.
+#endif
+
+#if defined(LAZY_SWEEP) && !defined(SLAB_ALLOCATOR)
+	#error LAZY_SWEEP needs SLAB_ALLOCATOR to be enabled as well.
+#endif
+
+#if defined(COMPACTING_GC) && (!defined(GENERATIONAL_GC) || !defined(SLAB_ALLOCATOR))
+	#error COMPACTING_GC needs GENERATIONAL_GC and SLAB_ALLOCATOR to be enabled as well.
+#endif
+
 //#endif
 
@@ -7,7 +7,9 @@
 #include "Common.h"
 #include "Compiler.h"
 #include "Memory.h"
+#include "NumberParser.h"
 #include "Scanner.h"
+#include "TokenBuffer.h"
 
 #ifdef DEBUG_PRINT_CODE
 	#include "Debug.h"
@@ -42,7 +44,7 @@ enum Precedence
 
 
 // This function pointer type is called "ParseFn" in the book.
-typedef void (*ParseFunction)(bool canAssign);
+typedef void (*ParseFunction)(CompileContext* context, bool canAssign);
 
 
 struct ParseRule
@@ -88,7 +90,22 @@ struct Compiler
 	Local Locals[UINT8_COUNT]; // Stores all local variables in existance at the current point in compilation.
 	int LocalCount; // The number of locals currently in existance.
 	UpValue UpValues[UINT8_COUNT]; // The list of UpValues this compiler has compiled. See chapter 25 in the book.
+	short UpValueLookup[UINT8_COUNT * 2]; // Maps an UpValue's (Index, IsLocal) pair to its position in the UpValues array plus one, or 0 if this function doesn't have that UpValue yet. This lets AddUpValue() find duplicates without a linear search.
 	int ScopeDepth; // How many scopes deep we currently are in the code.
+	int FirstBinding; // The index in the compile context's Bindings array that belongs to this compiler's local variable in slot 0. The rest of its locals follow in order.
+};
+
+
+/// <summary>
+/// Records one local variable in the compile context's scope table. Bindings are kept in a stack
+/// that matches the order locals are declared in across all of the nested compilers, so
+/// the binding for slot N of a compiler is always at index (FirstBinding + N).
+/// </summary>
+struct ScopeBinding
+{
+	ObjString* Name; // The interned name of the local variable.
+	Compiler* Owner; // The compiler the local variable belongs to.
+	int Shadowed; // The index of the binding this one shadows (the next one out with the same name), or -1 if there isn't one.
 };
 
 
@@ -99,11 +116,31 @@ struct ClassCompiler
 };
 
 
-
-
-Parser parser;
-Compiler* current = NULL;
-ClassCompiler* currentClass = NULL;
+/// <summary>
+/// Holds all of the state of a single compilation. Nothing in the compiler is global, so
+/// any number of these can be active at the same time (on different threads, or nested
+/// inside each other).
+/// </summary>
+struct CompileContext
+{
+#ifdef PRETOKENIZE_SOURCE
+	TokenBuffer Tokens; // Every token in the source code. The whole script gets lexed before parsing starts.
+	TokenCursor Cursor; // Feeds the tokens in the buffer to the parser.
+#else
+	Scanner Scanner; // The scanner that feeds tokens to the parser.
+#endif
+	Parser Parser; // The parser state.
+	Compiler* Current; // The compiler for the function currently being compiled.
+	ClassCompiler* CurrentClass; // The class currently being compiled, or NULL if we're not inside a class.
+	CompileContext* Enclosing; // The compilation that was already running when this one started, if any. The garbage collector walks this chain to find compiler roots.
+
+	// The scope table. It lets the compiler resolve a variable name with a single hash lookup instead of
+	// searching through the locals of every enclosing function.
+	Table Scope; // Maps each interned local variable name to the index of its innermost binding (stored as a number).
+	ScopeBinding* Bindings; // A stack of every local variable currently in scope, across all of the nested compilers.
+	int BindingCount; // The number of bindings in the stack.
+	int BindingCapacity; // The max number of bindings that can fit in the stack before it has to grow.
+};
 
 
 
@@ -112,26 +149,26 @@ ClassCompiler* currentClass = NULL;
 /// Returns a pointer to the bytecode chunk that is currently being compiled.
 /// </summary>
 /// <returns>A pointer to the bytecode chunk being compiled.</returns>
-static Chunk* CurrentChunk()
+static Chunk* CurrentChunk(CompileContext* context)
 {
-	return &current->Function->Chunk;
+	return &context->Current->Function->Chunk;
 }
 
 
-static void ErrorAt(Token* token, const char* message)
+static void ErrorAt(CompileContext* context, Token* token, const char* message)
 {
 	// If we are in panic mode (meaning we already had a compile error), then suppress any further errors.
-	if (parser.PanicMode)
+	if (context->Parser.PanicMode)
 		return;
 
-	parser.PanicMode = true;
+	context->Parser.PanicMode = true;
 
 
-	fprintf(stderr, "COMPILE ERROR: [Line %d] Error", token->Line);
+	fprintf(vm->Err, "COMPILE ERROR: [Line %d] Error", token->Line);
 
 	if (token->Type == TOKEN_EOF)
 	{
-		fprintf(stderr, " at end of source code.");
+		fprintf(vm->Err, " at end of source code.");
 	}
 	else if (token->Type == TOKEN_ERROR)
 	{
@@ -139,41 +176,45 @@ static void ErrorAt(Token* token, const char* message)
 	}
 	else
 	{ 
-		fprintf(stderr, " at '%.*s'", token->Length, token->Start);
+		fprintf(vm->Err, " at '%.*s'", token->Length, token->Start);
 	}
 
 
-	fprintf(stderr, ": %s\n", message);
-	parser.HadError = true;
+	fprintf(vm->Err, ": %s\n", message);
+	context->Parser.HadError = true;
 }
 
 
-static void Error(const char* message)
+static void Error(CompileContext* context, const char* message)
 {
-	ErrorAt(&parser.Previous, message);
+	ErrorAt(context, &context->Parser.Previous, message);
 }
 
 
-static void ErrorAtCurrent(const char* message)
+static void ErrorAtCurrent(CompileContext* context, const char* message)
 {
-	ErrorAt(&parser.Current, message);
+	ErrorAt(context, &context->Parser.Current, message);
 }
 
 
 /// <summary>
 /// Advances to the next token. Calls ErrorAtCurrent() if the parser returns an error.
 /// </summary>
-static void Advance()
+static void Advance(CompileContext* context)
 {
-	parser.Previous = parser.Current;
+	context->Parser.Previous = context->Parser.Current;
 
 	for (;;)
 	{
-		parser.Current = ScanToken();
-		if (parser.Current.Type != TOKEN_ERROR)
+#ifdef PRETOKENIZE_SOURCE
+		context->Parser.Current = NextToken(&context->Cursor);
+#else
+		context->Parser.Current = ScanToken(&context->Scanner);
+#endif
+		if (context->Parser.Current.Type != TOKEN_ERROR)
 			break;
 
-		ErrorAtCurrent(parser.Current.Start);
+		ErrorAtCurrent(context, context->Parser.Current.Start);
 	}
 }
 
@@ -184,30 +225,30 @@ static void Advance()
 /// </summary>
 /// <param name="type">The expected type of the token being looked at.</param>
 /// <param name="message">The error message to report if the token is not the expected type.</param>
-static void Consume(TokenType type, const char* message)
+static void Consume(CompileContext* context, TokenType type, const char* message)
 {
-	if (parser.Current.Type == type)
+	if (context->Parser.Current.Type == type)
 	{
-		Advance();
+		Advance(context);
 		return;
 	}
 
-	ErrorAtCurrent(message);
+	ErrorAtCurrent(context, message);
 }
 
 
-static bool Check(TokenType type)
+static bool Check(CompileContext* context, TokenType type)
 {
-	return parser.Current.Type == type;
+	return context->Parser.Current.Type == type;
 }
 
 
-static bool Match(TokenType type)
+static bool Match(CompileContext* context, TokenType type)
 {
-	if (!Check(type))
+	if (!Check(context, type))
 		return false;
 
-	Advance();
+	Advance(context);
 	return true;
 }
 
@@ -216,76 +257,77 @@ static bool Match(TokenType type)
 /// Appends a new byte to the end of the chunk of bytecode the compiler is generating.
 /// </summary>
 /// <param name="byte">The byte to add.</param>
-static void EmitByte(uint8_t byte)
+static void EmitByte(CompileContext* context, uint8_t byte)
 {
-	WriteChunk(CurrentChunk(), byte, parser.Previous.Line);
+	WriteChunk(CurrentChunk(context), byte, context->Parser.Previous.Line);
 }
 
 
-static void EmitBytes(uint8_t byte1, uint8_t byte2)
+static void EmitBytes(CompileContext* context, uint8_t byte1, uint8_t byte2)
 {
-	EmitByte(byte1);
-	EmitByte(byte2);
+	EmitByte(context, byte1);
+	EmitByte(context, byte2);
 }
 
 
-static void EmitLoop(int loopStart)
+static void EmitLoop(CompileContext* context, int loopStart)
 {
-	EmitByte(OP_LOOP);
+	EmitByte(context, OP_LOOP);
 
 	// Calculate how far back we need to jump to return to the start of the loop.
 	// The (+2) takes into account the OP_LOOP instruction's two-byte operand.
-	int offset = CurrentChunk()->Count - loopStart + 2;
+	int offset = CurrentChunk(context)->Count - loopStart + 2;
 	if (offset > UINT16_MAX)
 	{
-		Error("Loop body contains too many instructions to jump over.");
+		Error(context, "Loop body contains too many instructions to jump over.");
 	}
 
 	// This bitwise and operation effectively masks the value so only the last 8 bits remain.
 	// That's because 0xff doesn't specify the values of its higher 8 bits, so they are all 0.
-	EmitByte((offset >> 8) & 0xff);
-	EmitByte(offset & 0xff);
+	EmitByte(context, (offset >> 8) & 0xff);
+	EmitByte(context, offset & 0xff);
 }
 
 
-static int EmitJump(uint8_t instruction)
+static int EmitJump(CompileContext* context, uint8_t instruction)
 {
 	// Emit the appropriate jump instruction into the bytecode chunk.
-	EmitByte(instruction);
+	EmitByte(context, instruction);
 
 	// Emit two placeholder bytes for the jump instruction's operand.
 	// We use two bytes so our jump instructions can jump over up to 65,535 bytes of code.
 	// Some instruction sets have a separate "long" jump instruction that has a larger
 	// operand so it can jump over larger chunks of bytecode.
-	EmitByte(0xff);
-	EmitByte(0xff);
+	EmitByte(context, 0xff);
+	EmitByte(context, 0xff);
 
 	// Return the index of the jump instruction we emitted.
-	return CurrentChunk()->Count - 2;
+	return CurrentChunk(context)->Count - 2;
 }
 
 
-static void EmitReturn()
+static void EmitReturn(CompileContext* context)
 {
-	if (current->Type == TYPE_INITIALIZER)
+	if (context->Current->Type == TYPE_INITIALIZER)
 	{
-		EmitBytes(OP_GET_LOCAL, 0);
+		EmitBytes(context, OP_GET_LOCAL, 0);
 	}
 	else
 	{
-		EmitByte(OP_NIL); // Lox functions return nil if there is no return statement in a function.
+		EmitByte(context, OP_NIL); // Lox functions return nil if there is no return statement in a function.
 	}
 
-	EmitByte(OP_RETURN);
+	EmitByte(context, OP_RETURN);
 }
 
 
-static uint8_t MakeConstant(Value value)
+static uint8_t MakeConstant(CompileContext* context, Value value)
 {
-	int constant = AddConstant(CurrentChunk(), value);
+	int constant = AddConstant(CurrentChunk(context), value);
+	MARKING_BARRIER(value);
 	if (constant > UINT8_MAX)
 	{
-		Error("Cannot add any more constants in this bytecode chunk.");
+		Error(context, "Cannot add any more constants in this bytecode chunk.");
 		return 0;
 	}
 
@@ -293,9 +335,9 @@ static uint8_t MakeConstant(Value value)
 }
 
 
-static void EmitConstant(Value value)
+static void EmitConstant(CompileContext* context, Value value)
 {
-	EmitBytes(OP_CONSTANT, MakeConstant(value));
+	EmitBytes(context, OP_CONSTANT, MakeConstant(context, value));
 }
 
 
@@ -307,17 +349,17 @@ static void EmitConstant(Value value)
 /// information.
 /// </summary>
 /// <param name="offset">The index of the jump instruction to update in the bytecode.</param>
-static void PatchJump(int offset)
+static void PatchJump(CompileContext* context, int offset)
 {
 	// Calculate how far we need to jump in the bytecode.
 	// The -2 is to account for the two dummy bytes that EmitJump() placed
 	// after the jump instruction as placeholders for its operand.
-	int jump = CurrentChunk()->Count - offset - 2;
+	int jump = CurrentChunk(context)->Count - offset - 2;
 
 	
 	if (jump > UINT16_MAX)
 	{
-		Error("Too much code to jump over.");
+		Error(context, "Too much code to jump over.");
 	}
 
 
@@ -325,30 +367,123 @@ static void PatchJump(int offset)
 	// bytecode chunk.
 	// NOTE: This bitwise and operation effectively masks the value so only the last 8 bits remain.
 	//		 That's because 0xff doesn't specify the values of its higher 8 bits, so they are all 0.
-	CurrentChunk()->Code[offset] = (jump >> 8) & 0xff;
-	CurrentChunk()->Code[offset + 1] = jump & 0xff;
+	CurrentChunk(context)->Code[offset] = (jump >> 8) & 0xff;
+	CurrentChunk(context)->Code[offset + 1] = jump & 0xff;
+}
+
+
+/// <summary>
+/// Adds a local variable to the scope table. It becomes the innermost binding of its name, shadowing
+/// any variable with the same name that was already in scope.
+/// </summary>
+/// <param name="name">The token containing the name of the local variable.</param>
+static void PushBinding(CompileContext* context, Token* name)
+{
+	ObjString* interned = CopyString(name->Start, name->Length);
+
+	// Keep the name on the stack so the garbage collector can't free it while the scope table grows.
+	Push(OBJ_VAL(interned));
+
+	if (context->BindingCapacity < context->BindingCount + 1)
+	{
+		int oldCapacity = context->BindingCapacity;
+		context->BindingCapacity = GROW_CAPACITY(oldCapacity);
+		context->Bindings = GROW_ARRAY(ScopeBinding, context->Bindings, oldCapacity, context->BindingCapacity);
+	}
+
+
+	Value shadowed;
+	ScopeBinding* binding = &context->Bindings[context->BindingCount];
+	binding->Name = interned;
+	binding->Owner = context->Current;
+	binding->Shadowed = TableGet(&context->Scope, interned, &shadowed) ? (int)AS_NUMBER(shadowed) : -1;
+
+	TableSet(&context->Scope, interned, NUMBER_VAL(context->BindingCount));
+	context->BindingCount++;
+
+	Pop();
 }
 
 
-static void InitCompiler(Compiler* compiler, FunctionType type)
+/// <summary>
+/// Removes the most recently added local variable from the scope table. Whatever variable it was
+/// shadowing becomes visible again.
+/// </summary>
+static void PopBinding(CompileContext* context)
 {
-	compiler->Enclosing = current;
+	ScopeBinding* binding = &context->Bindings[context->BindingCount - 1];
+
+	if (binding->Shadowed == -1)
+	{
+		TableDelete(&context->Scope, binding->Name);
+	}
+	else
+	{
+		TableSet(&context->Scope, binding->Name, NUMBER_VAL(binding->Shadowed));
+	}
+
+	// We only shrink the stack after updating the table, so the name stays marked if TableSet() triggers a garbage collection.
+	context->BindingCount--;
+}
+
+
+/// <summary>
+/// Looks up the innermost local variable with the specified name that is currently in scope.
+/// Since bindings of nested compilers that already ended have been popped, this is also the innermost
+/// one visible to the current compiler.
+/// </summary>
+/// <param name="name">The token containing the name of the variable.</param>
+/// <returns>The index of the binding, or -1 if no local variable has that name (in which case it's a global).</returns>
+static int FindBinding(CompileContext* context, Token* name)
+{
+	if (context->Scope.Count == 0)
+		return -1;
+
+	// Every local variable's name was interned when it was declared, so if the name was never interned it can't be a local.
+	ObjString* interned = FindString(name->Start, name->Length);
+	if (interned == NULL)
+		return -1;
+
+	Value binding;
+	if (!TableGet(&context->Scope, interned, &binding))
+		return -1;
+
+	return (int)AS_NUMBER(binding);
+}
+
+
+/// <summary>
+/// Initializes a compiler and makes it the current one.
+/// </summary>
+/// <param name="function">The function to compile into. If this is NULL, a new function is created, and named after the previous token.</param>
+static void InitCompiler(CompileContext* context, Compiler* compiler, FunctionType type, ObjFunction* function)
+{
+	compiler->Enclosing = context->Current;
 	compiler->Function = NULL;
 	compiler->Type = type;
 	compiler->LocalCount = 0;
 	compiler->ScopeDepth = 0;
+	compiler->FirstBinding = context->BindingCount;
+	memset(compiler->UpValueLookup, 0, sizeof(compiler->UpValueLookup));
 
-	compiler->Function = NewFunction();
-
-	current = compiler;
-	if (type != TYPE_SCRIPT) // Is this compiler compiling a function rather than top-level Lox code?
+	context->Current = compiler;
+	if (function != NULL)
+	{
+		compiler->Function = function;
+	}
+	else
 	{
-		current->Function->Name = CopyString(parser.Previous.Start, parser.Previous.Length);
+		compiler->Function = NewFunction();
+
+		if (type != TYPE_SCRIPT) // Is this compiler compiling a function rather than top-level Lox code?
+		{
+			context->Current->Function->Name = CopyString(context->Parser.Previous.Start, context->Parser.Previous.Length);
+		}
 	}
 
 	// Create a Local with a blank name. This is for the VM's own internal use.
 	// We give it a blank name so that there is no way a user of Lox can access it.
-	Local* local = &current->Locals[current->LocalCount++];
+	Local* local = &context->Current->Locals[context->Current->LocalCount++];
 	local->Depth = 0;
 	local->IsCaptured = false;
 	if (type != TYPE_FUNCTION)
@@ -362,60 +497,68 @@ static void InitCompiler(Compiler* compiler, FunctionType type)
 		local->Name.Length = 0;
 	}
 
+	PushBinding(context, &local->Name);
 }
 
 
-static ObjFunction* EndCompiler()
+static ObjFunction* EndCompiler(CompileContext* context)
 {
-	EmitReturn();
-	ObjFunction* function = current->Function;
+	EmitReturn(context);
+	ObjFunction* function = context->Current->Function;
 	
 	
 	// Print out the bytecode the compiler just generated if this preprocessor symbol is
 	// defined, and only if there were NO compile errors. If the compiler hit an error,
 	// then it won't help us to try to read partially compiled code anyway.
 #ifdef DEBUG_PRINT_CODE
-	if (!parser.HadError)
+	if (!context->Parser.HadError)
 	{
 		
-		DisassembleChunk(CurrentChunk(), function->Name != NULL 
+		DisassembleChunk(CurrentChunk(context), function->Name != NULL 
 			? std::string("Compiler Debug Output: <fn >").insert(27, std::string(function->Name->Chars)).c_str()
 			: "Compiler Debug Output: <script>");
 	}
 #endif
 
 
-	current = current->Enclosing;
+	// Take this function's locals out of the scope table, since they are going out of scope along with it.
+	while (context->BindingCount > context->Current->FirstBinding)
+	{
+		PopBinding(context);
+	}
+
+	context->Current = context->Current->Enclosing;
 	return function;
 }
 
 
-static void BeginScope()
+static void BeginScope(CompileContext* context)
 {
-	current->ScopeDepth++;
+	context->Current->ScopeDepth++;
 }
 
 
-static void EndScope()
+static void EndScope(CompileContext* context)
 {
-	current->ScopeDepth--;
+	context->Current->ScopeDepth--;
 
 	// Emit bytecode instructions for removing from the stack all local variables that were
 	// declared in the scope that is ending.
-	while (current->LocalCount > 0 &&
-		current->Locals[current->LocalCount - 1].Depth > current->ScopeDepth)
+	while (context->Current->LocalCount > 0 &&
+		context->Current->Locals[context->Current->LocalCount - 1].Depth > context->Current->ScopeDepth)
 	{
 		// Is the variable captured by a closure? See chapter 25 in the book.
-		if (current->Locals[current->LocalCount - 1].IsCaptured)
+		if (context->Current->Locals[context->Current->LocalCount - 1].IsCaptured)
 		{
-			EmitByte(OP_CLOSE_UPVALUE);
+			EmitByte(context, OP_CLOSE_UPVALUE);
 		}
 		else // Variable is a local variable that is not captured by a closure.
 		{
-			EmitByte(OP_POP);
+			EmitByte(context, OP_POP);
 		}
 
-		current->LocalCount--;
+		context->Current->LocalCount--;
+		PopBinding(context);
 	}
 }
 
@@ -425,18 +568,19 @@ static void EndScope()
 // Forward declarations. These allow the referenced functions to be accessed by
 // ones below this point, even though those functions are defined before
 // the ones referenced by these forward declarations.
-static void ParseExpression();
-static void ParseStatement();
-static void ParseDeclarationStatement();
+static void ParseExpression(CompileContext* context);
+static void ParseStatement(CompileContext* context);
+static void ParseDeclarationStatement(CompileContext* context);
 static ParseRule* GetRule(TokenType type);
-static void ParsePrecedence(Precedence precedence);
+static void ParsePrecedence(CompileContext* context, Precedence precedence);
+static void Synchronize(CompileContext* context);
 
 
 
 
-static uint8_t IdentifierConstant(Token* name)
+static uint8_t IdentifierConstant(CompileContext* context, Token* name)
 {
-	return MakeConstant(OBJ_VAL(CopyString(name->Start, name->Length)));
+	return MakeConstant(context, OBJ_VAL(CopyString(name->Start, name->Length)));
 }
 
 
@@ -449,79 +593,69 @@ static bool IdentifiersEqual(Token* a, Token* b)
 }
 
 
-static int ResolveLocal(Compiler* compiler, Token* name)
+static int ResolveLocal(CompileContext* context, Compiler* compiler, int binding)
 {
-	for (int i = compiler->LocalCount - 1; i >= 0; i--)
-	{
-		Local* local = &compiler->Locals[i];
-		if (IdentifiersEqual(name, &local->Name))
-		{
-			if (local->Depth == -1)
-			{
-				Error("You can't read a local variable in its own initializer.");
-			}
-
-			return i;
-		}
+	int slot = binding - compiler->FirstBinding;
+	Local* local = &compiler->Locals[slot];
 
-	} // End for
+	if (local->Depth == -1)
+	{
+		Error(context, "You can't read a local variable in its own initializer.");
+	}
 
-	return -1;
+	return slot;
 }
 
 
-static int AddUpValue(Compiler* compiler, uint8_t index, bool isLocal)
+static int AddUpValue(CompileContext* context, Compiler* compiler, uint8_t index, bool isLocal)
 {
 	int upValueCount = compiler->Function->UpValueCount;
 	
 
 	// Check if this function already has an UpValue for this variable.
-	for (int i = 0; i < upValueCount; i++)
+	short* lookup = &compiler->UpValueLookup[index * 2 + (isLocal ? 1 : 0)];
+	if (*lookup != 0)
 	{
-		UpValue* upValue = &compiler->UpValues[i];
-		if (upValue->Index == index && upValue->IsLocal == isLocal)
-		{
-			return i;
-		}
+		return *lookup - 1;
 	}
 
 
 	if (upValueCount == UINT8_COUNT)
 	{
-		Error("Too many closure variables in function.");
+		Error(context, "Too many closure variables in function.");
 		return 0;
 	}
 
 
 	compiler->UpValues[upValueCount].IsLocal = isLocal;
 	compiler->UpValues[upValueCount].Index = index;
+	*lookup = (short)(upValueCount + 1);
 
 	return compiler->Function->UpValueCount++;
 }
 
 
-static int ResolveUpValue(Compiler* compiler, Token* name)
+/// <summary>
+/// Captures a local variable that belongs to a compiler enclosing the specified one. Every function
+/// in between gets an UpValue for it too, so the value can be passed down to the inner function.
+/// </summary>
+/// <param name="compiler">The compiler that needs access to the variable.</param>
+/// <param name="binding">The index of the variable's binding in the scope table.</param>
+/// <returns>The index of the UpValue in the specified compiler.</returns>
+static int ResolveUpValue(CompileContext* context, Compiler* compiler, int binding)
 {
-	if (compiler->Enclosing == NULL)
-		return -1;
-
-
-	int local = ResolveLocal(compiler->Enclosing, name);
-	if (local != -1)
-	{
-		compiler->Enclosing->Locals[local].IsCaptured = true;
-		return AddUpValue(compiler, (uint8_t) local, true);
-	}
-
+	Compiler* owner = context->Bindings[binding].Owner;
 
-	int upValue = ResolveUpValue(compiler->Enclosing, name);
-	if (upValue != -1)
+	if (compiler->Enclosing == owner)
 	{
-		return AddUpValue(compiler, (uint8_t) upValue, false);
+		int local = ResolveLocal(context, owner, binding);
+		owner->Locals[local].IsCaptured = true;
+		return AddUpValue(context, compiler, (uint8_t) local, true);
 	}
 
 
-	return -1;
+	int upValue = ResolveUpValue(context, compiler->Enclosing, binding);
+	return AddUpValue(context, compiler, (uint8_t) upValue, false);
 }
 
 
@@ -529,87 +663,86 @@ static int ResolveUpValue(Compiler* compiler, Token* name)
 /// This is called to record the existance of a local variable in the compiler.
 /// </summary>
 /// <param name="name">The token containing the name of the local variable.</param>
-static void AddLocal(Token name)
+static void AddLocal(CompileContext* context, Token name)
 {
-	if (current->LocalCount == UINT8_COUNT)
+	if (context->Current->LocalCount == UINT8_COUNT)
 	{
-		Error("There are too many local variables in this function.");
+		Error(context, "There are too many local variables in this function.");
 		return;
 	}
 
-	Local* local = &current->Locals[current->LocalCount++];
+	Local* local = &context->Current->Locals[context->Current->LocalCount++];
 	local->Name = name;
 	local->Depth = -1; // Indicates that this local variable is not fully initialized yet.
 	local->IsCaptured = false;
+
+	PushBinding(context, &local->Name);
 }
 
 
 /// <summary>
 /// Declares a local variable.
 /// </summary>
-static void DeclareVariable()
+static void DeclareVariable(CompileContext* context)
 {
 	// Is this a global variable?
-	if (current->ScopeDepth == 0)
+	if (context->Current->ScopeDepth == 0)
 		return;
 
-	Token* name = &parser.Previous;
+	Token* name = &context->Parser.Previous;
 
-	for (int i = current->LocalCount - 1; i >= 0; i--)
+	// The innermost variable with this name is the only one that could be in the current scope.
+	int binding = FindBinding(context, name);
+	if (binding != -1 && context->Bindings[binding].Owner == context->Current)
 	{
-		Local* local = &current->Locals[i];
-		if (local->Depth != -1 && local->Depth < current->ScopeDepth)
+		Local* local = &context->Current->Locals[binding - context->Current->FirstBinding];
+		if (local->Depth == -1 || local->Depth >= context->Current->ScopeDepth)
 		{
-			break;
+			Error(context, "There is already a variable with this name in this scope.");
 		}
+	}
 
-		if (IdentifiersEqual(name, &local->Name))
-		{
-			Error("There is already a variable with this name in this scope.");
-		}
-	} // End for
-
-	AddLocal(*name);
+	AddLocal(context, *name);
 }
 
 
-static void ParseBinaryExpression(bool canAssign)
+static void ParseBinaryExpression(CompileContext* context, bool canAssign)
 {
-	TokenType operatorType = parser.Previous.Type;
+	TokenType operatorType = context->Parser.Previous.Type;
 	ParseRule* rule = GetRule(operatorType);
-	ParsePrecedence((Precedence)(rule->Precedence + 1));
+	ParsePrecedence(context, (Precedence)(rule->Precedence + 1));
 
 	switch (operatorType)
 	{
 		case TOKEN_BANG_EQUAL:
-			EmitBytes(OP_EQUAL, OP_NOT);
+			EmitBytes(context, OP_EQUAL, OP_NOT);
 			break;
 		case TOKEN_EQUAL_EQUAL:
-			EmitByte(OP_EQUAL);
+			EmitByte(context, OP_EQUAL);
 			break;
 		case TOKEN_GREATER:
-			EmitByte(OP_GREATER);
+			EmitByte(context, OP_GREATER);
 			break;
 		case TOKEN_GREATER_EQUAL:
-			EmitBytes(OP_LESS, OP_NOT);
+			EmitBytes(context, OP_LESS, OP_NOT);
 			break;
 		case TOKEN_LESS:
-			EmitByte(OP_LESS);
+			EmitByte(context, OP_LESS);
 			break;
 		case TOKEN_LESS_EQUAL:
-			EmitBytes(OP_GREATER, OP_NOT);
+			EmitBytes(context, OP_GREATER, OP_NOT);
 			break;
 		case TOKEN_PLUS:
-			EmitByte(OP_ADD);
+			EmitByte(context, OP_ADD);
 			break;
 		case TOKEN_MINUS:
-			EmitByte(OP_SUBTRACT);
+			EmitByte(context, OP_SUBTRACT);
 			break;
 		case TOKEN_STAR:
-			EmitByte(OP_MULTIPLY);
+			EmitByte(context, OP_MULTIPLY);
 			break;
 		case TOKEN_SLASH:
-			EmitByte(OP_DIVIDE);
+			EmitByte(context, OP_DIVIDE);
 			break;
 
 		default:
@@ -618,73 +751,73 @@ static void ParseBinaryExpression(bool canAssign)
 }
 
 
-static uint8_t ParseArgumentList()
+static uint8_t ParseArgumentList(CompileContext* context)
 {
 	uint8_t argCount = 0;
 
-	if (!Check(TOKEN_RIGHT_PAREN))
+	if (!Check(context, TOKEN_RIGHT_PAREN))
 	{
 		do
 		{
-			ParseExpression();
+			ParseExpression(context);
 
 			if (argCount == 255)
 			{
-				Error("Can't have more than 255 function arguments.");
+				Error(context, "Can't have more than 255 function arguments.");
 			}
 
 			argCount++;
 
-		} while (Match(TOKEN_COMMA));
+		} while (Match(context, TOKEN_COMMA));
 	}
 
-	Consume(TOKEN_RIGHT_PAREN, "Expected ')' after function arguments.");
+	Consume(context, TOKEN_RIGHT_PAREN, "Expected ')' after function arguments.");
 	return argCount;
 }
 
 
-static void ParseCallExpression(bool canAssign)
+static void ParseCallExpression(CompileContext* context, bool canAssign)
 {
-	uint8_t argCount = ParseArgumentList();
-	EmitBytes(OP_CALL, argCount);
+	uint8_t argCount = ParseArgumentList(context);
+	EmitBytes(context, OP_CALL, argCount);
 }
 
 
-static void ParseDotExpression(bool canAssign)
+static void ParseDotExpression(CompileContext* context, bool canAssign)
 {
-	Consume(TOKEN_IDENTIFIER, "Expected property name after '.'.");
-	uint8_t name = IdentifierConstant(&parser.Previous);
+	Consume(context, TOKEN_IDENTIFIER, "Expected property name after '.'.");
+	uint8_t name = IdentifierConstant(context, &context->Parser.Previous);
 
-	if (canAssign && Match(TOKEN_EQUAL))
+	if (canAssign && Match(context, TOKEN_EQUAL))
 	{
-		ParseExpression();
-		EmitBytes(OP_SET_PROPERTY, name);
+		ParseExpression(context);
+		EmitBytes(context, OP_SET_PROPERTY, name);
 	}
-	else if (Match(TOKEN_LEFT_PAREN))
+	else if (Match(context, TOKEN_LEFT_PAREN))
 	{
-		uint8_t argCount = ParseArgumentList();
-		EmitBytes(OP_INVOKE, name);
-		EmitByte(argCount);
+		uint8_t argCount = ParseArgumentList(context);
+		EmitBytes(context, OP_INVOKE, name);
+		EmitByte(context, argCount);
 	}
 	else
 	{
-		EmitBytes(OP_GET_PROPERTY, name);
+		EmitBytes(context, OP_GET_PROPERTY, name);
 	}
 }
 
 
-static void ParseLiteralExpression(bool canAssign)
+static void ParseLiteralExpression(CompileContext* context, bool canAssign)
 {
-	switch(parser.Previous.Type)
+	switch(context->Parser.Previous.Type)
 	{
 		case TOKEN_FALSE:
-			EmitByte(OP_FALSE);
+			EmitByte(context, OP_FALSE);
 			break;
 		case TOKEN_NIL:
-			EmitByte(OP_NIL);
+			EmitByte(context, OP_NIL);
 			break;
 		case TOKEN_TRUE:
-			EmitByte(OP_TRUE);
+			EmitByte(context, OP_TRUE);
 			break;
 
 		default:
@@ -692,17 +825,18 @@ static void ParseLiteralExpression(bool canAssign)
 	} // end switch
 }
 
-static void ParseGroupingExpression(bool canAssign)
+static void ParseGroupingExpression(CompileContext* context, bool canAssign)
 {
-	ParseExpression();
-	Consume(TOKEN_RIGHT_PAREN, "Expected ')' after expression.");
+	ParseExpression(context);
+	Consume(context, TOKEN_RIGHT_PAREN, "Expected ')' after expression.");
 }
 
 
-static void ParseNumberExpression(bool canAssign)
+static void ParseNumberExpression(CompileContext* context, bool canAssign)
 {
-	double value = strtod(parser.Previous.Start, NULL);
-	EmitConstant(NUMBER_VAL(value));
+	// The scanner already found where the literal ends, so there is no need to rescan it like strtod() would.
+	double value = ParseNumberLiteral(context->Parser.Previous.Start, context->Parser.Previous.Length);
+	EmitConstant(context, NUMBER_VAL(value));
 }
 
 
@@ -710,14 +844,14 @@ static void ParseNumberExpression(bool canAssign)
 /// Finishes parsing the logical and operator. The first operand has already been compiled by
 /// the time this function is called.
 /// </summary>
-static void ParseAnd_(bool canAssign)
+static void ParseAnd_(CompileContext* context, bool canAssign)
 {
-	int endJump = EmitJump(OP_JUMP_IF_FALSE);
+	int endJump = EmitJump(context, OP_JUMP_IF_FALSE);
 
-	EmitByte(OP_POP);
-	ParsePrecedence(PREC_AND);
+	EmitByte(context, OP_POP);
+	ParsePrecedence(context, PREC_AND);
 
-	PatchJump(endJump);
+	PatchJump(context, endJump);
 }
 
 
@@ -725,65 +859,68 @@ static void ParseAnd_(bool canAssign)
 /// Finishes parsing the logical or operator. The first operand has already been compiled by
 /// the time this function is called.
 /// </summary>
-static void ParseOr_(bool canAssign)
+static void ParseOr_(CompileContext* context, bool canAssign)
 {
-	int elseJump = EmitJump(OP_JUMP_IF_FALSE);
-	int endJump = EmitJump(OP_JUMP);
+	int elseJump = EmitJump(context, OP_JUMP_IF_FALSE);
+	int endJump = EmitJump(context, OP_JUMP);
 
-	PatchJump(elseJump);
-	EmitByte(OP_POP);
+	PatchJump(context, elseJump);
+	EmitByte(context, OP_POP);
 
-	ParsePrecedence(PREC_OR);
-	PatchJump(endJump);
+	ParsePrecedence(context, PREC_OR);
+	PatchJump(context, endJump);
 }
 
 
-static void ParseStringExpression(bool canAssign)
+static void ParseStringExpression(CompileContext* context, bool canAssign)
 {
 	// Get the string's characters from the Lexeme. The " + 1" and " - 2"
 	// parts just trim the leading and trailing quotation marks (") off the ends.
-	EmitConstant(OBJ_VAL(CopyString(parser.Previous.Start + 1,
-									parser.Previous.Length - 2)));
+	EmitConstant(context, OBJ_VAL(CopyString(context->Parser.Previous.Start + 1,
+									context->Parser.Previous.Length - 2)));
 }
 
 
-static void NamedVariable(Token name, bool canAssign)
+static void NamedVariable(CompileContext* context, Token name, bool canAssign)
 {
 	uint8_t getOp, setOp;
-	int arg = ResolveLocal(current, &name);
-	if (arg != -1)
+	int arg;
+	int binding = FindBinding(context, &name);
+	if (binding != -1 && context->Bindings[binding].Owner == context->Current)
 	{
+		arg = ResolveLocal(context, context->Current, binding);
 		getOp = OP_GET_LOCAL;
 		setOp = OP_SET_LOCAL;
 	}
-	else if ((arg = ResolveUpValue(current, &name)) != -1)
+	else if (binding != -1)
 	{
+		arg = ResolveUpValue(context, context->Current, binding);
 		getOp = OP_GET_UPVALUE;
 		setOp = OP_SET_UPVALUE;
 	}
 	else
 	{
-		arg = IdentifierConstant(&name);
+		arg = IdentifierConstant(context, &name);
 		getOp = OP_GET_GLOBAL;
 		setOp = OP_SET_GLOBAL;
 	}
 
 
-	if (canAssign && Match(TOKEN_EQUAL))
+	if (canAssign && Match(context, TOKEN_EQUAL))
 	{
-		ParseExpression();
-		EmitBytes(setOp, (uint8_t) arg);
+		ParseExpression(context);
+		EmitBytes(context, setOp, (uint8_t) arg);
 	}
 	else
 	{
-		EmitBytes(getOp, (uint8_t) arg);
+		EmitBytes(context, getOp, (uint8_t) arg);
 	}
 }
 
 
-static void ParseVariableExpression(bool canAssign)
+static void ParseVariableExpression(CompileContext* context, bool canAssign)
 {
-	NamedVariable(parser.Previous, canAssign);
+	NamedVariable(context, context->Parser.Previous, canAssign);
 }
 
 
@@ -798,65 +935,65 @@ static Token SyntheticToken(const char* text)
 }
 
 
-static void ParseSuperExpression(bool canAssign)
+static void ParseSuperExpression(CompileContext* context, bool canAssign)
 {
-	if (currentClass == NULL)
+	if (context->CurrentClass == NULL)
 	{
-		Error("Can't use 'super' outside of a class.");
+		Error(context, "Can't use 'super' outside of a class.");
 	}
-	else if (!currentClass->HasSuperClass)
+	else if (!context->CurrentClass->HasSuperClass)
 	{
-		Error("Can't use 'super' in a class with no superclass.");
+		Error(context, "Can't use 'super' in a class with no superclass.");
 	}
 
-	Consume(TOKEN_DOT, "Expected '.' after 'super'.");
-	Consume(TOKEN_IDENTIFIER, "Expected superclass method name.");
-	uint8_t name = IdentifierConstant(&parser.Previous);
+	Consume(context, TOKEN_DOT, "Expected '.' after 'super'.");
+	Consume(context, TOKEN_IDENTIFIER, "Expected superclass method name.");
+	uint8_t name = IdentifierConstant(context, &context->Parser.Previous);
 
-	NamedVariable(SyntheticToken("this"), false);
-	if (Match(TOKEN_LEFT_PAREN))
+	NamedVariable(context, SyntheticToken("this"), false);
+	if (Match(context, TOKEN_LEFT_PAREN))
 	{
-		uint8_t argCount = ParseArgumentList();
-		NamedVariable(SyntheticToken("super"), false);
-		EmitBytes(OP_SUPER_INVOKE, name);
-		EmitByte(argCount);
+		uint8_t argCount = ParseArgumentList(context);
+		NamedVariable(context, SyntheticToken("super"), false);
+		EmitBytes(context, OP_SUPER_INVOKE, name);
+		EmitByte(context, argCount);
 	}
 	else
 	{
-		NamedVariable(SyntheticToken("super"), false);
-		EmitBytes(OP_GET_SUPER, name);
+		NamedVariable(context, SyntheticToken("super"), false);
+		EmitBytes(context, OP_GET_SUPER, name);
 	}
 }
 
 
-static void ParseThisExpression(bool canAssign)
+static void ParseThisExpression(CompileContext* context, bool canAssign)
 {
-	if (currentClass == NULL)
+	if (context->CurrentClass == NULL)
 	{
-		Error("Can't use 'this' outside of a class.");
+		Error(context, "Can't use 'this' outside of a class.");
 		return;
 	}
 
-	ParseVariableExpression(false);
+	ParseVariableExpression(context, false);
 }
 
 
-static void ParseUnaryExpression(bool canAssign)
+static void ParseUnaryExpression(CompileContext* context, bool canAssign)
 {
-	TokenType operatorType = parser.Previous.Type;
+	TokenType operatorType = context->Parser.Previous.Type;
 
 	// Compile the operand.
-	ParsePrecedence(PREC_UNARY);
+	ParsePrecedence(context, PREC_UNARY);
 
 	// Emit the operator instruction.
 	switch (operatorType)
 	{
 		case TOKEN_BANG:
-			EmitByte(OP_NOT);
+			EmitByte(context, OP_NOT);
 			break;
 
 		case TOKEN_MINUS:
-			EmitByte(OP_NEGATE);
+			EmitByte(context, OP_NEGATE);
 			break;
 
 		default:
@@ -934,68 +1071,68 @@ ParseRule rules[] =
 
 
 
-static void ParsePrecedence(Precedence precedence)
+static void ParsePrecedence(CompileContext* context, Precedence precedence)
 {
-	Advance();
+	Advance(context);
 
-	ParseFunction prefixRule = GetRule(parser.Previous.Type)->Prefix;
+	ParseFunction prefixRule = GetRule(context->Parser.Previous.Type)->Prefix;
 	if (prefixRule == NULL)
 	{
-		Error("Expected expression.");
+		Error(context, "Expected expression.");
 		return;
 	}
 
 	// Use the function pointer we just obtained to call the appropriate prefix expression parsing function.
 	bool canAssign = precedence <= PREC_ASSIGNMENT;
-	prefixRule(canAssign);
+	prefixRule(context, canAssign);
 
 
-	while (precedence <= GetRule(parser.Current.Type)->Precedence)
+	while (precedence <= GetRule(context->Parser.Current.Type)->Precedence)
 	{
-		Advance();
-		ParseFunction infixRule = GetRule(parser.Previous.Type)->Infix;
+		Advance(context);
+		ParseFunction infixRule = GetRule(context->Parser.Previous.Type)->Infix;
 
 		// Use the function pointer we just obtained to call the appropriate infix expression parsing function.
-		infixRule(canAssign);
+		infixRule(context, canAssign);
 	} // End while.
 
-	if (canAssign && Match(TOKEN_EQUAL))
+	if (canAssign && Match(context, TOKEN_EQUAL))
 	{
-		Error("Invalid assignment target.");
+		Error(context, "Invalid assignment target.");
 	}
 }
 
 
-static uint8_t ParseVariable(const char* errorMessage)
+static uint8_t ParseVariable(CompileContext* context, const char* errorMessage)
 {
-	Consume(TOKEN_IDENTIFIER, errorMessage);
+	Consume(context, TOKEN_IDENTIFIER, errorMessage);
 
-	DeclareVariable();
-	if (current->ScopeDepth > 0)
+	DeclareVariable(context);
+	if (context->Current->ScopeDepth > 0)
 		return 0;
 
-	return IdentifierConstant(&parser.Previous);
+	return IdentifierConstant(context, &context->Parser.Previous);
 }
 
 
-static void MarkInitialized()
+static void MarkInitialized(CompileContext* context)
 {
-	if (current->ScopeDepth == 0)
+	if (context->Current->ScopeDepth == 0)
 		return;
 
-	current->Locals[current->LocalCount - 1].Depth = current->ScopeDepth;
+	context->Current->Locals[context->Current->LocalCount - 1].Depth = context->Current->ScopeDepth;
 }
 
 
-static void DefineVariable(uint8_t global)
+static void DefineVariable(CompileContext* context, uint8_t global)
 {
-	if (current->ScopeDepth > 0)
+	if (context->Current->ScopeDepth > 0)
 	{
-		MarkInitialized();
+		MarkInitialized(context);
 		return;
 	}
 
-	EmitBytes(OP_DEFINE_GLOBAL, global);
+	EmitBytes(context, OP_DEFINE_GLOBAL, global);
 }
 
 
@@ -1005,64 +1142,718 @@ static ParseRule* GetRule(TokenType type)
 }
 
 
-static void ParseExpression()
+static void ParseExpression(CompileContext* context)
 {
-	ParsePrecedence(PREC_ASSIGNMENT);
+	ParsePrecedence(context, PREC_ASSIGNMENT);
 }
 
 
-static void ParseBlock()
+static void ParseBlock(CompileContext* context)
 {
-	while (!Check(TOKEN_RIGHT_BRACE) && !Check(TOKEN_EOF))
+	while (!Check(context, TOKEN_RIGHT_BRACE) && !Check(context, TOKEN_EOF))
 	{
-		ParseDeclarationStatement();
+		ParseDeclarationStatement(context);
 	}
 
-	Consume(TOKEN_RIGHT_BRACE, "Expected '}' after block.");
+	Consume(context, TOKEN_RIGHT_BRACE, "Expected '}' after block.");
 }
 
 
 /// <summary>
-/// This compiles a function body and its parameters.
+/// Parses a function's parameter list, up to and including the '{' that starts its body.
 /// </summary>
-static void ParseFunctionBody(FunctionType type)
+static void ParseParameterList(CompileContext* context)
 {
-	Compiler compiler;
-	InitCompiler(&compiler, type);
-	
-	// Quoted from the book:
-	// "This beginScope() doesnt have a corresponding endScope() call. Because we end Compiler
-	// completely when we reach the end of the function body, theres no need to close the lingering
-	// outermost scope."
-	BeginScope();
+	Consume(context, TOKEN_LEFT_PAREN, "Expected '(' after function name.");
+	if (!Check(context, TOKEN_RIGHT_PAREN))
+	{
+		do
+		{
+			context->Current->Function->Arity++;
+			if (context->Current->Function->Arity > 255)
+			{
+				ErrorAtCurrent(context, "Can't have more than 255 function parameters.");
+			}
+
+			uint8_t constant = ParseVariable(context, "Expected function parameter name.");
+			DefineVariable(context, constant);
+
+		} while (Match(context, TOKEN_COMMA));
+
+	} // End if
+
+	Consume(context, TOKEN_RIGHT_PAREN, "Expected ')' after function parameters.");
+	Consume(context, TOKEN_LEFT_BRACE, "Expected '{' before function body.");
+}
+
+
+#ifdef LAZY_COMPILE_FUNCTIONS
+
+/// <summary>
+/// Gives the function being skipped an UpValue for the variable with the specified name, if that name is a local
+/// variable of one of the functions it is nested inside.
+/// </summary>
+/// <param name="name">A name used somewhere in the function's body.</param>
+/// <param name="upValueNames">Records the name each of the function's UpValues was created for.</param>
+static void CaptureVariable(CompileContext* context, Token* name, ObjString** upValueNames)
+{
+	int binding = FindBinding(context, name);
+	if (binding == -1 || context->Bindings[binding].Owner == context->Current)
+		return;
+
+	// A variable that is still in its own initializer can't be read yet, so there's nothing to capture.
+	Compiler* owner = context->Bindings[binding].Owner;
+	if (owner->Locals[binding - owner->FirstBinding].Depth == -1)
+		return;
+
+	int upValue = ResolveUpValue(context, context->Current, binding);
+	upValueNames[upValue] = context->Bindings[binding].Name;
+}
+
+
+// A local variable declared inside the body being preparsed.
+struct PreparseLocal
+{
+	Token Name; // The name of the local variable.
+	int Depth; // The scope depth of the variable, or -1 while it is still in its own initializer.
+	int Function; // How many functions deep inside the skipped body the variable was declared (0 = the skipped function itself).
+};
 
 
-	// Parse the parameter list.
-	Consume(TOKEN_LEFT_PAREN, "Expected '(' after function name.");
-	if (!Check(TOKEN_RIGHT_PAREN))
+/// <summary>
+/// The state of the preparser, which checks the syntax of a function body that is being skipped without
+/// compiling it. See SkipFunctionBody().
+/// </summary>
+struct Preparser
+{
+	ObjString** UpValueNames; // Records the name each of the skipped function's UpValues was created for.
+	FunctionType Type; // The type of the function whose body is currently being preparsed.
+	int Function; // How many functions deep inside the skipped body we currently are.
+	int ScopeDepth; // The scope depth within that function.
+
+	PreparseLocal Locals[UINT8_COUNT]; // The local variables declared in the body that are currently in scope. Any past this limit are not tracked, so names that refer to them get captured just in case, and they get checked when the body is compiled instead.
+	int LocalCount; // The number of local variables currently in scope.
+};
+
+
+static void PreparseExpression(CompileContext* context, Preparser* preparser);
+static void PreparseStatement(CompileContext* context, Preparser* preparser);
+static void PreparseDeclaration(CompileContext* context, Preparser* preparser);
+
+
+/// <summary>
+/// Looks up the innermost local variable declared in the skipped body with the specified name.
+/// </summary>
+/// <returns>The local variable, or NULL if there isn't one.</returns>
+static PreparseLocal* PreparseFindLocal(Preparser* preparser, Token* name)
+{
+	for (int i = preparser->LocalCount - 1; i >= 0; i--)
+	{
+		if (IdentifiersEqual(name, &preparser->Locals[i].Name))
+			return &preparser->Locals[i];
+	}
+
+	return NULL;
+}
+
+
+static void PreparseAddLocal(Preparser* preparser, Token name, int depth)
+{
+	if (preparser->LocalCount == UINT8_COUNT)
+		return;
+
+	PreparseLocal* local = &preparser->Locals[preparser->LocalCount++];
+	local->Name = name;
+	local->Depth = depth;
+	local->Function = preparser->Function;
+}
+
+
+/// <summary>
+/// Declares a local variable named after the previous token. Does the same checks as DeclareVariable().
+/// </summary>
+static void PreparseDeclareLocal(CompileContext* context, Preparser* preparser)
+{
+	Token* name = &context->Parser.Previous;
+
+	PreparseLocal* local = PreparseFindLocal(preparser, name);
+	if (local != NULL && local->Function == preparser->Function &&
+		(local->Depth == -1 || local->Depth >= preparser->ScopeDepth))
+	{
+		Error(context, "There is already a variable with this name in this scope.");
+	}
+
+	PreparseAddLocal(preparser, *name, -1);
+}
+
+
+static void PreparseMarkInitialized(Preparser* preparser)
+{
+	if (preparser->LocalCount > 0)
+		preparser->Locals[preparser->LocalCount - 1].Depth = preparser->ScopeDepth;
+}
+
+
+static void PreparseEndScope(Preparser* preparser)
+{
+	preparser->ScopeDepth--;
+
+	while (preparser->LocalCount > 0 &&
+		   preparser->Locals[preparser->LocalCount - 1].Function == preparser->Function &&
+		   preparser->Locals[preparser->LocalCount - 1].Depth > preparser->ScopeDepth)
+	{
+		preparser->LocalCount--;
+	}
+}
+
+
+/// <summary>
+/// Captures the variable with the specified name, unless it was declared in the skipped body. Those are still around
+/// when the body gets compiled, so they don't need an UpValue.
+/// </summary>
+static void PreparseCapture(CompileContext* context, Preparser* preparser, Token* name)
+{
+	if (PreparseFindLocal(preparser, name) == NULL)
+		CaptureVariable(context, name, preparser->UpValueNames);
+}
+
+
+/// <summary>
+/// Checks a use of a variable, and captures it if it belongs to one of the functions the skipped one is nested inside.
+/// </summary>
+static void PreparseVariable(CompileContext* context, Preparser* preparser, Token* name)
+{
+	PreparseLocal* local = PreparseFindLocal(preparser, name);
+	if (local != NULL)
+	{
+		if (local->Depth == -1)
+			Error(context, "You can't read a local variable in its own initializer.");
+
+		return;
+	}
+
+	CaptureVariable(context, name, preparser->UpValueNames);
+}
+
+
+static void PreparseArgumentList(CompileContext* context, Preparser* preparser)
+{
+	int argCount = 0;
+
+	if (!Check(context, TOKEN_RIGHT_PAREN))
 	{
 		do
 		{
-			current->Function->Arity++;
-			if (current->Function->Arity > 255)
+			PreparseExpression(context, preparser);
+
+			if (argCount == 255)
 			{
-				ErrorAtCurrent("Can't have more than 255 function parameters.");
+				Error(context, "Can't have more than 255 function arguments.");
 			}
 
-			uint8_t constant = ParseVariable("Expected function parameter name.");
-			DefineVariable(constant);
+			argCount++;
 
-		} while (Match(TOKEN_COMMA));
+		} while (Match(context, TOKEN_COMMA));
+	}
 
-	} // End if
+	Consume(context, TOKEN_RIGHT_PAREN, "Expected ')' after function arguments.");
+}
+
+
+/// <summary>
+/// The preparser's version of ParsePrecedence(). It follows the same rules table, but just checks the syntax of the
+/// expression instead of compiling it.
+/// </summary>
+static void PreparsePrecedence(CompileContext* context, Preparser* preparser, Precedence precedence)
+{
+	Advance(context);
+
+	if (GetRule(context->Parser.Previous.Type)->Prefix == NULL)
+	{
+		Error(context, "Expected expression.");
+		return;
+	}
+
+	bool canAssign = precedence <= PREC_ASSIGNMENT;
+
+	Token token = context->Parser.Previous;
+	switch (token.Type)
+	{
+		case TOKEN_LEFT_PAREN:
+			PreparseExpression(context, preparser);
+			Consume(context, TOKEN_RIGHT_PAREN, "Expected ')' after expression.");
+			break;
+
+		case TOKEN_MINUS:
+		case TOKEN_BANG:
+			PreparsePrecedence(context, preparser, PREC_UNARY);
+			break;
+
+		case TOKEN_IDENTIFIER:
+			PreparseVariable(context, preparser, &token);
+			if (canAssign && Match(context, TOKEN_EQUAL))
+				PreparseExpression(context, preparser);
+			break;
+
+		case TOKEN_THIS:
+			if (context->CurrentClass == NULL)
+			{
+				Error(context, "Can't use 'this' outside of a class.");
+				break;
+			}
+
+			PreparseCapture(context, preparser, &token);
+			break;
+
+		case TOKEN_SUPER:
+		{
+			if (context->CurrentClass == NULL)
+			{
+				Error(context, "Can't use 'super' outside of a class.");
+			}
+			else if (!context->CurrentClass->HasSuperClass)
+			{
+				Error(context, "Can't use 'super' in a class with no superclass.");
+			}
+
+			Consume(context, TOKEN_DOT, "Expected '.' after 'super'.");
+			Consume(context, TOKEN_IDENTIFIER, "Expected superclass method name.");
+
+			// A super call uses both "this" and "super". See ParseSuperExpression().
+			Token name = SyntheticToken("this");
+			PreparseCapture(context, preparser, &name);
+			name = SyntheticToken("super");
+			PreparseCapture(context, preparser, &name);
+
+			if (Match(context, TOKEN_LEFT_PAREN))
+				PreparseArgumentList(context, preparser);
+			break;
+		}
+
+		default: // Literals.
+			break;
+	} // end switch
+
+
+	while (precedence <= GetRule(context->Parser.Current.Type)->Precedence)
+	{
+		Advance(context);
+
+		TokenType operatorType = context->Parser.Previous.Type;
+		switch (operatorType)
+		{
+			case TOKEN_LEFT_PAREN:
+				PreparseArgumentList(context, preparser);
+				break;
+
+			case TOKEN_DOT:
+				Consume(context, TOKEN_IDENTIFIER, "Expected property name after '.'.");
+
+				if (canAssign && Match(context, TOKEN_EQUAL))
+					PreparseExpression(context, preparser);
+				else if (Match(context, TOKEN_LEFT_PAREN))
+					PreparseArgumentList(context, preparser);
+				break;
+
+			case TOKEN_AND:
+				PreparsePrecedence(context, preparser, PREC_AND);
+				break;
+
+			case TOKEN_OR:
+				PreparsePrecedence(context, preparser, PREC_OR);
+				break;
+
+			default: // Binary operators.
+				PreparsePrecedence(context, preparser, (Precedence)(GetRule(operatorType)->Precedence + 1));
+				break;
+		} // end switch
+	} // End while.
+
+	if (canAssign && Match(context, TOKEN_EQUAL))
+	{
+		Error(context, "Invalid assignment target.");
+	}
+}
+
+
+static void PreparseExpression(CompileContext* context, Preparser* preparser)
+{
+	PreparsePrecedence(context, preparser, PREC_ASSIGNMENT);
+}
 
-	Consume(TOKEN_RIGHT_PAREN, "Expected ')' after function parameters.");
-	Consume(TOKEN_LEFT_BRACE, "Expected '{' before function body.");
 
-	ParseBlock();
+static void PreparseBlock(CompileContext* context, Preparser* preparser)
+{
+	while (!Check(context, TOKEN_RIGHT_BRACE) && !Check(context, TOKEN_EOF))
+	{
+		PreparseDeclaration(context, preparser);
+	}
+
+	Consume(context, TOKEN_RIGHT_BRACE, "Expected '}' after block.");
+}
+
+
+/// <summary>
+/// Preparses a function nested inside the skipped body, starting at its parameter list.
+/// </summary>
+static void PreparseFunction(CompileContext* context, Preparser* preparser, FunctionType type)
+{
+	FunctionType enclosingType = preparser->Type;
+	int enclosingScopeDepth = preparser->ScopeDepth;
+	int enclosingLocalCount = preparser->LocalCount;
+
+	preparser->Type = type;
+	preparser->Function++;
+	preparser->ScopeDepth = 1;
+
+	// Methods keep "this" in slot 0, just like InitCompiler() sets up.
+	if (type != TYPE_FUNCTION)
+		PreparseAddLocal(preparser, SyntheticToken("this"), 0);
+
+	Consume(context, TOKEN_LEFT_PAREN, "Expected '(' after function name.");
+	if (!Check(context, TOKEN_RIGHT_PAREN))
+	{
+		int arity = 0;
+		do
+		{
+			arity++;
+			if (arity > 255)
+			{
+				ErrorAtCurrent(context, "Can't have more than 255 function parameters.");
+			}
+
+			Consume(context, TOKEN_IDENTIFIER, "Expected function parameter name.");
+			PreparseDeclareLocal(context, preparser);
+			PreparseMarkInitialized(preparser);
+
+		} while (Match(context, TOKEN_COMMA));
+	}
+
+	Consume(context, TOKEN_RIGHT_PAREN, "Expected ')' after function parameters.");
+	Consume(context, TOKEN_LEFT_BRACE, "Expected '{' before function body.");
+
+	PreparseBlock(context, preparser);
 
-	ObjFunction* function = EndCompiler();
-	EmitBytes(OP_CLOSURE, MakeConstant(OBJ_VAL(function)));
+	preparser->Type = enclosingType;
+	preparser->Function--;
+	preparser->ScopeDepth = enclosingScopeDepth;
+	preparser->LocalCount = enclosingLocalCount;
+}
+
+
+static void PreparseClassDeclaration(CompileContext* context, Preparser* preparser)
+{
+	Consume(context, TOKEN_IDENTIFIER, "Expected class name.");
+	Token className = context->Parser.Previous;
+	PreparseDeclareLocal(context, preparser);
+	PreparseMarkInitialized(preparser);
+
+	ClassCompiler classCompiler;
+	classCompiler.HasSuperClass = false;
+	classCompiler.Enclosing = context->CurrentClass;
+	context->CurrentClass = &classCompiler;
+
+	if (Match(context, TOKEN_LESS))
+	{
+		Consume(context, TOKEN_IDENTIFIER, "Expected superclass name.");
+		Token superClassName = context->Parser.Previous;
+		PreparseVariable(context, preparser, &superClassName);
+
+		if (IdentifiersEqual(&className, &superClassName))
+		{
+			Error(context, "A class can't inherit from itself.");
+		}
+
+		// The scope that holds "super".
+		preparser->ScopeDepth++;
+		PreparseAddLocal(preparser, SyntheticToken("super"), preparser->ScopeDepth);
+		classCompiler.HasSuperClass = true;
+	}
+
+	Consume(context, TOKEN_LEFT_BRACE, "Expected '{' before class body.");
+
+	while (!Check(context, TOKEN_RIGHT_BRACE) && !Check(context, TOKEN_EOF))
+	{
+		Consume(context, TOKEN_IDENTIFIER, "Expected class method name.");
+
+		FunctionType type = TYPE_METHOD;
+		if (context->Parser.Previous.Length == 4 &&
+			memcmp(context->Parser.Previous.Start, "init", 4) == 0)
+		{
+			type = TYPE_INITIALIZER;
+		}
+
+		PreparseFunction(context, preparser, type);
+	}
+
+	Consume(context, TOKEN_RIGHT_BRACE, "Expected '}' after class body.");
+
+	if (classCompiler.HasSuperClass)
+	{
+		PreparseEndScope(preparser);
+	}
+
+	context->CurrentClass = context->CurrentClass->Enclosing;
+}
+
+
+static void PreparseVarDeclaration(CompileContext* context, Preparser* preparser)
+{
+	Consume(context, TOKEN_IDENTIFIER, "Expected variable name.");
+	PreparseDeclareLocal(context, preparser);
+
+	if (Match(context, TOKEN_EQUAL))
+	{
+		PreparseExpression(context, preparser);
+	}
+
+	Consume(context, TOKEN_SEMICOLON, "Expected ';' after variable declaration.");
+	PreparseMarkInitialized(preparser);
+}
+
+
+static void PreparseExpressionStatement(CompileContext* context, Preparser* preparser)
+{
+	PreparseExpression(context, preparser);
+	Consume(context, TOKEN_SEMICOLON, "Expected ';' after expression.");
+}
+
+
+static void PreparseForStatement(CompileContext* context, Preparser* preparser)
+{
+	preparser->ScopeDepth++;
+	Consume(context, TOKEN_LEFT_PAREN, "Expected '(' after 'for'.");
+
+	if (Match(context, TOKEN_SEMICOLON))
+	{
+		// No initializer.
+	}
+	else if (Match(context, TOKEN_VAR))
+	{
+		PreparseVarDeclaration(context, preparser);
+	}
+	else
+	{
+		PreparseExpressionStatement(context, preparser);
+	}
+
+	if (!Match(context, TOKEN_SEMICOLON))
+	{
+		PreparseExpression(context, preparser);
+		Consume(context, TOKEN_SEMICOLON, "Expected ';' after for loop condition.");
+	}
+
+	if (!Match(context, TOKEN_RIGHT_PAREN))
+	{
+		PreparseExpression(context, preparser);
+		Consume(context, TOKEN_RIGHT_PAREN, "Expected ')' after for loop clauses.");
+	}
+
+	PreparseStatement(context, preparser);
+	PreparseEndScope(preparser);
+}
+
+
+static void PreparseReturnStatement(CompileContext* context, Preparser* preparser)
+{
+	if (Match(context, TOKEN_SEMICOLON))
+		return;
+
+	if (preparser->Type == TYPE_INITIALIZER)
+	{
+		Error(context, "Can't return a value from a class initializer.");
+	}
+
+	PreparseExpression(context, preparser);
+	Consume(context, TOKEN_SEMICOLON, "Expected ';' after return value.");
+}
+
+
+static void PreparseStatement(CompileContext* context, Preparser* preparser)
+{
+	if (Match(context, TOKEN_PRINT))
+	{
+		PreparseExpression(context, preparser);
+		Consume(context, TOKEN_SEMICOLON, "Expected ';' after print statement value");
+	}
+	else if (Match(context, TOKEN_FOR))
+	{
+		PreparseForStatement(context, preparser);
+	}
+	else if (Match(context, TOKEN_IF))
+	{
+		Consume(context, TOKEN_LEFT_PAREN, "Expected '(' after 'if'.");
+		PreparseExpression(context, preparser);
+		Consume(context, TOKEN_RIGHT_PAREN, "Expected ')' after if condition.");
+		PreparseStatement(context, preparser);
+
+		if (Match(context, TOKEN_ELSE))
+			PreparseStatement(context, preparser);
+	}
+	else if (Match(context, TOKEN_RETURN))
+	{
+		PreparseReturnStatement(context, preparser);
+	}
+	else if (Match(context, TOKEN_WHILE))
+	{
+		Consume(context, TOKEN_LEFT_PAREN, "Expected '(' after 'while'.");
+		PreparseExpression(context, preparser);
+		Consume(context, TOKEN_RIGHT_PAREN, "Expected ')' after while loop condition.");
+		PreparseStatement(context, preparser);
+	}
+	else if (Match(context, TOKEN_LEFT_BRACE))
+	{
+		preparser->ScopeDepth++;
+		PreparseBlock(context, preparser);
+		PreparseEndScope(preparser);
+	}
+	else
+	{
+		PreparseExpressionStatement(context, preparser);
+	}
+}
+
+
+static void PreparseDeclaration(CompileContext* context, Preparser* preparser)
+{
+	if (Match(context, TOKEN_CLASS))
+	{
+		PreparseClassDeclaration(context, preparser);
+	}
+	else if (Match(context, TOKEN_FUN))
+	{
+		Consume(context, TOKEN_IDENTIFIER, "Expected function name.");
+		PreparseDeclareLocal(context, preparser);
+		PreparseMarkInitialized(preparser);
+		PreparseFunction(context, preparser, TYPE_FUNCTION);
+	}
+	else if (Match(context, TOKEN_VAR))
+	{
+		PreparseVarDeclaration(context, preparser);
+	}
+	else
+	{
+		PreparseStatement(context, preparser);
+	}
+
+
+	if (context->Parser.PanicMode)
+		Synchronize(context);
+}
+
+
+/// <summary>
+/// Skips over a function's body instead of compiling it, and saves a copy of its source code so it can be
+/// compiled the first time the function is called. See CompileLazyFunction().
+/// 
+/// The body still gets preparsed on the way past. That checks its syntax and scoping without generating any
+/// code, so compile errors in it are reported up front just like they would be if it were compiled now.
+/// 
+/// The enclosing functions will be gone by the time the body gets compiled, so any of their local variables
+/// the body uses have to be captured now. The preparser keeps track of the variables declared in the body (and
+/// in functions nested inside it), so it only captures the names that don't refer to one of those.
+/// </summary>
+/// <param name="parameters">The '(' token that starts the function's parameter list.</param>
+/// <returns>The function, with an empty chunk.</returns>
+static ObjFunction* SkipFunctionBody(CompileContext* context, Token* parameters)
+{
+	ObjString* upValueNames[UINT8_COUNT];
+
+	Preparser preparser;
+	preparser.UpValueNames = upValueNames;
+	preparser.Type = context->Current->Type;
+	preparser.Function = 0;
+	preparser.ScopeDepth = context->Current->ScopeDepth;
+	preparser.LocalCount = 0;
+
+	// The parameters have already been declared by ParseParameterList(). Slot 0 is skipped since it can't be named.
+	for (int i = 1; i < context->Current->LocalCount; i++)
+	{
+		PreparseLocal* local = &preparser.Locals[preparser.LocalCount++];
+		local->Name = context->Current->Locals[i].Name;
+		local->Depth = context->Current->Locals[i].Depth;
+		local->Function = 0;
+	}
+
+	PreparseBlock(context, &preparser);
+
+
+	Compiler* compiler = context->Current;
+	ObjFunction* function = compiler->Function;
+
+	if (!context->Parser.HadError)
+	{
+		const char* end = context->Parser.Previous.Start + context->Parser.Previous.Length;
+		int length = (int)(end - parameters->Start);
+
+		char* source = ALLOCATE(char, length);
+		memcpy(source, parameters->Start, length);
+
+		ObjString** names = NULL;
+		if (function->UpValueCount > 0)
+		{
+			names = ALLOCATE(ObjString*, function->UpValueCount);
+			memcpy(names, upValueNames, sizeof(ObjString*) * function->UpValueCount);
+		}
+
+		LazyFunctionBody* lazy = ALLOCATE(LazyFunctionBody, 1);
+		lazy->Source = source;
+		lazy->Length = length;
+		lazy->Line = parameters->Line;
+		lazy->Type = (uint8_t)compiler->Type;
+		lazy->InClass = context->CurrentClass != NULL;
+		lazy->HasSuperClass = context->CurrentClass != NULL && context->CurrentClass->HasSuperClass;
+		lazy->UpValueNames = names;
+		lazy->HadError = false;
+
+		// Only hook it up once it's filled in, since each ALLOCATE() above could trigger a garbage collection.
+		function->Lazy = lazy;
+	}
+
+
+	// End the compiler the same way EndCompiler() does, just without emitting any code.
+	while (context->BindingCount > compiler->FirstBinding)
+	{
+		PopBinding(context);
+	}
+
+	context->Current = compiler->Enclosing;
+	return function;
+}
+
+#endif
+
+
+/// <summary>
+/// This compiles a function body and its parameters.
+/// </summary>
+static void ParseFunctionBody(CompileContext* context, FunctionType type)
+{
+	Compiler compiler;
+	InitCompiler(context, &compiler, type, NULL);
+
+#ifdef LAZY_COMPILE_FUNCTIONS
+	// Remember where the parameter list starts, since that is where compiling will pick up again later.
+	Token parameters = context->Parser.Current;
+#endif
+	
+	// Quoted from the book:
+	// "This beginScope() doesnt have a corresponding endScope() call. Because we end Compiler
+	// completely when we reach the end of the function body, theres no need to close the lingering
+	// outermost scope."
+	BeginScope(context);
+
+
+	ParseParameterList(context);
+
+#ifdef LAZY_COMPILE_FUNCTIONS
+	ObjFunction* function = SkipFunctionBody(context, &parameters);
+#else
+	ParseBlock(context);
+
+	ObjFunction* function = EndCompiler(context);
+#endif
+	EmitBytes(context, OP_CLOSURE, MakeConstant(context, OBJ_VAL(function)));
 
 
 	// Emit data for the UpValues into the bytecode. This will be used by the OP_CLOSURE
@@ -1070,154 +1861,154 @@ static void ParseFunctionBody(FunctionType type)
 	// See chapter 25 in the book.
 	for (int i = 0; i < function->UpValueCount; i++)
 	{
-		EmitByte(compiler.UpValues[i].IsLocal ? 1 : 0);
-		EmitByte(compiler.UpValues[i].Index);
+		EmitByte(context, compiler.UpValues[i].IsLocal ? 1 : 0);
+		EmitByte(context, compiler.UpValues[i].Index);
 	}
 }
 
 
-static void ParseFunctionDeclaration()
+static void ParseFunctionDeclaration(CompileContext* context)
 {
-	uint8_t global = ParseVariable("Expected function name.");
-	MarkInitialized();
-	ParseFunctionBody(TYPE_FUNCTION);
-	DefineVariable(global);
+	uint8_t global = ParseVariable(context, "Expected function name.");
+	MarkInitialized(context);
+	ParseFunctionBody(context, TYPE_FUNCTION);
+	DefineVariable(context, global);
 }
 
 
-static void ParseClassMethodDeclaration()
+static void ParseClassMethodDeclaration(CompileContext* context)
 {
-	Consume(TOKEN_IDENTIFIER, "Expected class method name.");
-	uint8_t constant = IdentifierConstant(&parser.Previous);
+	Consume(context, TOKEN_IDENTIFIER, "Expected class method name.");
+	uint8_t constant = IdentifierConstant(context, &context->Parser.Previous);
 
 	FunctionType type = TYPE_METHOD;
-	if (parser.Previous.Length == 4 &&
-		memcmp(parser.Previous.Start, "init", 4) == 0)
+	if (context->Parser.Previous.Length == 4 &&
+		memcmp(context->Parser.Previous.Start, "init", 4) == 0)
 	{
 		type = TYPE_INITIALIZER;
 	}
 
-	ParseFunctionBody(type);
+	ParseFunctionBody(context, type);
 
-	EmitBytes(OP_METHOD, constant);
+	EmitBytes(context, OP_METHOD, constant);
 }
 
 
-static void ParseClassDeclaration()
+static void ParseClassDeclaration(CompileContext* context)
 {
-	Consume(TOKEN_IDENTIFIER, "Expected class name.");
-	Token className = parser.Previous;
-	uint8_t nameConstant = IdentifierConstant(&parser.Previous);
-	DeclareVariable();
+	Consume(context, TOKEN_IDENTIFIER, "Expected class name.");
+	Token className = context->Parser.Previous;
+	uint8_t nameConstant = IdentifierConstant(context, &context->Parser.Previous);
+	DeclareVariable(context);
 
-	EmitBytes(OP_CLASS, nameConstant);
-	DefineVariable(nameConstant);
+	EmitBytes(context, OP_CLASS, nameConstant);
+	DefineVariable(context, nameConstant);
 
 	ClassCompiler classCompiler;
 	classCompiler.HasSuperClass = false;
-	classCompiler.Enclosing = currentClass;
-	currentClass = &classCompiler;
+	classCompiler.Enclosing = context->CurrentClass;
+	context->CurrentClass = &classCompiler;
 
 	// Check for class inheritance
-	if (Match(TOKEN_LESS))
+	if (Match(context, TOKEN_LESS))
 	{
-		Consume(TOKEN_IDENTIFIER, "Expected superclass name.");
-		ParseVariableExpression(false);
+		Consume(context, TOKEN_IDENTIFIER, "Expected superclass name.");
+		ParseVariableExpression(context, false);
 
-		if (IdentifiersEqual(&className, &parser.Previous))
+		if (IdentifiersEqual(&className, &context->Parser.Previous))
 		{
-			Error("A class can't inherit from itself.");
+			Error(context, "A class can't inherit from itself.");
 		}
 
-		BeginScope();
-		AddLocal(SyntheticToken("super"));
-		DefineVariable(0);
+		BeginScope(context);
+		AddLocal(context, SyntheticToken("super"));
+		DefineVariable(context, 0);
 
-		NamedVariable(className, false);
-		EmitByte(OP_INHERIT);
+		NamedVariable(context, className, false);
+		EmitByte(context, OP_INHERIT);
 		classCompiler.HasSuperClass = true;
 	}
 
-	NamedVariable(className, false);
-	Consume(TOKEN_LEFT_BRACE, "Expected '{' before class body.");
+	NamedVariable(context, className, false);
+	Consume(context, TOKEN_LEFT_BRACE, "Expected '{' before class body.");
 
-	while (!Check(TOKEN_RIGHT_BRACE) && !Check(TOKEN_EOF))
+	while (!Check(context, TOKEN_RIGHT_BRACE) && !Check(context, TOKEN_EOF))
 	{
-		ParseClassMethodDeclaration();
+		ParseClassMethodDeclaration(context);
 	}
 
-	Consume(TOKEN_RIGHT_BRACE, "Expected '}' after class body.");
-	EmitByte(OP_POP);
+	Consume(context, TOKEN_RIGHT_BRACE, "Expected '}' after class body.");
+	EmitByte(context, OP_POP);
 
 	if (classCompiler.HasSuperClass)
 	{
-		EndScope();
+		EndScope(context);
 	}
 
-	currentClass = currentClass->Enclosing;
+	context->CurrentClass = context->CurrentClass->Enclosing;
 }
 
 
-static void ParseVarDeclarationStatement()
+static void ParseVarDeclarationStatement(CompileContext* context)
 {
-	uint8_t global = ParseVariable("Expected variable name.");
+	uint8_t global = ParseVariable(context, "Expected variable name.");
 
-	if (Match(TOKEN_EQUAL))
+	if (Match(context, TOKEN_EQUAL))
 	{
-		ParseExpression();
+		ParseExpression(context);
 	}
 	else
 	{
 		// Initialize the variable's value to NIL since the user did not initialize it.
-		EmitByte(OP_NIL);
+		EmitByte(context, OP_NIL);
 	}
 
-	Consume(TOKEN_SEMICOLON, "Expected ';' after variable declaration.");
+	Consume(context, TOKEN_SEMICOLON, "Expected ';' after variable declaration.");
 
-	DefineVariable(global);
+	DefineVariable(context, global);
 }
 
 
-static void ParseExpressionStatement()
+static void ParseExpressionStatement(CompileContext* context)
 {
-	ParseExpression();
-	Consume(TOKEN_SEMICOLON, "Expected ';' after expression.");
-	EmitByte(OP_POP);
+	ParseExpression(context);
+	Consume(context, TOKEN_SEMICOLON, "Expected ';' after expression.");
+	EmitByte(context, OP_POP);
 }
 
 
-static void ParseForStatement()
+static void ParseForStatement(CompileContext* context)
 {
-	BeginScope();
-	Consume(TOKEN_LEFT_PAREN, "Expected '(' after 'for'.");
+	BeginScope(context);
+	Consume(context, TOKEN_LEFT_PAREN, "Expected '(' after 'for'.");
 	
 
 	// Parse the initializer clause.
-	if (Match(TOKEN_SEMICOLON))
+	if (Match(context, TOKEN_SEMICOLON))
 	{
 		// No initializer.
 	}
-	else if (Match(TOKEN_VAR))
+	else if (Match(context, TOKEN_VAR))
 	{
-		ParseVarDeclarationStatement();
+		ParseVarDeclarationStatement(context);
 	}
 	else
 	{
-		ParseExpressionStatement();
+		ParseExpressionStatement(context);
 	}
 
 
 	// Parse the condition clause.
-	int loopStart = CurrentChunk()->Count;
+	int loopStart = CurrentChunk(context)->Count;
 	int exitJump = -1;
-	if (!Match(TOKEN_SEMICOLON))
+	if (!Match(context, TOKEN_SEMICOLON))
 	{
-		ParseExpression();
-		Consume(TOKEN_SEMICOLON, "Expected ';' after for loop condition.");
+		ParseExpression(context);
+		Consume(context, TOKEN_SEMICOLON, "Expected ';' after for loop condition.");
 
 		// Jump out of the loop if the condition is false.
-		exitJump = EmitJump(OP_JUMP_IF_FALSE);
-		EmitByte(OP_POP); // Pop the loop's condition value off of the stack since it is no longer needed.
+		exitJump = EmitJump(context, OP_JUMP_IF_FALSE);
+		EmitByte(context, OP_POP); // Pop the loop's condition value off of the stack since it is no longer needed.
 	}
 	else
 	{
@@ -1226,133 +2017,133 @@ static void ParseForStatement()
 		// You have a for loop inside a function. We could jump out of the loop using Lox's
 		// return statement. Therefore, a for loop with no condition expression is not necessarily
 		// an infinite loop.
-		// Error("For loop condition not specified.");
+		// Error(context, "For loop condition not specified.");
 	}
 
 	
 	// Parse the incementer clause.
-	if (!Match(TOKEN_RIGHT_PAREN))
+	if (!Match(context, TOKEN_RIGHT_PAREN))
 	{
-		int bodyJump = EmitJump(OP_JUMP);
-		int incrementStart = CurrentChunk()->Count;
+		int bodyJump = EmitJump(context, OP_JUMP);
+		int incrementStart = CurrentChunk(context)->Count;
 		
-		ParseExpression();
-		EmitByte(OP_POP); // Pop the value of the incrementer clause expression off of the stack since it is no longer needed.
-		Consume(TOKEN_RIGHT_PAREN, "Expected ')' after for loop clauses.");
+		ParseExpression(context);
+		EmitByte(context, OP_POP); // Pop the value of the incrementer clause expression off of the stack since it is no longer needed.
+		Consume(context, TOKEN_RIGHT_PAREN, "Expected ')' after for loop clauses.");
 
-		EmitLoop(loopStart);
+		EmitLoop(context, loopStart);
 		loopStart = incrementStart;
-		PatchJump(bodyJump);
+		PatchJump(context, bodyJump);
 	}
 
 
-	ParseStatement();
-	EmitLoop(loopStart);
+	ParseStatement(context);
+	EmitLoop(context, loopStart);
 
 	if (exitJump != -1)
 	{
-		PatchJump(exitJump);
-		EmitByte(OP_POP); // Pop the loop's condition value off of the stack since it is no longer needed.
+		PatchJump(context, exitJump);
+		EmitByte(context, OP_POP); // Pop the loop's condition value off of the stack since it is no longer needed.
 	}
 
-	EndScope();
+	EndScope(context);
 }
 
 
-static void ParseIfStatement()
+static void ParseIfStatement(CompileContext* context)
 {
-	Consume(TOKEN_LEFT_PAREN, "Expected '(' after 'if'.");
-	ParseExpression();
-	Consume(TOKEN_RIGHT_PAREN, "Expected ')' after if condition.");
+	Consume(context, TOKEN_LEFT_PAREN, "Expected '(' after 'if'.");
+	ParseExpression(context);
+	Consume(context, TOKEN_RIGHT_PAREN, "Expected ')' after if condition.");
 
 	// Keep track of where the jump instruction is in our bytecode.
-	int thenJump = EmitJump(OP_JUMP_IF_FALSE);
-	EmitByte(OP_POP); // Emit an instruction to pop the result of the if statement's condition expression off of the stack.
-	ParseStatement();
+	int thenJump = EmitJump(context, OP_JUMP_IF_FALSE);
+	EmitByte(context, OP_POP); // Emit an instruction to pop the result of the if statement's condition expression off of the stack.
+	ParseStatement(context);
 
-	int elseJump = EmitJump(OP_JUMP);
+	int elseJump = EmitJump(context, OP_JUMP);
 
 	// Now that we've compiled the then clause, we know how much byte code it was turned
 	// into. That means we can go back and update that OP_JUMP_IF_FALSE instruction
 	// with the proper value of how far it should jump when the if statement's
 	// condition is false. This trick is called "backpatching".
-	PatchJump(thenJump);
-	EmitByte(OP_POP); // Emit an instruction to pop the result of the if statement's condition expression off of the stack.
+	PatchJump(context, thenJump);
+	EmitByte(context, OP_POP); // Emit an instruction to pop the result of the if statement's condition expression off of the stack.
 					  // We do this again here, because if the if statement was false, then the first OP_POP instruction
 					  // we emitted will be skipped since it is in the code generated by the then clause.
 
 	// Check if there is an else clause.
-	if (Match(TOKEN_ELSE))
-		ParseStatement();
+	if (Match(context, TOKEN_ELSE))
+		ParseStatement(context);
 
-	PatchJump(elseJump);
+	PatchJump(context, elseJump);
 }
 
 
-static void ParsePrintStatement()
+static void ParsePrintStatement(CompileContext* context)
 {
-	ParseExpression();
-	Consume(TOKEN_SEMICOLON, "Expected ';' after print statement value");
-	EmitByte(OP_PRINT);
+	ParseExpression(context);
+	Consume(context, TOKEN_SEMICOLON, "Expected ';' after print statement value");
+	EmitByte(context, OP_PRINT);
 }
 
 
-static void ParseReturnStatement()
+static void ParseReturnStatement(CompileContext* context)
 {
-	if (current->Type == TYPE_SCRIPT)
+	if (context->Current->Type == TYPE_SCRIPT)
 	{
-		Error("Can't return from top-level code.");
+		Error(context, "Can't return from top-level code.");
 	}
 
 	// If this is true, then there is no return value specified in the return statement.
-	if (Match(TOKEN_SEMICOLON))
+	if (Match(context, TOKEN_SEMICOLON))
 	{
-		EmitReturn();
+		EmitReturn(context);
 	}
 	else
 	{
-		if (current->Type == TYPE_INITIALIZER)
+		if (context->Current->Type == TYPE_INITIALIZER)
 		{
-			Error("Can't return a value from a class initializer.");
+			Error(context, "Can't return a value from a class initializer.");
 		}
 
-		ParseExpression();
-		Consume(TOKEN_SEMICOLON, "Expected ';' after return value.");
-		EmitByte(OP_RETURN);
+		ParseExpression(context);
+		Consume(context, TOKEN_SEMICOLON, "Expected ';' after return value.");
+		EmitByte(context, OP_RETURN);
 	}
 }
 
 
-static void ParseWhileStatement()
+static void ParseWhileStatement(CompileContext* context)
 {
 	// Record the starting position of the loop in the bytecode chunk.
-	int loopStart = CurrentChunk()->Count;
+	int loopStart = CurrentChunk(context)->Count;
 
-	Consume(TOKEN_LEFT_PAREN, "Expected '(' after 'while'.");
-	ParseExpression();
-	Consume(TOKEN_RIGHT_PAREN, "Expected ')' after while loop condition.");
+	Consume(context, TOKEN_LEFT_PAREN, "Expected '(' after 'while'.");
+	ParseExpression(context);
+	Consume(context, TOKEN_RIGHT_PAREN, "Expected ')' after while loop condition.");
 
 	// This jump is what exits the loop if its condition is false.
-	int exitJump = EmitJump(OP_JUMP_IF_FALSE);
-	EmitByte(OP_POP);
-	ParseStatement();
-	EmitLoop(loopStart);
+	int exitJump = EmitJump(context, OP_JUMP_IF_FALSE);
+	EmitByte(context, OP_POP);
+	ParseStatement(context);
+	EmitLoop(context, loopStart);
 
-	PatchJump(exitJump);
-	EmitByte(OP_POP);
+	PatchJump(context, exitJump);
+	EmitByte(context, OP_POP);
 }
 
 
-static void Synchronize()
+static void Synchronize(CompileContext* context)
 {
-	parser.PanicMode = false;
+	context->Parser.PanicMode = false;
 
-	while (parser.Current.Type != TOKEN_EOF)
+	while (context->Parser.Current.Type != TOKEN_EOF)
 	{
-		if (parser.Previous.Type == TOKEN_SEMICOLON)
+		if (context->Parser.Previous.Type == TOKEN_SEMICOLON)
 			return;
 
-		switch (parser.Current.Type)
+		switch (context->Parser.Current.Type)
 		{
 			case TOKEN_CLASS:
 			case TOKEN_FUN:
@@ -1369,82 +2160,131 @@ static void Synchronize()
 
 		} // End switch
 
-		Advance();
+		Advance(context);
 
 	} // End whie
 }
 
 
-static void ParseDeclarationStatement()
+static void ParseDeclarationStatement(CompileContext* context)
 {
-	if (Match(TOKEN_CLASS))
+	if (Match(context, TOKEN_CLASS))
 	{
-		ParseClassDeclaration();
+		ParseClassDeclaration(context);
 	}
-	else if (Match(TOKEN_FUN))
+	else if (Match(context, TOKEN_FUN))
 	{
-		ParseFunctionDeclaration();
+		ParseFunctionDeclaration(context);
 	}
-	else if (Match(TOKEN_VAR))
+	else if (Match(context, TOKEN_VAR))
 	{
-		ParseVarDeclarationStatement();
+		ParseVarDeclarationStatement(context);
 	}
 	else
 	{
-		ParseStatement();
+		ParseStatement(context);
 	}
 
 
-	if (parser.PanicMode)
-		Synchronize();
+	if (context->Parser.PanicMode)
+		Synchronize(context);
 }
 
 
-static void ParseStatement()
+static void ParseStatement(CompileContext* context)
 {
-	if (Match(TOKEN_PRINT))
+	if (Match(context, TOKEN_PRINT))
 	{
-		ParsePrintStatement();
+		ParsePrintStatement(context);
 	}
-	else if (Match(TOKEN_FOR))
+	else if (Match(context, TOKEN_FOR))
 	{
-		ParseForStatement();
+		ParseForStatement(context);
 	}
-	else if (Match(TOKEN_IF))
+	else if (Match(context, TOKEN_IF))
 	{
-		ParseIfStatement();
+		ParseIfStatement(context);
 	}
-	else if (Match(TOKEN_RETURN))
+	else if (Match(context, TOKEN_RETURN))
 	{
-		ParseReturnStatement();
+		ParseReturnStatement(context);
 	}
-	else if (Match(TOKEN_WHILE))
+	else if (Match(context, TOKEN_WHILE))
 	{
-		ParseWhileStatement();
+		ParseWhileStatement(context);
 	}
-	else if (Match(TOKEN_LEFT_BRACE))
+	else if (Match(context, TOKEN_LEFT_BRACE))
 	{
-		BeginScope();
-		ParseBlock();
-		EndScope();
+		BeginScope(context);
+		ParseBlock(context);
+		EndScope(context);
 	}
 	else
 	{
-		ParseExpressionStatement();
+		ParseExpressionStatement(context);
 	}
 }
 
 
-ObjFunction* Compile(const char* source)
+/// <summary>
+/// Sets up a compile context and registers it with the VM.
+/// </summary>
+/// <param name="line">The line number the source code starts on.</param>
+static void InitCompileContext(CompileContext* context, const char* source, size_t length, int line)
+{
+#ifdef PRETOKENIZE_SOURCE
+	InitTokenBuffer(&context->Tokens);
+	TokenizeSource(&context->Tokens, source, length);
+	InitTokenCursor(&context->Cursor, &context->Tokens);
+	context->Cursor.Line = line;
+#else
+	InitScanner(&context->Scanner, source, length);
+	context->Scanner.Line = line;
+#endif
+	context->Current = NULL;
+	context->CurrentClass = NULL;
+
+	context->Parser.HadError = false;
+	context->Parser.PanicMode = false;
+
+	InitTable(&context->Scope);
+	context->Bindings = NULL;
+	context->BindingCount = 0;
+	context->BindingCapacity = 0;
+
+#ifdef CONCURRENT_GC
+	// The compiler doesn't use the snapshot barrier when it writes into functions, so the concurrent marker thread can't be
+	// running while it works. This has to come last, since everything above can allocate memory and start a collection.
+	FinishConcurrentMarking();
+#endif
+
+	// Register this compilation with the VM so the garbage collector can find the functions
+	// it is still building. If another compilation is already running, this one nests inside it.
+	context->Enclosing = vm->ActiveCompilation;
+	vm->ActiveCompilation = context;
+}
+
+
+static void FreeCompileContext(CompileContext* context)
 {
-	InitScanner(source);
+	FreeTable(&context->Scope);
+	FREE_ARRAY(ScopeBinding, context->Bindings, context->BindingCapacity);
+
+#ifdef PRETOKENIZE_SOURCE
+	FreeTokenBuffer(&context->Tokens);
+#endif
+
+	vm->ActiveCompilation = context->Enclosing;
+}
 
-	Compiler compiler;
-	InitCompiler(&compiler, TYPE_SCRIPT);
 
+ObjFunction* Compile(const char* source, size_t length)
+{
+	CompileContext context;
+	InitCompileContext(&context, source, length, 1);
 
-	parser.HadError = false;
-	parser.PanicMode = false;
+	Compiler compiler;
+	InitCompiler(&context, &compiler, TYPE_SCRIPT, NULL);
 
 
 
@@ -1454,28 +2294,136 @@ ObjFunction* Compile(const char* source)
 
 
 
-	Advance();
+	Advance(&context);
 	
-	while (!Match(TOKEN_EOF))
+	while (!Match(&context, TOKEN_EOF))
 	{
-		ParseDeclarationStatement();
+		ParseDeclarationStatement(&context);
 	}
 
 
-	ObjFunction* function = EndCompiler();
+	ObjFunction* function = EndCompiler(&context);
 
-	return parser.HadError ? NULL : function;
+	FreeCompileContext(&context);
+
+	return context.Parser.HadError ? NULL : function;
 
 }
 
 
-void MarkCompilerRoots()
+#ifdef LAZY_COMPILE_FUNCTIONS
+
+bool CompileLazyFunction(ObjFunction* function)
 {
-	Compiler* compiler = current;
+	LazyFunctionBody* lazy = function->Lazy;
+	if (lazy->HadError)
+		return false;
+
+	int arity = function->Arity;
+	int upValueCount = function->UpValueCount;
+
+	CompileContext context;
+	InitCompileContext(&context, lazy->Source, lazy->Length, lazy->Line);
+
+
+	// The functions this one was declared inside of are long gone, so we stand in for them with a compiler
+	// whose locals are the variables this function captured. Resolving one of those names then gives back
+	// the same UpValue the function got when it was skipped.
+	Compiler enclosing;
+	enclosing.Enclosing = NULL;
+	enclosing.Function = NULL;
+	enclosing.Type = TYPE_SCRIPT;
+	enclosing.LocalCount = 0;
+	enclosing.ScopeDepth = 0;
+	enclosing.FirstBinding = 0;
+	context.Current = &enclosing;
+
+	for (int i = 0; i < upValueCount; i++)
+	{
+		Local* local = &enclosing.Locals[enclosing.LocalCount++];
+		local->Name.Start = lazy->UpValueNames[i]->Chars;
+		local->Name.Length = lazy->UpValueNames[i]->Length;
+		local->Depth = 0;
+		local->IsCaptured = false;
+
+		PushBinding(&context, &local->Name);
+	}
+
+	ClassCompiler classCompiler;
+	if (lazy->InClass)
+	{
+		classCompiler.Enclosing = NULL;
+		classCompiler.HasSuperClass = lazy->HasSuperClass;
+		context.CurrentClass = &classCompiler;
+	}
+
+
+	// The parameters get counted again as they're parsed.
+	function->Arity = 0;
+
+	// The function is most likely in the old generation by now, and we're about to fill its chunk with new constants.
+	WRITE_BARRIER(function);
 
-	while (compiler != NULL)
+	Compiler compiler;
+	InitCompiler(&context, &compiler, (FunctionType)lazy->Type, function);
+
+	for (int i = 0; i < upValueCount; i++)
+	{
+		compiler.UpValues[i].Index = (uint8_t)i;
+		compiler.UpValues[i].IsLocal = true;
+		compiler.UpValueLookup[i * 2 + 1] = (short)(i + 1);
+	}
+
+	BeginScope(&context);
+
+	Advance(&context);
+	ParseParameterList(&context);
+	ParseBlock(&context);
+	EndCompiler(&context);
+
+
+	while (context.BindingCount > 0)
+	{
+		PopBinding(&context);
+	}
+
+	FreeCompileContext(&context);
+
+
+	// Every UpValue the body uses was created when it was skipped, so the count can't have changed unless something went wrong.
+	if (context.Parser.HadError || function->UpValueCount != upValueCount)
 	{
-		MarkObject((Obj*)compiler->Function);
-		compiler = compiler->Enclosing;
+		FreeChunk(&function->Chunk);
+		function->Arity = arity;
+		function->UpValueCount = upValueCount;
+		lazy->HadError = true;
+		return false;
+	}
+
+	FreeLazyFunctionBody(function);
+	return true;
+}
+
+#endif
+
+
+void MarkCompilerRoots(CompileContext* context)
+{
+	// Walk every active compilation, and every function each one is in the middle of compiling.
+	for (; context != NULL; context = context->Enclosing)
+	{
+		Compiler* compiler = context->Current;
+
+		while (compiler != NULL)
+		{
+			MarkObject((Obj*)compiler->Function);
+			compiler = compiler->Enclosing;
+		}
+
+		// The scope table only holds numbers, so marking the names of the bindings covers all of its keys.
+		for (int i = 0; i < context->BindingCount; i++)
+		{
+			MarkObject((Obj*)context->Bindings[i].Name);
+		}
 	}
 }
@@ -14,8 +14,20 @@
 
 
 
-ObjFunction* Compile(const char* source);
+// Holds the state of a single compilation (scanner, parser, and the compiler chain). It is
+// defined in Compiler.cpp, since nothing outside the compiler needs to look inside it.
+struct CompileContext;
 
-void MarkCompilerRoots(); // Used by the cLox garbage collector. See chapter 26 in the book.
+
+
+
+ObjFunction* Compile(const char* source, size_t length);
+
+#ifdef LAZY_COMPILE_FUNCTIONS
+	// Compiles the body of a function whose body was skipped when it was declared. Returns false if the body has a compile error.
+	bool CompileLazyFunction(ObjFunction* function);
+#endif
+
+void MarkCompilerRoots(CompileContext* context); // Used by the cLox garbage collector. See chapter 26 in the book. Marks the roots of the passed in compilation, and of every compilation it is nested inside.
 
 // #endif
@@ -4,13 +4,14 @@
 #include "Debug.h"
 #include "Object.h"
 #include "Value.h"
+#include "VM.h"
 
 
 
 
 void DisassembleChunk(Chunk* chunk, const char* name)
 {
-	printf("\n== %s ==\n", name);
+	fprintf(vm->Out, "\n== %s ==\n", name);
 	
 	for (int offset = 0; offset < chunk->Count;)
 	{
@@ -26,12 +27,12 @@ static int ConstantInstruction(const char* name, Chunk* chunk, int offset)
 	uint8_t constant = chunk->Code[offset + 1];
 
 	// Print out the instruction name and its constant index parameter.
-	printf("%-16s %4d '", name, constant);
+	fprintf(vm->Out, "%-16s %4d '", name, constant);
 
 	// Print out the actual constant value referenced by this instruction.
 	PrintValue(chunk->Constants.Values[constant]);
 
-	printf("'\n");
+	fprintf(vm->Out, "'\n");
 
 	// Return the offset of the next instruction. This instruction is 2-bytes long, so we add that to the current instruction's offset.
 	return offset + 2;
@@ -43,9 +44,9 @@ static int InvokeInstruction(const char* name, Chunk* chunk, int offset)
 	uint8_t constant = chunk->Code[offset + 1];
 	uint8_t argCount = chunk->Code[offset + 2];
 
-	printf("%-16s (%d args) %4d '", name, argCount, constant);
+	fprintf(vm->Out, "%-16s (%d args) %4d '", name, argCount, constant);
 	PrintValue(chunk->Constants.Values[constant]);
-	printf("'\n");
+	fprintf(vm->Out, "'\n");
 
 	return offset + 3;
 }
@@ -54,7 +55,7 @@ static int InvokeInstruction(const char* name, Chunk* chunk, int offset)
 static int SimpleInstruction(const char* name, int offset)
 {
 	// Print out the instruction name.
-	printf("%s\n", name);
+	fprintf(vm->Out, "%s\n", name);
 
 	// Return the offset of the next instruction.
 	// A simple instruction is only one byte, so we add 1 to the current instruction's offset.
@@ -67,7 +68,7 @@ static int ByteInstruction(const char* name, Chunk* chunk, int offset)
 	uint8_t slot = chunk->Code[offset + 1];
 
 	// Print out the instruction name and its slot parameter.
-	printf("%-16s %4d\n", name, slot);
+	fprintf(vm->Out, "%-16s %4d\n", name, slot);
 
 
 	return offset + 2;
@@ -80,7 +81,7 @@ static int JumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 	jump |= chunk->Code[offset + 2]; // Add 2 to take the jump instruction's two-byte operand into account.
 
 	// Print out the jump instruction's name, its bytecode index, and the bytecode index it will jump to.
-	printf("%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
+	fprintf(vm->Out, "%-16s %4d -> %d\n", name, offset, offset + 3 + sign * jump);
 
 	return offset + 3;
 }
@@ -89,19 +90,19 @@ static int JumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
 int DisassembleInstruction(Chunk* chunk, int offset)
 {
 	// Print out the current instruction's index in the bytecode array.
-	printf("%04d ", offset);
+	fprintf(vm->Out, "%04d ", offset);
 
 	// Print out the source code line number of this instruction.
 	if (offset > 0 &&
 		chunk->Lines[offset] == chunk->Lines[offset - 1])
 	{
 		// Indicate that this instruction is on the same source code line as the previous one.
-		printf("   | ");
+		fprintf(vm->Out, "   | ");
 	}
 	else
 	{
 		// Print out the source code line number.
-		printf("%4d ", chunk->Lines[offset]);
+		fprintf(vm->Out, "%4d ", chunk->Lines[offset]);
 	}
 
 
@@ -177,16 +178,16 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 		{
 			offset++;
 			uint8_t constant = chunk->Code[offset++];
-			printf("%-16s %4d ", "OP_CLOSURE", constant);
+			fprintf(vm->Out, "%-16s %4d ", "OP_CLOSURE", constant);
 			PrintValue(chunk->Constants.Values[constant]);
-			printf("\n");
+			fprintf(vm->Out, "\n");
 
 			ObjFunction* function = AS_FUNCTION(chunk->Constants.Values[constant]);
 			for (int j = 0; j < function->UpValueCount; j++)
 			{
 				int isLocal = chunk->Code[offset++];
 				int index = chunk->Code[offset++];
-				printf("%04d      |                     %s %d\n",
+				fprintf(vm->Out, "%04d      |                     %s %d\n",
 					   offset - 2, isLocal ? "local" : "upvalue", index);
 			}
 
@@ -204,7 +205,7 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 			return ConstantInstruction("OP_METHOD", chunk, offset);
 
 		default:
-			printf("ERROR: Unknown opcode (%d)\n", instruction);
+			fprintf(vm->Out, "ERROR: Unknown opcode (%d)\n", instruction);
 			return offset + 1;
 	} // End switch
 
@@ -213,24 +214,24 @@ int DisassembleInstruction(Chunk* chunk, int offset)
 
 void PrintDebugOutputKey()
 {
-	printf("\n== Debug Output Key ==\n");
-	printf("Column 1    The byte index of this opcode in the bytecode chunk.\n");
-	printf("Column 2    The source code line number this opcode was generated from. A | means it was generated from the same line as the previous opcode.\n");
-	printf("Column 3    This opcode's human-readable name. \n");
-	printf("Column 4    For constant instructions, this column shows the constant index.\n");
-	printf("            For byte instructions, this column instead shows the local variable slot index).\n");
-	printf("            For jump instructions, this column shows the instruction's bytecode index, and the bytecode index it jumps to.\n");
-	printf("Column 5    Not always used. For constant instructions, this is the value of the constant at the index shown in column 4.\n\n");
-
-	printf("In the runtime debug output, some lines contain values surrounded by []s. These lines show the values currently stored in the cLox stack.\n");
-	printf("Note that the stack debug output lines can be disabled by commenting out the DEBUG_PRINT_STACK preprocessor symbol I added in Common.h.\n");
-	printf("The runtime debug output may also be interspersed with values printed out by the OP_PRINT instruction.\n\n");
-
-	printf("fn is short for \"Function\". This abbreviation always appears just before a function name in the debug output.\n\n");
-
-	printf("The OP_CLOSURE instruction displays the function associated with it in the runtime debug output. It also lists all UpValues it contains.\n");
-	printf("    'local'    means the variable referenced by the UpValue is still in scope and living on the stack.\n");
-	printf("    'upvalue'  means it has gone out of scope, and was copied to the heap for future use by closure(s) that still reference it.\n");
-	printf("See chapter 25 of the online book \"Crafting Interpreters\", which this program was built from, for more on closures and UpValues.\n\n");
+	fprintf(vm->Out, "\n== Debug Output Key ==\n");
+	fprintf(vm->Out, "Column 1    The byte index of this opcode in the bytecode chunk.\n");
+	fprintf(vm->Out, "Column 2    The source code line number this opcode was generated from. A | means it was generated from the same line as the previous opcode.\n");
+	fprintf(vm->Out, "Column 3    This opcode's human-readable name. \n");
+	fprintf(vm->Out, "Column 4    For constant instructions, this column shows the constant index.\n");
+	fprintf(vm->Out, "            For byte instructions, this column instead shows the local variable slot index).\n");
+	fprintf(vm->Out, "            For jump instructions, this column shows the instruction's bytecode index, and the bytecode index it jumps to.\n");
+	fprintf(vm->Out, "Column 5    Not always used. For constant instructions, this is the value of the constant at the index shown in column 4.\n\n");
+
+	fprintf(vm->Out, "In the runtime debug output, some lines contain values surrounded by []s. These lines show the values currently stored in the cLox stack.\n");
+	fprintf(vm->Out, "Note that the stack debug output lines can be disabled by commenting out the DEBUG_PRINT_STACK preprocessor symbol I added in Common.h.\n");
+	fprintf(vm->Out, "The runtime debug output may also be interspersed with values printed out by the OP_PRINT instruction.\n\n");
+
+	fprintf(vm->Out, "fn is short for \"Function\". This abbreviation always appears just before a function name in the debug output.\n\n");
+
+	fprintf(vm->Out, "The OP_CLOSURE instruction displays the function associated with it in the runtime debug output. It also lists all UpValues it contains.\n");
+	fprintf(vm->Out, "    'local'    means the variable referenced by the UpValue is still in scope and living on the stack.\n");
+	fprintf(vm->Out, "    'upvalue'  means it has gone out of scope, and was copied to the heap for future use by closure(s) that still reference it.\n");
+	fprintf(vm->Out, "See chapter 25 of the online book \"Crafting Interpreters\", which this program was built from, for more on closures and UpValues.\n\n");
 }
 
@@ -0,0 +1,170 @@
+// This file contains the hash function used for strings.
+//
+
+#pragma once
+
+// #ifndef cLox_Hash_h
+//	#define cLox_Hash_h
+
+#include <string.h>
+
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+
+// cLox includes.
+#include "Common.h"
+
+
+
+
+// Odd 64-bit constants with an even mix of set bits. They get mixed into the input so runs of zero bytes can't cancel each other out.
+#define HASH_SECRET_0	0xa0761d6478bd642fULL
+#define HASH_SECRET_1	0xe7037ed1a0b428dbULL
+#define HASH_SECRET_2	0x8ebc6af09c88c6e3ULL
+#define HASH_SECRET_3	0x589965cc75374cc3ULL
+
+
+
+
+/// <summary>
+/// Multiplies two 64-bit numbers into a 128-bit result. The low half goes in a, and the high half in b.
+/// </summary>
+static inline void HashMultiply(uint64_t* a, uint64_t* b)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	*a = _umul128(*a, *b, b);
+#elif defined(__SIZEOF_INT128__)
+	__uint128_t result = (__uint128_t)*a * *b;
+	*a = (uint64_t)result;
+	*b = (uint64_t)(result >> 64);
+#else
+	// No 128-bit multiply, so it gets built out of four 32-bit ones.
+	uint64_t aHigh = *a >> 32, aLow = (uint32_t)*a;
+	uint64_t bHigh = *b >> 32, bLow = (uint32_t)*b;
+
+	uint64_t low = aLow * bLow;
+	uint64_t middle1 = aHigh * bLow;
+	uint64_t middle2 = aLow * bHigh;
+	uint64_t high = aHigh * bHigh;
+
+	uint64_t carry = ((low >> 32) + (uint32_t)middle1 + (uint32_t)middle2) >> 32;
+	*a = low + (middle1 << 32) + (middle2 << 32);
+	*b = high + (middle1 >> 32) + (middle2 >> 32) + carry;
+#endif
+}
+
+
+/// <summary>
+/// Multiplies two 64-bit numbers, and folds the two halves of the 128-bit result together. Every bit of the result depends on
+/// every bit of both inputs, which makes this a cheap and very thorough way to mix them.
+/// </summary>
+static inline uint64_t HashMix(uint64_t a, uint64_t b)
+{
+	HashMultiply(&a, &b);
+	return a ^ b;
+}
+
+
+// These read a few bytes from anywhere in a string as one number. memcpy() is the portable way to do an unaligned read, and
+// compilers turn it into a single load.
+
+static inline uint64_t HashRead64(const uint8_t* bytes)
+{
+	uint64_t value;
+	memcpy(&value, bytes, sizeof(value));
+	return value;
+}
+
+
+static inline uint64_t HashRead32(const uint8_t* bytes)
+{
+	uint32_t value;
+	memcpy(&value, bytes, sizeof(value));
+	return value;
+}
+
+
+/// <summary>
+/// Generates the hash code for a string. It works through the string 8 bytes at a time rather than one byte at a time, and
+/// long strings get split into three independent lanes so the CPU can work on several multiplies at once. It is based on
+/// wyhash (https://github.com/wangyi-fudan/wyhash), which is in the public domain.
+/// </summary>
+/// <remarks>
+/// The table code keeps the low 7 bits of the hash code in its control bytes, and uses the bits above those to pick the group
+/// a search starts in (see Table.cpp). So the final mix makes sure every bit of the string affects all of them. The seed is
+/// different for every VM (see VM::HashSeed), so a script can't be written ahead of time to be full of strings that all land
+/// in the same group.
+/// </remarks>
+/// <param name="key">The string to generate a hash code for.</param>
+/// <param name="length">The length of the passed in string.</param>
+/// <param name="seed">The seed to use. The same string always gets the same hash code as long as the seed is the same.</param>
+/// <returns>The generated hash code.</returns>
+static inline uint32_t HashString(const char* key, int length, uint64_t seed)
+{
+	const uint8_t* bytes = (const uint8_t*)key;
+	size_t remaining = (size_t)length;
+	uint64_t a;
+	uint64_t b;
+
+	seed ^= HashMix(seed ^ HASH_SECRET_0, HASH_SECRET_1);
+
+	if (remaining <= 16)
+	{
+		// Short strings (like most identifiers) are read as at most four overlapping 4-byte pieces, with no loop at all.
+		if (remaining >= 4)
+		{
+			size_t middle = (remaining >> 3) << 2;
+			a = (HashRead32(bytes) << 32) | HashRead32(bytes + middle);
+			b = (HashRead32(bytes + remaining - 4) << 32) | HashRead32(bytes + remaining - 4 - middle);
+		}
+		else if (remaining > 0)
+		{
+			a = ((uint64_t)bytes[0] << 16) | ((uint64_t)bytes[remaining >> 1] << 8) | bytes[remaining - 1];
+			b = 0;
+		}
+		else
+		{
+			a = 0;
+			b = 0;
+		}
+	}
+	else
+	{
+		if (remaining > 48)
+		{
+			uint64_t seed1 = seed;
+			uint64_t seed2 = seed;
+			do
+			{
+				seed = HashMix(HashRead64(bytes) ^ HASH_SECRET_1, HashRead64(bytes + 8) ^ seed);
+				seed1 = HashMix(HashRead64(bytes + 16) ^ HASH_SECRET_2, HashRead64(bytes + 24) ^ seed1);
+				seed2 = HashMix(HashRead64(bytes + 32) ^ HASH_SECRET_3, HashRead64(bytes + 40) ^ seed2);
+				bytes += 48;
+				remaining -= 48;
+			} while (remaining > 48);
+
+			seed ^= seed1 ^ seed2;
+		}
+
+		while (remaining > 16)
+		{
+			seed = HashMix(HashRead64(bytes) ^ HASH_SECRET_1, HashRead64(bytes + 8) ^ seed);
+			bytes += 16;
+			remaining -= 16;
+		}
+
+		// The last 16 bytes of the string. These may overlap with the ones the loops already took care of.
+		a = HashRead64(bytes + remaining - 16);
+		b = HashRead64(bytes + remaining - 8);
+	}
+
+	a ^= HASH_SECRET_1;
+	b ^= seed;
+	HashMultiply(&a, &b);
+
+	uint64_t hash = HashMix(a ^ HASH_SECRET_0 ^ (uint64_t)length, b ^ HASH_SECRET_1);
+	return (uint32_t)(hash ^ (hash >> 32));
+}
+
+// #endif
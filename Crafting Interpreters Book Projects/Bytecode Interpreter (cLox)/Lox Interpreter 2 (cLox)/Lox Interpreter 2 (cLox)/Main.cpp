@@ -5,12 +5,16 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <vector>
 
 
 // cLox includes.
 #include "Common.h"
 #include "Chunk.h"
+#include "BatchRunner.h"
+#include "Benchmark.h"
 #include "Debug.h"
+#include "SourceFile.h"
 #include "VM.h"
 
 
@@ -48,91 +52,116 @@ static void REPL()
             break;
         
 
-        Interpret(line);
+        Interpret(line, strlen(line));
 
     } // end for
 }
 
 
 /// <summary>
-/// This function loads in a Lox script file.
+/// Runs a Lox script file.
 /// </summary>
-/// <param name="path">The file path of the Lox script to load.</param>
-/// <returns>A char buffer containing the contents of the file.</returns>
-static char* ReadFile(const char* path)
+/// <param name="path">The file path of the Lox script file to execute.</param>
+static void RunFile(const char* path)
 {
-    FILE* file;
-    
-    // I changed this line to fopen_s() from fopen(), because the compiler bitched with an
-    // error about fopen() being deprecated.
-    fopen_s(&file, path, "rb");
-    if (file == NULL)
-    {
-        fprintf(stderr, "Could not open file \"%s\".\n", path);
+    SourceFile source;
+    if (!LoadSourceFile(path, &source, stderr))
         exit(74); // Exit this program with error code.
-    }
 
+    InterpretResult result = Interpret(source.Text, source.Length);
+    UnloadSourceFile(&source);
 
-    // Jump to the end of the file.
-    fseek(file, 0L, SEEK_END);
+    // Indicate an error in the exit code.
+    if (result == INTERPRET_COMPILE_ERROR)
+        exit(65);
+    if (result == INTERPRET_RUNTIME_ERROR)
+        exit(70);
+}
 
-    // Find out how many bytes we are from the end of the file (the file size).
-    size_t fileSize = ftell(file);
 
-    // Rewind to the start of the file.
-    rewind(file);
+/// <summary>
+/// Runs a batch of Lox scripts in parallel. This handles the "--jobs" and "--manifest" command line options.
+/// </summary>
+/// <returns>The exit code for this program.</returns>
+static int RunBatchCommand(int argc, const char* argv[])
+{
+    int jobCount = 0; // 0 means one worker thread per CPU core.
+    const char** manifestPaths = NULL;
+    int manifestCount = 0;
 
+    std::vector<const char*> paths;
+    int exitCode = 0;
 
-    // Create a char buffer one character longer than the file.
-    char* buffer = (char*)malloc(fileSize + 1);
-    if (buffer == NULL)
+    for (int i = 1; i < argc; i++)
     {
-        fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
-        exit(74); // Exit this program with error code.
-    }
+        if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc)
+        {
+            jobCount = atoi(argv[++i]);
+        }
+        else if (strcmp(argv[i], "--manifest") == 0 && i + 1 < argc)
+        {
+            if (manifestPaths != NULL)
+            {
+                fprintf(stderr, "Only one manifest can be given.\n");
+                exitCode = 64;
+                break;
+            }
+
+            manifestPaths = ReadManifest(argv[++i], &manifestCount);
+            if (manifestPaths == NULL)
+                return 74;
+
+            paths.insert(paths.end(), manifestPaths, manifestPaths + manifestCount);
+        }
+        else if (strncmp(argv[i], "--", 2) == 0)
+        {
+            fprintf(stderr, "Unknown or incomplete option \"%s\".\n", argv[i]);
+            exitCode = 64;
+            break;
+        }
+        else
+        {
+            paths.push_back(argv[i]);
+        }
+    } // end for
 
 
-    // Read in the file.
-    size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
-    if (bytesRead < fileSize)
+    if (exitCode == 0 && paths.empty())
     {
-        fprintf(stderr, "Could not read file \"%s\".\n", path);
-        exit(74); // Exit this program with error code.
+        fprintf(stderr, "Usage: cLox [path]\n");
+        fprintf(stderr, "       cLox [--jobs N] [--manifest file] [path...]\n");
+        exitCode = 64; // Return an exit code from this application to indicate an error happened.
+    }
+    else if (exitCode == 0)
+    {
+        exitCode = RunBatch(paths.data(), (int)paths.size(), jobCount);
     }
 
+    if (manifestPaths != NULL)
+        FreeManifest(manifestPaths, manifestCount);
 
-    // Add a null character at the end of the buffer.
-    buffer[bytesRead] = '\0';
-
-
-    fclose(file);
-    return buffer;
+    return exitCode;
 }
 
 
-/// <summary>
-/// Runs a Lox script file.
-/// </summary>
-/// <param name="path">The file path of the Lox script file to execute.</param>
-static void RunFile(const char* path)
+int main(int argc, const char* argv[])
 {
-    char* source = ReadFile(path);
-    InterpretResult result = Interpret(source);
-    free(source);
+    //std::cout << "Hello World!\n";
 
-    // Indicate an error in the exit code.
-    if (result == INTERPRET_COMPILE_ERROR)
-        exit(65);
-    if (result == INTERPRET_RUNTIME_ERROR)
-        exit(70);
-}
+    if (argc >= 2 && strcmp(argv[1], "--benchmark") == 0)
+    {
+        // Run one of the built-in benchmarks instead of a Lox script.
+        return RunBenchmark(argc > 2 ? argv[2] : NULL);
+    }
 
+    if (argc >= 2 && (argc > 2 || strncmp(argv[1], "--", 2) == 0))
+    {
+        // Run several Lox script files at once. Each one gets its own VM, so we don't create one here.
+        return RunBatchCommand(argc, argv);
+    }
 
-int main(int argc, const char* argv[])
-{
-    //std::cout << "Hello World!\n";
 
-    InitVM();
+    VM* machine = NewVM();
 
     if (argc == 1)
     {
@@ -144,14 +173,9 @@ int main(int argc, const char* argv[])
         // Run the Lox script file that was passed into this program as a command line argument.
         RunFile(argv[1]);
     }
-    else
-    {
-        fprintf(stderr, "Usage: cLox [path]\n");
-        exit(64); // Return an exit code from this application to indicate an error happened.
-    }
 
 
-    FreeVM();
+    FreeVM(machine);
 
     return 0;
 }
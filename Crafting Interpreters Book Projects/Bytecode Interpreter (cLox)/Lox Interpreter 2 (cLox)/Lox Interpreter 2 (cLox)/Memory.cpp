@@ -1,4 +1,6 @@
 #include <stdlib.h>
+#include <string.h>
+#include <chrono>
 
 // cLox includes.
 #include "Compiler.h"
@@ -6,6 +8,17 @@
 #include "VM.h"
 
 
+#if defined(CONCURRENT_GC) || defined(PARALLEL_GC)
+	#include <atomic>
+	#include <mutex>
+	#include <thread>
+#endif
+
+#ifdef PARALLEL_GC
+	#include <deque>
+	#include <vector>
+#endif
+
 #ifdef DEBUG_LOG_GC
 	#include <stdio.h>
 	#include "Debug.h"
@@ -16,12 +29,229 @@
 
 #define GC_HEAP_GROW_FACTOR		2
 
+#ifdef GENERATIONAL_GC
+	// Objects in the nursery are packed one after another, with each one's size rounded up to this so the next one is aligned.
+	#define NURSERY_ALIGNMENT		8
+	#define ALIGN_NURSERY_SIZE(size)	(((size) + NURSERY_ALIGNMENT - 1) & ~(size_t)(NURSERY_ALIGNMENT - 1))
+#endif
+
+#ifdef INCREMENTAL_GC
+	#define GC_MARK_RATE			4 // How many bytes worth of objects a marking step scans for every byte allocated.
+	#define GC_BUDGET_CHECK_INTERVAL	32 // How many objects a marking step scans between checks of the clock.
+#endif
+
+#ifdef LAZY_SWEEP
+	#define GC_SWEEP_STEP			(16 * 1024) // How many bytes have to be allocated to pay for lazily sweeping one slab page.
+#endif
+
+#ifdef PARALLEL_GC
+	#define GC_STEAL_BATCH			64 // How many gray objects get moved at a time when a parallel mark worker shares or steals work.
+#endif
+
+
+
+
+#ifdef CONCURRENT_GC
+
+/// <summary>
+/// Holds the concurrent marker thread, and the state it shares with the program's thread.
+/// </summary>
+struct ConcurrentMarker
+{
+	std::thread Thread; // The marker thread for the collection that is running.
+	std::atomic<bool> IsDone; // Set by the marker thread once it has run out of work. It doesn't get any more work after that.
+
+	std::mutex Lock; // Guards IsDone being set, and the hand off list.
+	int HandOffCount; // Number of objects in the hand off list.
+	int HandOffCapacity; // Max number of objects that can fit in the hand off list.
+	Obj** HandOff; // Objects from the snapshot log that the program's thread has handed over to the marker thread.
+};
+
+
+static thread_local bool OnMarkerThread = false; // Set on the concurrent marker thread, so the code it shares with the program's thread knows where it is running.
+
+
+/// <summary>
+/// Gets an object's ScanState field, so it can be used atomically.
+/// </summary>
+static std::atomic<uint8_t>* ScanStateOf(Obj* object)
+{
+	static_assert(sizeof(std::atomic<uint8_t>) == sizeof(uint8_t), "Obj::ScanState can't be used atomically on this platform.");
+	return reinterpret_cast<std::atomic<uint8_t>*>(&object->ScanState);
+}
+
+#endif
+
+
+
+
+#ifdef PARALLEL_GC
+
+/// <summary>
+/// Holds the gray objects belonging to one of the threads taking part in a parallel mark.
+/// </summary>
+struct MarkWorker
+{
+	std::vector<Obj*> Local; // The worker's own gray stack. Only the worker itself uses it.
+	std::mutex Lock; // Guards Shared.
+	std::deque<Obj*> Shared; // Gray objects the worker has put up for grabs. It takes them back off the front, and idle workers steal them off the back.
+	std::atomic<int> SharedCount; // The number of objects in Shared. This can be checked without taking the lock.
+};
+
+
+static thread_local MarkWorker* CurrentWorker = NULL; // The parallel mark worker running on this thread, or NULL if there isn't one.
+
+#endif
+
+
+
+
+// Mark bits.
+//
+// An object in a slab page keeps its mark bit in the page's Marked bitmap instead of in its own header. So a collection
+// doesn't write to every live object just to mark it and then again to unmark it, which keeps the cache lines holding them
+// clean, and lets pages that are shared copy-on-write (after a fork() for example) stay shared. Sweeping a page only has to
+// look at its bitmaps. The few big objects that don't fit in a slab page still use Obj::IsMarked.
+//
+// When marking can happen on more than one thread, the bits get set atomically, since the objects sharing a word of the
+// bitmap may be getting marked by different threads.
+
+#if defined(CONCURRENT_GC) || defined(PARALLEL_GC)
+
+/// <summary>
+/// Gets an object's IsMarked field, so it can be used atomically.
+/// </summary>
+static std::atomic<bool>* IsMarkedOf(Obj* object)
+{
+	return reinterpret_cast<std::atomic<bool>*>(&object->IsMarked);
+}
+
+
+/// <summary>
+/// Gets a word of a slab page's Marked bitmap, so it can be used atomically.
+/// </summary>
+static std::atomic<uint64_t>* MarkWordOf(uint64_t* word)
+{
+	static_assert(sizeof(std::atomic<uint64_t>) == sizeof(uint64_t), "SlabPage::Marked can't be used atomically on this platform.");
+	return reinterpret_cast<std::atomic<uint64_t>*>(word);
+}
+
+#endif
+
+
+/// <summary>
+/// Checks if the garbage collector has marked an object.
+/// </summary>
+static inline bool TestMark(Obj* object)
+{
+#ifdef SLAB_ALLOCATOR
+	if (object->IsInSlab)
+	{
+		SlabPage* page = SLAB_PAGE_OF(object);
+		int index = SlabSlotIndex(page, object);
+	#if defined(CONCURRENT_GC) || defined(PARALLEL_GC)
+		uint64_t word = MarkWordOf(&page->Marked[index / 64])->load(std::memory_order_relaxed);
+	#else
+		uint64_t word = page->Marked[index / 64];
+	#endif
+		return (word >> (index % 64)) & 1;
+	}
+#endif
+
+#if defined(CONCURRENT_GC) || defined(PARALLEL_GC)
+	return IsMarkedOf(object)->load(std::memory_order_relaxed);
+#else
+	return object->IsMarked;
+#endif
+}
+
+
+/// <summary>
+/// Marks an object.
+/// </summary>
+/// <returns>True if the object was already marked. If several threads mark the same object at once, only one of them gets false.</returns>
+static inline bool SetMark(Obj* object)
+{
+#ifdef SLAB_ALLOCATOR
+	if (object->IsInSlab)
+	{
+		SlabPage* page = SLAB_PAGE_OF(object);
+		int index = SlabSlotIndex(page, object);
+		uint64_t bit = (uint64_t)1 << (index % 64);
+	#if defined(CONCURRENT_GC) || defined(PARALLEL_GC)
+		return (MarkWordOf(&page->Marked[index / 64])->fetch_or(bit, std::memory_order_relaxed) & bit) != 0;
+	#else
+		bool wasMarked = (page->Marked[index / 64] & bit) != 0;
+		page->Marked[index / 64] |= bit;
+		return wasMarked;
+	#endif
+	}
+#endif
+
+#if defined(CONCURRENT_GC) || defined(PARALLEL_GC)
+	return IsMarkedOf(object)->exchange(true, std::memory_order_relaxed);
+#else
+	bool wasMarked = object->IsMarked;
+	object->IsMarked = true;
+	return wasMarked;
+#endif
+}
+
+
+bool IsObjectMarked(Obj* object)
+{
+	return TestMark(object);
+}
+
+
+void SetObjectMarked(Obj* object)
+{
+	SetMark(object);
+}
+
+
+
+
+static size_t ObjectSize(Obj* object);
+#ifdef INCREMENTAL_GC
+	static void MarkStep(size_t allocated);
+#endif
+#ifdef LAZY_SWEEP
+	static void SweepForSizeClass(int sizeClass);
+	static void SweepStep(size_t allocated);
+#endif
+
+
+
+
+/// <summary>
+/// Gives the garbage collector a chance to run, after the heap has grown by the specified number of bytes.
+/// </summary>
+static void PayForAllocation(size_t allocated)
+{
+#ifdef LAZY_SWEEP
+	SweepStep(allocated);
+#endif
+
+#ifdef INCREMENTAL_GC
+	MarkStep(allocated);
+#else
 
+	#ifdef DEBUG_STRESS_GC
+	CollectGarbage();
+	#endif
+
+	if (vm->BytesAllocated > vm->NextGC)
+	{
+		CollectGarbage();
+	}
+#endif
+}
 
 
 void* Reallocate(void* pointer, size_t oldSize, size_t newSize)
 {
-	vm.BytesAllocated += newSize - oldSize;
+	vm->BytesAllocated += newSize - oldSize;
 
 
 	// Quoted from the book:
@@ -30,16 +260,7 @@ void* Reallocate(void* pointer, size_t oldSize, size_t newSize)
 	// allocation. We dont want to trigger a GC for thatin particular because the GC itself
 	// will call reallocate() to free memory."
 	if (newSize > oldSize)
-	{
-#ifdef DEBUG_STRESS_GC
-		CollectGarbage();
-#endif
-
-		if (vm.BytesAllocated > vm.NextGC)
-		{
-			CollectGarbage();
-		}
-	}
+		PayForAllocation(newSize - oldSize);
 
 
 	if (newSize == 0)
@@ -59,39 +280,173 @@ void* Reallocate(void* pointer, size_t oldSize, size_t newSize)
 
 
 /// <summary>
-/// This function is used by the cLox garbage collector. See chapter 26 in the book.
+/// Gets the memory for an object in the old generation. This doesn't count it towards BytesAllocated, or give the garbage
+/// collector a chance to run. Small objects go in a slab page. Anything else gets allocated on its own and added to the VM's linked list of objects.
 /// </summary>
-/// <param name="object">The object to mark.</param>
-void MarkObject(Obj* object)
+static Obj* PlaceOldObject(size_t size)
 {
+#ifdef SLAB_ALLOCATOR
+	if (FITS_IN_SLAB(size))
+	{
+	#ifdef LAZY_SWEEP
+		SweepForSizeClass(SLAB_SIZE_CLASS(size));
+	#endif
+
+		// Objects in slab pages aren't kept in the linked list. The collector finds them through their pages instead.
+		Obj* object = (Obj*)SlabAllocate(&vm->Slabs, size);
+		object->Next = NULL;
+		object->IsInSlab = true;
+		return object;
+	}
+#endif
+
+	Obj* object = (Obj*)malloc(size);
+
+	// Check that memory was allocated successfully. Otherwise, the cLox interpreter exits to the operating system with an error code.
 	if (object == NULL)
-		return;
-	if (object->IsMarked) // If the object is already marked, then skip it since that means we've already looked at it.
-		return;
+		exit(1);
+
+	object->Next = vm->Objects;
+	vm->Objects = object;
+#ifdef SLAB_ALLOCATOR
+	object->IsInSlab = false;
+#endif
+	return object;
+}
 
 
-#ifdef DEBUG_LOG_GC
-	printf("%p mark object: ", (void*)object);
-	PrintValue(OBJ_VAL(object));
-	printf("\n");
+/// <summary>
+/// Gets the number of bytes an object in the old generation takes up in the heap.
+/// </summary>
+static size_t OldObjectFootprint(size_t size)
+{
+#ifdef SLAB_ALLOCATOR
+	if (FITS_IN_SLAB(size))
+		return SLAB_SLOT_SIZE(size);
 #endif
 
+	return size;
+}
+
+
+Obj* AllocateOldObject(size_t size)
+{
+	// Just like Reallocate(), the collector may run before the memory is handed out.
+	size_t footprint = OldObjectFootprint(size);
+	vm->BytesAllocated += footprint;
+	PayForAllocation(footprint);
+
+	return PlaceOldObject(size);
+}
+
+
+/// <summary>
+/// Adds a pause in the program to the garbage collector's statistics.
+/// </summary>
+/// <param name="start">When the pause started.</param>
+/// <param name="longest">The longest pause so far of the same kind, which gets updated if this one is longer. Can be NULL.</param>
+static void RecordPause(std::chrono::steady_clock::time_point start, double* longest)
+{
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	double pause = elapsed.count();
+
+	vm->Stats.Pauses++;
+	vm->Stats.TotalPause += pause;
+	if (pause > vm->Stats.MaxPause)
+		vm->Stats.MaxPause = pause;
+	if (longest != NULL && pause > *longest)
+		*longest = pause;
+}
+
+
+/// <summary>
+/// Adds an object to the gray stack, so the garbage collector will look at the references inside of it later.
+/// </summary>
+static void PushGray(Obj* object)
+{
+	if (vm->GrayCapacity < vm->GrayCount + 1)
+	{
+		vm->GrayCapacity = GROW_CAPACITY(vm->GrayCapacity);
+		vm->GrayStack = (Obj**)realloc(vm->GrayStack,
+									  sizeof(Obj*) * vm->GrayCapacity);;
+
+		// Check that memory was allocated successfully. Otherwise, the cLox interpreter exits to the operating system with an error code.
+		if (vm->GrayStack == NULL)
+			exit(1);
+	}
+
+	vm->GrayStack[vm->GrayCount++] = object;
+}
 
-	object->IsMarked = true;
 
+#ifdef CONCURRENT_GC
 
-	if (vm.GrayCapacity < vm.GrayCount + 1)
+/// <summary>
+/// Adds an object to the snapshot log. While the concurrent marker thread is running, it owns the gray stack and the mark
+/// flags. So anything the program's thread finds goes in here, and gets handed over to the marker later on.
+/// </summary>
+static void LogSnapshotObject(Obj* object)
+{
+	if (vm->SnapshotCapacity < vm->SnapshotCount + 1)
 	{
-		vm.GrayCapacity = GROW_CAPACITY(vm.GrayCapacity);
-		vm.GrayStack = (Obj**)realloc(vm.GrayStack,
-									  sizeof(Obj*) * vm.GrayCapacity);;
+		vm->SnapshotCapacity = GROW_CAPACITY(vm->SnapshotCapacity);
+		vm->SnapshotLog = (Obj**)realloc(vm->SnapshotLog, sizeof(Obj*) * vm->SnapshotCapacity);
 
 		// Check that memory was allocated successfully. Otherwise, the cLox interpreter exits to the operating system with an error code.
-		if (vm.GrayStack == NULL)
+		if (vm->SnapshotLog == NULL)
 			exit(1);
 	}
 
-	vm.GrayStack[vm.GrayCount++] = object;
+	vm->SnapshotLog[vm->SnapshotCount++] = object;
+}
+
+#endif
+
+
+/// <summary>
+/// This function is used by the cLox garbage collector. See chapter 26 in the book.
+/// </summary>
+/// <param name="object">The object to mark.</param>
+void MarkObject(Obj* object)
+{
+	if (object == NULL)
+		return;
+#if defined(GENERATIONAL_GC) && defined(CONCURRENT_GC)
+	// The concurrent marker leaves young objects alone. They all got looked at when the collection started. See StartMarkerThread().
+	if (vm->Phase == GC_CONCURRENT_MARKING && IS_YOUNG(object))
+		return;
+#endif
+#ifdef CONCURRENT_GC
+	if (vm->Phase == GC_CONCURRENT_MARKING && !OnMarkerThread)
+	{
+		LogSnapshotObject(object);
+		return;
+	}
+#endif
+#ifdef PARALLEL_GC
+	if (CurrentWorker != NULL)
+	{
+		// Several threads may reach the same object at once, so only the one that sets the mark puts the object on its gray stack.
+		if (TestMark(object) || SetMark(object))
+			return;
+
+		CurrentWorker->Local.push_back(object);
+		return;
+	}
+#endif
+	if (TestMark(object)) // If the object is already marked, then skip it since that means we've already looked at it.
+		return;
+
+
+#ifdef DEBUG_LOG_GC
+	fprintf(vm->Out, "%p mark object: ", (void*)object);
+	PrintValue(OBJ_VAL(object));
+	fprintf(vm->Out, "\n");
+#endif
+
+
+	SetMark(object);
+	PushGray(object);
 }
 
 
@@ -125,12 +480,13 @@ static void MarkArray(ValueArray* array)
 /// When an object is "blackened", it means we've traversed its internal references
 /// to find all of the ones that are still "reachable", and thus should not be garbage collected.
 /// </summary>
-static void BlackenObject(Obj* object)
+/// <returns>Roughly how many bytes had to be looked at. The incremental collector uses this to measure its progress.</returns>
+static size_t BlackenObject(Obj* object)
 {
 #ifdef DEBUG_LOG_GC
-	printf("%p blacken object: ", (void*)object);
+	fprintf(vm->Out, "%p blacken object: ", (void*)object);
 	PrintValue(OBJ_VAL(object));
-	printf("\n");
+	fprintf(vm->Out, "\n");
 #endif
 
 
@@ -141,7 +497,7 @@ static void BlackenObject(Obj* object)
 			ObjBoundMethod* bound = (ObjBoundMethod*)object;
 			MarkValue(bound->Receiver);
 			MarkObject((Obj*)bound->Method);
-			break;
+			return sizeof(ObjBoundMethod);
 		}
 
 		case OBJ_CLASS:
@@ -149,7 +505,7 @@ static void BlackenObject(Obj* object)
 			ObjClass* klass = (ObjClass*)object;
 			MarkObject((Obj*)klass->Name);
 			MarkTable(&klass->Methods);
-			break;
+			return sizeof(ObjClass) + sizeof(Entry) * klass->Methods.Capacity;
 		}
 
 		case OBJ_CLOSURE:
@@ -160,7 +516,7 @@ static void BlackenObject(Obj* object)
 			{
 				MarkObject((Obj*)closure->UpValues[i]);
 			}
-			break;
+			return sizeof(ObjClosure) + sizeof(ObjUpValue*) * closure->UpValueCount;
 		}
 
 		case OBJ_FUNCTION:
@@ -168,7 +524,15 @@ static void BlackenObject(Obj* object)
 			ObjFunction* function = (ObjFunction*)object;
 			MarkObject((Obj*)function->Name);
 			MarkArray(&function->Chunk.Constants);
-			break;
+
+			if (function->Lazy != NULL)
+			{
+				for (int i = 0; i < function->UpValueCount; i++)
+				{
+					MarkObject((Obj*)function->Lazy->UpValueNames[i]);
+				}
+			}
+			return sizeof(ObjFunction) + sizeof(Value) * function->Chunk.Constants.Count;
 		}
 
 		case OBJ_INSTANCE:
@@ -176,13 +540,22 @@ static void BlackenObject(Obj* object)
 			ObjInstance* instance = (ObjInstance*)object;
 			MarkObject((Obj*)instance->Klass);
 			MarkTable(&instance->Fields);
-			break;
+			return sizeof(ObjInstance) + sizeof(Entry) * instance->Fields.Capacity;
+		}
+
+		case OBJ_ROPE:
+		{
+			ObjRope* rope = (ObjRope*)object;
+			MarkObject(rope->Left);
+			MarkObject(rope->Right);
+			MarkObject((Obj*)rope->Flat);
+			return sizeof(ObjRope);
 		}
 
 		case OBJ_UPVALUE:
 		{
 			MarkValue(((ObjUpValue*)object)->Closed);
-			break;
+			return sizeof(ObjUpValue);
 		}
 
 		case OBJ_NATIVE_FUNCTION:
@@ -190,31 +563,50 @@ static void BlackenObject(Obj* object)
 			break;
 
 	} // End switch
+
+	return ObjectSize(object);
+}
+
+
+/// <summary>
+/// Gets the size of an object's struct. This doesn't include any memory the object owns, like a function's chunk. It does
+/// include a string's characters, since they're stored inline.
+/// </summary>
+static size_t ObjectSize(Obj* object)
+{
+	switch (object->Type)
+	{
+		case OBJ_BOUND_METHOD:		return sizeof(ObjBoundMethod);
+		case OBJ_CLASS:				return sizeof(ObjClass);
+		case OBJ_CLOSURE:			return sizeof(ObjClosure);
+		case OBJ_FUNCTION:			return sizeof(ObjFunction);
+		case OBJ_INSTANCE:			return sizeof(ObjInstance);
+		case OBJ_NATIVE_FUNCTION:	return sizeof(ObjNativeFunction);
+		case OBJ_ROPE:				return sizeof(ObjRope);
+		case OBJ_STRING:			return STRING_SIZE(((ObjString*)object)->Length);
+		case OBJ_UPVALUE:			return sizeof(ObjUpValue);
+	}
+
+	return 0; // Unreachable.
 }
 
 
 void FreeObject(Obj* object)
 {
 #ifdef DEBUG_LOG_GC
-	printf("%p free object: ", (void*)object);
+	fprintf(vm->Out, "%p free object: ", (void*)object);
 	PrintValue(OBJ_VAL(object));
-	printf("\n");
+	fprintf(vm->Out, "\n");
 #endif
 
 
+	// First free any memory the object owns.
 	switch (object->Type)
 	{
-		case OBJ_BOUND_METHOD:
-		{
-			FREE(ObjBoundMethod, object);
-			break;
-		}
-
 		case OBJ_CLASS:
 		{
 			ObjClass* klass = (ObjClass*)object;
 			FreeTable(&klass->Methods);
-			FREE(ObjClass, object);
 			break;
 		}
 
@@ -222,7 +614,6 @@ void FreeObject(Obj* object)
 		{
 			ObjClosure* closure = (ObjClosure*)object;
 			FREE_ARRAY(ObjUpValue*, closure->UpValues, closure->UpValueCount);
-			FREE(ObjClosure, object);
 
 			// We don't clear the function pointed to by the closure here. This is because
 			// it may still be referenced by other elements in the Lox program.
@@ -234,7 +625,7 @@ void FreeObject(Obj* object)
 		{
 			ObjFunction* function = (ObjFunction*)object;
 			FreeChunk(&function->Chunk);
-			FREE(ObjFunction, object);
+			FreeLazyFunctionBody(function);
 			break;
 		}
 
@@ -242,91 +633,431 @@ void FreeObject(Obj* object)
 		{
 			ObjInstance* instance = (ObjInstance*)object;
 			FreeTable(&instance->Fields);
-			FREE(ObjInstance, object);
 			break;
 		}
 
+		case OBJ_BOUND_METHOD:
 		case OBJ_NATIVE_FUNCTION:
-		{
-			FREE(ObjNativeFunction, object);
-			break;
-		}
-
-		case OBJ_STRING:
-		{
-			ObjString* string = (ObjString*)object;
-			FREE_ARRAY(char, string->Chars, string->Length + 1);
-			FREE(ObjString, object);
-			break;
-		}
-
+		case OBJ_ROPE: // A rope doesn't own its two halves. They are objects of their own.
+		case OBJ_STRING: // A string's characters are part of the object itself.
 		case OBJ_UPVALUE:
-		{
-			FREE(ObjUpValue, object);
 			break;
-		}
 
 	} // End switch
+
+
+#ifdef GENERATIONAL_GC
+	// Objects in the nursery don't get freed one at a time. The whole nursery gets emptied at once by a minor collection.
+	if (IS_YOUNG(object))
+		return;
+#endif
+
+	// Then free the object itself.
+#ifdef SLAB_ALLOCATOR
+	if (FITS_IN_SLAB(ObjectSize(object)))
+	{
+		vm->BytesAllocated -= SLAB_SLOT_SIZE(ObjectSize(object));
+		SlabFree(&vm->Slabs, object);
+		return;
+	}
+#endif
+
+	Reallocate(object, ObjectSize(object), 0);
 }
 
 
 /// <summary>
-/// This function is used by the cLox garbage collector. See chapter 26 in the book.
+/// Marks the roots that change without going through MARKING_BARRIER. These are the stack, the call frames, the open UpValues,
+/// and the functions the compiler is building. The incremental collector looks at these again at the end of marking.
 /// </summary>
-static void MarkRoots()
+static void MarkStackRoots()
 {
-	for (Value* slot = vm.Stack; slot < vm.StackTop; slot++)
+	for (Value* slot = vm->Stack; slot < vm->StackTop; slot++)
 	{
 		MarkValue(*slot);
 	}
 
 
-	for (int i = 0; i < vm.FrameCount; i++)
+	for (int i = 0; i < vm->FrameCount; i++)
 	{
-		MarkObject((Obj*)vm.Frames[i].Closure);
+		MarkObject((Obj*)vm->Frames[i].Closure);
 	}
 
 
-	for (ObjUpValue* upValue = vm.OpenUpValues; upValue != NULL; upValue = upValue->Next)
+	for (ObjUpValue* upValue = vm->OpenUpValues; upValue != NULL; upValue = upValue->Next)
 	{
 		MarkObject((Obj*)upValue);
 	}
 
 
-	MarkTable(&vm.Globals);
-	MarkCompilerRoots();
-	MarkObject((Obj*)vm.InitString);
+	MarkCompilerRoots(vm->ActiveCompilation);
 }
 
 
 /// <summary>
 /// This function is used by the cLox garbage collector. See chapter 26 in the book.
 /// </summary>
-static void TraceReferences()
+static void MarkRoots()
 {
-	while (vm.GrayCount > 0)
-	{
-		Obj* object = vm.GrayStack[--vm.GrayCount];
-		BlackenObject(object);
-	}
+	MarkStackRoots();
+
+	// Globals get stored with TableSet(), which uses the barrier.
+	MarkTable(&vm->Globals);
+	MarkObject((Obj*)vm->InitString);
+}
+
+
+#ifdef PARALLEL_GC
+
+// The parallel marker works like this:
+//
+// The gray stack gets dealt out to a group of worker threads, with this one being one of them. Each worker blackens objects off
+// its own gray stack. When its stack gets big, and nobody can see any of its work, it moves a batch of objects into its shared
+// queue. A worker that runs out of work takes objects back from its own shared queue first, and then steals a batch from the
+// back of someone else's. The marks are set atomically, so each object still only gets blackened once. Marking is done when
+// every worker is out of work at the same time. The program is paused the whole time, so nothing in the heap changes.
+
+
+/// <summary>
+/// Puts a batch of objects from a worker's gray stack into its shared queue, where other workers can steal them.
+/// </summary>
+static void ShareGrayObjects(MarkWorker* worker)
+{
+	std::lock_guard<std::mutex> guard(worker->Lock);
+	for (int i = 0; i < GC_STEAL_BATCH; i++)
+	{
+		worker->Shared.push_back(worker->Local.back());
+		worker->Local.pop_back();
+	}
+
+	worker->SharedCount.store((int)worker->Shared.size(), std::memory_order_relaxed);
+}
+
+
+/// <summary>
+/// Moves a batch of gray objects onto the specified worker's gray stack. It first checks the worker's own shared queue, and if
+/// that is empty it tries to steal from the other workers' shared queues.
+/// </summary>
+/// <returns>True if the worker got some work, or false if there was none to be found.</returns>
+static bool TakeGrayObjects(std::vector<MarkWorker>& workers, int index)
+{
+	int workerCount = (int)workers.size();
+	for (int i = 0; i < workerCount; i++)
+	{
+		MarkWorker* victim = &workers[(index + i) % workerCount];
+		if (victim->SharedCount.load(std::memory_order_relaxed) == 0)
+			continue;
+
+		std::lock_guard<std::mutex> guard(victim->Lock);
+		int count = 0;
+		while (!victim->Shared.empty() && count < GC_STEAL_BATCH)
+		{
+			// The owner takes from the front, and everyone else from the back.
+			if (i == 0)
+			{
+				workers[index].Local.push_back(victim->Shared.front());
+				victim->Shared.pop_front();
+			}
+			else
+			{
+				workers[index].Local.push_back(victim->Shared.back());
+				victim->Shared.pop_back();
+			}
+
+			count++;
+		}
+
+		victim->SharedCount.store((int)victim->Shared.size(), std::memory_order_relaxed);
+		if (count > 0)
+			return true;
+	}
+
+	return false;
+}
+
+
+/// <summary>
+/// The main loop of a parallel mark worker. It keeps blackening objects, and taking or stealing more, until every worker is out of work.
+/// </summary>
+static void ParallelMarkLoop(VM* machine, std::vector<MarkWorker>* workers, int index, std::atomic<int>* idleCount)
+{
+	SetCurrentVM(machine);
+
+	MarkWorker* worker = &(*workers)[index];
+	CurrentWorker = worker;
+
+	int workerCount = (int)workers->size();
+	for (;;)
+	{
+		while (!worker->Local.empty())
+		{
+			Obj* object = worker->Local.back();
+			worker->Local.pop_back();
+			BlackenObject(object);
+
+			// If the other workers can't see any of this worker's work, give them some.
+			if (worker->Local.size() > GC_STEAL_BATCH && worker->SharedCount.load(std::memory_order_relaxed) == 0)
+				ShareGrayObjects(worker);
+		}
+
+		if (TakeGrayObjects(*workers, index))
+			continue;
+
+
+		// This worker is out of work. It waits until someone else shares some, or until every worker is out of work, which means
+		// the marking is done. A worker only goes idle once its own shared queue is empty, and only the owner ever adds to
+		// that. So once every worker is idle, there can't be any work left anywhere.
+		idleCount->fetch_add(1);
+		for (;;)
+		{
+			if (idleCount->load() == workerCount)
+			{
+				CurrentWorker = NULL;
+				return;
+			}
+
+			bool workShared = false;
+			for (int i = 0; i < workerCount; i++)
+			{
+				if ((*workers)[i].SharedCount.load(std::memory_order_relaxed) > 0)
+					workShared = true;
+			}
+
+			if (workShared)
+			{
+				idleCount->fetch_sub(1);
+				break;
+			}
+
+			std::this_thread::yield();
+		}
+	} // End for
+}
+
+
+/// <summary>
+/// Does the same job as TraceReferences(), but splits the work across the specified number of threads.
+/// </summary>
+static void ParallelTraceReferences(int threadCount)
+{
+	std::vector<MarkWorker> workers(threadCount);
+
+	// Deal the gray stack out round-robin. Workers that run out early steal from the others.
+	for (int i = 0; i < vm->GrayCount; i++)
+	{
+		workers[i % threadCount].Shared.push_back(vm->GrayStack[i]);
+	}
+
+	for (int i = 0; i < threadCount; i++)
+	{
+		workers[i].SharedCount.store((int)workers[i].Shared.size(), std::memory_order_relaxed);
+	}
+
+	vm->GrayCount = 0;
+
+
+	std::atomic<int> idleCount(0);
+	std::vector<std::thread> threads;
+	for (int i = 1; i < threadCount; i++)
+	{
+		threads.emplace_back(ParallelMarkLoop, vm, &workers, i, &idleCount);
+	}
+
+	// This thread is worker 0.
+	ParallelMarkLoop(vm, &workers, 0, &idleCount);
+
+	for (size_t i = 0; i < threads.size(); i++)
+	{
+		threads[i].join();
+	}
+}
+
+#endif
+
+
+/// <summary>
+/// This function is used by the cLox garbage collector. See chapter 26 in the book.
+/// </summary>
+static void TraceReferences()
+{
+#ifdef PARALLEL_GC
+	// Big heaps get marked by several threads at once.
+	if (vm->GrayCount > 1 && vm->BytesAllocated >= vm->ParallelMarkThreshold)
+	{
+		int threadCount = vm->MarkThreads > 0 ? vm->MarkThreads : (int)std::thread::hardware_concurrency();
+		if (threadCount > 1)
+		{
+			ParallelTraceReferences(threadCount);
+			return;
+		}
+	}
+#endif
+
+	while (vm->GrayCount > 0)
+	{
+		Obj* object = vm->GrayStack[--vm->GrayCount];
+		BlackenObject(object);
+	}
+}
+
+
+#ifdef SLAB_ALLOCATOR
+
+/// <summary>
+/// Sweeps the objects that live in a slab page. They aren't in the VM's linked list, so the dead ones are found from the page's
+/// Allocated and Marked bitmaps instead. The live objects never get touched.
+/// </summary>
+/// <param name="freeAll">If this is true, every object gets freed whether it was marked or not. This is used when the VM is freed.</param>
+static void SweepSlabPage(SlabPage* page, bool freeAll)
+{
+	// No slot past UnusedIndex has ever been handed out, so there is no need to look at those words.
+	int wordCount = (page->UnusedIndex + 63) / 64;
+	for (int word = 0; word < wordCount; word++)
+	{
+		uint64_t live = freeAll ? 0 : page->Marked[word];
+		uint64_t dead = page->Allocated[word] & ~live;
+		while (dead != 0)
+		{
+			int index = word * 64 + LowestSetBit(dead);
+			dead &= dead - 1;
+
+			FreeObject((Obj*)(page->Slots + (size_t)index * page->SlotSize));
+		} // End while
+
+#ifdef CONCURRENT_GC
+		// The scan states are still kept in the objects, so those do have to be reset.
+		while (live != 0)
+		{
+			int index = word * 64 + LowestSetBit(live);
+			live &= live - 1;
+
+			((Obj*)(page->Slots + (size_t)index * page->SlotSize))->ScanState = SCAN_PENDING;
+		} // End while
+#endif
+	}
+
+	// Reset the mark bits so they're ready to go the next time the garbage collector runs.
+	memset(page->Marked, 0, sizeof(uint64_t) * wordCount);
+}
+
+
+#ifdef LAZY_SWEEP
+
+// Lazy sweeping.
+//
+// Sweeping every slab page straight after marking would put the cost of the whole sweep in the same pause as the end of
+// the marking, and that cost depends on how big the heap is rather than on how much of it is alive. So instead, the end of
+// a collection just queues the pages up (see QueueSlabSweep()), and they get swept one at a time afterwards. A page gets
+// swept when the allocator needs a slot of its size class and there are no swept pages of that size class with room left,
+// and allocating also pays for sweeping a page every GC_SWEEP_STEP bytes, so the sweep is usually done long before the
+// next collection. Whatever is left gets swept right before the next collection starts marking, since that needs the mark
+// bits.
+
+
+/// <summary>
+/// Sweeps a page that was waiting to be swept, and makes it available for allocations again.
+/// </summary>
+static void SweepQueuedPage(SlabPage* page)
+{
+	SweepSlabPage(page, false);
+	FinishSlabPageSweep(&vm->Slabs, page);
+
+	// Once the last page is done, give back the pages that ended up empty.
+	if (vm->Slabs.UnsweptCount == 0)
+		ReleaseEmptySlabPages(&vm->Slabs);
+}
+
+
+/// <summary>
+/// Sweeps the pages of the specified size class that are waiting to be swept, until one of them has a free slot.
+/// </summary>
+static void SweepForSizeClass(int sizeClass)
+{
+	SlabPage* page;
+	while (vm->Slabs.Available[sizeClass] == NULL && (page = TakeUnsweptPage(&vm->Slabs, sizeClass)) != NULL)
+	{
+		SweepQueuedPage(page);
+	}
+}
+
+
+/// <summary>
+/// Pays off some of the sweeping that is left to do, after the heap has grown by the specified number of bytes.
+/// </summary>
+static void SweepStep(size_t allocated)
+{
+	if (vm->Slabs.UnsweptCount == 0)
+		return;
+
+	vm->SweepDebt += allocated;
+
+	SlabPage* page;
+	while (vm->SweepDebt >= GC_SWEEP_STEP && (page = TakeUnsweptPage(&vm->Slabs, -1)) != NULL)
+	{
+		vm->SweepDebt -= GC_SWEEP_STEP;
+		SweepQueuedPage(page);
+	}
+}
+
+
+/// <summary>
+/// Sweeps all of the pages that are still waiting to be swept. This has to be done before a collection starts marking.
+/// </summary>
+static void FinishSweeping()
+{
+	SlabPage* page;
+	while ((page = TakeUnsweptPage(&vm->Slabs, -1)) != NULL)
+	{
+		SweepQueuedPage(page);
+	}
+
+	vm->SweepDebt = 0;
+}
+
+#endif
+
+
+/// <summary>
+/// Sweeps every object in the slab pages.
+/// </summary>
+/// <param name="freeAll">If this is true, every object gets freed whether it was marked or not. This is used when the VM is freed.</param>
+static void SweepSlabPages(bool freeAll)
+{
+	for (SlabPage* page = vm->Slabs.Pages; page != NULL; page = page->Next)
+	{
+		SweepSlabPage(page, freeAll);
+	}
 }
 
+#endif
+
 
 /// <summary>
 /// This function is used by the cLox garbage collector. See chapter 26 in the book.
 /// </summary>
-static void Sweep()
+/// <returns>How many bytes of garbage were left in slab pages to be swept lazily. This is always 0 unless LAZY_SWEEP is enabled.</returns>
+static size_t Sweep()
 {
+	size_t unswept = 0;
+#if defined(LAZY_SWEEP)
+	unswept = QueueSlabSweep(&vm->Slabs);
+#elif defined(SLAB_ALLOCATOR)
+	SweepSlabPages(false);
+#endif
+
 	Obj* previous = NULL;
-	Obj* object = vm.Objects;
+	Obj* object = vm->Objects;
 
 
 	// Iterate through all heap objects in the VM's linked list.
 	while (object != NULL)
 	{
-		if (object->IsMarked)
+		if (TestMark(object))
 		{
 			object->IsMarked = false; // Reset this flag so it's ready to go the next time the garbage collector runs.
+#ifdef CONCURRENT_GC
+			object->ScanState = SCAN_PENDING;
+#endif
 			previous = object;
 			object = object->Next;
 		}
@@ -340,56 +1071,1069 @@ static void Sweep()
 			}
 			else // If previous is NULL, it means we're freeing the first object in the linked list. Therefore, the VM's pointer needs to be updated to point to the new first object in the list.
 			{
-				vm.Objects = object;
+				vm->Objects = object;
 			}
 
 			FreeObject(unreached);
 		}
 	} // End while
+
+#if defined(SLAB_ALLOCATOR) && !defined(LAZY_SWEEP)
+	ReleaseEmptySlabPages(&vm->Slabs);
+#endif
+
+	return unswept;
 }
 
 
+#ifdef GENERATIONAL_GC
+
+// The young generation works like this:
+//
+// New objects get bump allocated in the nursery, which is just one fixed-size block of memory. When it fills up, a minor
+// collection copies every young object that is still reachable into the old generation (the same malloc'ed objects in the
+// VM's linked list the full collector has always used), and then empties the nursery in one go. Finding the live young
+// objects only needs the roots, plus the old objects that might point into the nursery. Those are tracked by the write
+// barrier, which puts old objects into the remembered set when a reference gets stored in them. Dead young objects
+// never get looked at (other than to free any memory they own), so the cost of a minor collection only depends on how
+// much survives.
+//
+// Since copying an object moves it, a minor collection can only run when there are no pointers to young objects held in C
+// variables, as those can't be updated. So when the nursery fills up, new objects go straight into the old generation, and
+// the VM runs the minor collection at the top of its instruction loop. The full collector doesn't move anything, so it can
+// still run from anywhere. It marks and traces young objects like any others, so it can find the old objects they keep alive,
+// but it leaves freeing them to the next minor collection. Their mark flags get cleared at the end of the collection instead
+// (see ClearYoungMarks()).
+
+
 /// <summary>
-/// This function is essentially the brain of the garbage collector. See chapter 26 in the book.
+/// Gets the object that comes after the passed in one in the nursery.
 /// </summary>
-void CollectGarbage()
+static Obj* NextYoungObject(Obj* object)
 {
-#ifdef DEBUG_LOG_GC
-	printf("-- gc (garbage collector) begin\n");
-	size_t before = vm.BytesAllocated;
+	return (Obj*)((uint8_t*)object + ALIGN_NURSERY_SIZE(ObjectSize(object)));
+}
+
+
+Obj* AllocateYoungObject(size_t size)
+{
+	// A long string could fill up most of the nursery on its own, so objects that big go straight into the old generation.
+	if (size > NURSERY_MAX_OBJECT_SIZE)
+		return NULL;
+
+	size = ALIGN_NURSERY_SIZE(size);
+	if ((size_t)(vm->Nursery + NURSERY_SIZE - vm->NurseryTop) < size)
+	{
+		vm->MinorGCRequested = true;
+		return NULL;
+	}
+
+#ifdef DEBUG_STRESS_GC
+	vm->MinorGCRequested = true;
 #endif
 
+	Obj* object = (Obj*)vm->NurseryTop;
+	vm->NurseryTop += size;
+	return object;
+}
 
-	MarkRoots(); // Find all "reachable" objects in the stack, and in the VM's internal references as well as in compiler ones.
-	TraceReferences(); // Scan through all references contained in the "reachable" objects we just found to find more "reachable" objects.
-	TableRemoveWhite(&vm.Strings); // Clean up strings in the VM's string table that are no longer "reachable".
-	Sweep(); // Clean up objects that are no longer "reachable" and which should therefore be garbage collected.
 
+void RememberObject(Obj* object)
+{
+	if (vm->RememberedCapacity < vm->RememberedCount + 1)
+	{
+		vm->RememberedCapacity = GROW_CAPACITY(vm->RememberedCapacity);
+		vm->RememberedSet = (Obj**)realloc(vm->RememberedSet, sizeof(Obj*) * vm->RememberedCapacity);
+
+		// Check that memory was allocated successfully. Otherwise, the cLox interpreter exits to the operating system with an error code.
+		if (vm->RememberedSet == NULL)
+			exit(1);
+	}
+
+	object->IsRemembered = true;
+	vm->RememberedSet[vm->RememberedCount++] = object;
+}
+
+
+Obj* EvacuateObject(Obj* object)
+{
+#ifdef COMPACTING_GC
+	// A compaction leaves forwarding pointers behind in the old generation as well. See CompactHeap().
+	if (object != NULL && object->IsForwarded)
+		return object->Next;
+#endif
+
+	if (object == NULL || !IS_YOUNG(object))
+		return object;
+
+	// Has this object already been moved?
+	if (object->IsForwarded)
+		return object->Next;
+
+
+	// This can't go through AllocateOldObject(), since that could start a full collection in the middle of this one.
+	size_t size = ObjectSize(object);
+	Obj* copy = PlaceOldObject(size);
+	Obj* next = copy->Next;
+#ifdef SLAB_ALLOCATOR
+	bool isInSlab = copy->IsInSlab;
+#endif
+
+	vm->BytesAllocated += OldObjectFootprint(size);
+
+	memcpy(copy, object, size);
+	copy->IsMarked = false;
+	copy->IsRemembered = false;
+	copy->IsForwarded = false;
+	copy->Next = next;
+#ifdef SLAB_ALLOCATOR
+	copy->IsInSlab = isInSlab;
+#endif
+
+#ifdef CONCURRENT_GC
+	// The whole nursery got scanned when the concurrent collection started, so the copy doesn't need to be looked at again.
+	// It gets treated the same as a brand new object. See StartMarkerThread().
+	if (vm->Phase == GC_CONCURRENT_MARKING)
+	{
+		SetMark(copy);
+		copy->ScanState = SCAN_DONE;
+	}
+	else
+	{
+		copy->ScanState = SCAN_PENDING;
+	}
+#endif
+
+	// A closed UpValue points at its own Closed field, which just moved along with it.
+	if (object->Type == OBJ_UPVALUE)
+	{
+		ObjUpValue* upValue = (ObjUpValue*)object;
+		if (upValue->Location == &upValue->Closed)
+			((ObjUpValue*)copy)->Location = &((ObjUpValue*)copy)->Closed;
+	}
+
+	// Leave a forwarding pointer behind, so any other references to the object get pointed at the copy.
+	object->IsForwarded = true;
+	object->Next = copy;
 
-	// Adjust the threshold for the next garbage collection. See chapter 26 in the book.
-	vm.NextGC = vm.BytesAllocated * GC_HEAP_GROW_FACTOR;
 
 #ifdef DEBUG_LOG_GC
-	printf("-- gc end\n");
-	printf("   collected %zu bytes (from %zu to %zu). Next garbage collection when heap size reaches %zu bytes.\n",
-		before - vm.BytesAllocated,
-		before,
-		vm.BytesAllocated,
-		vm.NextGC);
+	fprintf(vm->Out, "%p promote object to %p: ", (void*)object, (void*)copy);
+	PrintValue(OBJ_VAL(copy));
+	fprintf(vm->Out, "\n");
+#endif
+
+	// The copy may still be pointing at young objects, so it needs to be scanned.
+	if (vm->PromotedCapacity < vm->PromotedCount + 1)
+	{
+		vm->PromotedCapacity = GROW_CAPACITY(vm->PromotedCapacity);
+		vm->PromotedStack = (Obj**)realloc(vm->PromotedStack, sizeof(Obj*) * vm->PromotedCapacity);
+
+		// Check that memory was allocated successfully. Otherwise, the cLox interpreter exits to the operating system with an error code.
+		if (vm->PromotedStack == NULL)
+			exit(1);
+	}
+
+	vm->PromotedStack[vm->PromotedCount++] = copy;
+
+#ifdef INCREMENTAL_GC
+	// If a full collection is in the middle of marking, the young object may well have been on its gray stack, which is about
+	// to lose it (see ForgetYoungGrayObjects()). So rather than work out which young objects it had already reached, every copy
+	// starts out gray.
+	if (vm->Phase == GC_MARKING)
+		MarkObject(copy);
 #endif
+
+	return copy;
 }
 
 
-void FreeObjects()
+Value EvacuateValue(Value value)
 {
-	Obj* object = vm.Objects;
+	if (IS_OBJ(value))
+		return OBJ_VAL(EvacuateObject(AS_OBJ(value)));
 
-	while (object != NULL)
+	return value;
+}
+
+
+/// <summary>
+/// Used by minor collections. This moves every young object the passed in object references into the old generation, and
+/// updates the references to point to the copies. It is the minor collection's version of BlackenObject().
+/// </summary>
+static void ScanObject(Obj* object)
+{
+	switch (object->Type)
 	{
-		Obj* next = object->Next;
-		FreeObject(object);
-		object = next;
-	} // End while
+		case OBJ_BOUND_METHOD:
+		{
+			ObjBoundMethod* bound = (ObjBoundMethod*)object;
+			bound->Receiver = EvacuateValue(bound->Receiver);
+			bound->Method = (ObjClosure*)EvacuateObject((Obj*)bound->Method);
+			break;
+		}
+
+		case OBJ_CLASS:
+		{
+			ObjClass* klass = (ObjClass*)object;
+			klass->Name = (ObjString*)EvacuateObject((Obj*)klass->Name);
+			EvacuateTable(&klass->Methods);
+			break;
+		}
+
+		case OBJ_CLOSURE:
+		{
+			ObjClosure* closure = (ObjClosure*)object;
+			closure->Function = (ObjFunction*)EvacuateObject((Obj*)closure->Function);
+			for (int i = 0; i < closure->UpValueCount; i++)
+			{
+				closure->UpValues[i] = (ObjUpValue*)EvacuateObject((Obj*)closure->UpValues[i]);
+			}
+			break;
+		}
+
+		case OBJ_FUNCTION:
+		{
+			ObjFunction* function = (ObjFunction*)object;
+			function->Name = (ObjString*)EvacuateObject((Obj*)function->Name);
+
+			ValueArray* constants = &function->Chunk.Constants;
+			for (int i = 0; i < constants->Count; i++)
+			{
+				constants->Values[i] = EvacuateValue(constants->Values[i]);
+			}
+
+			if (function->Lazy != NULL)
+			{
+				for (int i = 0; i < function->UpValueCount; i++)
+				{
+					function->Lazy->UpValueNames[i] = (ObjString*)EvacuateObject((Obj*)function->Lazy->UpValueNames[i]);
+				}
+			}
+			break;
+		}
+
+		case OBJ_INSTANCE:
+		{
+			ObjInstance* instance = (ObjInstance*)object;
+			instance->Klass = (ObjClass*)EvacuateObject((Obj*)instance->Klass);
+			EvacuateTable(&instance->Fields);
+			break;
+		}
+
+		case OBJ_ROPE:
+		{
+			ObjRope* rope = (ObjRope*)object;
+			rope->Left = EvacuateObject(rope->Left);
+			rope->Right = EvacuateObject(rope->Right);
+			rope->Flat = (ObjString*)EvacuateObject((Obj*)rope->Flat);
+			break;
+		}
+
+		case OBJ_UPVALUE:
+		{
+			ObjUpValue* upValue = (ObjUpValue*)object;
+			upValue->Closed = EvacuateValue(upValue->Closed);
+			break;
+		}
+
+		case OBJ_NATIVE_FUNCTION:
+		case OBJ_STRING:
+			break;
+
+	} // End switch
+}
+
+
+/// <summary>
+/// Points every root at the new home of the object it references, if that object has been moved. These are the same roots
+/// MarkRoots() uses, other than the compiler's, since nothing gets moved while the compiler is running.
+/// </summary>
+static void EvacuateRoots()
+{
+	for (Value* slot = vm->Stack; slot < vm->StackTop; slot++)
+	{
+		*slot = EvacuateValue(*slot);
+	}
+
+	for (int i = 0; i < vm->FrameCount; i++)
+	{
+		vm->Frames[i].Closure = (ObjClosure*)EvacuateObject((Obj*)vm->Frames[i].Closure);
+	}
+
+	// The open UpValues' Locations point into the stack, which never moves. So only the list itself needs updating.
+	for (ObjUpValue** upValue = &vm->OpenUpValues; *upValue != NULL; upValue = &(*upValue)->Next)
+	{
+		*upValue = (ObjUpValue*)EvacuateObject((Obj*)*upValue);
+	}
+
+	EvacuateTable(&vm->Globals);
+	vm->InitString = (ObjString*)EvacuateObject((Obj*)vm->InitString);
+}
+
+
+#ifdef INCREMENTAL_GC
+
+/// <summary>
+/// Takes the young objects off of the gray stack. A minor collection does this before it empties the nursery, since the gray
+/// stack would otherwise be left pointing into it. The ones that survived were copied, and the copies are already gray.
+/// </summary>
+static void ForgetYoungGrayObjects()
+{
+	int count = 0;
+	for (int i = 0; i < vm->GrayCount; i++)
+	{
+		if (!IS_YOUNG(vm->GrayStack[i]))
+			vm->GrayStack[count++] = vm->GrayStack[i];
+	}
+
+	vm->GrayCount = count;
+}
+
+#endif
+
+
+void CollectYoungGeneration()
+{
+	// The compiler keeps pointers to the objects it is building in C variables, so nothing can move while it's running.
+	if (vm->ActiveCompilation != NULL)
+		return;
+
+	vm->MinorGCRequested = false;
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+#ifdef DEBUG_LOG_GC
+	fprintf(vm->Out, "-- minor gc begin\n");
+	size_t before = vm->BytesAllocated;
+	size_t nurseryUsed = vm->NurseryTop - vm->Nursery;
+#endif
+
+
+	// Move everything the roots reference out of the nursery.
+	EvacuateRoots();
+
+
+	// Then everything the remembered objects in the old generation reference. Once the nursery is empty, no old
+	// object can be pointing into it anymore, so the remembered set starts over.
+	for (int i = 0; i < vm->RememberedCount; i++)
+	{
+		SNAPSHOT_BARRIER(vm->RememberedSet[i]); // The references in it are about to be pointed at the copies.
+		vm->RememberedSet[i]->IsRemembered = false;
+		ScanObject(vm->RememberedSet[i]);
+	}
+
+	vm->RememberedCount = 0;
+
+
+	// Finally, keep going until every object that got moved has been scanned.
+	while (vm->PromotedCount > 0)
+	{
+		ScanObject(vm->PromotedStack[--vm->PromotedCount]);
+	}
+
+
+	// The string table doesn't keep strings alive, so any young string nothing else referenced is gone now.
+	TableRemoveYoung(&vm->Strings);
+
+	// The objects that didn't survive still need to free the memory they own.
+	for (Obj* object = (Obj*)vm->Nursery; (uint8_t*)object < vm->NurseryTop; object = NextYoungObject(object))
+	{
+		if (!object->IsForwarded)
+			FreeObject(object);
+	}
+
+#ifdef INCREMENTAL_GC
+	if (vm->Phase == GC_MARKING)
+		ForgetYoungGrayObjects();
+#endif
+
+	vm->NurseryTop = vm->Nursery;
+
+	vm->Stats.MinorCollections++;
+	RecordPause(start, &vm->Stats.MaxMinorPause);
+
+
+#ifdef DEBUG_LOG_GC
+	fprintf(vm->Out, "-- minor gc end\n");
+	fprintf(vm->Out, "   emptied %zu bytes from the nursery, and promoted %zu bytes into the old generation.\n",
+		nurseryUsed,
+		vm->BytesAllocated - before);
+#endif
+}
+
+
+/// <summary>
+/// Used by full collections. Young objects never get swept, so their mark flags are left set at the end of marking. This clears
+/// them, so the next collection will trace them again.
+/// </summary>
+static void ClearYoungMarks()
+{
+	for (Obj* object = (Obj*)vm->Nursery; (uint8_t*)object < vm->NurseryTop; object = NextYoungObject(object))
+	{
+		object->IsMarked = false;
+	}
+}
+
+
+#ifdef CONCURRENT_GC
+
+/// <summary>
+/// Used by concurrent collections. The marker thread doesn't look inside young objects, since the program changes them without
+/// using the snapshot barrier. So every object in the nursery gets treated as a root, and gets blackened before the marker starts.
+/// </summary>
+static void MarkYoungGeneration()
+{
+	for (Obj* object = (Obj*)vm->Nursery; (uint8_t*)object < vm->NurseryTop; object = NextYoungObject(object))
+	{
+		BlackenObject(object);
+	}
+}
+
+#endif
+
+
+/// <summary>
+/// Used by full collections. Takes any objects that are about to be swept out of the remembered set.
+/// </summary>
+static void ForgetUnmarkedObjects()
+{
+	int count = 0;
+	for (int i = 0; i < vm->RememberedCount; i++)
+	{
+		Obj* object = vm->RememberedSet[i];
+		if (TestMark(object))
+			vm->RememberedSet[count++] = object;
+	}
+
+	vm->RememberedCount = count;
+}
+
+#endif
+
+
+#ifdef COMPACTING_GC
+
+// Compaction.
+//
+// Objects in the old generation never move on their own, so a long running program that frees most of what it allocated
+// ends up with lots of slab pages that only have a few objects left in each. Those pages can't be given back to the system,
+// and the live objects are spread out over far more memory than they need. So after a full collection, a compaction can
+// pack each size class back into as few pages as it will fit in, and give the emptied pages back.
+//
+// It works a lot like a minor collection. Each object in a page that is being emptied gets copied into a free slot in one of
+// the pages that are being kept, and leaves a forwarding pointer behind (see EvacuateObject()). Then every reference to it
+// gets updated: the roots, the string table, and the references inside every object in the heap. Since objects move, it can
+// only run at the same safe point the minor collections do, and it starts by running one, so there are no young objects
+// pointing into the old generation that would need updating too.
+
+
+/// <summary>
+/// Moves an object out of a page that is being emptied, into a free slot of another page of the same size class. A forwarding
+/// pointer is left behind, so references to the object can find the copy.
+/// </summary>
+static void RelocateObject(Obj* object)
+{
+	size_t size = ObjectSize(object);
+	Obj* copy = (Obj*)SlabAllocate(&vm->Slabs, size);
+	memcpy(copy, object, size);
+
+	// A closed UpValue points at its own Closed field, which just moved along with it.
+	if (object->Type == OBJ_UPVALUE)
+	{
+		ObjUpValue* upValue = (ObjUpValue*)object;
+		if (upValue->Location == &upValue->Closed)
+			((ObjUpValue*)copy)->Location = &((ObjUpValue*)copy)->Closed;
+	}
+
+	object->IsForwarded = true;
+	object->Next = copy;
+
+#ifdef DEBUG_LOG_GC
+	fprintf(vm->Out, "%p relocate object to %p: ", (void*)object, (void*)copy);
+	PrintValue(OBJ_VAL(copy));
+	fprintf(vm->Out, "\n");
+#endif
+}
+
+
+/// <summary>
+/// Calls ScanObject() on every object in the slab pages, other than the ones in pages that are being emptied.
+/// </summary>
+static void ScanSlabPages()
+{
+	for (SlabPage* page = vm->Slabs.Pages; page != NULL; page = page->Next)
+	{
+		if (page->IsEvacuating)
+			continue;
+
+		int wordCount = (page->UnusedIndex + 63) / 64;
+		for (int word = 0; word < wordCount; word++)
+		{
+			uint64_t bits = page->Allocated[word];
+			while (bits != 0)
+			{
+				int index = word * 64 + LowestSetBit(bits);
+				bits &= bits - 1;
+
+				ScanObject((Obj*)(page->Slots + (size_t)index * page->SlotSize));
+			} // End while
+		}
+	}
+}
+
+
+void CompactHeap()
+{
+	// Just like a minor collection, this has to wait until the compiler is done. A full collection that is part way through
+	// marking has to finish first as well, since its gray stack would need updating too.
+	if (vm->ActiveCompilation != NULL)
+		return;
+#ifdef INCREMENTAL_GC
+	if (vm->Phase != GC_IDLE)
+		return;
+#endif
+
+	vm->CompactionRequested = false;
+
+	// Empty out the nursery, so nothing in it can be pointing at the objects that are about to move.
+	CollectYoungGeneration();
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+#ifdef LAZY_SWEEP
+	// Dead objects must not get copied, so every page has to have been swept.
+	FinishSweeping();
+#endif
+
+	int pageCount = PlanSlabCompaction(&vm->Slabs);
+	if (pageCount == 0)
+	{
+		RecordPause(start, NULL);
+		return;
+	}
+
+#ifdef DEBUG_LOG_GC
+	fprintf(vm->Out, "-- compaction begin\n");
+	int before = vm->Slabs.PageCount;
+#endif
+
+
+	// Move every object out of the pages that are being emptied.
+	for (SlabPage* page = vm->Slabs.Pages; page != NULL; page = page->Next)
+	{
+		if (!page->IsEvacuating)
+			continue;
+
+		int wordCount = (page->UnusedIndex + 63) / 64;
+		for (int word = 0; word < wordCount; word++)
+		{
+			uint64_t bits = page->Allocated[word];
+			while (bits != 0)
+			{
+				int index = word * 64 + LowestSetBit(bits);
+				bits &= bits - 1;
+
+				RelocateObject((Obj*)(page->Slots + (size_t)index * page->SlotSize));
+			} // End while
+		}
+	}
+
+
+	// Then point every reference at the copies.
+	EvacuateRoots();
+	EvacuateTable(&vm->Strings); // A string keeps its hash when it moves, so it can stay in the same entry.
+
+	ScanSlabPages();
+	for (Obj* object = vm->Objects; object != NULL; object = object->Next)
+	{
+		ScanObject(object);
+	}
+
+
+	// Nothing points into the emptied pages anymore. The copies own whatever memory the originals did, so the pages just get
+	// given back without freeing anything in them.
+	ReleaseEvacuatedSlabPages(&vm->Slabs);
+
+	vm->Stats.Compactions++;
+	RecordPause(start, NULL);
+
+#ifdef DEBUG_LOG_GC
+	fprintf(vm->Out, "-- compaction end\n");
+	fprintf(vm->Out, "   emptied %d of %d slab pages.\n", before - vm->Slabs.PageCount, before);
+#endif
+}
+
+#endif
+
+
+/// <summary>
+/// Finishes off a collection once all of the marking is done. It frees everything that wasn't reached.
+/// </summary>
+static void FinishCollection()
+{
+#ifdef DEBUG_LOG_GC
+	size_t before = vm->BytesAllocated;
+#endif
+
+#ifdef GENERATIONAL_GC
+	ClearYoungMarks();
+#endif
+
+	TableRemoveWhite(&vm->Strings); // Clean up strings in the VM's string table that are no longer "reachable".
+#ifdef GENERATIONAL_GC
+	ForgetUnmarkedObjects(); // Take objects that are about to be freed out of the remembered set.
+#endif
+	size_t unswept = Sweep(); // Clean up objects that are no longer "reachable" and which should therefore be garbage collected.
+
+
+	// Adjust the threshold for the next garbage collection. See chapter 26 in the book. Garbage that is going to be swept lazily
+	// is still counted in BytesAllocated, so it's left out here.
+	vm->NextGC = (vm->BytesAllocated - unswept) * GC_HEAP_GROW_FACTOR;
+	vm->Stats.Collections++;
+
+#ifdef COMPACTING_GC
+	// The VM runs the compaction at its next safe point.
+	if (vm->CompactAfterCollections)
+		vm->CompactionRequested = true;
+#endif
+
+#ifdef INCREMENTAL_GC
+	vm->Phase = GC_IDLE;
+#endif
+
+#ifdef DEBUG_LOG_GC
+	fprintf(vm->Out, "-- gc end\n");
+	fprintf(vm->Out, "   collected %zu bytes (from %zu to %zu). Next garbage collection when heap size reaches %zu bytes.\n",
+		before - vm->BytesAllocated,
+		before,
+		vm->BytesAllocated,
+		vm->NextGC);
+#endif
+}
+
+
+#ifdef CONCURRENT_GC
+
+// The concurrent collector works like this:
+//
+// When a collection is due, the VM starts it at the top of its instruction loop, where it isn't in the middle of changing any
+// objects. It marks the roots, and scans the young objects, right away. Then the gray stack is handed over to the marker
+// thread, which does the rest of the marking while the program keeps running on its own thread. Once the marker runs out of
+// work, the program's thread notices the next time it allocates something, and finishes off the collection in one short
+// pause (the remark) before the sweep.
+//
+// The marker only ever looks at the heap the way it was when the collection started. Before the program changes any of the
+// references inside an object, SNAPSHOT_BARRIER makes sure that object has been scanned. If the marker hasn't gotten to it yet,
+// the program's thread scans it itself, and puts the objects it references in the snapshot log, which gets handed over to the
+// marker every so often. That way the marker never sees an object change while it's reading it, and everything that was
+// reachable when the collection started still gets marked, even if the program has since dropped every reference to it.
+// Objects created during the collection start out marked and scanned, since anything they can reference is either new as
+// well, or part of the snapshot. Because of that, the roots don't need to be marked again during the remark. It only has to
+// mark whatever is still in the snapshot log.
+//
+// The compiler writes into the functions it is building without any barriers. So a collection that starts while it's running
+// does its marking incrementally on the program's thread instead, and the compiler finishes off any concurrent collection
+// before it starts.
+
+
+void ScanBeforeWrite(Obj* object)
+{
+#ifdef GENERATIONAL_GC
+	// The marker never looks inside young objects. They were all scanned when the collection started.
+	if (IS_YOUNG(object))
+		return;
+#endif
+
+	std::atomic<uint8_t>* state = ScanStateOf(object);
+	if (state->load(std::memory_order_acquire) == SCAN_DONE)
+		return;
+
+
+	uint8_t expected = SCAN_PENDING;
+	if (state->compare_exchange_strong(expected, SCAN_IN_PROGRESS, std::memory_order_acquire))
+	{
+		// The marker hasn't gotten to this object yet, so scan it here. Since this isn't the marker thread, the objects
+		// it references go into the snapshot log.
+		BlackenObject(object);
+		state->store(SCAN_DONE, std::memory_order_release);
+		return;
+	}
+
+
+	// The marker is in the middle of scanning the object. That never takes long, since it's only the one object.
+	while (state->load(std::memory_order_acquire) != SCAN_DONE)
+	{
+		std::this_thread::yield();
+	}
+}
+
+
+/// <summary>
+/// The main loop of the concurrent marker thread. It blackens objects from the gray stack, and takes in the ones the program's
+/// thread hands over to it, until there are none left.
+/// </summary>
+static void ConcurrentMarkLoop(VM* machine)
+{
+	SetCurrentVM(machine);
+	OnMarkerThread = true;
+
+	ConcurrentMarker* marker = vm->Marker;
+	for (;;)
+	{
+		while (vm->GrayCount > 0)
+		{
+			Obj* object = vm->GrayStack[--vm->GrayCount];
+
+			// Skip the object if the program's thread has already scanned it. See ScanBeforeWrite().
+			uint8_t expected = SCAN_PENDING;
+			if (ScanStateOf(object)->compare_exchange_strong(expected, SCAN_IN_PROGRESS, std::memory_order_acquire))
+			{
+				BlackenObject(object);
+				ScanStateOf(object)->store(SCAN_DONE, std::memory_order_release);
+			}
+		}
+
+
+		std::lock_guard<std::mutex> guard(marker->Lock);
+		if (marker->HandOffCount == 0)
+		{
+			marker->IsDone.store(true, std::memory_order_release);
+			return;
+		}
+
+		for (int i = 0; i < marker->HandOffCount; i++)
+		{
+			MarkObject(marker->HandOff[i]);
+		}
+
+		marker->HandOffCount = 0;
+	} // End for
+}
+
+
+/// <summary>
+/// Hands the rest of a collection's marking over to the concurrent marker thread. The roots must have been marked already.
+/// </summary>
+static void StartMarkerThread()
+{
+#ifdef GENERATIONAL_GC
+	// Young objects don't use the snapshot barrier, so the references inside them have to be looked at while they're still the
+	// same as they were when the collection started. The ones the roots reached are left out of the marker's gray stack, since
+	// that makes them black already.
+	MarkYoungGeneration();
+	ForgetYoungGrayObjects();
+#endif
+
+	if (vm->Marker == NULL)
+	{
+		vm->Marker = new ConcurrentMarker();
+		vm->Marker->HandOffCount = 0;
+		vm->Marker->HandOffCapacity = 0;
+		vm->Marker->HandOff = NULL;
+	}
+
+	vm->Marker->IsDone.store(false, std::memory_order_relaxed);
+	vm->Phase = GC_CONCURRENT_MARKING;
+	vm->Marker->Thread = std::thread(ConcurrentMarkLoop, vm);
+}
+
+
+/// <summary>
+/// Passes the objects in the snapshot log over to the concurrent marker thread. If the marker has already finished, they are
+/// left in the log for the remark instead.
+/// </summary>
+static void HandOffSnapshotLog()
+{
+	ConcurrentMarker* marker = vm->Marker;
+	std::lock_guard<std::mutex> guard(marker->Lock);
+	if (marker->IsDone.load(std::memory_order_relaxed))
+		return;
+
+	if (marker->HandOffCapacity < marker->HandOffCount + vm->SnapshotCount)
+	{
+		while (marker->HandOffCapacity < marker->HandOffCount + vm->SnapshotCount)
+			marker->HandOffCapacity = GROW_CAPACITY(marker->HandOffCapacity);
+
+		marker->HandOff = (Obj**)realloc(marker->HandOff, sizeof(Obj*) * marker->HandOffCapacity);
+
+		// Check that memory was allocated successfully. Otherwise, the cLox interpreter exits to the operating system with an error code.
+		if (marker->HandOff == NULL)
+			exit(1);
+	}
+
+	memcpy(marker->HandOff + marker->HandOffCount, vm->SnapshotLog, sizeof(Obj*) * vm->SnapshotCount);
+	marker->HandOffCount += vm->SnapshotCount;
+	vm->SnapshotCount = 0;
+}
+
+
+/// <summary>
+/// Waits for the concurrent marker thread to run out of work, and then takes the marking back over on this thread. Whatever is
+/// still in the snapshot log gets marked.
+/// </summary>
+static void StopMarkerThread()
+{
+	vm->Marker->Thread.join();
+	vm->Phase = GC_MARKING;
+
+	for (int i = 0; i < vm->SnapshotCount; i++)
+	{
+		MarkObject(vm->SnapshotLog[i]);
+	}
+
+	vm->SnapshotCount = 0;
+}
+
+
+void StartConcurrentCollection()
+{
+	vm->ConcurrentGCRequested = false;
+
+	// A collection may have started on this thread while the compiler was running.
+	if (vm->Phase != GC_IDLE)
+		return;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+#ifdef DEBUG_LOG_GC
+	fprintf(vm->Out, "-- gc (garbage collector) begin\n");
+#endif
+
+#ifdef LAZY_SWEEP
+	FinishSweeping();
+#endif
+
+	vm->Phase = GC_MARKING;
+	MarkRoots();
+	StartMarkerThread();
+
+	RecordPause(start, &vm->Stats.MaxCollectionPause);
+}
+
+
+void FinishConcurrentMarking()
+{
+	if (vm->Phase != GC_CONCURRENT_MARKING)
+		return;
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	StopMarkerThread();
+	TraceReferences();
+	FinishCollection();
+
+	RecordPause(start, &vm->Stats.MaxCollectionPause);
+}
+
+#endif
+
+
+#ifdef INCREMENTAL_GC
+
+// The incremental collector works like this:
+//
+// A collection starts by marking the roots, which puts the objects they reference on the gray stack. After that, every time
+// memory gets allocated, MarkStep() blackens some more gray objects. The more that gets allocated, the more marking gets done
+// (see GC_MARK_RATE), so the collection always finishes before the heap gets out of hand. A step also stops early once it has
+// used up the pause budget, and the rest of its work gets carried over to the next one.
+//
+// While marking is underway the program keeps changing the heap. If it stored a white object into a black one, and then
+// dropped every other reference to it, the collector would never find it. So every store into the heap goes through
+// MARKING_BARRIER, which shades the value being stored. Objects allocated during marking start out gray too.
+//
+// The stack and the other roots that change all the time don't have a barrier. So once the gray stack is empty, those get
+// marked again. Whatever that turns up gets traced by the following steps, the same as any other gray objects, and the roots
+// get looked at again once they run out. Objects created since the collection started are already marked, so this always ends.
+//
+// That keeps every pause to about the budget, other than these:
+//   - The one that starts a collection marks all of the roots, including every global variable.
+//   - Each root rescan looks at the whole stack, so it takes as long as the stack is deep.
+//   - The last one cleans up the string table, the remembered set and the objects that aren't in slab pages. Those take time in
+//     proportion to how big they are. The slab pages only get queued up to be swept later (see LAZY_SWEEP), and clearing the
+//     young objects' mark flags never takes longer than a walk through the nursery.
+//   - Minor collections aren't part of a full collection. They take as long as it takes to copy what survived in the nursery.
+
+
+/// <summary>
+/// This gets called every time memory is allocated. If a collection is running, it does one step of it. If it runs out of
+/// gray objects, the collection gets finished. Otherwise, it starts a new collection once the heap has grown enough.
+/// </summary>
+/// <param name="allocated">How many bytes were just allocated. This decides how much marking the step does.</param>
+static void MarkStep(size_t allocated)
+{
+#ifdef CONCURRENT_GC
+	if (vm->Phase == GC_CONCURRENT_MARKING)
+	{
+		// The marker thread does the work. This thread just has to keep it fed, and finish off the collection once it's done.
+		if (vm->Marker->IsDone.load(std::memory_order_acquire))
+			FinishConcurrentMarking();
+		else if (vm->SnapshotCount >= GC_SNAPSHOT_HANDOFF)
+			HandOffSnapshotLog();
+
+		return;
+	}
+#endif
+
+	if (vm->Phase == GC_IDLE)
+	{
+#ifndef DEBUG_STRESS_GC
+		if (vm->BytesAllocated <= vm->NextGC)
+			return;
+#endif
+
+	#ifdef CONCURRENT_GC
+		// The VM starts the collection at its next safe point instead. Collections that start while the compiler is running stay
+		// on this thread though. See FinishConcurrentMarking().
+		if (vm->ConcurrentMarking && vm->ActiveCompilation == NULL)
+		{
+			vm->ConcurrentGCRequested = true;
+			return;
+		}
+	#endif
+
+		std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	#ifdef DEBUG_LOG_GC
+		fprintf(vm->Out, "-- gc (garbage collector) begin\n");
+	#endif
+
+	#ifdef LAZY_SWEEP
+		FinishSweeping();
+	#endif
+
+		vm->Phase = GC_MARKING;
+		vm->MarkDebt = 0;
+		MarkRoots();
+
+		RecordPause(start, &vm->Stats.MaxCollectionPause);
+		return;
+	}
+
+
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+	vm->MarkDebt += allocated * GC_MARK_RATE;
+
+	// Without a pause budget, all of the marking gets done in this one step.
+	if (vm->PauseBudget <= 0)
+		TraceReferences();
+
+	int scanned = 0;
+	while (vm->GrayCount > 0 && vm->MarkDebt > 0)
+	{
+		size_t work = BlackenObject(vm->GrayStack[--vm->GrayCount]);
+		vm->MarkDebt = work < vm->MarkDebt ? vm->MarkDebt - work : 0;
+
+		// Checking the clock isn't free, so only do it every so often.
+		if (vm->PauseBudget > 0 && ++scanned % GC_BUDGET_CHECK_INTERVAL == 0)
+		{
+			std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+			if (elapsed.count() >= vm->PauseBudget)
+				break;
+		}
+	}
+
+
+	// If the budget has already been used up, the end of the collection is left for the next step.
+	std::chrono::duration<double, std::milli> elapsed = std::chrono::steady_clock::now() - start;
+	if (vm->GrayCount == 0 && (vm->PauseBudget <= 0 || elapsed.count() < vm->PauseBudget))
+	{
+		// The stack may have changed since it was marked, so look at it again before sweeping. Without a pause budget, whatever that
+		// turns up gets traced right away. Otherwise the following steps do it, and then the stack gets looked at again.
+		MarkStackRoots();
+		if (vm->PauseBudget <= 0)
+			TraceReferences();
+
+		if (vm->GrayCount == 0)
+			FinishCollection();
+	}
+
+	RecordPause(start, &vm->Stats.MaxCollectionPause);
+}
+
+#endif
+
+
+void CollectGarbage()
+{
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+
+#ifdef INCREMENTAL_GC
+	#ifdef CONCURRENT_GC
+	if (vm->Phase == GC_CONCURRENT_MARKING)
+		StopMarkerThread();
+	#endif
+
+	if (vm->Phase == GC_IDLE)
+	{
+	#ifdef DEBUG_LOG_GC
+		fprintf(vm->Out, "-- gc (garbage collector) begin\n");
+	#endif
+
+	#ifdef LAZY_SWEEP
+		FinishSweeping();
+	#endif
+
+		vm->Phase = GC_MARKING;
+	}
+#else
+	#ifdef DEBUG_LOG_GC
+		fprintf(vm->Out, "-- gc (garbage collector) begin\n");
+	#endif
+
+	#ifdef LAZY_SWEEP
+		FinishSweeping();
+	#endif
+#endif
+
+	MarkRoots(); // Find all "reachable" objects in the stack, and in the VM's internal references as well as in compiler ones.
+	TraceReferences(); // Scan through all references contained in the "reachable" objects we just found to find more "reachable" objects.
+	FinishCollection();
+
+	RecordPause(start, &vm->Stats.MaxCollectionPause);
+}
+
+
+void FreeObjects()
+{
+#ifdef CONCURRENT_GC
+	if (vm->Marker != NULL)
+	{
+		// The VM may be getting freed in the middle of a collection, while the marker thread is still reading the heap.
+		if (vm->Marker->Thread.joinable())
+			vm->Marker->Thread.join();
+
+		free(vm->Marker->HandOff);
+		delete vm->Marker;
+	}
+
+	free(vm->SnapshotLog);
+#endif
+
+	Obj* object = vm->Objects;
+
+	while (object != NULL)
+	{
+		Obj* next = object->Next;
+		FreeObject(object);
+		object = next;
+	} // End while
+
+#ifdef SLAB_ALLOCATOR
+	SweepSlabPages(true);
+	FreeSlabHeap(&vm->Slabs);
+#endif
+
+#ifdef GENERATIONAL_GC
+	for (Obj* object = (Obj*)vm->Nursery; (uint8_t*)object < vm->NurseryTop; object = NextYoungObject(object))
+	{
+		FreeObject(object);
+	}
+
+	free(vm->Nursery);
+	free(vm->RememberedSet);
+	free(vm->PromotedStack);
+#endif
 
-	free(vm.GrayStack);
+	free(vm->GrayStack);
 }
@@ -9,6 +9,7 @@
 // cLox includes.
 #include "Common.h"
 #include "Object.h"
+#include "VM.h"
 
 
 
@@ -39,6 +40,92 @@
 		sizeof(type) * (newCount))
 
 
+#ifdef GENERATIONAL_GC
+
+	#ifndef NURSERY_SIZE
+		#define NURSERY_SIZE	(256 * 1024) // The size in bytes of the nursery that new objects get allocated in.
+	#endif
+
+	#define NURSERY_MAX_OBJECT_SIZE	(NURSERY_SIZE / 16) // Objects bigger than this are always allocated in the old generation.
+
+	// Checks if an object lives in the nursery, which makes it part of the young generation.
+	#define IS_YOUNG(object) \
+		((uintptr_t)(object) - (uintptr_t)vm->Nursery < NURSERY_SIZE)
+
+	// The write barrier. This has to be used on an object after storing a reference to another object in it (other than when
+	// the object is first created). If the object is in the old generation, it gets added to the remembered set so the next
+	// minor collection knows it may be pointing at young objects.
+	#define WRITE_BARRIER(object) \
+		do \
+		{ \
+			if (!((Obj*)(object))->IsRemembered && !IS_YOUNG(object)) \
+				RememberObject((Obj*)(object)); \
+		} while (false)
+
+#else
+
+	#define WRITE_BARRIER(object)
+
+#endif
+
+
+#ifdef INCREMENTAL_GC
+
+	#ifndef GC_PAUSE_BUDGET
+		#define GC_PAUSE_BUDGET		0.5 // The default pause budget for a marking step, in milliseconds. See VM::PauseBudget, and Memory.cpp for the pauses it doesn't cover.
+	#endif
+
+	// The incremental collector's write barrier. This has to be used on a value before it gets stored anywhere on the heap. If the
+	// collector is in the middle of marking, the value gets marked (shaded gray), so it can't end up hidden inside an object the
+	// collector has already finished with. This is a Dijkstra style barrier. Stores into tables go through TableSet(), which takes
+	// care of it.
+	#define MARKING_BARRIER(value) \
+		do \
+		{ \
+			if (vm->Phase == GC_MARKING) \
+				MarkValue(value); \
+		} while (false)
+
+#else
+
+	#define MARKING_BARRIER(value)
+
+#endif
+
+
+#ifdef PARALLEL_GC
+
+	#ifndef GC_PARALLEL_THRESHOLD
+		#define GC_PARALLEL_THRESHOLD	(16 * 1024 * 1024) // The default for VM::ParallelMarkThreshold, in bytes.
+	#endif
+
+#endif
+
+
+#ifdef CONCURRENT_GC
+
+	#ifndef GC_SNAPSHOT_HANDOFF
+		#define GC_SNAPSHOT_HANDOFF		256 // How many objects the snapshot log collects before they get handed over to the concurrent marker thread.
+	#endif
+
+	// The concurrent collector's write barrier. This has to be used on an object before any of the references inside it get
+	// changed (other than when the object is first created). While the marker thread is running, it makes sure the references
+	// the object held when the collection started have been looked at before they get overwritten. This is a snapshot at the
+	// beginning barrier. See Memory.cpp.
+	#define SNAPSHOT_BARRIER(object) \
+		do \
+		{ \
+			if (vm->Phase == GC_CONCURRENT_MARKING) \
+				ScanBeforeWrite((Obj*)(object)); \
+		} while (false)
+
+#else
+
+	#define SNAPSHOT_BARRIER(object)
+
+#endif
+
+
 
 
 /// <summary>
@@ -62,11 +149,63 @@
 void* Reallocate(void* pointer, size_t oldSize, size_t newSize);
 
 
+/// <summary>
+/// Allocates the memory for an object in the old generation. The garbage collector may run first, just like it can in
+/// Reallocate(). Small objects get put in a slab page when SLAB_ALLOCATOR is enabled, and everything else gets added to the
+/// VM's linked list of objects.
+/// </summary>
+Obj* AllocateOldObject(size_t size);
+
 void MarkObject(Obj* object);
 void MarkValue(Value value);
 
+bool IsObjectMarked(Obj* object); // Checks if the garbage collector has marked an object. Use this rather than reading Obj::IsMarked, since slab objects keep their mark bits in their page.
+void SetObjectMarked(Obj* object); // Marks an object without putting it on the gray stack. Used for objects that are created black.
+
+#ifdef GENERATIONAL_GC
+	Obj* AllocateYoungObject(size_t size); // Bump allocates an object in the nursery. Returns NULL if the nursery is full, in which case a minor collection gets requested.
+	void RememberObject(Obj* object); // Adds an old generation object to the remembered set. Use the WRITE_BARRIER macro rather than calling this directly.
+
+	Obj* EvacuateObject(Obj* object); // Used by minor collections. If the object is young, it gets copied into the old generation (if it wasn't already), and the copy is returned.
+	Value EvacuateValue(Value value);
+
+	/// <summary>
+	/// Runs a minor collection. Every young object that is still reachable gets copied into the old generation, and then the
+	/// whole nursery is emptied in one go. Since objects move, this can only be called where no C code is holding on to a pointer
+	/// to a young object. The VM does it at the top of its instruction loop when the nursery has filled up.
+	/// </summary>
+	void CollectYoungGeneration();
+#endif
+
+#ifdef COMPACTING_GC
+	/// <summary>
+	/// Runs a compaction. The objects in the emptiest slab pages get moved into the free slots of the fullest ones, every
+	/// reference to them gets updated, and the emptied pages get given back to the system. Like a minor collection, this moves
+	/// objects, so it can only be called where no C code is holding on to a pointer to an object. The VM does it at the top of
+	/// its instruction loop after a full collection has asked for it (see VM::CompactionRequested).
+	/// </summary>
+	void CompactHeap();
+#endif
+
+#ifdef CONCURRENT_GC
+	void ScanBeforeWrite(Obj* object); // Used by SNAPSHOT_BARRIER. Use that rather than calling this directly.
+
+	/// <summary>
+	/// Starts a collection that has been requested (see VM::ConcurrentGCRequested). The roots get marked, and then the rest of the
+	/// marking is handed to the concurrent marker thread. The VM calls this at the top of its instruction loop.
+	/// </summary>
+	void StartConcurrentCollection();
+
+	/// <summary>
+	/// If the concurrent marker thread is running, this waits for it to finish, and then finishes off the collection. The compiler
+	/// calls this before it starts, because it writes into the functions it is building without using the write barriers.
+	/// </summary>
+	void FinishConcurrentMarking();
+#endif
+
 /// <summary>
 /// This function is essentially the brain of the garbage collector. See chapter 26 in the book.
+/// It runs a whole collection right away. If an incremental collection is already running, that one gets finished instead.
 /// </summary>
 void CollectGarbage();
 
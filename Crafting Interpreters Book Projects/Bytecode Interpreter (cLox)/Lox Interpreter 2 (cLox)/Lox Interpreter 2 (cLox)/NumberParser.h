@@ -0,0 +1,34 @@
+// This file contains code for converting Lox number literals into doubles.
+//
+
+#pragma once
+
+// #ifndef cLox_NumberParser_h
+//	#define cLox_NumberParser_h
+
+// cLox includes.
+#include "Common.h"
+
+
+
+
+/// <summary>
+/// Converts a Lox number literal into the closest double, exactly like a correctly rounded strtod() would.
+/// </summary>
+/// <param name="start">The first character of the literal. It does not need to be null terminated.</param>
+/// <param name="length">The number of characters in the literal.</param>
+/// <returns>The value of the number literal.</returns>
+/// <remarks>
+/// Unlike strtod(), this function does not depend on the current locale. Lox number literals always
+/// use a '.' for the decimal point. The literal must already be valid, which the scanner guarantees.
+/// That is, one or more digits, optionally followed by a '.' and one or more digits.
+/// 
+/// Most literals are converted with a single multiplication or division (Clinger's fast path). Literals
+/// that can't be handled that way use the Eisel-Lemire algorithm, which multiplies the digits by a
+/// 128-bit approximation of the matching power of ten. In the rare case where neither can guarantee
+/// the correctly rounded result (literals with more than 19 significant digits that fall right on a
+/// rounding boundary), this falls back to strtod().
+/// </remarks>
+double ParseNumberLiteral(const char* start, int length);
+
+// #endif
@@ -1,7 +1,9 @@
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 
 // cLox includes.
+#include "Hash.h"
 #include "Memory.h"
 #include "Object.h"
 #include "Table.h"
@@ -19,35 +21,103 @@
 
 static Obj* AllocateObject(size_t size, ObjType type)
 {
-	Obj* object = (Obj*)Reallocate(NULL, 0, size);
+#ifdef GENERATIONAL_GC
+	Obj* young = AllocateYoungObject(size);
+	if (young != NULL)
+	{
+		// Young objects aren't kept in the VM's linked list. A minor collection finds them by walking the nursery instead.
+		young->Type = type;
+		young->IsMarked = false;
+		young->IsRemembered = false;
+		young->IsForwarded = false;
+		young->Next = NULL;
+	#ifdef SLAB_ALLOCATOR
+		young->IsInSlab = false;
+	#endif
+	#ifdef CONCURRENT_GC
+		young->ScanState = SCAN_PENDING;
+	#endif
+
+	#ifdef INCREMENTAL_GC
+		// Just like an old object, a young one created while the garbage collector is marking starts out gray.
+		if (vm->Phase == GC_MARKING)
+			MarkObject(young);
+	#endif
+
+	#ifdef DEBUG_LOG_GC
+		fprintf(vm->Out, "%p allocate %zu bytes for young object of type %d\n", (void*)young, size, type);
+	#endif
+
+		return young;
+	}
+
+	// The nursery is full, so this object goes straight into the old generation.
+#endif
+
+	Obj* object = AllocateOldObject(size);
 	
 	object->Type = type;
 	object->IsMarked = false;
-	object->Next = vm.Objects;
 
-	vm.Objects = object;
+#ifdef GENERATIONAL_GC
+	// The caller fills in the new object's fields without using the write barrier, and they may well point to young objects.
+	object->IsRemembered = false;
+	object->IsForwarded = false;
+	RememberObject(object);
+#endif
+
+#ifdef INCREMENTAL_GC
+	// If the garbage collector is in the middle of marking, it has to treat the new object as reachable. So it starts
+	// out gray. Its fields will have been filled in by the time the collector gets around to looking at them.
+	if (vm->Phase == GC_MARKING)
+		MarkObject(object);
+#endif
+
+#ifdef CONCURRENT_GC
+	// If the concurrent marker thread is running, the new object is black right away instead. The marker only looks at objects
+	// that were around when the collection started, so it will never need to look inside this one. See Memory.cpp.
+	object->ScanState = SCAN_PENDING;
+	if (vm->Phase == GC_CONCURRENT_MARKING)
+	{
+		SetObjectMarked(object);
+		object->ScanState = SCAN_DONE;
+	}
+#endif
 
 
 #ifdef DEBUG_LOG_GC
-	printf("%p allocate %zu bytes for object of type %d\n", (void*)object, size, type);	
+	fprintf(vm->Out, "%p allocate %zu bytes for object of type %d\n", (void*)object, size, type);	
 #endif
 
 	return object;
 }
 
 
-static ObjString* AllocateString(char* chars, int length, uint32_t hash)
+ObjString* AllocateString(int length)
 {
-	ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
-	
+	ObjString* string = (ObjString*)AllocateObject(STRING_SIZE(length), OBJ_STRING);
+
 	string->Length = length;
-	string->Chars = chars;
+	string->Hash = 0;
+	string->IsInterned = false;
+	string->Chars[length] = '\0'; // Add a null character on the end of the string.
+
+	return string;
+}
+
+
+/// <summary>
+/// Adds a new string to the VM's string table.
+/// </summary>
+static ObjString* AddInternedString(ObjString* string, uint32_t hash)
+{
 	string->Hash = hash;
+	string->IsInterned = true;
 
 	Push(OBJ_VAL(string));
 	// Intern this new string. See the "String Interning" section of chapter 20 in the book:
 	// https://craftinginterpreters.com/hash-tables.html
-	TableSet(&vm.Strings, string, NIL_VAL);
+	TableSet(&vm->Strings, string, NIL_VAL);
 	Pop();
 	
 	return string;
@@ -126,38 +196,31 @@ ObjFunction* NewFunction()
 	function->Arity = 0;
 	function->UpValueCount = 0;
 	function->Name = NULL;
+	function->Lazy = NULL;
 	InitChunk(&function->Chunk);
 
 	return function;
 }
 
 
-ObjNativeFunction* NewNativeFunction(NativeFn function)
+void FreeLazyFunctionBody(ObjFunction* function)
 {
-	ObjNativeFunction* native = ALLOCATE_OBJ(ObjNativeFunction, OBJ_NATIVE_FUNCTION);
-	native->Function = function;
-	return native;
+	LazyFunctionBody* lazy = function->Lazy;
+	if (lazy == NULL)
+		return;
+
+	FREE_ARRAY(char, lazy->Source, lazy->Length);
+	FREE_ARRAY(ObjString*, lazy->UpValueNames, function->UpValueCount);
+	FREE(LazyFunctionBody, lazy);
+	function->Lazy = NULL;
 }
 
 
-/// <summary>
-/// This function generates hash codes for strings.
-/// The book says we are using a hash function called FNV-1a:
-/// http://www.isthe.com/chongo/tech/comp/fnv/
-/// </summary>
-/// <param name="key">The string to generate a hash code for.</param>
-/// <param name="length">The length of the passed in string.</param>
-/// <returns>The generated hash code.</returns>
-static uint32_t HashString(const char* key, int length)
+ObjNativeFunction* NewNativeFunction(NativeFn function)
 {
-	uint32_t hash = 2166136261u;
-	for (int i = 0; i < length; i++)
-	{
-		hash ^= (uint8_t)key[i];
-		hash *= 16777619;
-	}
-
-	return hash;
+	ObjNativeFunction* native = ALLOCATE_OBJ(ObjNativeFunction, OBJ_NATIVE_FUNCTION);
+	native->Function = function;
+	return native;
 }
 
 
@@ -169,37 +232,140 @@ static uint32_t HashString(const char* key, int length)
 /// <returns></returns>
 ObjString* TakeString(char* chars, int length)
 {
-	uint32_t hash = HashString(chars, length);
+	uint32_t hash = HashString(chars, length, vm->HashSeed);
 
 	// Check if this string has already been interned.
 	// See the "String Interning" section in chapter 20 of the book:
 	// https://craftinginterpreters.com/hash-tables.html
-	ObjString* interned = TableFindString(&vm.Strings, chars, length, hash);
+	ObjString* interned = TableFindString(&vm->Strings, chars, length, hash);
 	if (interned != NULL)
 	{
 		FREE_ARRAY(char, chars, length + 1);
 		return interned;
 	}
 
-	return AllocateString(chars, length, hash);
+	// Strings keep their characters inline, so they still have to be copied into the new string.
+	ObjString* string = AllocateString(length);
+	memcpy(string->Chars, chars, length);
+	FREE_ARRAY(char, chars, length + 1);
+
+	return AddInternedString(string, hash);
 }
 
 
 ObjString* CopyString(const char* chars, int length)
 {
-	uint32_t hash = HashString(chars, length);
+	uint32_t hash = HashString(chars, length, vm->HashSeed);
 
 	// Check if this string has already been interned.
 	// See the "String Interning" section in chapter 20 of the book:
 	// https://craftinginterpreters.com/hash-tables.html
-	ObjString* interned = TableFindString(&vm.Strings, chars, length, hash);
+	ObjString* interned = TableFindString(&vm->Strings, chars, length, hash);
 	if (interned != NULL)
 		return interned;
 
-	char* heapChars = ALLOCATE(char, length + 1);
-	memcpy(heapChars, chars, length);
-	heapChars[length] = '\0'; // Add a null character on the end of the string.
-	return AllocateString(heapChars, length, hash);
+	ObjString* string = AllocateString(length);
+	memcpy(string->Chars, chars, length);
+	return AddInternedString(string, hash);
+}
+
+
+ObjString* FindString(const char* chars, int length)
+{
+	return TableFindString(&vm->Strings, chars, length, HashString(chars, length, vm->HashSeed));
+}
+
+
+/// <summary>
+/// A rope that has already been flattened can stand in for its flattened string, so the new rope doesn't hold on to it.
+/// </summary>
+static Obj* RopeHalf(Obj* string)
+{
+	if (string->Type == OBJ_ROPE && ((ObjRope*)string)->Flat != NULL)
+		return (Obj*)((ObjRope*)string)->Flat;
+
+	return string;
+}
+
+
+ObjRope* NewRope(Obj* left, Obj* right)
+{
+	ObjRope* rope = ALLOCATE_OBJ(ObjRope, OBJ_ROPE);
+	rope->Length = StringLength(left) + StringLength(right);
+	rope->Left = RopeHalf(left);
+	rope->Right = RopeHalf(right);
+	rope->Flat = NULL;
+
+	return rope;
+}
+
+
+/// <summary>
+/// Copies the characters of all the flat strings that make up a rope into the passed in buffer, from left to right.
+/// </summary>
+/// <remarks>
+/// A rope built up in a loop is one long chain of ropes, so this walks the tree with its own stack rather than recursing.
+/// </remarks>
+static void CopyRopeChars(ObjRope* rope, char* destination)
+{
+	Obj** pending = NULL; // The right halves that still have to be copied once their left halves are done.
+	int pendingCount = 0;
+	int pendingCapacity = 0;
+
+	Obj* node = (Obj*)rope;
+	for (;;)
+	{
+		// Go down the left side of the tree, remembering the right halves on the way.
+		while (node->Type == OBJ_ROPE && ((ObjRope*)node)->Flat == NULL)
+		{
+			if (pendingCapacity < pendingCount + 1)
+			{
+				pendingCapacity = GROW_CAPACITY(pendingCapacity);
+				pending = (Obj**)realloc(pending, sizeof(Obj*) * pendingCapacity);
+
+				// Check that memory was allocated successfully. Otherwise, the cLox interpreter exits to the operating system with an error code.
+				if (pending == NULL)
+					exit(1);
+			}
+
+			pending[pendingCount++] = ((ObjRope*)node)->Right;
+			node = ((ObjRope*)node)->Left;
+		}
+
+		ObjString* leaf = node->Type == OBJ_ROPE ? ((ObjRope*)node)->Flat : (ObjString*)node;
+		memcpy(destination, leaf->Chars, leaf->Length);
+		destination += leaf->Length;
+
+		if (pendingCount == 0)
+			break;
+
+		node = pending[--pendingCount];
+	}
+
+	free(pending);
+}
+
+
+ObjString* FlattenRope(ObjRope* rope)
+{
+	if (rope->Flat != NULL)
+		return rope->Flat;
+
+	// The new string gets built right in place, just like in Concatenate() in VM.cpp. The rope is still referenced by the
+	// caller, so none of its pieces can get freed while this allocates. Just like any other string made at runtime, it doesn't
+	// get interned.
+	ObjString* string = AllocateString(rope->Length);
+	CopyRopeChars(rope, string->Chars);
+
+	// Keep the flattened string for next time, and let go of the pieces so the garbage collector can free them.
+	SNAPSHOT_BARRIER(rope);
+	rope->Flat = string;
+	rope->Left = NULL;
+	rope->Right = NULL;
+	WRITE_BARRIER(rope);
+	MARKING_BARRIER(OBJ_VAL(string));
+
+	return string;
 }
 
 
@@ -209,11 +375,11 @@ static void PrintFunction(ObjFunction* function)
 	// in a user-defined function?
 	if (function->Name == NULL)
 	{
-		printf("<script>");
+		fprintf(vm->Out, "<script>");
 		return;
 	}
 
-	printf("<fn %s>", function->Name->Chars);
+	fprintf(vm->Out, "<fn %s>", function->Name->Chars);
 }
 
 
@@ -229,7 +395,7 @@ void PrintObject(Value value)
 		}
 
 		case OBJ_CLASS:
-			printf("%s class", AS_CLASS(value)->Name->Chars);
+			fprintf(vm->Out, "%s class", AS_CLASS(value)->Name->Chars);
 			break;
 
 		case OBJ_CLOSURE:
@@ -245,19 +411,25 @@ void PrintObject(Value value)
 			break;
 
 		case OBJ_INSTANCE:
-			printf("%s instance", AS_INSTANCE(value)->Klass->Name->Chars);
+			fprintf(vm->Out, "%s instance", AS_INSTANCE(value)->Klass->Name->Chars);
 			break;
 
 		case OBJ_NATIVE_FUNCTION:
-			printf("<native fn>");
+			fprintf(vm->Out, "<native fn>");
+			break;
+
+		case OBJ_ROPE:
+			// The VM flattens a rope before a print statement prints it, so this only shows up in the debug output. That can
+			// print a rope before its fields have been filled in, or after its halves have been freed, so this doesn't look at them.
+			fprintf(vm->Out, "<rope of %d characters>", AS_ROPE(value)->Length);
 			break;
 
 		case OBJ_STRING:
-			printf("%s", AS_CSTRING(value));
+			fprintf(vm->Out, "%s", AS_CSTRING(value));
 			break;
 
 		case OBJ_UPVALUE: // See chapter 25 in the book. This case should never run, but is here to keep the compiler happy.
-			printf("upvalue");
+			fprintf(vm->Out, "upvalue");
 			break;
 
 	} // End switch
@@ -26,7 +26,9 @@
 #define IS_FUNCTION(value)			IsObjType(value, OBJ_FUNCTION)
 #define IS_INSTANCE(value)			IsObjType(value, OBJ_INSTANCE)
 #define IS_NATIVE_FUNCTION(value)	IsObjType(value, OBJ_NATIVE_FUNCTION)
+#define IS_ROPE(value)				IsObjType(value, OBJ_ROPE)
 #define IS_STRING(value)			IsObjType(value, OBJ_STRING)
+#define IS_ANY_STRING(value)		(IS_STRING(value) || IS_ROPE(value)) // Checks if a value is a Lox string, whether it is a flat ObjString or a rope.
 
 
 // These macros cast an Obj pointer to another type. See the comments for the Obj struct.
@@ -36,10 +38,20 @@
 #define AS_FUNCTION(value)			((ObjFunction*) AS_OBJ(value))
 #define AS_INSTANCE(value)			((ObjInstance*) AS_OBJ(value))
 #define AS_NATIVE_FUNCTION(value)	(((ObjNativeFunction*) AS_OBJ(value))->Function)
+#define AS_ROPE(value)				((ObjRope*) AS_OBJ(value))
 #define AS_STRING(value)			((ObjString*) AS_OBJ(value))
 #define AS_CSTRING(value)			(((ObjString*) AS_OBJ(value))->Chars)
 
 
+// Gets the size of an ObjString with room for the specified number of characters, plus the null character on the end.
+#define STRING_SIZE(length)			(offsetof(ObjString, Chars) + (length) + 1)
+
+
+#ifndef ROPE_MIN_LENGTH
+	#define ROPE_MIN_LENGTH			64 // Concatenating two strings makes a rope instead of a new string if the result is at least this many characters long.
+#endif
+
+
 
 
 // An enumeration of the object types that can be stored in the Value struct.
@@ -51,11 +63,24 @@ enum ObjType
 	OBJ_FUNCTION, // Represents a user-defined Lox function
 	OBJ_INSTANCE, // Represents an instance of a cLox class.
 	OBJ_NATIVE_FUNCTION, // Represents a native C/C++ function
+	OBJ_ROPE, // Represents a string that was made by concatenating two other strings, and hasn't been flattened yet.
 	OBJ_STRING, // Represents a string.
 	OBJ_UPVALUE, // See chapter 25 in the book.
 };
 
 
+#ifdef CONCURRENT_GC
+// Whether anyone has looked at the references inside an object yet, during the collection that is running. The concurrent
+// marker thread and the program's thread both claim an object before scanning it, so only one of them does. See Memory.cpp.
+enum ScanState
+{
+	SCAN_PENDING, // Nobody has scanned the object yet.
+	SCAN_IN_PROGRESS, // Someone is scanning the object right now.
+	SCAN_DONE, // The object has been scanned (or it was created during the collection, so it doesn't need to be).
+};
+#endif
+
+
 // A basic struct for representing an object in memory.
 //
 // NOTE: A pointer to a more specific type, like ObjString, can be cast to
@@ -68,10 +93,37 @@ struct Obj
 {
 	ObjType Type; // The type of this cLox object.
 	bool IsMarked; // Indicates if the garbage collector has marked this object as "reachable". In other words, the cLox program still has access to it, and therefore it should not be garbage collected. See chapter 26 in the book.
+				   // When SLAB_ALLOCATOR is enabled, this is only used for the big objects that don't go in a slab page. The rest keep their mark bits in their page.
+#ifdef SLAB_ALLOCATOR
+	bool IsInSlab; // Set if this object lives in a slab page. See SlabAllocator.h.
+#endif
+#ifdef GENERATIONAL_GC
+	bool IsRemembered; // Set while this old generation object is in the VM's remembered set, so the write barrier doesn't add it twice.
+	bool IsForwarded; // Set on an object in the nursery once a minor collection has copied it into the old generation. Its Next field then points to the copy.
+#endif
+#ifdef CONCURRENT_GC
+	uint8_t ScanState; // A ScanState value. Tracks whether the concurrent marker thread, or the program's own thread, has looked at the references inside this object yet.
+#endif
 	struct Obj* Next; // The next object in the linked list.
 };
 
 
+// Holds what the compiler needs to compile a function's body later on, when LAZY_COMPILE_FUNCTIONS is enabled in Common.h.
+// The functions the body was declared inside of may be long done compiling by then, so this keeps its own copy of
+// the source code, and the names of the variables the function captures from them.
+struct LazyFunctionBody
+{
+	char* Source; // A copy of the function's source code, from the '(' that starts its parameter list to the '}' that ends its body.
+	int Length; // The length of the source code.
+	int Line; // The line number the source code starts on.
+	uint8_t Type; // The FunctionType of the function (see Compiler.cpp).
+	bool InClass; // Whether the function was declared inside a class.
+	bool HasSuperClass; // Whether that class has a superclass.
+	ObjString** UpValueNames; // The name of the variable each of the function's UpValues captures, in order.
+	bool HadError; // Set once compiling the body has failed, so it isn't attempted again on every call.
+};
+
+
 // A more specialized object struct for representing a Lox function.
 struct ObjFunction
 {
@@ -80,6 +132,7 @@ struct ObjFunction
 	int UpValueCount; // The number of UpValues this function has. See chapter 25 in the book.
 	Chunk Chunk; // Holds the compiled bytecode of the function since we decided not to compile the entire Lox program into a single monolithic bytecode chunk.
 	ObjString* Name; // The function's name.
+	LazyFunctionBody* Lazy; // The function's uncompiled body, or NULL once it has been compiled (or if it wasn't compiled lazily).
 };
 
 
@@ -94,12 +147,41 @@ struct ObjNativeFunction
 
 
 // A more specialized object struct for representing a Lox string in memory.
+//
+// The characters are stored right after the rest of the struct, in the same allocation, rather than in a separate array. So a
+// string only takes one allocation, and getting at its characters doesn't mean following a pointer somewhere else. This is
+// why it's always allocated with STRING_SIZE() rather than sizeof().
+//
+// The strings in the source code get interned by the compiler, since they get used as table keys. But the strings the program
+// makes while it runs (by concatenating, or flattening a rope) are never used as table keys, so they aren't hashed or interned.
+// That means there can be more than one string with the same characters, so ValuesEqual() compares the characters when either
+// string isn't interned.
 struct ObjString
 {
 	Obj Obj; // The cLox Obj struct representing this cLox string.
 	int Length; // The length of this cLox string.
-	char* Chars; // The character array storing this cLox string's raw text.
-	uint32_t Hash; // The hash code for this cLox string.
+	uint32_t Hash; // The hash code for this cLox string. This is only set once the string has been interned.
+	bool IsInterned; // Set if this string is in the VM's string table. Only interned strings can be used as table keys.
+	char Chars[1]; // The string's raw text, followed by a null character. It really has Length + 1 characters in it.
+};
+
+
+// A more specialized object struct that represents the result of concatenating two strings, without copying any characters.
+//
+// Building up a string in a loop would otherwise copy everything built so far on every iteration. A rope just points at the
+// two strings it joins, either of which can be another rope. The characters only get copied once the whole string is needed,
+// which is when it gets compared with ==, or printed. That flattens the rope into a normal ObjString. The rope keeps
+// the flattened string, and lets go of its two halves, so it doesn't get flattened again. See FlattenRope().
+//
+// Ropes are never interned and never used as table keys. Anywhere a string is needed as an ObjString, the rope has to be
+// flattened first.
+struct ObjRope
+{
+	Obj Obj; // The cLox Obj struct representing this rope.
+	int Length; // The total length of the string. This is always at least ROPE_MIN_LENGTH.
+	struct Obj* Left; // The left half of the string. This is either an ObjString or another ObjRope. NULL once the rope has been flattened.
+	struct Obj* Right; // The right half of the string. This is either an ObjString or another ObjRope. NULL once the rope has been flattened.
+	ObjString* Flat; // The flattened string with the rope's characters, or NULL if the rope hasn't been flattened yet. Like any other string made at runtime, it isn't interned.
 };
 
 
@@ -161,10 +243,16 @@ ObjClosure* NewClosure(ObjFunction* function);
 ObjUpValue* NewUpValue(Value* slot);
 
 ObjFunction* NewFunction();
+void FreeLazyFunctionBody(ObjFunction* function);
 ObjNativeFunction* NewNativeFunction(NativeFn function);
 
 ObjString* TakeString(char* chars, int length);
 ObjString* CopyString(const char* chars, int length);
+ObjString* AllocateString(int length); // Allocates a string with room for the specified number of characters, for the caller to fill in. It isn't hashed or interned, so it can't be used as a table key.
+ObjString* FindString(const char* chars, int length); // Returns the interned string with the passed in characters, or NULL if there isn't one. Unlike CopyString(), this never allocates a new string.
+
+ObjRope* NewRope(Obj* left, Obj* right); // Joins two strings (each either an ObjString or an ObjRope) into a rope. They have to be kept somewhere the garbage collector can see them until this returns.
+ObjString* FlattenRope(ObjRope* rope); // Copies a rope's characters into a string, the first time it's called for that rope. The rope has to be kept somewhere the garbage collector can see it.
 
 void PrintObject(Value value);
 
@@ -174,4 +262,13 @@ static inline bool IsObjType(Value value, ObjType type)
 	return IS_OBJ(value) && AS_OBJ(value)->Type == type;
 }
 
+
+/// <summary>
+/// Gets the length of a Lox string, which is either an ObjString or an ObjRope. This never flattens a rope.
+/// </summary>
+static inline int StringLength(Obj* string)
+{
+	return string->Type == OBJ_ROPE ? ((ObjRope*)string)->Length : ((ObjString*)string)->Length;
+}
+
 //#endif
\ No newline at end of file
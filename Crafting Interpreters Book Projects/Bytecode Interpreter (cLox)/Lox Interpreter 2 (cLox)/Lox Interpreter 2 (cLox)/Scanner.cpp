@@ -6,208 +6,393 @@
 #include "Scanner.h"
 
 
+#if defined(SCANNER_SIMD) && defined(__AVX2__)
+	#include <immintrin.h>
 
+	#define SCAN_BLOCK_SIZE 32
+	typedef __m256i ScanBlock;
 
-struct Scanner
+	#define LOAD_BLOCK(address) _mm256_load_si256((const __m256i*)(address))
+	#define BLOCK_EQUALS(block, c) ((uint32_t)_mm256_movemask_epi8(_mm256_cmpeq_epi8((block), _mm256_set1_epi8(c))))
+
+#elif defined(SCANNER_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#include <emmintrin.h>
+
+	#define SCAN_BLOCK_SIZE 16
+	typedef __m128i ScanBlock;
+
+	#define LOAD_BLOCK(address) _mm_load_si128((const __m128i*)(address))
+	#define BLOCK_EQUALS(block, c) ((uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8((block), _mm_set1_epi8(c))))
+
+#endif
+
+
+#if defined(SCAN_BLOCK_SIZE) && defined(_MSC_VER)
+	#include <intrin.h>
+#endif
+
+
+
+
+// Character class flags used by the CharClasses lookup table below.
+#define CHAR_ALPHA 0x01 // a-z, A-Z, and _
+#define CHAR_DIGIT 0x02 // 0-9
+#define CHAR_SPACE 0x04 // Space, tab, and carriage return.
+#define CHAR_NEWLINE 0x08 // Line feed.
+
+
+/// <summary>
+/// Maps every possible character to its character class flags, so the scanner can classify a character
+/// with a single table lookup instead of a chain of comparisons.
+/// </summary>
+static const uint8_t CharClasses[256] =
 {
-	const char* Start; // The start of the lexeme being scanned.
-	const char* Current; // The current character being looked at.
-	int line; // The line number the current lexeme is on in the source code.
+	// 0x00 - 0x0F
+	0, 0, 0, 0, 0, 0, 0, 0, 0, CHAR_SPACE, CHAR_NEWLINE, 0, 0, CHAR_SPACE, 0, 0,
+	// 0x10 - 0x1F
+	0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	// 0x20 - 0x2F (space through /)
+	CHAR_SPACE, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0, 0,
+	// 0x30 - 0x3F (0 through ?)
+	CHAR_DIGIT, CHAR_DIGIT, CHAR_DIGIT, CHAR_DIGIT, CHAR_DIGIT, CHAR_DIGIT, CHAR_DIGIT, CHAR_DIGIT,
+	CHAR_DIGIT, CHAR_DIGIT, 0, 0, 0, 0, 0, 0,
+	// 0x40 - 0x5F (@ through _)
+	0, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA,
+	CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA,
+	CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA,
+	CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, 0, 0, 0, 0, CHAR_ALPHA,
+	// 0x60 - 0x7F (` through DEL)
+	0, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA,
+	CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA,
+	CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA,
+	CHAR_ALPHA, CHAR_ALPHA, CHAR_ALPHA, 0, 0, 0, 0, 0,
+	// 0x80 - 0xFF are all 0.
 };
 
 
+/// <summary>
+/// The kinds of character runs ScanRun() can skip over.
+/// </summary>
+enum ScanRunType
+{
+	SCAN_RUN_WHITESPACE, // Stops at the first character that isn't whitespace or a newline.
+	SCAN_RUN_LINE, // Stops at the next newline, which is how comments end.
+	SCAN_RUN_STRING, // Stops at the next quotation mark, which is how string literals end.
+};
+
 
 
-Scanner scanner;
 
+#ifdef SCAN_BLOCK_SIZE
 
+static inline int CountBits(uint32_t mask)
+{
+#ifdef _MSC_VER
+	mask = mask - ((mask >> 1) & 0x55555555);
+	mask = (mask & 0x33333333) + ((mask >> 2) & 0x33333333);
+	return (int)((((mask + (mask >> 4)) & 0x0F0F0F0F) * 0x01010101) >> 24);
+#else
+	return __builtin_popcount(mask);
+#endif
+}
 
 
-void InitScanner(const char* source)
+static inline int FirstBit(uint32_t mask)
 {
-	scanner.Start = source;
-	scanner.Current = source;
-	scanner.line = 1;
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
 }
 
+#endif
 
-static char Advance()
+
+/// <summary>
+/// Skips over a run of characters one at a time.
+/// </summary>
+/// <param name="current">The character to start at.</param>
+/// <param name="end">One past the last character to look at.</param>
+/// <param name="type">The kind of run to skip. See the ScanRunType enum.</param>
+/// <param name="line">The line counter to add the number of newlines skipped over to.</param>
+/// <returns>The first character that ends the run, or end if it is reached first.</returns>
+static inline const char* ScanRunScalar(const char* current, const char* end, ScanRunType type, int* line)
 {
-	scanner.Current++;
-	return scanner.Current[-1];
+	switch (type)
+	{
+		case SCAN_RUN_WHITESPACE:
+			while (current < end && (CharClasses[(uint8_t)*current] & (CHAR_SPACE | CHAR_NEWLINE)))
+			{
+				if (*current == '\n')
+					(*line)++;
+				current++;
+			}
+			break;
+
+		case SCAN_RUN_LINE:
+			while (current < end && *current != '\n')
+				current++;
+			break;
+
+		case SCAN_RUN_STRING:
+			while (current < end && *current != '"')
+			{
+				if (*current == '\n')
+					(*line)++;
+				current++;
+			}
+			break;
+	}
+
+	return current;
 }
 
 
-static bool IsAtEnd()
+/// <summary>
+/// Skips over a run of characters, a whole block at a time when SIMD instructions are available.
+/// </summary>
+/// <param name="current">The character to start at.</param>
+/// <param name="end">One past the last character of the source code.</param>
+/// <param name="type">The kind of run to skip. See the ScanRunType enum.</param>
+/// <param name="line">The line counter to add the number of newlines skipped over to.</param>
+/// <returns>The first character that ends the run, or end if the end of the source is reached first.</returns>
+/// <remarks>
+/// The SIMD version never reads outside of [current, end). Characters before the first aligned block
+/// are scanned one at a time, then aligned blocks are loaded only while a whole block still fits
+/// before the end of the source, and whatever is left over at the end is scanned one at a time again.
+/// The number of newlines skipped is counted by doing a popcount on the newline mask of each block.
+/// </remarks>
+static const char* ScanRun(const char* current, const char* end, ScanRunType type, int* line)
 {
-	return *scanner.Current == '\0';
+#ifdef SCAN_BLOCK_SIZE
+	const uint32_t allBits = SCAN_BLOCK_SIZE == 32 ? 0xFFFFFFFFu : (1u << SCAN_BLOCK_SIZE) - 1;
+
+	// Scan up to the first aligned block one character at a time.
+	uintptr_t offset = (uintptr_t)current & (SCAN_BLOCK_SIZE - 1);
+	const char* blockStart = current;
+	if (offset != 0)
+	{
+		const char* headEnd = (end - current > (ptrdiff_t)(SCAN_BLOCK_SIZE - offset)) ? current + (SCAN_BLOCK_SIZE - offset) : end;
+		blockStart = ScanRunScalar(current, headEnd, type, line);
+		if (blockStart < headEnd || blockStart == end)
+			return blockStart;
+	}
+
+	while (end - blockStart >= SCAN_BLOCK_SIZE)
+	{
+		ScanBlock block = LOAD_BLOCK(blockStart);
+		uint32_t newlines = BLOCK_EQUALS(block, '\n');
+		uint32_t stops;
+
+		switch (type)
+		{
+			case SCAN_RUN_WHITESPACE:
+				stops = ~(newlines | BLOCK_EQUALS(block, ' ') | BLOCK_EQUALS(block, '\t') | BLOCK_EQUALS(block, '\r')) & allBits;
+				break;
+			case SCAN_RUN_LINE:
+				stops = newlines;
+				break;
+			default: // SCAN_RUN_STRING
+				stops = BLOCK_EQUALS(block, '"');
+				break;
+		}
+
+		if (stops != 0)
+		{
+			int index = FirstBit(stops);
+			*line += CountBits(newlines & ((1u << index) - 1));
+			return blockStart + index;
+		}
+
+		*line += CountBits(newlines);
+		blockStart += SCAN_BLOCK_SIZE;
+	} // end while
+
+	// Scan the partial block left at the end one character at a time.
+	return ScanRunScalar(blockStart, end, type, line);
+
+#else
+	return ScanRunScalar(current, end, type, line);
+#endif
+}
+
+
+
+
+void InitScanner(Scanner* scanner, const char* source, size_t length)
+{
+	scanner->Start = source;
+	scanner->Current = source;
+	scanner->End = source + length;
+	scanner->Line = 1;
+}
+
+
+static char Advance(Scanner* scanner)
+{
+	scanner->Current++;
+	return scanner->Current[-1];
+}
+
+
+static bool IsAtEnd(Scanner* scanner)
+{
+	return scanner->Current >= scanner->End;
 }
 
 
 /// <summary>
 /// Gets the current character without consuming it.
 /// </summary>
-/// <returns>The current character.</returns>
-static char Peek()
+/// <returns>The current character, or '\0' if we are at the end of the source code.</returns>
+static char Peek(Scanner* scanner)
 {
-	return *scanner.Current;
+	if (IsAtEnd(scanner))
+		return '\0';
+
+	return *scanner->Current;
 }
 
 
 /// <summary>
 /// Gets the character after the current one without consuming it.
 /// </summary>
-/// <returns>The character after the current one.</returns>
-static char PeekNext()
+/// <returns>The character after the current one, or '\0' if it is past the end of the source code.</returns>
+static char PeekNext(Scanner* scanner)
 {
-	if (IsAtEnd())
+	if (scanner->End - scanner->Current < 2)
 		return '\0';
 
-	return scanner.Current[1];
+	return scanner->Current[1];
 }
 
 
 static bool IsAlpha(char c)
 {
-	return (c >= 'a' && c <= 'z') ||
-		   (c >= 'A' && c <= 'Z') ||
-			c == '_';
+	return (CharClasses[(uint8_t)c] & CHAR_ALPHA) != 0;
 }
 
 
 static bool IsDigit(char c)
 {
-	return c >= '0' && c <= '9';
+	return (CharClasses[(uint8_t)c] & CHAR_DIGIT) != 0;
+}
+
+
+/// <summary>
+/// Consumes characters as long as they belong to one of the specified character classes.
+/// </summary>
+/// <param name="classes">The CHAR_ flags of the character classes to consume.</param>
+static void SkipClass(Scanner* scanner, uint8_t classes)
+{
+	const char* current = scanner->Current;
+	while (current < scanner->End && (CharClasses[(uint8_t)*current] & classes))
+		current++;
+
+	scanner->Current = current;
 }
 
 
-static Token MakeToken(TokenType type)
+static Token MakeToken(Scanner* scanner, TokenType type)
 {
 	Token token;
 
 	token.Type = type;
-	token.Start = scanner.Start;
-	token.Length = (int)(scanner.Current - scanner.Start);
-	token.Line = scanner.line;
+	token.Start = scanner->Start;
+	token.Length = (int)(scanner->Current - scanner->Start);
+	token.Line = scanner->Line;
 
 	return token;
 }
 
 
-static Token Number()
+static Token Number(Scanner* scanner)
 {
-	while (IsDigit(Peek()))
-		Advance();
+	SkipClass(scanner, CHAR_DIGIT);
 
 	// Look for a fractional part of the number.
-	if (Peek() == '.' && IsDigit(PeekNext()))
+	if (Peek(scanner) == '.' && IsDigit(PeekNext(scanner)))
 	{
 		// Consume the ".".
-		Advance();
+		Advance(scanner);
 
-		while (IsDigit(Peek()))
-			Advance();
+		SkipClass(scanner, CHAR_DIGIT);
 	}
 
-	return MakeToken(TOKEN_NUMBER);
+	return MakeToken(scanner, TOKEN_NUMBER);
 }
 
 
-static bool Match(char expected)
+static bool Match(Scanner* scanner, char expected)
 {
-	if (IsAtEnd())
+	if (IsAtEnd(scanner))
 		return false;
 
-	if (*scanner.Current != expected)
+	if (*scanner->Current != expected)
 		return false;
 
-	scanner.Current++;
+	scanner->Current++;
 	return true;
 }
 
 
-static Token ErrorToken(const char* message)
+static Token ErrorToken(Scanner* scanner, const char* message)
 {
 	Token token;
 
 	token.Type = TOKEN_ERROR;
 	token.Start = message;
 	token.Length = (int)strlen(message);
-	token.Line = scanner.line;
+	token.Line = scanner->Line;
 
 	return token;
 }
 
 
-static void SkipWhiteSpace()
+static void SkipWhiteSpace(Scanner* scanner)
 {
 	for (;;)
 	{
-		char c = Peek();
+		// Skip any spaces, tabs, carriage returns, and newlines.
+		scanner->Current = ScanRun(scanner->Current, scanner->End, SCAN_RUN_WHITESPACE, &scanner->Line);
 
-		switch (c)
+		// Skip comments too.
+		// A double "//" denotes the start of a comment in Lox code.
+		if (Peek(scanner) == '/' && PeekNext(scanner) == '/')
 		{
-			case ' ':
-			case '\r':
-			case '\t':
-				Advance();
-				break;
-
-			case '\n':
-				scanner.line++;
-				Advance();
-				break;
-
-			// Skip comments too.
-			case '/':
-				// Check that the second character is also a '/'.
-				// A double "//" denotes the start of a comment in Lox code.
-				if (PeekNext() == '/')
-				{
-					// A comment goes until the end of a line.
-					while (Peek() != '\n' && !IsAtEnd())
-						Advance();					
-				}
-				else
-				{
-					return;
-				}
-
-				break;
-
-			default:
-				return;
-
-		} // end switch
+			// A comment goes until the end of a line.
+			scanner->Current = ScanRun(scanner->Current + 2, scanner->End, SCAN_RUN_LINE, &scanner->Line);
+		}
+		else
+		{
+			return;
+		}
 
 	} // end for
 }
 
 
-static Token String()
+static Token String(Scanner* scanner)
 {
-	while (Peek() != '"' && !IsAtEnd())
-	{
-		// Watch for newline characters since Lox supports multi-line strings.
-		if (Peek() == '\n')
-			scanner.line++;
-
-		Advance();
-	} // end while
+	// Watch for newline characters since Lox supports multi-line strings. ScanRun() counts them for us.
+	scanner->Current = ScanRun(scanner->Current, scanner->End, SCAN_RUN_STRING, &scanner->Line);
 
-	if (IsAtEnd())
-		return ErrorToken("Unterminated string.");
+	if (IsAtEnd(scanner))
+		return ErrorToken(scanner, "Unterminated string.");
 
 	// The closing quotation mark of the string.
-	Advance();
-	return MakeToken(TOKEN_STRING);
+	Advance(scanner);
+	return MakeToken(scanner, TOKEN_STRING);
 }
 
 
-static TokenType CheckKeyword(int start, int length, const char* rest, TokenType type)
+static TokenType CheckKeyword(Scanner* scanner, int start, int length, const char* rest, TokenType type)
 {
-	if (scanner.Current - scanner.Start == start + length &&
-		memcmp(scanner.Start + start, rest, length) == 0)
+	if (scanner->Current - scanner->Start == start + length &&
+		memcmp(scanner->Start + start, rest, length) == 0)
 	{
 		return type;
 	}
@@ -230,125 +415,124 @@ static TokenType CheckKeyword(int start, int length, const char* rest, TokenType
 /// match the keyword it suspects the token to be, it bails out since it now knows the token
 /// can't be that keyword.
 /// </remarks>
-static TokenType IndentifierType()
+static TokenType IndentifierType(Scanner* scanner)
 {
-	switch (scanner.Start[0]) {
+	switch (scanner->Start[0]) {
 		case 'a':
-			return CheckKeyword(1, 2, "nd", TOKEN_AND);
+			return CheckKeyword(scanner, 1, 2, "nd", TOKEN_AND);
 		case 'c':
-			return CheckKeyword(1, 4, "lass", TOKEN_CLASS);
+			return CheckKeyword(scanner, 1, 4, "lass", TOKEN_CLASS);
 		case 'e':
-			return CheckKeyword(1, 3, "lse", TOKEN_ELSE);
+			return CheckKeyword(scanner, 1, 3, "lse", TOKEN_ELSE);
 		case 'f':
-			if (scanner.Current - scanner.Start > 1) // Check that there is a second character.
+			if (scanner->Current - scanner->Start > 1) // Check that there is a second character.
 			{
-				switch (scanner.Start[1]) {
-					case 'a': return CheckKeyword(2, 3, "lse", TOKEN_FALSE);
-					case 'o': return CheckKeyword(2, 1, "r", TOKEN_FOR);
-					case 'u': return CheckKeyword(2, 1, "n", TOKEN_FUN);
+				switch (scanner->Start[1]) {
+					case 'a': return CheckKeyword(scanner, 2, 3, "lse", TOKEN_FALSE);
+					case 'o': return CheckKeyword(scanner, 2, 1, "r", TOKEN_FOR);
+					case 'u': return CheckKeyword(scanner, 2, 1, "n", TOKEN_FUN);
 				}
 			}
 			break;
 		case 'i':
-			return CheckKeyword(1, 1, "f", TOKEN_IF);
+			return CheckKeyword(scanner, 1, 1, "f", TOKEN_IF);
 		case 'n':
-			return CheckKeyword(1, 2, "il", TOKEN_NIL);
+			return CheckKeyword(scanner, 1, 2, "il", TOKEN_NIL);
 		case 'o':
-			return CheckKeyword(1, 1, "r", TOKEN_OR);
+			return CheckKeyword(scanner, 1, 1, "r", TOKEN_OR);
 		case 'p':
-			return CheckKeyword(1, 4, "rint", TOKEN_PRINT);
+			return CheckKeyword(scanner, 1, 4, "rint", TOKEN_PRINT);
 		case 'r':
-			return CheckKeyword(1, 5, "eturn", TOKEN_RETURN);
+			return CheckKeyword(scanner, 1, 5, "eturn", TOKEN_RETURN);
 		case 's':
-			return CheckKeyword(1, 4, "uper", TOKEN_SUPER);
+			return CheckKeyword(scanner, 1, 4, "uper", TOKEN_SUPER);
 		case 't':
-			if (scanner.Current - scanner.Start > 1) // Check that there is a second character.
+			if (scanner->Current - scanner->Start > 1) // Check that there is a second character.
 			{
-				switch (scanner.Start[1]) {
-					case 'h': return CheckKeyword(2, 2, "is", TOKEN_THIS);
-					case 'r': return CheckKeyword(2, 2, "ue", TOKEN_TRUE);
+				switch (scanner->Start[1]) {
+					case 'h': return CheckKeyword(scanner, 2, 2, "is", TOKEN_THIS);
+					case 'r': return CheckKeyword(scanner, 2, 2, "ue", TOKEN_TRUE);
 				}
 			}
 			break;
 		case 'v':
-			return CheckKeyword(1, 2, "ar", TOKEN_VAR);
+			return CheckKeyword(scanner, 1, 2, "ar", TOKEN_VAR);
 		case 'w':
-			return CheckKeyword(1, 4, "hile", TOKEN_WHILE);
+			return CheckKeyword(scanner, 1, 4, "hile", TOKEN_WHILE);
 	} // end switch
 
 	return TOKEN_IDENTIFIER;
 }
 
 
-static Token Identifier()
+static Token Identifier(Scanner* scanner)
 {
-	while (IsAlpha(Peek()) || IsDigit(Peek()))
-		Advance();
+	SkipClass(scanner, CHAR_ALPHA | CHAR_DIGIT);
 
-	return MakeToken(IndentifierType());
+	return MakeToken(scanner, IndentifierType(scanner));
 }
 
 
-Token ScanToken()
+Token ScanToken(Scanner* scanner)
 {
-	SkipWhiteSpace();
-	scanner.Start = scanner.Current;
+	SkipWhiteSpace(scanner);
+	scanner->Start = scanner->Current;
 
-	if (IsAtEnd())
-		return MakeToken(TOKEN_EOF);
+	if (IsAtEnd(scanner))
+		return MakeToken(scanner, TOKEN_EOF);
 
 
-	char c = Advance();
+	char c = Advance(scanner);
 	if (IsAlpha(c))
-		return Identifier();
+		return Identifier(scanner);
 	if (IsDigit(c))
-		return Number();
+		return Number(scanner);
 
 	switch (c)
 	{
 		// Single-character tokens.
 		case '(':
-			return MakeToken(TOKEN_LEFT_PAREN);
+			return MakeToken(scanner, TOKEN_LEFT_PAREN);
 		case ')':
-			return MakeToken(TOKEN_RIGHT_PAREN);
+			return MakeToken(scanner, TOKEN_RIGHT_PAREN);
 		case '{':
-			return MakeToken(TOKEN_LEFT_BRACE);
+			return MakeToken(scanner, TOKEN_LEFT_BRACE);
 		case '}':
-			return MakeToken(TOKEN_RIGHT_BRACE);
+			return MakeToken(scanner, TOKEN_RIGHT_BRACE);
 		case ';':
-			return MakeToken(TOKEN_SEMICOLON);
+			return MakeToken(scanner, TOKEN_SEMICOLON);
 		case ',':
-			return MakeToken(TOKEN_COMMA);
+			return MakeToken(scanner, TOKEN_COMMA);
 		case '.':
-			return MakeToken(TOKEN_DOT);
+			return MakeToken(scanner, TOKEN_DOT);
 		case '-':
-			return MakeToken(TOKEN_MINUS);
+			return MakeToken(scanner, TOKEN_MINUS);
 		case '+':
-			return MakeToken(TOKEN_PLUS);
+			return MakeToken(scanner, TOKEN_PLUS);
 		case '/':
-			return MakeToken(TOKEN_SLASH);
+			return MakeToken(scanner, TOKEN_SLASH);
 		case '*':
-			return MakeToken(TOKEN_STAR);
+			return MakeToken(scanner, TOKEN_STAR);
 
 
 			// One or two character tokens.
 		case '!':
-			return MakeToken(Match('=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
+			return MakeToken(scanner, Match(scanner, '=') ? TOKEN_BANG_EQUAL : TOKEN_BANG);
 		case '=':
-			return MakeToken(Match('=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
+			return MakeToken(scanner, Match(scanner, '=') ? TOKEN_EQUAL_EQUAL : TOKEN_EQUAL);
 		case '<':
-			return MakeToken(Match('=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
+			return MakeToken(scanner, Match(scanner, '=') ? TOKEN_LESS_EQUAL : TOKEN_LESS);
 		case '>':
-			return MakeToken(Match('=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
+			return MakeToken(scanner, Match(scanner, '=') ? TOKEN_GREATER_EQUAL : TOKEN_GREATER);
 
 
 			// Literals.
 		case '"':
-			return String();
+			return String(scanner);
 
 	} // end switch
 
 
-	return ErrorToken("Unexpected character.");
+	return ErrorToken(scanner, "Unexpected character.");
 }
 
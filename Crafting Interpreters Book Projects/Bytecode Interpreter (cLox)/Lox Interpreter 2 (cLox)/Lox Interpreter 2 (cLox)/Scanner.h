@@ -62,7 +62,22 @@ struct Token
 };
 
 
-void InitScanner(const char* source);
-Token ScanToken();
+/// <summary>
+/// Holds the state of a scanner. Each compilation owns its own scanner, so several
+/// Lox scripts can be scanned at the same time (or one can be scanned while another is paused).
+/// </summary>
+struct Scanner
+{
+	const char* Start; // The start of the lexeme being scanned.
+	const char* Current; // The current character being looked at.
+	const char* End; // One past the last character of the source code. The source doesn't need to be null terminated.
+	int Line; // The line number the current lexeme is on in the source code.
+};
+
+
+
+
+void InitScanner(Scanner* scanner, const char* source, size_t length);
+Token ScanToken(Scanner* scanner);
 
 // #endif
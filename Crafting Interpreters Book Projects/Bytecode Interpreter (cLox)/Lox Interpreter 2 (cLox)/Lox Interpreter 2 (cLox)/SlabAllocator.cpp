@@ -0,0 +1,417 @@
+#include <stdlib.h>
+#include <string.h>
+
+// Pages get mapped straight from the operating system where possible, so releasing one really does give the memory back,
+// rather than leaving it in the C library's heap.
+#if defined(_WIN32)
+	#define WIN32_LEAN_AND_MEAN
+	#include <windows.h>
+
+	#define SLAB_PAGE_VIRTUAL_ALLOC
+#elif defined(__unix__) || defined(__APPLE__)
+	#include <sys/mman.h>
+
+	#define SLAB_PAGE_MMAP
+#endif
+
+// cLox includes.
+#include "SlabAllocator.h"
+
+
+
+
+// The slots in a page start this far into it, so they are aligned to SLAB_GRANULE.
+#define SLAB_HEADER_SIZE	((sizeof(SlabPage) + SLAB_GRANULE - 1) & ~(size_t)(SLAB_GRANULE - 1))
+
+
+
+
+void InitSlabHeap(SlabHeap* heap)
+{
+	heap->Pages = NULL;
+	heap->PageCount = 0;
+	heap->UnsweptCount = 0;
+
+	for (int i = 0; i < SLAB_CLASS_COUNT; i++)
+	{
+		heap->Available[i] = NULL;
+		heap->Unswept[i] = NULL;
+	}
+}
+
+
+/// <summary>
+/// Allocates a block of memory for a page that is aligned to SLAB_PAGE_SIZE.
+/// </summary>
+/// <param name="block">Used to return the block that has to be passed to ReleasePageMemory() later.</param>
+static SlabPage* AllocatePageMemory(void** block)
+{
+#if defined(SLAB_PAGE_VIRTUAL_ALLOC)
+	// Windows hands out address space in 64KB chunks, so this is always aligned to the page size.
+	*block = VirtualAlloc(NULL, SLAB_PAGE_SIZE, MEM_RESERVE | MEM_COMMIT, PAGE_READWRITE);
+#elif defined(SLAB_PAGE_MMAP)
+	// mmap() only lines things up with the system's (much smaller) pages. So map twice as much as we need, and then unmap
+	// the bits either side of the aligned page inside it.
+	uint8_t* mapping = (uint8_t*)mmap(NULL, SLAB_PAGE_SIZE * 2, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	*block = NULL;
+	if (mapping != MAP_FAILED)
+	{
+		uint8_t* page = (uint8_t*)(((uintptr_t)mapping + SLAB_PAGE_SIZE - 1) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1));
+		if (page > mapping)
+			munmap(mapping, page - mapping);
+		if (page + SLAB_PAGE_SIZE < mapping + SLAB_PAGE_SIZE * 2)
+			munmap(page + SLAB_PAGE_SIZE, mapping + SLAB_PAGE_SIZE * 2 - (page + SLAB_PAGE_SIZE));
+
+		*block = page;
+	}
+#elif defined(_MSC_VER)
+	*block = _aligned_malloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+#else
+	*block = aligned_alloc(SLAB_PAGE_SIZE, SLAB_PAGE_SIZE);
+#endif
+
+	// Check that memory was allocated successfully. Otherwise, the cLox interpreter exits to the operating system with an error code.
+	if (*block == NULL)
+		exit(1);
+
+	return (SlabPage*)*block;
+}
+
+
+static void ReleasePageMemory(void* block)
+{
+#if defined(SLAB_PAGE_VIRTUAL_ALLOC)
+	VirtualFree(block, 0, MEM_RELEASE);
+#elif defined(SLAB_PAGE_MMAP)
+	munmap(block, SLAB_PAGE_SIZE);
+#elif defined(_MSC_VER)
+	_aligned_free(block);
+#else
+	free(block);
+#endif
+}
+
+
+/// <summary>
+/// Adds a page to the front of its size class's list of pages with free slots.
+/// </summary>
+static void MakePageAvailable(SlabHeap* heap, SlabPage* page)
+{
+	SlabPage** list = &heap->Available[page->SizeClass];
+
+	page->PreviousAvailable = NULL;
+	page->NextAvailable = *list;
+	if (*list != NULL)
+		(*list)->PreviousAvailable = page;
+
+	*list = page;
+	page->IsAvailable = true;
+}
+
+
+/// <summary>
+/// Takes a page out of its size class's list of pages with free slots.
+/// </summary>
+static void MakePageUnavailable(SlabHeap* heap, SlabPage* page)
+{
+	if (page->PreviousAvailable != NULL)
+		page->PreviousAvailable->NextAvailable = page->NextAvailable;
+	else
+		heap->Available[page->SizeClass] = page->NextAvailable;
+
+	if (page->NextAvailable != NULL)
+		page->NextAvailable->PreviousAvailable = page->PreviousAvailable;
+
+	page->NextAvailable = NULL;
+	page->PreviousAvailable = NULL;
+	page->IsAvailable = false;
+}
+
+
+/// <summary>
+/// Takes a page out of the heap and gives its memory back.
+/// </summary>
+static void ReleasePage(SlabHeap* heap, SlabPage* page)
+{
+	if (page->IsAvailable)
+		MakePageUnavailable(heap, page);
+
+	if (page->Previous != NULL)
+		page->Previous->Next = page->Next;
+	else
+		heap->Pages = page->Next;
+
+	if (page->Next != NULL)
+		page->Next->Previous = page->Previous;
+
+	heap->PageCount--;
+	ReleasePageMemory(page->Block);
+}
+
+
+/// <summary>
+/// Creates a new empty page for the specified size class, and adds it to the heap.
+/// </summary>
+static SlabPage* NewPage(SlabHeap* heap, int sizeClass)
+{
+	void* block;
+	SlabPage* page = AllocatePageMemory(&block);
+
+	page->Block = block;
+	page->SizeClass = sizeClass;
+	page->SlotSize = (sizeClass + 1) * SLAB_GRANULE;
+	page->SlotDivisor = (uint32_t)((((uint64_t)1 << 32) + page->SlotSize - 1) / page->SlotSize);
+	page->SlotCount = (int)((SLAB_PAGE_SIZE - SLAB_HEADER_SIZE) / page->SlotSize);
+	page->LiveCount = 0;
+	page->UnusedIndex = 0;
+	page->FreeSlots = NULL;
+	page->Slots = (uint8_t*)page + SLAB_HEADER_SIZE;
+	page->NextUnswept = NULL;
+	page->NeedsSweep = false;
+	page->IsEvacuating = false;
+	memset(page->Allocated, 0, sizeof(page->Allocated));
+	memset(page->Marked, 0, sizeof(page->Marked));
+
+	page->Previous = NULL;
+	page->Next = heap->Pages;
+	if (heap->Pages != NULL)
+		heap->Pages->Previous = page;
+
+	heap->Pages = page;
+	heap->PageCount++;
+
+	MakePageAvailable(heap, page);
+	return page;
+}
+
+
+void FreeSlabHeap(SlabHeap* heap)
+{
+	SlabPage* page = heap->Pages;
+	while (page != NULL)
+	{
+		SlabPage* next = page->Next;
+		ReleasePageMemory(page->Block);
+		page = next;
+	} // End while
+
+	InitSlabHeap(heap);
+}
+
+
+void* SlabAllocate(SlabHeap* heap, size_t size)
+{
+	int sizeClass = SLAB_SIZE_CLASS(size);
+	if (sizeClass < 0)
+		sizeClass = 0;
+
+	SlabPage* page = heap->Available[sizeClass];
+	if (page == NULL)
+		page = NewPage(heap, sizeClass);
+
+
+	// Reuse a freed slot if there is one. Otherwise take the next slot that has never been used.
+	uint8_t* slot;
+	if (page->FreeSlots != NULL)
+	{
+		slot = (uint8_t*)page->FreeSlots;
+		page->FreeSlots = *(void**)slot;
+	}
+	else
+	{
+		slot = page->Slots + (size_t)page->UnusedIndex * page->SlotSize;
+		page->UnusedIndex++;
+	}
+
+	int index = SlabSlotIndex(page, slot);
+	page->Allocated[index / 64] |= (uint64_t)1 << (index % 64);
+	page->LiveCount++;
+
+	if (page->LiveCount == page->SlotCount)
+		MakePageUnavailable(heap, page);
+
+	return slot;
+}
+
+
+void SlabFree(SlabHeap* heap, void* pointer)
+{
+	SlabPage* page = SLAB_PAGE_OF(pointer);
+
+	int index = SlabSlotIndex(page, pointer);
+	page->Allocated[index / 64] &= ~((uint64_t)1 << (index % 64));
+	page->LiveCount--;
+
+	*(void**)pointer = page->FreeSlots;
+	page->FreeSlots = pointer;
+
+	// A page that is waiting to be swept goes back into the list once the sweep is done with it. A page that is being
+	// evacuated never goes back, since it is about to be released. See PlanSlabCompaction().
+	if (!page->IsAvailable && !page->NeedsSweep && !page->IsEvacuating)
+		MakePageAvailable(heap, page);
+}
+
+
+size_t QueueSlabSweep(SlabHeap* heap)
+{
+	size_t garbage = 0;
+
+	for (SlabPage* page = heap->Pages; page != NULL; page = page->Next)
+	{
+		if (page->IsAvailable)
+			MakePageUnavailable(heap, page);
+
+		page->NeedsSweep = true;
+		page->NextUnswept = heap->Unswept[page->SizeClass];
+		heap->Unswept[page->SizeClass] = page;
+		heap->UnsweptCount++;
+
+		int wordCount = (page->UnusedIndex + 63) / 64;
+		for (int word = 0; word < wordCount; word++)
+		{
+			garbage += (size_t)CountSetBits(page->Allocated[word] & ~page->Marked[word]) * page->SlotSize;
+		}
+	}
+
+	return garbage;
+}
+
+
+SlabPage* TakeUnsweptPage(SlabHeap* heap, int sizeClass)
+{
+	if (sizeClass < 0)
+	{
+		for (int i = 0; i < SLAB_CLASS_COUNT && sizeClass < 0; i++)
+		{
+			if (heap->Unswept[i] != NULL)
+				sizeClass = i;
+		}
+
+		if (sizeClass < 0)
+			return NULL;
+	}
+
+	SlabPage* page = heap->Unswept[sizeClass];
+	if (page == NULL)
+		return NULL;
+
+	heap->Unswept[sizeClass] = page->NextUnswept;
+	heap->UnsweptCount--;
+	page->NextUnswept = NULL;
+	return page;
+}
+
+
+void FinishSlabPageSweep(SlabHeap* heap, SlabPage* page)
+{
+	page->NeedsSweep = false;
+
+	if (page->LiveCount < page->SlotCount)
+		MakePageAvailable(heap, page);
+}
+
+
+void ReleaseEmptySlabPages(SlabHeap* heap)
+{
+	SlabPage* page = heap->Pages;
+	while (page != NULL)
+	{
+		SlabPage* next = page->Next;
+
+		// Keep the page allocations would come from next, so a size class that is in use doesn't keep getting a page and
+		// giving it back.
+		if (page->LiveCount == 0 && !page->NeedsSweep && heap->Available[page->SizeClass] != page)
+			ReleasePage(heap, page);
+
+		page = next;
+	} // End while
+}
+
+
+/// <summary>
+/// Used to sort pages by size class, with the fullest pages of each size class first.
+/// </summary>
+static int CompareForCompaction(const void* a, const void* b)
+{
+	const SlabPage* pageA = *(const SlabPage* const*)a;
+	const SlabPage* pageB = *(const SlabPage* const*)b;
+
+	if (pageA->SizeClass != pageB->SizeClass)
+		return pageA->SizeClass - pageB->SizeClass;
+
+	return pageB->LiveCount - pageA->LiveCount;
+}
+
+
+int PlanSlabCompaction(SlabHeap* heap)
+{
+	if (heap->PageCount == 0)
+		return 0;
+
+	SlabPage** pages = (SlabPage**)malloc(sizeof(SlabPage*) * heap->PageCount);
+
+	// Check that memory was allocated successfully. Otherwise, the cLox interpreter exits to the operating system with an error code.
+	if (pages == NULL)
+		exit(1);
+
+	int count = 0;
+	for (SlabPage* page = heap->Pages; page != NULL; page = page->Next)
+	{
+		pages[count++] = page;
+	}
+
+	qsort(pages, count, sizeof(SlabPage*), CompareForCompaction);
+
+
+	// For each size class, work out how few pages its objects would fit in. Those are filled up from the pages after them,
+	// which are the emptiest ones.
+	int evacuating = 0;
+	int first = 0;
+	while (first < count)
+	{
+		int end = first;
+		int liveCount = 0;
+		while (end < count && pages[end]->SizeClass == pages[first]->SizeClass)
+		{
+			liveCount += pages[end]->LiveCount;
+			end++;
+		}
+
+		int pageCount = end - first;
+		int needed = (liveCount + pages[first]->SlotCount - 1) / pages[first]->SlotCount;
+		int released = pageCount - needed;
+
+		// Moving objects isn't free, so only bother if it gets rid of a good share of the size class's pages.
+		if (released > 0 && released * SLAB_COMPACT_FRACTION >= pageCount)
+		{
+			for (int i = first + needed; i < end; i++)
+			{
+				SlabPage* page = pages[i];
+				if (page->IsAvailable)
+					MakePageUnavailable(heap, page);
+
+				page->IsEvacuating = true;
+				evacuating++;
+			}
+		}
+
+		first = end;
+	} // End while
+
+	free(pages);
+	return evacuating;
+}
+
+
+void ReleaseEvacuatedSlabPages(SlabHeap* heap)
+{
+	SlabPage* page = heap->Pages;
+	while (page != NULL)
+	{
+		SlabPage* next = page->Next;
+		if (page->IsEvacuating)
+			ReleasePage(heap, page);
+
+		page = next;
+	} // End while
+}
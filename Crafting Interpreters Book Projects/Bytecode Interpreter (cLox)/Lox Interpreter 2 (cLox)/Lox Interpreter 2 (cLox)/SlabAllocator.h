@@ -0,0 +1,200 @@
+// This file contains the size class allocator that the objects in the old generation live in.
+//
+
+#pragma once
+
+// #ifndef cLox_SlabAllocator_h
+//	#define cLox_SlabAllocator_h
+
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
+
+// cLox includes.
+#include "Common.h"
+
+
+
+
+#define SLAB_PAGE_SIZE		(64 * 1024) // The size of a slab page in bytes. Pages are aligned to their size, so the page an object lives in can be found from its address.
+#define SLAB_GRANULE		16 // Slot sizes are always a multiple of this many bytes.
+#define SLAB_MAX_SIZE		256 // The biggest allocation that goes in a slab page. Anything bigger gets allocated on its own.
+#define SLAB_CLASS_COUNT	(SLAB_MAX_SIZE / SLAB_GRANULE) // The number of size classes.
+#define SLAB_MAX_SLOTS		(SLAB_PAGE_SIZE / SLAB_GRANULE) // The most slots a page could ever have.
+#define SLAB_COMPACT_FRACTION	4 // A compaction only moves the objects of a size class if it would free up at least 1/this of the size class's pages.
+
+
+// Gets the size of the slot an allocation of the specified size gets put in.
+#define SLAB_SLOT_SIZE(size) \
+	(((size) + SLAB_GRANULE - 1) & ~(size_t)(SLAB_GRANULE - 1))
+
+// Gets the size class an allocation of the specified size goes in.
+#define SLAB_SIZE_CLASS(size)	((int)(SLAB_SLOT_SIZE(size) / SLAB_GRANULE) - 1)
+
+// Checks if an allocation of the specified size goes in a slab page.
+#define FITS_IN_SLAB(size)	((size) <= SLAB_MAX_SIZE)
+
+// Gets the slab page that a slab allocation lives in.
+#define SLAB_PAGE_OF(pointer) \
+	((SlabPage*)((uintptr_t)(pointer) & ~(uintptr_t)(SLAB_PAGE_SIZE - 1)))
+
+
+
+
+/// <summary>
+/// A page of memory that is split up into slots which are all the same size. This header sits at the start of the page,
+/// and the slots come after it.
+/// </summary>
+struct SlabPage
+{
+	SlabPage* Next; // The next page in the heap.
+	SlabPage* Previous; // The previous page in the heap.
+	SlabPage* NextAvailable; // The next page of the same size class that has free slots.
+	SlabPage* PreviousAvailable; // The previous page of the same size class that has free slots.
+	bool IsAvailable; // Whether this page is in its size class's list of pages with free slots.
+	SlabPage* NextUnswept; // The next page of the same size class that is waiting to be swept.
+	bool NeedsSweep; // Set while the page is waiting to be swept. Nothing can be allocated from it until then. See QueueSlabSweep().
+	bool IsEvacuating; // Set while a compaction is moving all of the objects out of this page. Nothing can be allocated from it. See PlanSlabCompaction().
+
+	void* Block; // The memory the page was allocated as. This is what gets passed back to the system when the page is released.
+	int SizeClass; // The size class of the page.
+	int SlotSize; // The size of each slot in bytes.
+	uint32_t SlotDivisor; // 2^32 / SlotSize, rounded up. Lets SlabSlotIndex() turn an address into a slot index with a multiply instead of a divide.
+	int SlotCount; // The number of slots in the page.
+	int LiveCount; // How many of the slots are in use.
+	int UnusedIndex; // The slots from this index onwards have never been used.
+	void* FreeSlots; // Slots that have been freed. They are linked together through their first few bytes.
+	uint8_t* Slots; // Where the first slot starts.
+
+	uint64_t Allocated[SLAB_MAX_SLOTS / 64]; // Has a bit set for each slot that is in use, so the objects in the page can be found without any list.
+	uint64_t Marked[SLAB_MAX_SLOTS / 64]; // The garbage collector's mark bits for the objects in the page. Keeping them out here means marking and
+										  // sweeping don't write to the objects themselves. See Memory.cpp.
+};
+
+
+/// <summary>
+/// Holds all of the slab pages that belong to one VM.
+/// </summary>
+struct SlabHeap
+{
+	SlabPage* Pages; // Every page in the heap.
+	SlabPage* Available[SLAB_CLASS_COUNT]; // For each size class, the pages that still have free slots. The first one is the one allocations come from.
+	SlabPage* Unswept[SLAB_CLASS_COUNT]; // For each size class, the pages that are waiting to be swept.
+	int PageCount; // The number of pages in the heap.
+	int UnsweptCount; // The number of pages that are waiting to be swept.
+};
+
+
+
+
+/// <summary>
+/// Finds the lowest bit that is set in a mask. The mask must not be 0.
+/// </summary>
+static inline int LowestSetBit(uint64_t mask)
+{
+#if defined(_MSC_VER) && defined(_M_X64)
+	unsigned long index;
+	_BitScanForward64(&index, mask);
+	return (int)index;
+#elif defined(_MSC_VER)
+	unsigned long index;
+	if (_BitScanForward(&index, (unsigned long)mask))
+		return (int)index;
+
+	_BitScanForward(&index, (unsigned long)(mask >> 32));
+	return (int)index + 32;
+#else
+	return __builtin_ctzll(mask);
+#endif
+}
+
+
+/// <summary>
+/// Counts the bits that are set in a mask.
+/// </summary>
+static inline int CountSetBits(uint64_t mask)
+{
+#ifdef _MSC_VER
+	// __popcnt64() needs a CPU with the POPCNT instruction, so this just does it by hand.
+	mask = mask - ((mask >> 1) & 0x5555555555555555ULL);
+	mask = (mask & 0x3333333333333333ULL) + ((mask >> 2) & 0x3333333333333333ULL);
+	mask = (mask + (mask >> 4)) & 0x0F0F0F0F0F0F0F0FULL;
+	return (int)((mask * 0x0101010101010101ULL) >> 56);
+#else
+	return __builtin_popcountll(mask);
+#endif
+}
+
+
+/// <summary>
+/// Gets the index of the slot in a page that a slab allocation lives in.
+/// </summary>
+static inline int SlabSlotIndex(SlabPage* page, void* pointer)
+{
+	// The offset is always a whole number of slots, and small enough that rounding the divisor up never changes the result.
+	return (int)(((uint64_t)((uint8_t*)pointer - page->Slots) * page->SlotDivisor) >> 32);
+}
+
+
+void InitSlabHeap(SlabHeap* heap);
+
+/// <summary>
+/// Releases every page in the heap at once. Anything still allocated in them is gone, so the objects in them have to have
+/// freed whatever memory they own first.
+/// </summary>
+void FreeSlabHeap(SlabHeap* heap);
+
+/// <summary>
+/// Allocates a slot. The size must not be bigger than SLAB_MAX_SIZE.
+/// </summary>
+/// <returns>A pointer to the slot, which is aligned to SLAB_GRANULE bytes.</returns>
+void* SlabAllocate(SlabHeap* heap, size_t size);
+
+/// <summary>
+/// Puts a slot back into its page's free list. The page itself is kept around until ReleaseEmptySlabPages() is called.
+/// </summary>
+void SlabFree(SlabHeap* heap, void* pointer);
+
+/// <summary>
+/// Queues every page in the heap up to be swept, which is done lazily a page at a time. Until a page has been swept, its Marked
+/// bitmap still says which of its objects are alive, so nothing can be allocated from it. So each page is taken out of its size
+/// class's list of pages with free slots until it has been swept. See FinishSlabPageSweep().
+/// </summary>
+/// <returns>How many bytes the slots that are in use but weren't marked add up to. The sweep will free these.</returns>
+size_t QueueSlabSweep(SlabHeap* heap);
+
+/// <summary>
+/// Takes a page that is waiting to be swept off of the queue.
+/// </summary>
+/// <param name="sizeClass">The size class to take a page of, or -1 to take a page of any size class.</param>
+/// <returns>The page, or NULL if there are no pages of that size class left to sweep.</returns>
+SlabPage* TakeUnsweptPage(SlabHeap* heap, int sizeClass);
+
+/// <summary>
+/// Called once the dead objects in a page taken from TakeUnsweptPage() have been freed and its mark bits cleared. It makes the
+/// page available for allocations again.
+/// </summary>
+void FinishSlabPageSweep(SlabHeap* heap, SlabPage* page);
+
+/// <summary>
+/// Picks the pages a compaction should move the objects out of. For each size class, the objects would fit into fewer pages if
+/// they were packed together, so the emptiest pages get their objects moved into the free slots of the fullest ones. The chosen
+/// pages get their IsEvacuating flag set, and are taken out of their size class's list of pages with free slots, so new slots
+/// always come from the pages that are being kept. All of the pages must have been swept first.
+/// </summary>
+/// <returns>The number of pages that were picked.</returns>
+int PlanSlabCompaction(SlabHeap* heap);
+
+/// <summary>
+/// Gives the pages picked by PlanSlabCompaction() back to the system, once everything in them has been moved out. The objects
+/// in them don't get freed, since their copies own the same memory now.
+/// </summary>
+void ReleaseEvacuatedSlabPages(SlabHeap* heap);
+
+/// <summary>
+/// Gives every page that has no slots in use back to the system, other than the one each size class would allocate from next.
+/// The garbage collector calls this after a sweep.
+/// </summary>
+void ReleaseEmptySlabPages(SlabHeap* heap);
+
+// #endif
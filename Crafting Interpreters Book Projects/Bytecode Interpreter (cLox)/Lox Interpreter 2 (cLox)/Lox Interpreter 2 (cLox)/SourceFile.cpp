@@ -0,0 +1,160 @@
+// fopen() is standard C, but the Microsoft compiler reports it as deprecated in favor of its own fopen_s().
+#ifdef _MSC_VER
+	#define _CRT_SECURE_NO_WARNINGS
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+
+#if defined(__unix__) || defined(__APPLE__)
+	#include <fcntl.h>
+	#include <sys/mman.h>
+	#include <sys/stat.h>
+	#include <unistd.h>
+
+	#define SOURCE_FILE_MMAP
+#endif
+
+// cLox includes.
+#include "SourceFile.h"
+
+
+
+
+/// <summary>
+/// Reads the rest of an open file into a heap buffer. This works for any kind of stream, including ones
+/// that can't tell us their size up front (like pipes).
+/// </summary>
+/// <returns>True if the file was read, or false if an error occurred.</returns>
+static bool ReadIntoBuffer(const char* path, FILE* stream, SourceFile* file, FILE* err)
+{
+	size_t capacity = 0;
+	size_t length = 0;
+	char* buffer = NULL;
+
+	for (;;)
+	{
+		if (length == capacity)
+		{
+			capacity = capacity < 4096 ? 4096 : capacity * 2;
+
+			char* grown = (char*)realloc(buffer, capacity);
+			if (grown == NULL)
+			{
+				fprintf(err, "Not enough memory to read \"%s\".\n", path);
+				free(buffer);
+				return false;
+			}
+
+			buffer = grown;
+		}
+
+
+		size_t bytesRead = fread(buffer + length, sizeof(char), capacity - length, stream);
+		length += bytesRead;
+
+		if (bytesRead == 0)
+			break;
+	} // end for
+
+
+	if (ferror(stream))
+	{
+		fprintf(err, "Could not read file \"%s\".\n", path);
+		free(buffer);
+		return false;
+	}
+
+
+	file->Text = buffer;
+	file->Length = length;
+	file->IsMapped = false;
+	return true;
+}
+
+
+bool LoadSourceFile(const char* path, SourceFile* file, FILE* err)
+{
+	file->Text = NULL;
+	file->Length = 0;
+	file->IsMapped = false;
+
+#ifdef SOURCE_FILE_MMAP
+	int descriptor = open(path, O_RDONLY);
+	if (descriptor == -1)
+	{
+		fprintf(err, "Could not open file \"%s\".\n", path);
+		return false;
+	}
+
+
+	struct stat info;
+	if (fstat(descriptor, &info) == 0 && S_ISREG(info.st_mode))
+	{
+		// There is nothing to map in an empty file, and mmap() refuses to map zero bytes anyway.
+		if (info.st_size == 0)
+		{
+			close(descriptor);
+			return true;
+		}
+
+
+		void* mapping = mmap(NULL, (size_t)info.st_size, PROT_READ, MAP_PRIVATE, descriptor, 0);
+		if (mapping != MAP_FAILED)
+		{
+			// The scanner reads the file from start to finish, so let the kernel read ahead.
+			madvise(mapping, (size_t)info.st_size, MADV_SEQUENTIAL);
+
+			// The mapping stays valid after the file is closed.
+			close(descriptor);
+
+			file->Text = (const char*)mapping;
+			file->Length = (size_t)info.st_size;
+			file->IsMapped = true;
+			return true;
+		}
+	}
+
+
+	// This isn't a regular file, or it couldn't be mapped, so just read it instead.
+	FILE* stream = fdopen(descriptor, "rb");
+	if (stream == NULL)
+	{
+		close(descriptor);
+		fprintf(err, "Could not open file \"%s\".\n", path);
+		return false;
+	}
+
+#else
+	FILE* stream = fopen(path, "rb");
+	if (stream == NULL)
+	{
+		fprintf(err, "Could not open file \"%s\".\n", path);
+		return false;
+	}
+
+#endif
+
+	bool result = ReadIntoBuffer(path, stream, file, err);
+	fclose(stream);
+	return result;
+}
+
+
+void UnloadSourceFile(SourceFile* file)
+{
+#ifdef SOURCE_FILE_MMAP
+	if (file->IsMapped)
+	{
+		munmap((void*)file->Text, file->Length);
+	}
+	else
+#endif
+	{
+		free((void*)file->Text);
+	}
+
+	file->Text = NULL;
+	file->Length = 0;
+	file->IsMapped = false;
+}
@@ -0,0 +1,50 @@
+// This file contains code for loading Lox script files.
+//
+
+#pragma once
+
+// #ifndef cLox_SourceFile_h
+//	#define cLox_SourceFile_h
+
+#include <stdio.h>
+
+// cLox includes.
+#include "Common.h"
+
+
+
+
+/// <summary>
+/// Holds the contents of a loaded Lox script file.
+/// </summary>
+/// <remarks>
+/// On Linux (and other POSIX systems) regular files are memory mapped read-only, so large scripts
+/// don't have to be copied into a buffer first, and their pages are only read in as the scanner reaches them.
+/// Everywhere else, or when a file can't be mapped (like a pipe), the file is read into a heap buffer instead.
+/// Either way, the text is NOT null terminated. The scanner works on the (Text, Length) range directly.
+/// </remarks>
+struct SourceFile
+{
+	const char* Text; // The contents of the file. This is NULL if the file is empty.
+	size_t Length; // The length of the file in bytes.
+	bool IsMapped; // Whether Text points at a memory mapping of the file, or a heap buffer.
+};
+
+
+
+
+/// <summary>
+/// This function loads in a Lox script file.
+/// </summary>
+/// <param name="path">The file path of the Lox script to load.</param>
+/// <param name="file">The SourceFile struct to load the file into.</param>
+/// <param name="err">The stream to write an error message to if the file can't be loaded.</param>
+/// <returns>True if the file was loaded, or false if it could not be read.</returns>
+bool LoadSourceFile(const char* path, SourceFile* file, FILE* err);
+
+/// <summary>
+/// Releases the memory holding the contents of a loaded Lox script file.
+/// </summary>
+void UnloadSourceFile(SourceFile* file);
+
+// #endif
@@ -8,9 +8,192 @@
 #include "Value.h"
 
 
+#if defined(TABLE_SIMD) && (defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2))
+	#include <emmintrin.h>
+	#define TABLE_SSE2
+#endif
 
+#ifdef _MSC_VER
+	#include <intrin.h>
+#endif
 
-#define TABLE_MAX_LOAD		0.75 // How full a hash table must get before we expand it.
+
+
+
+// How the hash table works.
+//
+// The slots are split up into groups of TABLE_GROUP_SIZE. Each slot has a control byte in a separate array. An empty slot's
+// control byte is CONTROL_EMPTY, and a deleted one's is CONTROL_DELETED. Those both have their top bit set. A slot that is in
+// use has its top bit clear, and the other 7 bits are the lowest 7 bits of its key's hash code (see HASH_FRAGMENT).
+//
+// A lookup uses the rest of the hash code to pick the group to start in. Then it compares the hash fragment it's looking for
+// against all of the group's control bytes at once, which takes a couple of SSE2 instructions. Only the slots that matched
+// need their keys checked, and a wrong match only happens about once in 128 slots. If the group has an empty slot in it,
+// the search is over. Otherwise it moves on to the next group in the probe sequence. That means looking at the 16 bytes of
+// a group's control bytes does the work the book's version needed up to 16 entries (and 16 cache misses into the keys) for.
+// And because a group only needs one empty slot to stop a search, the table can be fuller before it has to grow.
+//
+// The probe sequence goes 1, 2, 3... groups further along each time. When the number of groups is a power of two, that
+// visits every group before it comes back around to the first.
+//
+// Deleted slots get cleared out again without waiting for the table to grow. When there are too many of them, or when the
+// table is about to grow but is mostly deleted slots, the entries get rehashed right where they are (see RehashInPlace()).
+// That doesn't allocate anything, so the garbage collector can do it while it removes dead strings. And a big table that
+// has gotten mostly empty gets shrunk the next time something is added to it.
+
+
+#define TABLE_MAX_LOAD			0.875 // How full a hash table must get (counting deleted slots) before we expand it.
+#define TABLE_REHASH_LOAD		0.75 // When a full table has no more entries than this, it gets rehashed at the same size instead of expanded.
+#define TABLE_MAX_TOMBSTONES	0.25 // How much of a table can be deleted slots before it gets rehashed to clear them out.
+#define TABLE_MIN_LOAD			0.125 // How empty a hash table must get before the next insert shrinks it.
+#define TABLE_SHRINK_MIN		64 // Tables with fewer slots than this never shrink. Small tables are the ones that empty out and fill
+								   // back up all the time (like the local variables of a block in the compiler), and there's little
+								   // memory to get back from them anyway.
+#define TABLE_GROUP_SIZE		16 // The number of slots whose control bytes are checked at once.
+
+#define CONTROL_EMPTY			0x80 // The control byte for a slot that has never been used.
+#define CONTROL_DELETED			0xFE // The control byte for a slot whose entry has been deleted. See TableDelete().
+#define CONTROL_PADDING			0xFF // The control byte past the end of a table with fewer slots than a whole group. Lookups never match it.
+
+// Checks if a control byte belongs to a slot that is in use.
+#define IS_FULL(control)		(((control) & 0x80) == 0)
+
+// Gets the 7 bits of a hash code that go in the control byte.
+#define HASH_FRAGMENT(hash)		((uint8_t)((hash) & 0x7F))
+
+// Gets the part of a hash code that picks the group a lookup starts in.
+#define HASH_GROUP(hash)		((hash) >> 7)
+
+
+
+
+/// <summary>
+/// Finds the lowest bit that is set in a mask. The mask must not be 0.
+/// </summary>
+static inline int LowestBit(uint32_t mask)
+{
+#ifdef _MSC_VER
+	unsigned long index;
+	_BitScanForward(&index, mask);
+	return (int)index;
+#else
+	return __builtin_ctz(mask);
+#endif
+}
+
+
+#ifndef TABLE_SSE2
+
+/// <summary>
+/// Reads 8 control bytes as one number, with the first byte in the lowest 8 bits.
+/// </summary>
+static inline uint64_t ReadControlWord(const uint8_t* control)
+{
+	uint64_t word;
+	memcpy(&word, control, sizeof(word));
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	word = __builtin_bswap64(word);
+#endif
+	return word;
+}
+
+
+/// <summary>
+/// Turns a word that has only the top bit of some of its bytes set into a mask with one bit for each of those bytes. The
+/// multiply moves the top bit of every byte into the top byte of the result.
+/// </summary>
+static inline uint32_t ByteMask(uint64_t highBits)
+{
+	return (uint32_t)(((highBits >> 7) * 0x0102040810204080ULL) >> 56);
+}
+
+
+/// <summary>
+/// Checks 8 control bytes against a value.
+/// </summary>
+static inline uint32_t MatchWord(uint64_t word, uint8_t value)
+{
+	// The bytes that match become 0. Adding 0x7F to the low 7 bits of a byte carries into its top bit unless they are all
+	// 0, so after this, only the bytes that were 0 have their top bit clear. Nothing carries from one byte into the next.
+	uint64_t difference = word ^ (0x0101010101010101ULL * value);
+	uint64_t nonZero = ((difference & 0x7F7F7F7F7F7F7F7FULL) + 0x7F7F7F7F7F7F7F7FULL) | difference;
+	return ByteMask(~nonZero & 0x8080808080808080ULL);
+}
+
+#endif
+
+
+/// <summary>
+/// Checks the control bytes of a group against a value.
+/// </summary>
+/// <returns>A mask with a bit set for each slot in the group whose control byte is equal to the value.</returns>
+static inline uint32_t MatchGroup(const uint8_t* control, uint8_t value)
+{
+#ifdef TABLE_SSE2
+	__m128i group = _mm_loadu_si128((const __m128i*)control);
+	return (uint32_t)_mm_movemask_epi8(_mm_cmpeq_epi8(group, _mm_set1_epi8((char)value)));
+#else
+	// Without SSE2, the group gets checked as two 8-byte words instead.
+	return MatchWord(ReadControlWord(control), value) | (MatchWord(ReadControlWord(control + 8), value) << 8);
+#endif
+}
+
+
+/// <summary>
+/// Finds the slots in a group that aren't in use.
+/// </summary>
+/// <returns>A mask with a bit set for each slot in the group that is empty or deleted.</returns>
+static inline uint32_t MatchGroupFree(const uint8_t* control)
+{
+#ifdef TABLE_SSE2
+	// The free slots are the ones with the top bit of their control byte set, which is exactly what this picks out.
+	return (uint32_t)_mm_movemask_epi8(_mm_loadu_si128((const __m128i*)control));
+#else
+	return ByteMask(ReadControlWord(control) & 0x8080808080808080ULL) |
+		(ByteMask(ReadControlWord(control + 8) & 0x8080808080808080ULL) << 8);
+#endif
+}
+
+
+/// <summary>
+/// Gets the mask that wraps a group number around to the start of the table. A table with fewer slots than a whole group
+/// still has one group, so this is 0 for it.
+/// </summary>
+static inline uint32_t GroupMask(int capacity)
+{
+	return (uint32_t)(capacity - 1) / TABLE_GROUP_SIZE;
+}
+
+
+/// <summary>
+/// Gets the mask of the slots that really exist in each group. In a table with fewer slots than a whole group, the control
+/// bytes past the end of the table are only there so the whole group can be loaded at once. They are CONTROL_PADDING, which
+/// never matches a hash fragment or CONTROL_EMPTY, so only searches for a free slot need this mask.
+/// </summary>
+static inline uint32_t SlotMask(int capacity)
+{
+	return capacity < TABLE_GROUP_SIZE ? (1u << capacity) - 1 : (1u << TABLE_GROUP_SIZE) - 1;
+}
+
+
+/// <summary>
+/// Gets the number of control bytes a table with the specified capacity needs.
+/// </summary>
+static inline int ControlSize(int capacity)
+{
+	return capacity < TABLE_GROUP_SIZE ? TABLE_GROUP_SIZE : capacity;
+}
+
+
+/// <summary>
+/// Gets the size in bytes of the block a table with the specified capacity lives in. The entries and the control bytes share
+/// one allocation, with the control bytes right after the entries. Most tables are the fields of small instances, so this
+/// saves an allocation and a free for every one of them.
+/// </summary>
+static inline size_t TableBlockSize(int capacity)
+{
+	return sizeof(Entry) * capacity + ControlSize(capacity);
+}
 
 
 
@@ -18,14 +201,18 @@
 void InitTable(Table* table)
 {
 	table->Count = 0;
+	table->Tombstones = 0;
 	table->Capacity = 0;
 	table->Entries = NULL;
+	table->Control = NULL;
 }
 
 
 void FreeTable(Table* table)
 {
-	FREE_ARRAY(Entry, table->Entries, table->Capacity);
+	if (table->Entries != NULL)
+		FREE_ARRAY(uint8_t, table->Entries, TableBlockSize(table->Capacity));
+
 	InitTable(table);
 }
 
@@ -33,52 +220,72 @@ void FreeTable(Table* table)
 /// <summary>
 /// Searches for a specified key in the specified hash table.
 /// </summary>
-/// <param name="entries">A pointer to the entries array of the table to search.</param>
-/// <param name="capacity">The capacity of the table being searched.</param>
+/// <param name="table">The table to search. It must have a capacity of at least 1.</param>
 /// <param name="key">The key to search for in the hash table.</param>
-/// <returns>The entry if one was found, or NULL otherwise.</returns>
-static Entry* FindEntry(Entry* entries, int capacity, ObjString* key)
+/// <param name="freeSlot">If this isn't NULL and the key wasn't found, it is used to return the first empty or deleted slot
+/// the search went past. That's where the key would go if it was added now.</param>
+/// <returns>The index of the key's slot if it was found, or -1 otherwise.</returns>
+static inline int FindEntry(Table* table, ObjString* key, int* freeSlot)
 {
-	// This line got replaced with a new one that achieves the same thing using bitmasking.
-	// This optimization was added in chapter 30 of the book, because the modulus operator
-	// is pretty slow.
-	//uint32_t index = key->Hash % capacity;
-	uint32_t index = key->Hash & (capacity - 1);
+	uint32_t groupMask = GroupMask(table->Capacity);
+	uint8_t fragment = HASH_FRAGMENT(key->Hash);
+	int firstFree = -1;
 
+	uint32_t group = HASH_GROUP(key->Hash) & groupMask;
+	for (uint32_t step = 1; ; step++)
+	{
+		const uint8_t* control = table->Control + group * TABLE_GROUP_SIZE;
 
-	Entry* tombstone = NULL;
+		uint32_t matches = MatchGroup(control, fragment);
+		while (matches != 0)
+		{
+			int index = (int)(group * TABLE_GROUP_SIZE) + LowestBit(matches);
+			if (table->Entries[index].Key == key)
+				return index;
 
+			matches &= matches - 1;
+		}
 
-	// This forever loop can't get stuck, because we'll never have a full table.
-	// Our MAX_LOAD_FACTOR constant ensures this.
-	for (;;)
-	{
-		Entry* entry = &entries[index];
-		if (entry->Key == NULL)
+		if (freeSlot != NULL && firstFree < 0)
 		{
-			if (IS_NIL(entry->Value))
-			{
-				// Empty entry.
-				return tombstone != NULL ? tombstone : entry;
-			}
-			else
-			{
-				// We found a tombstone.
-				if (tombstone == NULL)
-					tombstone = entry;
-			}
+			uint32_t free = MatchGroupFree(control) & SlotMask(table->Capacity);
+			if (free != 0)
+				firstFree = (int)(group * TABLE_GROUP_SIZE) + LowestBit(free);
 		}
-		else if (entry->Key == key)
+
+		// If the key had ever gotten this far, it would have gone in the empty slot. The table is never allowed to fill up
+		// (see TABLE_MAX_LOAD), so every search ends up finding an empty slot eventually.
+		if (MatchGroup(control, CONTROL_EMPTY) != 0)
 		{
-			// We found the key.
-			return entry;
+			if (freeSlot != NULL)
+				*freeSlot = firstFree;
+
+			return -1;
 		}
 
-		// This line got replaced with a new one that achieves the same thing using bitmasking.
-		// This optimization was added in chapter 30 of the book, because the modulus operator
-		// is pretty slow.
-		// index = (index + 1) % capacity;
-		index = (index + 1) & (capacity - 1);
+		group = (group + step) & groupMask;
+	} // End for
+}
+
+
+/// <summary>
+/// Finds the slot a new key with the specified hash code should go in. That's the first slot in its probe sequence that
+/// is empty or deleted. The key mustn't be in the table already.
+/// </summary>
+/// <returns>The index of the slot.</returns>
+static int FindFreeSlot(uint8_t* controlBytes, int capacity, uint32_t hash)
+{
+	uint32_t groupMask = GroupMask(capacity);
+	uint32_t slotMask = SlotMask(capacity);
+
+	uint32_t group = HASH_GROUP(hash) & groupMask;
+	for (uint32_t step = 1; ; step++)
+	{
+		uint32_t free = MatchGroupFree(controlBytes + group * TABLE_GROUP_SIZE) & slotMask;
+		if (free != 0)
+			return (int)(group * TABLE_GROUP_SIZE) + LowestBit(free);
+
+		group = (group + step) & groupMask;
 	} // End for
 }
 
@@ -95,11 +302,11 @@ bool TableGet(Table* table, ObjString* key, Value* value)
 	if (table->Count == 0)
 		return false;
 
-	Entry* entry = FindEntry(table->Entries, table->Capacity, key);
-	if (entry->Key == NULL)
+	int index = FindEntry(table, key, NULL);
+	if (index < 0)
 		return false;
 
-	*value = entry->Value;
+	*value = table->Entries[index].Value;
 	return true;
 }
 
@@ -112,45 +319,129 @@ bool TableGet(Table* table, ObjString* key, Value* value)
 static void AdjustCapacity(Table* table, int capacity)
 {
 	// Allocate memory for the table.
-	Entry* entries = ALLOCATE(Entry, capacity);
+	Entry* entries = (Entry*)ALLOCATE(uint8_t, TableBlockSize(capacity));
+	uint8_t* control = (uint8_t*)(entries + capacity);
 
 
-	// Set the newly allocated table to default values.
-	for (int i = 0; i < capacity; i++)
-	{
-		entries[i].Key = NULL;
-		entries[i].Value = NIL_VAL;
-	} // End for
+	// Set the newly allocated table to default values. Only the control bytes need it, since an entry never gets looked
+	// at unless its slot is in use.
+	memset(control, CONTROL_EMPTY, capacity);
+	memset(control + capacity, CONTROL_PADDING, ControlSize(capacity) - capacity);
 
 
 	// Copy entries into the newly allocated memory.
 	// This is needed for when we're expanding an existing table, rather than creating
-	// a new one.
-	table->Count = 0;
+	// a new one. Deleted entries get left behind.
 	for (int i = 0; i < table->Capacity; i++)
 	{
-		Entry* entry = &table->Entries[i];
-		if (entry->Key == NULL)
+		if (!IS_FULL(table->Control[i]))
 			continue;
 
-		// Find the slot where the entry will go in the new expanded table.
-		Entry* dest = FindEntry(entries, capacity, entry->Key);
+		Entry* entry = &table->Entries[i];
 
-		// Copy the entry to that location.
-		dest->Key = entry->Key;
-		dest->Value = entry->Value;
-		table->Count++;
+		// Find the slot where the entry will go in the new expanded table, and copy the entry there.
+		int index = FindFreeSlot(control, capacity, entry->Hash);
+		control[index] = HASH_FRAGMENT(entry->Hash);
+		entries[index] = *entry;
 
 	} // End for
 
 
 	// Free the memory used by the old, smaller table.
-	FREE_ARRAY(Entry, table->Entries, table->Capacity);
+	if (table->Entries != NULL)
+		FREE_ARRAY(uint8_t, table->Entries, TableBlockSize(table->Capacity));
 
 
 	// Set fields of the table struct.
 	table->Entries = entries;
+	table->Control = control;
 	table->Capacity = capacity;
+	table->Tombstones = 0;
+}
+
+
+/// <summary>
+/// Gets rid of all of the deleted slots in a table by putting every entry back where it would go if the table was being
+/// built from scratch. Unlike AdjustCapacity(), this moves the entries around inside the arrays the table already has, so
+/// it never allocates anything.
+/// </summary>
+static void RehashInPlace(Table* table)
+{
+	int capacity = table->Capacity;
+	uint8_t* control = table->Control;
+	Entry* entries = table->Entries;
+
+	// For now, a slot that is in use gets marked as deleted, which means its entry hasn't been put back yet. And the slots
+	// that really were deleted become empty.
+	for (int i = 0; i < capacity; i++)
+	{
+		control[i] = IS_FULL(control[i]) ? CONTROL_DELETED : CONTROL_EMPTY;
+	}
+
+	for (int i = 0; i < capacity; i++)
+	{
+		if (control[i] != CONTROL_DELETED)
+			continue;
+
+		Entry* entry = &entries[i];
+		int index = FindFreeSlot(control, capacity, entry->Hash);
+
+		// A search finds the entry in the first group of its probe sequence that has a free slot. If that's the group it is
+		// already in, it can stay where it is.
+		if (index / TABLE_GROUP_SIZE == i / TABLE_GROUP_SIZE)
+		{
+			control[i] = HASH_FRAGMENT(entry->Hash);
+			continue;
+		}
+
+		if (control[index] == CONTROL_EMPTY)
+		{
+			// Move the entry to its new slot.
+			entries[index] = *entry;
+			control[index] = HASH_FRAGMENT(entry->Hash);
+			control[i] = CONTROL_EMPTY;
+			entry->Key = NULL;
+			entry->Value = NIL_VAL;
+		}
+		else
+		{
+			// The new slot holds an entry that hasn't been put back yet either. So the two entries swap places, and the one
+			// that ended up in this slot gets looked at next.
+			Entry swapped = entries[index];
+			entries[index] = *entry;
+			control[index] = HASH_FRAGMENT(entry->Hash);
+			*entry = swapped;
+			i--;
+		}
+	} // End for
+
+	table->Tombstones = 0;
+}
+
+
+/// <summary>
+/// Gets the capacity a table that has gotten mostly empty should shrink to. It's the smallest one that leaves the table no
+/// more than half full, so it can take some more entries before it has to grow again.
+/// </summary>
+static int ShrunkCapacity(int count)
+{
+	int capacity = GROW_CAPACITY(0);
+	while (count > capacity * TABLE_MAX_LOAD / 2)
+	{
+		capacity *= 2;
+	}
+
+	return capacity;
+}
+
+
+/// <summary>
+/// Rehashes a table in place if too much of it is deleted slots.
+/// </summary>
+static void ClearTombstones(Table* table)
+{
+	if (table->Tombstones > table->Capacity * TABLE_MAX_TOMBSTONES)
+		RehashInPlace(table);
 }
 
 
@@ -165,41 +456,93 @@ static void AdjustCapacity(Table* table, int capacity)
 /// <returns>True if a new entry was added.</returns>
 bool TableSet(Table* table, ObjString* key, Value value)
 {
-	// Expand the hash table if necessary.
-	if (table->Count + 1 > table->Capacity * TABLE_MAX_LOAD)
+	int freeSlot = -1;
+	int index = table->Capacity > 0 ? FindEntry(table, key, &freeSlot) : -1;
+	bool isNewKey = index < 0;
+
+	if (isNewKey)
 	{
-		int capacity = GROW_CAPACITY(table->Capacity);
-		AdjustCapacity(table, capacity);
-	}
+		// Expand the hash table if necessary. Deleted slots count, since they make searches longer just like entries do.
+		// But if it's only the deleted slots that filled it up, clearing those out makes enough room. The search above
+		// already found where the key goes, unless the table gets rebuilt.
+		if (table->Count + table->Tombstones + 1 > table->Capacity * TABLE_MAX_LOAD)
+		{
+			if (table->Count + 1 <= table->Capacity * TABLE_REHASH_LOAD)
+				RehashInPlace(table);
+			else
+				AdjustCapacity(table, GROW_CAPACITY(table->Capacity));
+
+			freeSlot = FindFreeSlot(table->Control, table->Capacity, key->Hash);
+		}
+		else if (table->Capacity >= TABLE_SHRINK_MIN && table->Count < table->Capacity * TABLE_MIN_LOAD)
+		{
+			// Most of the table has been deleted, so it gets shrunk. That waits until something gets added, since the garbage
+			// collector is the one that deletes strings from the string table, and it can't allocate a new one while it does.
+			AdjustCapacity(table, ShrunkCapacity(table->Count + 1));
+			freeSlot = FindFreeSlot(table->Control, table->Capacity, key->Hash);
+		}
+
+		index = freeSlot;
+
+		// The new entry may be going into a deleted slot, rather than a truly empty one.
+		if (table->Control[index] == CONTROL_DELETED)
+			table->Tombstones--;
 
-	Entry* entry = FindEntry(table->Entries, table->Capacity, key);
-	bool isNewKey = entry->Key == NULL;
-	if (isNewKey && IS_NIL(entry->Value)) // Increment table count only if the new item was put into a truly empty slot as opposed to a tombstone slot. See the comments in the TableDelete() implementation for more on this.
+		table->Control[index] = HASH_FRAGMENT(key->Hash);
 		table->Count++;
+	}
 
+	Entry* entry = &table->Entries[index];
 	entry->Key = key;
 	entry->Value = value;
+	entry->Hash = key->Hash;
+
+	// The table may belong to an object the incremental garbage collector has already finished marking.
+	MARKING_BARRIER(OBJ_VAL(key));
+	MARKING_BARRIER(value);
 
 	return isNewKey;
 }
 
 
+/// <summary>
+/// Removes the entry in a slot that is in use.
+/// </summary>
+static void DeleteSlot(Table* table, int index)
+{
+	// If the slot's group still has an empty slot in it, every search that gets to this group stops here. So nothing can
+	// be relying on this slot to keep going, and it can just be made empty again. Otherwise, it has to be marked as deleted.
+	// This is the tombstone from the "Deleting Entries" section in Chapter 20 of the book:
+	// https://craftinginterpreters.com/hash-tables.html
+	const uint8_t* group = table->Control + (index - index % TABLE_GROUP_SIZE);
+	if (MatchGroup(group, CONTROL_EMPTY) != 0)
+	{
+		table->Control[index] = CONTROL_EMPTY;
+	}
+	else
+	{
+		table->Control[index] = CONTROL_DELETED;
+		table->Tombstones++;
+	}
+
+	table->Entries[index].Key = NULL;
+	table->Entries[index].Value = NIL_VAL;
+	table->Count--;
+}
+
+
 bool TableDelete(Table* table, ObjString* key)
 {
 	if (table->Count == 0)
 		return false;
 
 	// Find the entry;
-	Entry* entry = FindEntry(table->Entries, table->Capacity, key);
-	if (entry->Key == NULL)
+	int index = FindEntry(table, key, NULL);
+	if (index < 0)
 		return false;
 
-	// Place a tombstone in the slot of the deleted entry.
-	// This is necessary to stop the removal of the item from breaking the hash table.
-	// See the "Deleting Entries" section in Chapter 20 of the book for more:
-	// https://craftinginterpreters.com/hash-tables.html
-	entry->Key = NULL;
-	entry->Value = BOOL_VAL(true);
+	DeleteSlot(table, index);
+	ClearTombstones(table);
 	return true;
 }
 
@@ -213,9 +556,9 @@ void TableAddAll(Table* from, Table* to)
 {
 	for (int i = 0; i < from->Capacity; i++)
 	{
-		Entry* entry = &from->Entries[i];
-		if (entry->Key != NULL)
+		if (IS_FULL(from->Control[i]))
 		{
+			Entry* entry = &from->Entries[i];
 			TableSet(to, entry->Key, entry->Value);
 		}
 	} // End for
@@ -238,36 +581,37 @@ ObjString* TableFindString(Table* table, const char* chars, int length, uint32_t
 {
 	if (table->Count == 0)
 		return NULL;
-		
-	// This line got replaced with a new one that achieves the same thing using bitmasking.
-	// This optimization was added in chapter 30 of the book, because the modulus operator
-	// is pretty slow.
-	// uint32_t index = hash % table->Capacity;
-	uint32_t index = hash & (table->Capacity - 1);
-
-	for (;;)
+
+	uint32_t groupMask = GroupMask(table->Capacity);
+	uint8_t fragment = HASH_FRAGMENT(hash);
+
+	uint32_t group = HASH_GROUP(hash) & groupMask;
+	for (uint32_t step = 1; ; step++)
 	{
-		Entry* entry = &table->Entries[index];
-		if (entry->Key == NULL)
-		{
-			// Stop if we find an empty non-tombstone entry. See the comments in the TableDelete() implementation for more.
-			if (IS_NIL(entry->Value))
-				return NULL;
-		}
-		else if (entry->Key->Length == length &&
-			entry->Key->Hash == hash &&
-			memcmp(entry->Key->Chars, chars, length) == 0)
+		const uint8_t* control = table->Control + group * TABLE_GROUP_SIZE;
+
+		uint32_t matches = MatchGroup(control, fragment);
+		while (matches != 0)
 		{
-			// We found it.
-			return entry->Key;
+			// The whole hash code gets checked before the key is, since reading the key means a trip out to wherever the
+			// string lives in memory.
+			Entry* entry = &table->Entries[group * TABLE_GROUP_SIZE + LowestBit(matches)];
+			if (entry->Hash == hash &&
+				entry->Key->Length == length &&
+				memcmp(entry->Key->Chars, chars, length) == 0)
+			{
+				// We found it.
+				return entry->Key;
+			}
+
+			matches &= matches - 1;
 		}
 
-		// This line got replaced with a new one that achieves the same thing using bitmasking.
-		// This optimization was added in chapter 30 of the book, because the modulus operator
-		// is pretty slow.
-		// index = (index + 1) % table->Capacity;
-		index = (index + 1) & (table->Capacity - 1);
+		// Stop if the group has an empty slot in it. See FindEntry().
+		if (MatchGroup(control, CONTROL_EMPTY) != 0)
+			return NULL;
 
+		group = (group + step) & groupMask;
 	} // End for
 }
 
@@ -276,12 +620,25 @@ void TableRemoveWhite(Table* table)
 {
 	for (int i = 0; i < table->Capacity; i++)
 	{
+		if (!IS_FULL(table->Control[i]))
+			continue;
+
 		Entry* entry = &table->Entries[i];
-		if (entry->Key != NULL && !entry->Key->Obj.IsMarked)
+#ifdef GENERATIONAL_GC
+		// Young strings are left to the minor collections.
+		if (IS_YOUNG(entry->Key))
+			continue;
+#endif
+
+		if (!IsObjectMarked(&entry->Key->Obj))
 		{
-			TableDelete(table, entry->Key);
+			DeleteSlot(table, i);
 		}
 	}
+
+	// The collector can't allocate a smaller table here, but it can get rid of the deleted slots. The table gets shrunk the
+	// next time a string is added to it.
+	ClearTombstones(table);
 }
 
 
@@ -289,8 +646,54 @@ void MarkTable(Table* table)
 {
 	for (int i = 0; i < table->Capacity; i++)
 	{
+		if (!IS_FULL(table->Control[i]))
+			continue;
+
 		Entry* entry = &table->Entries[i];
 		MarkObject((Obj*)entry->Key);
 		MarkValue(entry->Value);
 	}
-}
\ No newline at end of file
+}
+
+#ifdef GENERATIONAL_GC
+
+void EvacuateTable(Table* table)
+{
+	for (int i = 0; i < table->Capacity; i++)
+	{
+		if (!IS_FULL(table->Control[i]))
+			continue;
+
+		Entry* entry = &table->Entries[i];
+		entry->Key = (ObjString*)EvacuateObject((Obj*)entry->Key);
+		entry->Value = EvacuateValue(entry->Value);
+	}
+}
+
+
+void TableRemoveYoung(Table* table)
+{
+	for (int i = 0; i < table->Capacity; i++)
+	{
+		if (!IS_FULL(table->Control[i]))
+			continue;
+
+		Entry* entry = &table->Entries[i];
+		if (!IS_YOUNG(entry->Key))
+			continue;
+
+		// A string that survived has the same hash in its new home, so it can stay in the same entry.
+		if (entry->Key->Obj.IsForwarded)
+		{
+			entry->Key = (ObjString*)entry->Key->Obj.Next;
+		}
+		else
+		{
+			DeleteSlot(table, i);
+		}
+	}
+
+	ClearTombstones(table);
+}
+
+#endif
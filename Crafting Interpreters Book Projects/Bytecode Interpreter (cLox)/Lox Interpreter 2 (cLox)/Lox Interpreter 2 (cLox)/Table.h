@@ -21,17 +21,26 @@ struct Entry
 {
 	ObjString* Key;
 	Value Value;
+	uint32_t Hash; // A copy of the key's hash code, so searching for a string and growing the table don't have to read the key itself.
 };
 
 
 /// <summary>
 /// This struct stores the data of a hash table.
 /// </summary>
+/// <remarks>
+/// The slots are split up into groups of 16. Each slot has a control byte, which says whether the slot is empty, deleted, or
+/// in use, and if it's in use, holds 7 bits of its key's hash code. The control bytes are kept in their own array, so a lookup
+/// can check a whole group of slots against the hash code it's looking for at once, and only has to look at the entries whose
+/// control bytes matched. See Table.cpp.
+/// </remarks>
 struct Table
 {
 	int Count; // The number of entries in the table.
-	int Capacity; // The max number of entries that can fit in the table.
+	int Tombstones; // The number of slots whose entries have been deleted, but that still have to be skipped over by lookups. See TableDelete().
+	int Capacity; // The number of slots in the table. This is always a power of two.
 	Entry* Entries; // The table entries.
+	uint8_t* Control; // The control byte for each slot. It lives in the same block as the entries, right after them, and always has room for at least one whole group, even if the table has fewer slots than that.
 };
 
 
@@ -49,4 +58,9 @@ ObjString* TableFindString(Table* table, const char* chars, int length, uint32_t
 void TableRemoveWhite(Table* table); // Used by the cLox garbage collector. See chapter 26 in the book.
 void MarkTable(Table* table); // Used by the cLox garbage collector. See chapter 26 in the book.
 
+#ifdef GENERATIONAL_GC
+	void EvacuateTable(Table* table); // Used by minor collections. Moves every young key and value in the table into the old generation.
+	void TableRemoveYoung(Table* table); // Used by minor collections on the string table. Removes keys that died in the nursery, and updates the ones that were moved.
+#endif
+
 // #endif
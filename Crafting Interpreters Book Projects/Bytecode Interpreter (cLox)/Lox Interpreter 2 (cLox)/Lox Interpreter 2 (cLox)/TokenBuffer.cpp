@@ -0,0 +1,483 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <thread>
+#include <vector>
+
+// cLox includes.
+#include "Memory.h"
+#include "TokenBuffer.h"
+
+
+
+
+#ifndef PARALLEL_LEX_MIN_SIZE
+	#define PARALLEL_LEX_MIN_SIZE (1024 * 1024) // Scripts smaller than this are always lexed on a single thread, even when PARALLEL_LEX is on.
+#endif
+
+#ifndef PARALLEL_LEX_CHUNK_SIZE
+	#define PARALLEL_LEX_CHUNK_SIZE (256 * 1024) // The smallest piece of a script that is worth lexing on its own thread.
+#endif
+
+
+
+
+/// <summary>
+/// Holds one piece of a script that is being lexed in parallel, along with its tokens.
+/// </summary>
+/// <remarks>
+/// Every chunk starts right after a newline, so the only kind of token that can run from one chunk into the
+/// next is a multi-line string literal. Each chunk is lexed assuming it doesn't start in the middle of one.
+/// Line numbers in a chunk's token buffer count from 1 at the start of the chunk.
+/// </remarks>
+struct LexChunk
+{
+	const char* Start; // The first character of the chunk.
+	const char* End; // One past the last character of the chunk.
+	TokenBuffer Tokens; // The tokens found in the chunk.
+	int LineCount; // The number of newlines in the chunk.
+	int LastLine; // The line the last token in the chunk is on, or 1 if it has no tokens.
+
+	bool EndsInString; // Set if a string literal is still open at the end of the chunk, which means the next chunk was lexed with the wrong assumption.
+	const char* StringStart; // Where the open string literal starts.
+	int StringLine; // The line the open string literal starts on.
+};
+
+
+
+
+// The token buffer uses malloc() directly rather than Reallocate(), because it holds no Lox objects and
+// its memory shouldn't count towards (or trigger) garbage collection.
+static void* GrowBuffer(void* pointer, size_t elementSize, int newCapacity)
+{
+	void* result = realloc(pointer, elementSize * newCapacity);
+	if (result == NULL)
+		exit(1);
+
+	return result;
+}
+
+
+
+
+void InitTokenBuffer(TokenBuffer* buffer)
+{
+	buffer->Source = NULL;
+	buffer->Types = NULL;
+	buffer->Offsets = NULL;
+	buffer->Lengths = NULL;
+	buffer->LineDeltas = NULL;
+	buffer->Count = 0;
+	buffer->Capacity = 0;
+	buffer->ErrorMessages = NULL;
+	buffer->ErrorCount = 0;
+	buffer->ErrorCapacity = 0;
+}
+
+
+void FreeTokenBuffer(TokenBuffer* buffer)
+{
+	free(buffer->Types);
+	free(buffer->Offsets);
+	free(buffer->Lengths);
+	free(buffer->LineDeltas);
+	free((void*)buffer->ErrorMessages);
+
+	InitTokenBuffer(buffer);
+}
+
+
+/// <summary>
+/// Makes sure the token arrays have room for at least the specified number of tokens.
+/// </summary>
+static void ReserveTokens(TokenBuffer* buffer, int capacity)
+{
+	if (buffer->Capacity >= capacity)
+		return;
+
+	buffer->Capacity = capacity;
+	buffer->Types = (uint8_t*)GrowBuffer(buffer->Types, sizeof(uint8_t), capacity);
+	buffer->Offsets = (uint32_t*)GrowBuffer(buffer->Offsets, sizeof(uint32_t), capacity);
+	buffer->Lengths = (uint32_t*)GrowBuffer(buffer->Lengths, sizeof(uint32_t), capacity);
+	buffer->LineDeltas = (uint32_t*)GrowBuffer(buffer->LineDeltas, sizeof(uint32_t), capacity);
+}
+
+
+void AppendToken(TokenBuffer* buffer, Token* token, int previousLine)
+{
+	if (buffer->Capacity < buffer->Count + 1)
+		ReserveTokens(buffer, GROW_CAPACITY(buffer->Capacity));
+
+
+	int index = buffer->Count++;
+	buffer->Types[index] = (uint8_t)token->Type;
+	buffer->Lengths[index] = (uint32_t)token->Length;
+	buffer->LineDeltas[index] = (uint32_t)(token->Line - previousLine);
+
+	if (token->Type == TOKEN_ERROR)
+	{
+		// Error tokens point at a message instead of into the source code, so keep the message to the side.
+		if (buffer->ErrorCapacity < buffer->ErrorCount + 1)
+		{
+			buffer->ErrorCapacity = GROW_CAPACITY(buffer->ErrorCapacity);
+			buffer->ErrorMessages = (const char**)GrowBuffer((void*)buffer->ErrorMessages, sizeof(const char*), buffer->ErrorCapacity);
+		}
+
+		buffer->Offsets[index] = (uint32_t)buffer->ErrorCount;
+		buffer->ErrorMessages[buffer->ErrorCount++] = token->Start;
+	}
+	else
+	{
+		buffer->Offsets[index] = (uint32_t)(token->Start - buffer->Source);
+	}
+}
+
+
+/// <summary>
+/// Lexes a single chunk of a script. This runs on a worker thread.
+/// </summary>
+/// <param name="source">The start of the whole script. Token offsets are relative to this.</param>
+static void TokenizeChunk(LexChunk* chunk, const char* source)
+{
+	InitTokenBuffer(&chunk->Tokens);
+	chunk->Tokens.Source = source;
+	chunk->EndsInString = false;
+	chunk->StringStart = NULL;
+	chunk->StringLine = 0;
+
+	size_t length = chunk->End - chunk->Start;
+	ReserveTokens(&chunk->Tokens, (int)(length / 4) + 8);
+
+	Scanner scanner;
+	InitScanner(&scanner, chunk->Start, length);
+
+	int line = 1;
+	for (;;)
+	{
+		Token token = ScanToken(&scanner);
+		if (token.Type == TOKEN_EOF)
+			break;
+
+
+		// A string literal that runs off the end of the chunk. It probably continues in the next chunk,
+		// so leave it for the fix-up pass rather than reporting it as unterminated.
+		if (token.Type == TOKEN_ERROR && *scanner.Start == '"' && scanner.Current == chunk->End)
+		{
+			chunk->EndsInString = true;
+			chunk->StringStart = scanner.Start;
+
+			// The error token is on the line where the string ran out, so count back to where it started.
+			chunk->StringLine = token.Line;
+			for (const char* c = scanner.Start; c < chunk->End; c++)
+			{
+				if (*c == '\n')
+					chunk->StringLine--;
+			}
+
+			break;
+		}
+
+
+		AppendToken(&chunk->Tokens, &token, line);
+		line = token.Line;
+	} // end for
+
+	chunk->LastLine = line;
+	chunk->LineCount = scanner.Line - 1;
+}
+
+
+/// <summary>
+/// Copies all of a chunk's tokens onto the end of the token buffer.
+/// </summary>
+/// <param name="chunkLine">The line number the chunk starts on in the whole script.</param>
+/// <param name="lastLine">The line of the last token in the buffer. This gets updated to the line of the chunk's last token.</param>
+static void AppendChunk(TokenBuffer* buffer, LexChunk* chunk, int chunkLine, int* lastLine)
+{
+	TokenBuffer* tokens = &chunk->Tokens;
+	if (tokens->Count == 0)
+		return;
+
+	if (buffer->Capacity < buffer->Count + tokens->Count)
+		ReserveTokens(buffer, buffer->Count + tokens->Count + 1);
+
+
+	int first = buffer->Count;
+	memcpy(buffer->Types + first, tokens->Types, tokens->Count * sizeof(uint8_t));
+	memcpy(buffer->Offsets + first, tokens->Offsets, tokens->Count * sizeof(uint32_t));
+	memcpy(buffer->Lengths + first, tokens->Lengths, tokens->Count * sizeof(uint32_t));
+	memcpy(buffer->LineDeltas + first, tokens->LineDeltas, tokens->Count * sizeof(uint32_t));
+	buffer->Count += tokens->Count;
+
+	// Only the first token's line delta changes, since it is now relative to the last token of the previous chunk.
+	buffer->LineDeltas[first] = (uint32_t)(chunkLine + (int)tokens->LineDeltas[0] - *lastLine);
+	*lastLine = chunkLine + chunk->LastLine - 1;
+
+
+	// Move the chunk's error messages over too, and point its error tokens at their new spot.
+	if (tokens->ErrorCount > 0)
+	{
+		for (int i = first; i < buffer->Count; i++)
+		{
+			if (buffer->Types[i] == TOKEN_ERROR)
+				buffer->Offsets[i] += (uint32_t)buffer->ErrorCount;
+		}
+
+		for (int i = 0; i < tokens->ErrorCount; i++)
+		{
+			if (buffer->ErrorCapacity < buffer->ErrorCount + 1)
+			{
+				buffer->ErrorCapacity = GROW_CAPACITY(buffer->ErrorCapacity);
+				buffer->ErrorMessages = (const char**)GrowBuffer((void*)buffer->ErrorMessages, sizeof(const char*), buffer->ErrorCapacity);
+			}
+
+			buffer->ErrorMessages[buffer->ErrorCount++] = tokens->ErrorMessages[i];
+		}
+	}
+}
+
+
+/// <remarks>
+/// The script is split into chunks at newlines, and the chunks' tokens are stitched back together in order.
+/// Each chunk is lexed assuming it doesn't start inside a string literal. That assumption is only wrong when
+/// the previous chunk ends with a string literal still open. In that case the fix-up pass lexes the script
+/// normally from the start of that string literal, until it reaches the start of a later chunk without a token
+/// running across it. From there on, that chunk's tokens are known to be right and are used as they are.
+/// </remarks>
+int TokenizeInParallel(TokenBuffer* buffer, const char* source, size_t length, int workerCount)
+{
+	buffer->Source = source;
+	const char* sourceEnd = source + length;
+	int fixUpCount = 0;
+
+
+	// Split the script up into roughly equal chunks that each start at the beginning of a line.
+	std::vector<LexChunk> chunks;
+	const char* chunkStart = source;
+	for (int i = 1; i <= workerCount && chunkStart < sourceEnd; i++)
+	{
+		const char* chunkEnd = i == workerCount ? sourceEnd : source + (length / workerCount) * i;
+		if (chunkEnd < chunkStart)
+			chunkEnd = chunkStart;
+
+		if (chunkEnd < sourceEnd)
+		{
+			const char* newline = (const char*)memchr(chunkEnd, '\n', sourceEnd - chunkEnd);
+			chunkEnd = newline == NULL ? sourceEnd : newline + 1;
+		}
+
+		LexChunk chunk;
+		chunk.Start = chunkStart;
+		chunk.End = chunkEnd;
+		chunks.push_back(chunk);
+
+		chunkStart = chunkEnd;
+	}
+
+	int chunkCount = (int)chunks.size();
+
+
+	// Lex the first chunk on this thread while the worker threads do the rest.
+	std::vector<std::thread> workers;
+	for (int i = 1; i < chunkCount; i++)
+	{
+		workers.emplace_back(TokenizeChunk, &chunks[i], source);
+	}
+
+	TokenizeChunk(&chunks[0], source);
+
+	for (size_t i = 0; i < workers.size(); i++)
+	{
+		workers[i].join();
+	}
+
+
+	// Work out which line each chunk starts on. The newline count of a chunk is right even if it was lexed with the
+	// wrong assumption, since the scanner counts every newline whether it is inside a string literal or not.
+	std::vector<int> chunkLines(chunkCount + 1);
+	int totalTokens = 0;
+	chunkLines[0] = 1;
+	for (int i = 0; i < chunkCount; i++)
+	{
+		chunkLines[i + 1] = chunkLines[i] + chunks[i].LineCount;
+		totalTokens += chunks[i].Tokens.Count;
+	}
+
+	ReserveTokens(buffer, totalTokens + 1);
+
+
+	// Stitch the chunks together.
+	int lastLine = 1;
+	bool reachedEnd = false;
+	int i = 0;
+	while (i < chunkCount && !reachedEnd)
+	{
+		LexChunk* chunk = &chunks[i];
+		AppendChunk(buffer, chunk, chunkLines[i], &lastLine);
+
+		if (!chunk->EndsInString)
+		{
+			i++;
+			continue;
+		}
+
+
+		// The fix-up pass. The string literal at the end of this chunk continues into the next one, so lex from
+		// the start of it until we are back in step with the start of a later chunk.
+		fixUpCount++;
+		Scanner scanner;
+		InitScanner(&scanner, chunk->StringStart, sourceEnd - chunk->StringStart);
+		scanner.Line = chunkLines[i] + chunk->StringLine - 1;
+
+		const char* previousEnd = chunk->StringStart;
+		int next = i + 1;
+		bool inStep = false;
+
+		for (;;)
+		{
+			Token token = ScanToken(&scanner);
+
+			// Check if this token starts at or past the start of the next chunk. If the previous token also ended
+			// before the start of that chunk, then no token runs across it, and the chunk's tokens are right.
+			while (next < chunkCount && chunks[next].Start <= scanner.Start)
+			{
+				if (previousEnd <= chunks[next].Start)
+				{
+					inStep = true;
+					break;
+				}
+
+				next++;
+			}
+
+			if (inStep)
+				break;
+
+
+			AppendToken(buffer, &token, lastLine);
+			lastLine = token.Line;
+			previousEnd = scanner.Current;
+
+			if (token.Type == TOKEN_EOF)
+			{
+				reachedEnd = true;
+				break;
+			}
+		} // end for
+
+		i = next;
+	} // end while
+
+
+	if (!reachedEnd)
+	{
+		Token eof;
+		eof.Type = TOKEN_EOF;
+		eof.Start = sourceEnd;
+		eof.Length = 0;
+		eof.Line = chunkLines[chunkCount];
+		AppendToken(buffer, &eof, lastLine);
+	}
+
+
+	for (int c = 0; c < chunkCount; c++)
+	{
+		FreeTokenBuffer(&chunks[c].Tokens);
+	}
+
+	return fixUpCount;
+}
+
+
+void TokenizeOnOneThread(TokenBuffer* buffer, const char* source, size_t length)
+{
+	buffer->Source = source;
+
+	Scanner scanner;
+	InitScanner(&scanner, source, length);
+
+	// Typical Lox code averages around five characters per token, so this usually avoids growing the arrays at all.
+	ReserveTokens(buffer, (int)(length / 4) + 8);
+
+	int line = 1;
+	for (;;)
+	{
+		Token token = ScanToken(&scanner);
+		AppendToken(buffer, &token, line);
+		line = token.Line;
+
+		if (token.Type == TOKEN_EOF)
+			break;
+	}
+}
+
+
+void TokenizeSource(TokenBuffer* buffer, const char* source, size_t length)
+{
+#ifdef PARALLEL_LEX
+	if (length >= PARALLEL_LEX_MIN_SIZE)
+	{
+		int workerCount = (int)std::thread::hardware_concurrency();
+		if (workerCount > (int)(length / PARALLEL_LEX_CHUNK_SIZE))
+			workerCount = (int)(length / PARALLEL_LEX_CHUNK_SIZE);
+
+		if (workerCount > 1)
+		{
+			TokenizeInParallel(buffer, source, length, workerCount);
+			return;
+		}
+	}
+#endif
+
+	TokenizeOnOneThread(buffer, source, length);
+}
+
+
+
+
+void InitTokenCursor(TokenCursor* cursor, TokenBuffer* buffer)
+{
+	cursor->Buffer = buffer;
+	cursor->Index = 0;
+	cursor->Line = 1;
+}
+
+
+Token NextToken(TokenCursor* cursor)
+{
+	TokenBuffer* buffer = cursor->Buffer;
+	int index = cursor->Index;
+
+	if (index < buffer->Count)
+	{
+		cursor->Line += (int)buffer->LineDeltas[index];
+		cursor->Index++;
+	}
+	else
+	{
+		// Stay on the TOKEN_EOF token at the end.
+		index = buffer->Count - 1;
+	}
+
+	Token token;
+	token.Type = (TokenType)buffer->Types[index];
+	token.Length = (int)buffer->Lengths[index];
+	token.Line = cursor->Line;
+
+	if (token.Type == TOKEN_ERROR)
+		token.Start = buffer->ErrorMessages[buffer->Offsets[index]];
+	else
+		token.Start = buffer->Source + buffer->Offsets[index];
+
+	return token;
+}
+
+
+TokenType PeekTokenType(TokenCursor* cursor, int distance)
+{
+	int index = cursor->Index + distance;
+	if (index >= cursor->Buffer->Count)
+		index = cursor->Buffer->Count - 1;
+
+	return (TokenType)cursor->Buffer->Types[index];
+}
@@ -0,0 +1,101 @@
+// This file contains code for lexing a whole Lox script up front into a compact token buffer.
+//
+
+#pragma once
+
+// #ifndef cLox_TokenBuffer_h
+//	#define cLox_TokenBuffer_h
+
+// cLox includes.
+#include "Common.h"
+#include "Scanner.h"
+
+
+
+
+/// <summary>
+/// Holds every token in a Lox script, stored as a structure of arrays.
+/// </summary>
+/// <remarks>
+/// Normally the compiler asks the scanner for one token at a time, so lexing and code generation are interleaved.
+/// When PRETOKENIZE_SOURCE is defined in Common.h, the whole script is lexed into one of these first instead.
+/// Each token only takes up 13 bytes this way (compared to 24 for a Token struct), and the tokens can be
+/// looked ahead at cheaply. Tokens refer to their lexeme by its offset from the start of the source code,
+/// and their line number is stored as the number of lines since the previous token.
+/// </remarks>
+struct TokenBuffer
+{
+	const char* Source; // The source code the tokens were lexed from.
+
+	uint8_t* Types; // The TokenType of each token.
+	uint32_t* Offsets; // Where each token's lexeme starts in the source code. For error tokens, this is an index into ErrorMessages instead.
+	uint32_t* Lengths; // The length of each token's lexeme.
+	uint32_t* LineDeltas; // How many lines each token is past the previous one. The first token is relative to line 1.
+	int Count; // The number of tokens in the buffer.
+	int Capacity; // The max number of tokens that can fit before the arrays have to grow.
+
+	const char** ErrorMessages; // The messages of the error tokens in the buffer.
+	int ErrorCount; // The number of error messages.
+	int ErrorCapacity; // The max number of error messages that can fit before the array has to grow.
+};
+
+
+/// <summary>
+/// Reads tokens back out of a TokenBuffer in order.
+/// </summary>
+struct TokenCursor
+{
+	TokenBuffer* Buffer; // The tokens being read.
+	int Index; // The index of the next token to read.
+	int Line; // The line number of the most recently read token.
+};
+
+
+
+
+void InitTokenBuffer(TokenBuffer* buffer);
+void FreeTokenBuffer(TokenBuffer* buffer);
+
+/// <summary>
+/// Lexes all of the passed in source code into the token buffer, ending with a TOKEN_EOF token.
+/// When PARALLEL_LEX is defined in Common.h, big scripts are split up and lexed on several threads at once
+/// (see TokenizeInParallel()). Otherwise, this is the same as TokenizeOnOneThread().
+/// </summary>
+/// <param name="source">The Lox source code. It doesn't need to be null terminated.</param>
+/// <param name="length">The length of the source code.</param>
+void TokenizeSource(TokenBuffer* buffer, const char* source, size_t length);
+
+/// <summary>
+/// Lexes all of the passed in source code into the token buffer on the calling thread, ending with a TOKEN_EOF token.
+/// </summary>
+void TokenizeOnOneThread(TokenBuffer* buffer, const char* source, size_t length);
+
+/// <summary>
+/// Lexes all of the passed in source code into the token buffer, split into the specified number of chunks that are
+/// lexed at the same time on separate threads. The tokens come out exactly the same as with TokenizeOnOneThread().
+/// </summary>
+/// <param name="workerCount">How many chunks to split the source code into.</param>
+/// <returns>How many times a string literal ran from one chunk into the next, so the fix-up pass had to lex part of the script again.</returns>
+int TokenizeInParallel(TokenBuffer* buffer, const char* source, size_t length, int workerCount);
+
+/// <summary>
+/// Adds a token to the end of the buffer.
+/// </summary>
+/// <param name="line">The line the previous token in the buffer is on. Used to work out the new token's line delta.</param>
+void AppendToken(TokenBuffer* buffer, Token* token, int previousLine);
+
+
+void InitTokenCursor(TokenCursor* cursor, TokenBuffer* buffer);
+
+/// <summary>
+/// Reads the next token. Once the end of the buffer is reached, this keeps returning the TOKEN_EOF token.
+/// </summary>
+Token NextToken(TokenCursor* cursor);
+
+/// <summary>
+/// Gets the type of an upcoming token without reading it.
+/// </summary>
+/// <param name="distance">How far ahead to look. 0 is the token the next call to NextToken() will return.</param>
+TokenType PeekTokenType(TokenCursor* cursor, int distance);
+
+// #endif
@@ -1,7 +1,10 @@
 #include <stdarg.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
 #include <time.h>
+#include <chrono>
+#include <random>
 
 // cLox includes.
 #include "Common.h"
@@ -14,41 +17,41 @@
 
 
 
-VM vm;
+thread_local VM* vm = NULL;
 
 
 
 
 static void ResetStack()
 {
-	vm.StackTop = vm.Stack;
-	vm.FrameCount = 0;
-	vm.OpenUpValues = NULL;
+	vm->StackTop = vm->Stack;
+	vm->FrameCount = 0;
+	vm->OpenUpValues = NULL;
 }
 
 
 static void RuntimeError(const char* format, ...)
 {
-	printf("RUNTIME ERROR: ");
+	fprintf(vm->Out, "RUNTIME ERROR: ");
 	va_list args;
 	va_start(args, format);
-	vfprintf(stderr, format, args);
+	vfprintf(vm->Err, format, args);
 	va_end(args);
-	fputs("\n", stderr);
+	fputs("\n", vm->Err);
 
-	for (int i = vm.FrameCount - 1; i >= 0; i--)
+	for (int i = vm->FrameCount - 1; i >= 0; i--)
 	{
-		CallFrame* frame = &vm.Frames[i];
+		CallFrame* frame = &vm->Frames[i];
 		ObjFunction* function = frame->Closure->Function;
 		size_t instruction = frame->IP - function->Chunk.Code - 1; // The instruction pointer is pointing at the next instruction to be executed. So we subtract one here to reference the previous one (the instruction that failed to cause the runtime error).	
-		fprintf(stderr, "    [Line %d] in ", function->Chunk.Lines[instruction]);
+		fprintf(vm->Err, "    [Line %d] in ", function->Chunk.Lines[instruction]);
 		if (function->Name == NULL)
 		{
-			fprintf(stderr, "script\n");
+			fprintf(vm->Err, "script\n");
 		}
 		else
 		{
-			fprintf(stderr, "%s()\n", function->Name->Chars);
+			fprintf(vm->Err, "%s()\n", function->Name->Chars);
 		}
 	} // End for
 
@@ -60,7 +63,7 @@ static void DefineNativeFunction(const char* name, NativeFn function)
 {
 	Push(OBJ_VAL(CopyString(name, (int)strlen(name))));
 	Push(OBJ_VAL(NewNativeFunction(function)));
-	TableSet(&vm.Globals, AS_STRING(vm.Stack[0]), vm.Stack[1]);
+	TableSet(&vm->Globals, AS_STRING(vm->Stack[0]), vm->Stack[1]);
 	Pop();
 	Pop();
 }
@@ -72,58 +75,141 @@ static Value ClockNative(int argCount, Value* args)
 }
 
 
-void InitVM()
+static void InitVM()
 {
 	ResetStack();
-	vm.Objects = NULL;
-	vm.BytesAllocated = 0;
-	vm.NextGC = 1024 * 1024;
+	vm->Out = stdout;
+	vm->Err = stderr;
+	vm->Objects = NULL;
+#ifdef SLAB_ALLOCATOR
+	InitSlabHeap(&vm->Slabs);
+#endif
+#ifdef COMPACTING_GC
+	vm->CompactAfterCollections = true;
+	vm->CompactionRequested = false;
+#endif
+#ifdef LAZY_SWEEP
+	vm->SweepDebt = 0;
+#endif
+	vm->ActiveCompilation = NULL;
+	vm->BytesAllocated = 0;
+	vm->NextGC = 1024 * 1024;
 
 	// This group of items is used by the cLox garbage collector. See chapter 26 in the book.
-	vm.GrayCount = 0;
-	vm.GrayCapacity = 0;
-	vm.GrayStack = NULL;
+	vm->GrayCount = 0;
+	vm->GrayCapacity = 0;
+	vm->GrayStack = NULL;
+	memset(&vm->Stats, 0, sizeof(GCStats));
+
+#ifdef INCREMENTAL_GC
+	vm->Phase = GC_IDLE;
+	vm->PauseBudget = GC_PAUSE_BUDGET;
+	vm->MarkDebt = 0;
+#endif
 
-	InitTable(&vm.Globals);
-	InitTable(&vm.Strings);
+#ifdef CONCURRENT_GC
+	vm->ConcurrentMarking = true;
+	vm->ConcurrentGCRequested = false;
+	vm->Marker = NULL;
+	vm->SnapshotCount = 0;
+	vm->SnapshotCapacity = 0;
+	vm->SnapshotLog = NULL;
+#endif
 
-	vm.InitString = NULL;
-	vm.InitString = CopyString("init", 4);
+#ifdef PARALLEL_GC
+	vm->MarkThreads = 0;
+	vm->ParallelMarkThreshold = GC_PARALLEL_THRESHOLD;
+#endif
+
+#ifdef GENERATIONAL_GC
+	// The nursery lives outside of the Lox heap, so it doesn't count towards BytesAllocated.
+	vm->Nursery = (uint8_t*)malloc(NURSERY_SIZE);
+	if (vm->Nursery == NULL)
+		exit(1);
+
+	vm->NurseryTop = vm->Nursery;
+	vm->MinorGCRequested = false;
+	vm->RememberedCount = 0;
+	vm->RememberedCapacity = 0;
+	vm->RememberedSet = NULL;
+	vm->PromotedCount = 0;
+	vm->PromotedCapacity = 0;
+	vm->PromotedStack = NULL;
+#endif
+
+	InitTable(&vm->Globals);
+	InitTable(&vm->Strings);
+
+	// Every VM hashes its strings differently, so nobody can work out ahead of time which strings will collide. The clock and
+	// the VM's address get mixed in as well, in case random_device isn't really random on this platform.
+	std::random_device random;
+	vm->HashSeed = ((uint64_t)random() << 32) ^ random() ^
+				   (uint64_t)std::chrono::steady_clock::now().time_since_epoch().count() ^ (uint64_t)(uintptr_t)vm;
+
+	vm->InitString = NULL;
+	vm->InitString = CopyString("init", 4);
 
 	// Define native functions. When invoked in Lox, these just call native C/C++ functions.
 	DefineNativeFunction("clock", ClockNative);
 }
 
 
-void FreeVM()
+VM* NewVM()
 {
-	FreeTable(&vm.Globals);
-	FreeTable(&vm.Strings);
+	// The VM struct itself lives outside of the Lox heap, so we don't use Reallocate() for it.
+	VM* machine = (VM*)malloc(sizeof(VM));
+	if (machine == NULL)
+		exit(1);
+
+	SetCurrentVM(machine);
+	InitVM();
 
-	vm.InitString = NULL;
+	return machine;
+}
+
+
+void FreeVM(VM* machine)
+{
+	// The heap belongs to the VM being freed, so make it current while we tear it down.
+	VM* previous = vm;
+	SetCurrentVM(machine);
+
+	FreeTable(&vm->Globals);
+	FreeTable(&vm->Strings);
+
+	vm->InitString = NULL;
 
 	FreeObjects();
+
+	free(machine);
+	SetCurrentVM(previous == machine ? NULL : previous);
+}
+
+
+void SetCurrentVM(VM* machine)
+{
+	vm = machine;
 }
 
 
 void Push(Value value)
 {
-	*vm.StackTop = value;
-	vm.StackTop++;
+	*vm->StackTop = value;
+	vm->StackTop++;
 }
 
 
 Value Pop()
 {
-	vm.StackTop--;
-	return *vm.StackTop;
+	vm->StackTop--;
+	return *vm->StackTop;
 }
 
 
 // Gets a value from the stack without popping it off.
 static Value Peek(int distance)
 {
-	return vm.StackTop[-1 - distance];
+	return vm->StackTop[-1 - distance];
 }
 
 
@@ -141,14 +227,23 @@ static bool Call(ObjClosure* closure, int argCount)
 		return false;
 	}
 
-	if (vm.FrameCount == FRAMES_MAX)
+	if (vm->FrameCount == FRAMES_MAX)
 	{
 		RuntimeError("Stack overflow.");
 		return false;
 	}
 
+#ifdef LAZY_COMPILE_FUNCTIONS
+	// The function's body was skipped when it was declared, so compile it now that it's actually being called.
+	if (closure->Function->Lazy != NULL && !CompileLazyFunction(closure->Function))
+	{
+		RuntimeError("Could not compile function '%s'.", closure->Function->Name->Chars);
+		return false;
+	}
+#endif
+
 
-	CallFrame* frame = &vm.Frames[vm.FrameCount++];
+	CallFrame* frame = &vm->Frames[vm->FrameCount++];
 
 	frame->Closure = closure;
 	frame->IP = closure->Function->Chunk.Code;
@@ -157,7 +252,7 @@ static bool Call(ObjClosure* closure, int argCount)
 	// "The funny little - 1 is to account for stack slot zero which the compiler set aside for
 	// "when we add methods later. The parameters start at slot one so we make the window
 	// start one slot earlier to align them with the arguments."
-	frame->Slots = vm.StackTop - argCount - 1;
+	frame->Slots = vm->StackTop - argCount - 1;
 
 	return true;
 }
@@ -172,17 +267,17 @@ static bool CallValue(Value callee, int argCount)
 			case OBJ_BOUND_METHOD:
 			{
 				ObjBoundMethod* bound = AS_BOUND_METHOD(callee);
-				vm.StackTop[-argCount - 1] = bound->Receiver;
+				vm->StackTop[-argCount - 1] = bound->Receiver;
 				return Call(bound->Method, argCount);
 			}
 
 			case OBJ_CLASS:
 			{
 				ObjClass* klass = AS_CLASS(callee);
-				vm.StackTop[-argCount - 1] = OBJ_VAL(NewInstance(klass));
+				vm->StackTop[-argCount - 1] = OBJ_VAL(NewInstance(klass));
 
 				Value initializer;
-				if (TableGet(&klass->Methods, vm.InitString, &initializer))
+				if (TableGet(&klass->Methods, vm->InitString, &initializer))
 				{
 					return Call(AS_CLOSURE(initializer), argCount);
 				}
@@ -203,8 +298,8 @@ static bool CallValue(Value callee, int argCount)
 			case OBJ_NATIVE_FUNCTION:
 			{
 				NativeFn native = AS_NATIVE_FUNCTION(callee);
-				Value result = native(argCount, vm.StackTop - argCount);
-				vm.StackTop -= argCount + 1;
+				Value result = native(argCount, vm->StackTop - argCount);
+				vm->StackTop -= argCount + 1;
 				Push(result);
 				return true;
 			}
@@ -249,7 +344,7 @@ static bool Invoke(ObjString* name, int argCount)
 	Value value;
 	if (TableGet(&instance->Fields, name, &value))
 	{
-		vm.StackTop[-argCount - 1] = value;
+		vm->StackTop[-argCount - 1] = value;
 		return CallValue(value, argCount);
 	}
 
@@ -277,7 +372,7 @@ static bool BindMethod(ObjClass* klass, ObjString* name)
 static ObjUpValue* CaptureUpValue(Value* local)
 {
 	ObjUpValue* prevUpValue = NULL;
-	ObjUpValue* upValue = vm.OpenUpValues;
+	ObjUpValue* upValue = vm->OpenUpValues;
 	
 	while (upValue != NULL && upValue->Location > local)
 	{
@@ -296,7 +391,7 @@ static ObjUpValue* CaptureUpValue(Value* local)
 
 	if (prevUpValue == NULL)
 	{
-		vm.OpenUpValues = createdUpValue;
+		vm->OpenUpValues = createdUpValue;
 	}
 	else
 	{
@@ -309,15 +404,18 @@ static ObjUpValue* CaptureUpValue(Value* local)
 
 static void CloseUpValues(Value* last)
 {
-	while (vm.OpenUpValues != NULL &&
-		   vm.OpenUpValues->Location >= last)
+	while (vm->OpenUpValues != NULL &&
+		   vm->OpenUpValues->Location >= last)
 	{
-		ObjUpValue* upValue = vm.OpenUpValues;
+		ObjUpValue* upValue = vm->OpenUpValues;
 
+		SNAPSHOT_BARRIER(upValue);
 		upValue->Closed = *upValue->Location;
 		upValue->Location = &upValue->Closed;
+		WRITE_BARRIER(upValue);
+		MARKING_BARRIER(upValue->Closed);
 
-		vm.OpenUpValues = upValue->Next;
+		vm->OpenUpValues = upValue->Next;
 	}
 }
 
@@ -326,7 +424,9 @@ static void DefineClassMethod(ObjString* name)
 {
 	Value method = Peek(0);
 	ObjClass* klass = AS_CLASS(Peek(1));
+	SNAPSHOT_BARRIER(klass);
 	TableSet(&klass->Methods, name, method);
+	WRITE_BARRIER(klass);
 	Pop();
 }
 
@@ -339,26 +439,55 @@ static bool IsFalsey(Value value)
 
 static void Concatenate()
 {
-	ObjString* b = AS_STRING(Peek(0));
-	ObjString* a = AS_STRING(Peek(1));
+	Obj* b = AS_OBJ(Peek(0));
+	Obj* a = AS_OBJ(Peek(1));
 
-	int length = a->Length + b->Length;
-	char* chars = ALLOCATE(char, length + 1);
-	memcpy(chars, a->Chars, a->Length);
-	memcpy(chars + a->Length, b->Chars, b->Length);
-	chars[length] = '\0'; // Add a null character on the end.
+	// Both of the strings are still on the stack, so the garbage collector won't free them if it runs while the result is
+	// allocated.
+	Obj* result;
+	if (StringLength(a) + StringLength(b) >= ROPE_MIN_LENGTH)
+	{
+		// A long result becomes a rope, so building a string up in a loop doesn't copy everything built so far every time
+		// around. See ObjRope in Object.h.
+		result = (Obj*)NewRope(a, b);
+	}
+	else
+	{
+		// A rope is never shorter than ROPE_MIN_LENGTH, so both of these are flat strings. The result gets built right in the
+		// new string, rather than in a buffer that then has to be copied into it. Most of the strings made here are only ever
+		// printed, compared, or concatenated again, and never used as table keys, so it doesn't get hashed or interned.
+		ObjString* left = (ObjString*)a;
+		ObjString* right = (ObjString*)b;
+
+		ObjString* string = AllocateString(left->Length + right->Length);
+		memcpy(string->Chars, left->Chars, left->Length);
+		memcpy(string->Chars + left->Length, right->Chars, right->Length);
+
+		result = (Obj*)string;
+	}
 
-	ObjString* result = TakeString(chars, length);
 	Pop();
 	Pop();
 	Push(OBJ_VAL(result));
 }
 
 
+/// <summary>
+/// If the value at the specified distance from the top of the stack is a rope, it gets replaced by its flattened string. A
+/// rope's characters aren't in one place until this is done, so it has to be done before a string can be compared or printed.
+/// </summary>
+static void FlattenStackValue(int distance)
+{
+	Value value = Peek(distance);
+	if (IS_ROPE(value))
+		vm->StackTop[-1 - distance] = OBJ_VAL(FlattenRope(AS_ROPE(value)));
+}
+
+
 static InterpretResult Run()
 {
 
-	CallFrame* frame = &vm.Frames[vm.FrameCount - 1];
+	CallFrame* frame = &vm->Frames[vm->FrameCount - 1];
 
 
 #define READ_BYTE() (*frame->IP++) // A macro that returns and then increments the value of the instruction pointer.
@@ -383,7 +512,7 @@ static InterpretResult Run()
 
 
 #ifdef DEBUG_TRACE_EXECUTION
-	printf("\n\n== Runtime Debug Output ==\n");
+	fprintf(vm->Out, "\n\n== Runtime Debug Output ==\n");
 #endif
 
 
@@ -398,18 +527,18 @@ static InterpretResult Run()
 
 #ifdef DEBUG_TRACE_EXECUTION
 		
-	printf("          ");
+	fprintf(vm->Out, "          ");
 
 
 	#ifdef DEBUG_PRINT_STACK
 		
-		for (Value* slot = vm.Stack; slot < vm.StackTop; slot++)
+		for (Value* slot = vm->Stack; slot < vm->StackTop; slot++)
 		{
-			printf("[ ");
+			fprintf(vm->Out, "[ ");
 			PrintValue(*slot);
-			printf(" ]");
+			fprintf(vm->Out, " ]");
 		}
-		printf("\n");
+		fprintf(vm->Out, "\n");
 
 	#endif
 
@@ -420,6 +549,27 @@ static InterpretResult Run()
 
 
 
+#ifdef GENERATIONAL_GC
+		// This is a safe point. None of the C code is holding on to pointers to young objects here, so the
+		// nursery can be collected once it has filled up, even though that moves objects around.
+		if (vm->MinorGCRequested)
+			CollectYoungGeneration();
+#endif
+
+#ifdef COMPACTING_GC
+		// Compactions move objects too, so they wait for this safe point as well.
+		if (vm->CompactionRequested)
+			CompactHeap();
+#endif
+
+#ifdef CONCURRENT_GC
+		// Concurrent collections only start here, where the VM isn't in the middle of changing an object. Otherwise the marker
+		// thread could start reading the object before the change had gone through the snapshot barrier.
+		if (vm->ConcurrentGCRequested)
+			StartConcurrentCollection();
+#endif
+
+
 		uint8_t instruction;
 		switch (instruction = READ_BYTE())
 		{
@@ -472,7 +622,7 @@ static InterpretResult Run()
 			{
 				ObjString* name = READ_STRING();
 				Value value;
-				if (!TableGet(&vm.Globals, name, &value))
+				if (!TableGet(&vm->Globals, name, &value))
 				{
 					RuntimeError("Undefined variable '%s'.", name->Chars);
 					return INTERPRET_RUNTIME_ERROR;
@@ -485,7 +635,7 @@ static InterpretResult Run()
 			case OP_DEFINE_GLOBAL:
 			{
 				ObjString* name = READ_STRING();
-				TableSet(&vm.Globals, name, Peek(0));
+				TableSet(&vm->Globals, name, Peek(0));
 				Pop();
 				break;
 			}
@@ -493,9 +643,9 @@ static InterpretResult Run()
 			case OP_SET_GLOBAL:
 			{
 				ObjString* name = READ_STRING();
-				if (TableSet(&vm.Globals, name, Peek(0)))
+				if (TableSet(&vm->Globals, name, Peek(0)))
 				{
-					TableDelete(&vm.Globals, name);
+					TableDelete(&vm->Globals, name);
 					RuntimeError("Undefined variable '%s'.", name->Chars);
 					return INTERPRET_RUNTIME_ERROR;
 				}
@@ -513,7 +663,10 @@ static InterpretResult Run()
 			case OP_SET_UPVALUE:
 			{
 				uint8_t slot = READ_BYTE();
+				SNAPSHOT_BARRIER(frame->Closure->UpValues[slot]);
 				*frame->Closure->UpValues[slot]->Location = Peek(0);
+				WRITE_BARRIER(frame->Closure->UpValues[slot]);
+				MARKING_BARRIER(Peek(0));
 				break;
 			}
 
@@ -553,7 +706,9 @@ static InterpretResult Run()
 				}
 
 				ObjInstance* instance = AS_INSTANCE(Peek(1));
+				SNAPSHOT_BARRIER(instance);
 				TableSet(&instance->Fields, READ_STRING(), Peek(0));
+				WRITE_BARRIER(instance);
 				Value value = Pop();
 				Pop();
 				Push(value);
@@ -575,6 +730,8 @@ static InterpretResult Run()
 
 			case OP_EQUAL:
 			{
+				FlattenStackValue(0);
+				FlattenStackValue(1);
 				Value b = Pop();
 				Value a = Pop();
 				Push(BOOL_VAL(ValuesEqual(a, b)));
@@ -595,7 +752,7 @@ static InterpretResult Run()
 			
 			case OP_ADD:
 			{
-				if (IS_STRING(Peek(0)) && IS_STRING(Peek(1)))
+				if (IS_ANY_STRING(Peek(0)) && IS_ANY_STRING(Peek(1)))
 				{
 					Concatenate();
 				}
@@ -652,8 +809,9 @@ static InterpretResult Run()
 
 			case OP_PRINT:
 			{
+				FlattenStackValue(0);
 				PrintValue(Pop());
-				printf("\n");
+				fprintf(vm->Out, "\n");
 				break;
 			}
 
@@ -692,7 +850,7 @@ static InterpretResult Run()
 				{
 					return INTERPRET_RUNTIME_ERROR;
 				}
-				frame = &vm.Frames[vm.FrameCount - 1];
+				frame = &vm->Frames[vm->FrameCount - 1];
 				break;
 			}
 
@@ -706,7 +864,7 @@ static InterpretResult Run()
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
-				frame = &vm.Frames[vm.FrameCount - 1];
+				frame = &vm->Frames[vm->FrameCount - 1];
 				break;
 			}
 
@@ -721,7 +879,7 @@ static InterpretResult Run()
 					return INTERPRET_RUNTIME_ERROR;
 				}
 
-				frame = &vm.Frames[vm.FrameCount - 1];
+				frame = &vm->Frames[vm->FrameCount - 1];
 				break;
 			}
 
@@ -731,6 +889,9 @@ static InterpretResult Run()
 				ObjClosure* closure = NewClosure(function);
 				Push(OBJ_VAL(closure));
 
+				// Filling in the UpValues doesn't need the generational write barrier. A brand new object is either young, or it went
+				// straight into the old generation because the nursery was full, in which case it was remembered right away.
+
 				for (int i = 0; i < closure->UpValueCount; i++)
 				{
 					uint8_t isLocal = READ_BYTE();
@@ -743,6 +904,8 @@ static InterpretResult Run()
 					{
 						closure->UpValues[i] = frame->Closure->UpValues[index];
 					}
+
+					MARKING_BARRIER(OBJ_VAL(closure->UpValues[i]));
 				}
 
 				break;
@@ -751,7 +914,7 @@ static InterpretResult Run()
 
 			case OP_CLOSE_UPVALUE:
 			{
-				CloseUpValues(vm.StackTop - 1);
+				CloseUpValues(vm->StackTop - 1);
 				Pop();
 				break;
 			}
@@ -761,18 +924,18 @@ static InterpretResult Run()
 				// Grab the return value of the function that just finished from the stack and cache it in 'result'.
 				Value result = Pop();
 				CloseUpValues(frame->Slots);
-				vm.FrameCount--;
+				vm->FrameCount--;
 				
 				// Are we exiting out of the top level Lox code (in other words, is the program ending)?
-				if (vm.FrameCount == 0)
+				if (vm->FrameCount == 0)
 				{
 					Pop();
 					return INTERPRET_OK;
 				}
 
-				vm.StackTop = frame->Slots;
+				vm->StackTop = frame->Slots;
 				Push(result); // Now that the finished function's stuff has been removed from the stack, pop its return value back on.
-				frame = &vm.Frames[vm.FrameCount - 1];
+				frame = &vm->Frames[vm->FrameCount - 1];
 				break;				
 			}
 
@@ -792,8 +955,10 @@ static InterpretResult Run()
 				}
 
 				ObjClass* subClass = AS_CLASS(Peek(0));
+				SNAPSHOT_BARRIER(subClass);
 				TableAddAll(&AS_CLASS(superClass)->Methods,
 							&subClass->Methods);
+				WRITE_BARRIER(subClass);
 				Pop(); // Subclass
 				break;
 			}
@@ -818,9 +983,9 @@ static InterpretResult Run()
 } // end Run()
 
 
-InterpretResult Interpret(const char* source)
+InterpretResult Interpret(const char* source, size_t length)
 {
-	ObjFunction* function = Compile(source);
+	ObjFunction* function = Compile(source, length);
 	
 	if (function == NULL)
 		return INTERPRET_COMPILE_ERROR;
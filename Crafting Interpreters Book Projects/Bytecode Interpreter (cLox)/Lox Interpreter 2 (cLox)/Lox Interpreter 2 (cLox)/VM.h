@@ -6,14 +6,26 @@
 // #ifndef cLox_VM_h
 //	#define cLox_VM_h
 
+#include <stdio.h>
+
 // cLox includes.
 #include "Object.h"
+#include "SlabAllocator.h"
 #include "Table.h"
 #include "Value.h"
 
 
 
 
+// Forward declaration of the struct that holds the state of a compilation. See Compiler.h.
+struct CompileContext;
+
+// Forward declaration of the struct that runs the concurrent marker thread. See Memory.cpp.
+struct ConcurrentMarker;
+
+
+
+
 #define FRAMES_MAX	 64 // This is the maximum allowed depth for our call stack.
 #define STACK_MAX	(FRAMES_MAX * UINT8_COUNT) // The maximum size of the values stack in this virtual machine.
 
@@ -34,6 +46,29 @@ struct CallFrame
 };
 
 
+// Tracks how often, and for how long, the garbage collector has paused the program.
+struct GCStats
+{
+	int Collections; // The number of full collections that have finished.
+	int MinorCollections; // The number of minor collections (see GENERATIONAL_GC in Common.h).
+	int Pauses; // The number of times the garbage collector has paused the program to do some work.
+	double TotalPause; // The total time spent in those pauses, in milliseconds.
+	double MaxPause; // The longest single pause, in milliseconds.
+	double MaxCollectionPause; // The longest pause for a full collection, or for one step of an incremental one, in milliseconds.
+	double MaxMinorPause; // The longest pause for a minor collection, in milliseconds. The pause budget doesn't apply to these.
+	int Compactions; // The number of compactions that have moved objects (see COMPACTING_GC in Common.h).
+};
+
+
+// What the incremental garbage collector is in the middle of doing.
+enum GCPhase
+{
+	GC_IDLE, // No collection is running.
+	GC_MARKING, // A collection has marked the roots, and is working its way through the gray stack a step at a time.
+	GC_CONCURRENT_MARKING, // A collection has marked the roots, and the concurrent marker thread is working its way through the gray stack (see CONCURRENT_GC in Common.h).
+};
+
+
 struct VM
 {
 	CallFrame Frames[FRAMES_MAX]; // The call frame stack. This keeps track of executing function calls.
@@ -49,20 +84,72 @@ struct VM
 	Table Strings; // Stores interned strings. See the "String Interning" section of chapter 20 in the
 				   // book: https://craftinginterpreters.com/hash-tables.html
 	ObjString* InitString; // The name class initializer methods will use internally.
+	uint64_t HashSeed; // The seed this VM's string hash codes are generated with. It is picked at random when the VM is created. See HashString() in Hash.h.
 	ObjUpValue* OpenUpValues; // Linked list of UpValues that have not been moved to the heap yet (in other words, they refer to variables that are
 							  // still alive on the stack).
 
+	FILE* Out; // Where this VM writes the output of print statements, as well as debug output. Defaults to stdout.
+	FILE* Err; // Where this VM writes compile errors and runtime errors. Defaults to stderr.
+
 	size_t BytesAllocated; // Tracks how much heap memory the VM has allocated.
 	size_t NextGC; // When BytesAllocated reaches this threshold, the garbage collector is triggered and this threshold gets updated.
 				   // See chapter 26 in the book. Note that the garbage collector gets run every time something is allocated if the DEBUG_STRESS_GC
 				   // symbol is defined in Common.h.
-	Obj* Objects; // Keeps references to all Lox objects that we still have in memory.
+	Obj* Objects; // Keeps references to all Lox objects that we still have in memory. When SLAB_ALLOCATOR is enabled, this only has the big ones in it.
+#ifdef SLAB_ALLOCATOR
+	SlabHeap Slabs; // The slab pages that hold all of the small objects in the old generation. See SlabAllocator.h.
+#endif
+#ifdef COMPACTING_GC
+	bool CompactAfterCollections; // Whether each full collection is followed by a compaction. On by default.
+	bool CompactionRequested; // Set when a full collection finishes. The VM runs the compaction at its next safe point.
+#endif
+#ifdef LAZY_SWEEP
+	size_t SweepDebt; // How many bytes have been allocated since a slab page was last swept lazily. See Memory.cpp.
+#endif
+	CompileContext* ActiveCompilation; // The innermost compilation currently running on this VM, or NULL. The garbage collector marks the functions it is still compiling.
 
 	// These are used by the cLox garbage collector. See chapter 26 in the book.
 	int GrayCount; // Number of objects in the gray stack.
 	int GrayCapacity; // Max number of objects that can fit in the gray stack.
 	Obj** GrayStack; // Holds references to all "reachable" objects the garbage collector has found. We need to look at references inside them find
 				     // more "reachable" objects that should not be garbage collected.
+	GCStats Stats; // How much the garbage collector has paused the program so far.
+
+#ifdef INCREMENTAL_GC
+	// These are used by the incremental garbage collector. See Memory.cpp.
+	GCPhase Phase; // What the garbage collector is in the middle of doing.
+	double PauseBudget; // The longest a marking step is meant to pause the program for, in milliseconds. 0 means there is no limit, so all of the marking gets done in one go. See Memory.cpp for the pauses that can run over it.
+	size_t MarkDebt; // How much marking work (in bytes scanned) allocations have paid for that hasn't been done yet.
+#endif
+
+#ifdef CONCURRENT_GC
+	// These are used by the concurrent marker. See Memory.cpp.
+	bool ConcurrentMarking; // Whether collections are allowed to do their marking on a background thread. On by default.
+	bool ConcurrentGCRequested; // Set when a collection is due. The VM starts it at its next safe point, and hands its marking to the marker thread.
+	ConcurrentMarker* Marker; // The concurrent marker thread and the state it shares with this VM. It is created the first time it's needed.
+	int SnapshotCount; // Number of objects in the snapshot log.
+	int SnapshotCapacity; // Max number of objects that can fit in the snapshot log.
+	Obj** SnapshotLog; // Objects the program's thread has found while the marker thread is running, that it still has to hand over to the marker.
+#endif
+
+#ifdef PARALLEL_GC
+	// These are used by the parallel marker. See Memory.cpp.
+	int MarkThreads; // How many threads marking is split across, including this one. 0 means one per CPU core.
+	size_t ParallelMarkThreshold; // Marking is only split across threads once the heap (BytesAllocated) is at least this big, since starting the threads isn't free.
+#endif
+
+#ifdef GENERATIONAL_GC
+	// These are used by the young generation of the garbage collector. See Memory.cpp.
+	uint8_t* Nursery; // The block of memory new objects get bump allocated in. It is NURSERY_SIZE bytes long.
+	uint8_t* NurseryTop; // Where the next object in the nursery will be allocated.
+	bool MinorGCRequested; // Set when the nursery fills up. The VM runs a minor collection at its next safe point.
+	int RememberedCount; // Number of objects in the remembered set.
+	int RememberedCapacity; // Max number of objects that can fit in the remembered set.
+	Obj** RememberedSet; // Old objects that may have had a pointer to a young object stored in them since the last minor collection.
+	int PromotedCount; // Number of objects in the promoted stack.
+	int PromotedCapacity; // Max number of objects that can fit in the promoted stack.
+	Obj** PromotedStack; // Objects the running minor collection has copied into the old generation, but hasn't scanned yet.
+#endif
 };
 
 
@@ -76,15 +163,20 @@ enum InterpretResult
 
 
 
-extern VM vm;
+// The VM that is currently running on this thread. Every VM owns its own heap, globals, and string
+// table, so any number of them can exist in one process. Each thread works with one VM at a time,
+// and everything in the runtime (allocation, the garbage collector, string interning, etc.) uses
+// this one.
+extern thread_local VM* vm;
 
 
 
 
-void InitVM();
-void FreeVM();
+VM* NewVM(); // Creates a new VM and makes it the current VM on the calling thread.
+void FreeVM(VM* machine); // Frees the VM and everything on its heap. If it was the current VM on the calling thread, then that is cleared.
+void SetCurrentVM(VM* machine); // Makes the passed in VM the current VM on the calling thread.
 
-InterpretResult Interpret(const char* source);
+InterpretResult Interpret(const char* source, size_t length); // Compiles and runs the passed in Lox source code. It doesn't need to be null terminated.
 
 // Value stack operations.
 void Push(Value value);
@@ -5,6 +5,7 @@
 #include "Object.h"
 #include "Memory.h"
 #include "Value.h"
+#include "VM.h"
 
 
 
@@ -53,15 +54,15 @@ void PrintValue(Value value)
 	//if (IS_BOOL(value))
 	if (IS_BOOL(value))
 	{
-		printf(AS_BOOL(value) ? "true" : "false");
+		fprintf(vm->Out, AS_BOOL(value) ? "true" : "false");
 	}
 	else if (IS_NIL(value))
 	{
-		printf("nil");
+		fprintf(vm->Out, "nil");
 	}
 	else if (IS_NUMBER(value))
 	{
-		printf("%g", AS_NUMBER(value));
+		fprintf(vm->Out, "%g", AS_NUMBER(value));
 	}
 	else if (IS_OBJ(value))
 	{
@@ -73,15 +74,15 @@ void PrintValue(Value value)
 	switch (value.Type)
 	{
 		case VAL_BOOL:
-			printf(AS_BOOL(value) ? "true" : "false");
+			fprintf(vm->Out, AS_BOOL(value) ? "true" : "false");
 			break;
 
 		case VAL_NIL:
-			printf("nil");
+			fprintf(vm->Out, "nil");
 			break;
 
 		case VAL_NUMBER:
-			printf("%g", AS_NUMBER(value));
+			fprintf(vm->Out, "%g", AS_NUMBER(value));
 			break;
 
 		case VAL_OBJ:
@@ -94,6 +95,29 @@ void PrintValue(Value value)
 }
 
 
+/// <summary>
+/// Checks if two objects are equal. Objects are only equal to themselves, other than strings that have the same characters.
+/// </summary>
+static bool ObjectsEqual(Obj* a, Obj* b)
+{
+	if (a == b)
+		return true;
+
+	if (a->Type != OBJ_STRING || b->Type != OBJ_STRING)
+		return false;
+
+	// Two interned strings can only have the same characters if they are the same string. But strings made at runtime usually
+	// aren't interned, so their characters have to be compared. See ObjString in Object.h.
+	ObjString* aString = (ObjString*)a;
+	ObjString* bString = (ObjString*)b;
+	if (aString->IsInterned && bString->IsInterned)
+		return false;
+
+	return aString->Length == bString->Length &&
+		   memcmp(aString->Chars, bString->Chars, aString->Length) == 0;
+}
+
+
 bool ValuesEqual(Value a, Value b)
 {
 
@@ -106,6 +130,14 @@ bool ValuesEqual(Value a, Value b)
 		return AS_NUMBER(a) == AS_NUMBER(b);
 	}
 
+	if (IS_OBJ(a) && IS_OBJ(b))
+	{
+		return ObjectsEqual(AS_OBJ(a), AS_OBJ(b));
+	}
+
+	// Everything else is equal if it has exactly the same bits.
+	return a == b;
+
 #else
 
 	if (a.Type != b.Type)
@@ -120,7 +152,7 @@ bool ValuesEqual(Value a, Value b)
 		case VAL_NUMBER:
 			return AS_NUMBER(a) == AS_NUMBER(b);
 		case VAL_OBJ:
-			return AS_OBJ(a) == AS_OBJ(b);
+			return ObjectsEqual(AS_OBJ(a), AS_OBJ(b));
 
 		default:
 			return false; // Unreachable